@@ -647,7 +647,7 @@ spider_addr_parse_mask_ports(const char *s,
                           uint16_t *port_min_out, uint16_t *port_max_out)
 {
   char *base = NULL, *address, *mask = NULL, *port = NULL, *rbracket = NULL;
-  char *endptr;
+  char *endptr, *esc = NULL;
   int any_flag=0, v4map=0;
   sa_family_t family;
   struct in6_addr in6_tmp;
@@ -665,7 +665,8 @@ spider_addr_parse_mask_ports(const char *s,
 #define MAX_ADDRESS_LENGTH (TOR_ADDR_BUF_LEN+2+(1+INET_NTOA_BUF_LEN)+12+1)
 
   if (strlen(s) > MAX_ADDRESS_LENGTH) {
-    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", escaped(s));
+    esc = esc_for_log(s);
+    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", esc);
     goto err;
   }
   base = spider_strdup(s);
@@ -740,8 +741,9 @@ spider_addr_parse_mask_ports(const char *s,
     family = AF_INET;
     spider_addr_from_in(addr_out, &in_tmp);
   } else {
+    esc = esc_for_log(address);
     log_warn(LD_GENERAL, "Malformed IP %s in address pattern; rejecting.",
-             escaped(address));
+             esc);
     goto err;
   }
 
@@ -766,15 +768,16 @@ spider_addr_parse_mask_ports(const char *s,
         if (spider_inet_pton(AF_INET, mask, &v4mask) > 0) {
           bits = addr_mask_get_bits(ntohl(v4mask.s_addr));
           if (bits < 0) {
+            esc = esc_for_log(mask);
             log_warn(LD_GENERAL,
                      "IPv4-style mask %s is not a prefix address; rejecting.",
-                     escaped(mask));
+                     esc);
             goto err;
           }
         } else { /* Not IPv4; we don't do address-style IPv6 masks. */
+          esc = esc_for_log(s);
           log_warn(LD_GENERAL,
-                   "Malformed mask on address range %s; rejecting.",
-                   escaped(s));
+                   "Malformed mask on address range %s; rejecting.", esc);
           goto err;
         }
       }
@@ -804,8 +807,8 @@ spider_addr_parse_mask_ports(const char *s,
     *maskbits_out = (maskbits_t) bits;
   } else {
     if (mask) {
-      log_warn(LD_GENERAL,
-               "Unexpected mask in address %s; rejecting", escaped(s));
+      esc = esc_for_log(s);
+      log_warn(LD_GENERAL, "Unexpected mask in address %s; rejecting", esc);
       goto err;
     }
   }
@@ -827,8 +830,8 @@ spider_addr_parse_mask_ports(const char *s,
     }
   } else {
     if (port) {
-      log_warn(LD_GENERAL,
-               "Unexpected ports in address %s; rejecting", escaped(s));
+      esc = esc_for_log(s);
+      log_warn(LD_GENERAL, "Unexpected ports in address %s; rejecting", esc);
       goto err;
     }
   }
@@ -836,6 +839,7 @@ spider_addr_parse_mask_ports(const char *s,
   spider_free(base);
   return spider_addr_family(addr_out);
  err:
+  spider_free(esc);
   spider_free(base);
   return -1;
 }
@@ -2015,18 +2019,20 @@ parse_port_range(const char *port, uint16_t *port_min_out,
     char *endptr = NULL;
     port_min = (int)spider_parse_long(port, 10, 0, 65535, &ok, &endptr);
     if (!ok) {
+      char *esc = esc_for_log(port);
       log_warn(LD_GENERAL,
-               "Malformed port %s on address range; rejecting.",
-               escaped(port));
+               "Malformed port %s on address range; rejecting.", esc);
+      spider_free(esc);
       return -1;
     } else if (endptr && *endptr == '-') {
       port = endptr+1;
       endptr = NULL;
       port_max = (int)spider_parse_long(port, 10, 1, 65535, &ok, &endptr);
       if (!ok) {
+        char *esc = esc_for_log(port);
         log_warn(LD_GENERAL,
-                 "Malformed port %s on address range; rejecting.",
-                 escaped(port));
+                 "Malformed port %s on address range; rejecting.", esc);
+        spider_free(esc);
         return -1;
       }
     } else {
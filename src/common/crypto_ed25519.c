@@ -426,6 +426,116 @@ ed25519_checksig_batch,(int *okay_out,
   return res;
 }
 
+/** One signature in an ed25519_batch_t. */
+typedef struct ed25519_batch_entry_t {
+  ed25519_public_key_t pubkey;
+  ed25519_signature_t signature;
+  uint8_t *msg;
+  size_t len;
+} ed25519_batch_entry_t;
+
+struct ed25519_batch_t {
+  /** The signatures to check, in the order they were added. */
+  ed25519_batch_entry_t *entries;
+  /** Number of elements in use in <b>entries</b>. */
+  int n_entries;
+  /** Number of elements allocated in <b>entries</b>. */
+  int n_allocated;
+};
+
+/** Return a new, empty, ed25519_batch_t. */
+ed25519_batch_t *
+ed25519_batch_new(void)
+{
+  return spider_malloc_zero(sizeof(ed25519_batch_t));
+}
+
+/** Release all storage held in <b>batch</b>. */
+void
+ed25519_batch_free(ed25519_batch_t *batch)
+{
+  if (!batch)
+    return;
+  ed25519_batch_truncate(batch, 0);
+  spider_free(batch->entries);
+  spider_free(batch);
+}
+
+/** Add a copy of the signature described by <b>checkable</b> to
+ * <b>batch</b>.  The caller may release <b>checkable</b>, its key, and its
+ * message afterwards. */
+void
+ed25519_batch_add(ed25519_batch_t *batch,
+                  const ed25519_checkable_t *checkable)
+{
+  ed25519_batch_entry_t *ent;
+  spider_assert(batch);
+  spider_assert(checkable);
+
+  if (batch->n_entries == batch->n_allocated) {
+    batch->n_allocated = batch->n_allocated ? batch->n_allocated * 2 : 16;
+    batch->entries = spider_reallocarray(batch->entries, batch->n_allocated,
+                                         sizeof(ed25519_batch_entry_t));
+  }
+  ent = &batch->entries[batch->n_entries++];
+  memcpy(&ent->pubkey, checkable->pubkey, sizeof(ed25519_public_key_t));
+  memcpy(&ent->signature, &checkable->signature, sizeof(ed25519_signature_t));
+  ent->msg = spider_memdup(checkable->msg, checkable->len);
+  ent->len = checkable->len;
+}
+
+/** Return the number of signatures in <b>batch</b>. */
+int
+ed25519_batch_size(const ed25519_batch_t *batch)
+{
+  return batch->n_entries;
+}
+
+/** Remove every signature but the first <b>n</b> from <b>batch</b>.  Used
+ * when whatever was going to be checked turned out to be invalid anyway. */
+void
+ed25519_batch_truncate(ed25519_batch_t *batch, int n)
+{
+  spider_assert(n >= 0);
+  while (batch->n_entries > n) {
+    ed25519_batch_entry_t *ent = &batch->entries[--batch->n_entries];
+    spider_free(ent->msg);
+  }
+}
+
+/** Check every signature in <b>batch</b> with ed25519_checksig_batch().  If
+ * <b>okay_out</b> is non-NULL, it must have room for
+ * ed25519_batch_size(<b>batch</b>) elements: set the i'th one to 1 if the
+ * i'th signature added to <b>batch</b> is valid, and to 0 otherwise.  Return
+ * 0 if every signature was valid; otherwise return -N, where N is the number
+ * of invalid signatures.
+ *
+ * Checking a large batch is much faster than checking each signature on its
+ * own.  If any signature in the batch is bad, the batch code falls back to
+ * checking them one by one, so that we learn which. */
+int
+ed25519_batch_check(const ed25519_batch_t *batch, int *okay_out)
+{
+  ed25519_checkable_t *checkable;
+  int i, r;
+
+  if (batch->n_entries == 0)
+    return 0;
+
+  checkable = spider_calloc(batch->n_entries, sizeof(ed25519_checkable_t));
+  for (i = 0; i < batch->n_entries; ++i) {
+    const ed25519_batch_entry_t *ent = &batch->entries[i];
+    checkable[i].pubkey = &ent->pubkey;
+    memcpy(&checkable[i].signature, &ent->signature,
+           sizeof(ed25519_signature_t));
+    checkable[i].msg = ent->msg;
+    checkable[i].len = ent->len;
+  }
+  r = ed25519_checksig_batch(okay_out, checkable, batch->n_entries);
+  spider_free(checkable);
+  return r;
+}
+
 /**
  * Given a curve25519 keypair in <b>inp</b>, generate a corresponding
  * ed25519 keypair in <b>out</b>, and set <b>signbit_out</b> to the
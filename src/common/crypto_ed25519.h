@@ -88,6 +88,21 @@ MOCK_DECL(int, ed25519_checksig_batch,(int *okay_out,
                                        const ed25519_checkable_t *checkable,
                                        int n_checkable));
 
+/**
+ * A growable set of Ed25519 signatures that we've decided to check later,
+ * all at once.  Unlike an array of ed25519_checkable_t, it holds its own
+ * copy of every key, signature and message.
+ */
+typedef struct ed25519_batch_t ed25519_batch_t;
+
+ed25519_batch_t *ed25519_batch_new(void);
+void ed25519_batch_free(ed25519_batch_t *batch);
+void ed25519_batch_add(ed25519_batch_t *batch,
+                       const ed25519_checkable_t *checkable);
+int ed25519_batch_size(const ed25519_batch_t *batch);
+void ed25519_batch_truncate(ed25519_batch_t *batch, int n);
+int ed25519_batch_check(const ed25519_batch_t *batch, int *okay_out);
+
 int ed25519_keypair_from_curve25519_keypair(ed25519_keypair_t *out,
                                             int *signbit_out,
                                             const curve25519_keypair_t *inp);
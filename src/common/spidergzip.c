@@ -135,6 +135,19 @@ int
 spider_gzip_compress(char **out, size_t *out_len,
                   const char *in, size_t in_len,
                   compress_method_t method)
+{
+  return spider_gzip_compress_level(out, out_len, in, in_len, method,
+                                    HIGH_COMPRESSION);
+}
+
+/** As spider_gzip_compress, but trade compression for memory as described
+ * by <b>level</b>.  Unlike spider_zlib_new(), this touches no global state,
+ * so it is safe to call from any thread. */
+int
+spider_gzip_compress_level(char **out, size_t *out_len,
+                           const char *in, size_t in_len,
+                           compress_method_t method,
+                           zlib_compression_level_t level)
 {
   struct z_stream_s *stream = NULL;
   size_t out_size, old_size;
@@ -155,8 +168,8 @@ spider_gzip_compress(char **out, size_t *out_len,
   stream->avail_in = (unsigned int)in_len;
 
   if (deflateInit2(stream, Z_BEST_COMPRESSION, Z_DEFLATED,
-                   method_bits(method, HIGH_COMPRESSION),
-                   get_memlevel(HIGH_COMPRESSION),
+                   method_bits(method, level),
+                   get_memlevel(level),
                    Z_DEFAULT_STRATEGY) != Z_OK) {
     //LCOV_EXCL_START -- we can only provoke failure by giving junk arguments.
     log_warn(LD_GENERAL, "Error from deflateInit2: %s",
@@ -33,6 +33,11 @@ spider_gzip_compress(char **out, size_t *out_len,
                   const char *in, size_t in_len,
                   compress_method_t method);
 int
+spider_gzip_compress_level(char **out, size_t *out_len,
+                           const char *in, size_t in_len,
+                           compress_method_t method,
+                           zlib_compression_level_t level);
+int
 spider_gzip_uncompress(char **out, size_t *out_len,
                     const char *in, size_t in_len,
                     compress_method_t method,
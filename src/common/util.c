@@ -910,12 +910,33 @@ find_whitespace(const char *s)
   }
 }
 
+/** A 64-bit word with every byte set to 1. */
+#define WORD_ONES UINT64_C(0x0101010101010101)
+/** Return nonzero iff some byte of the 64-bit word <b>w</b> is less than
+ * <b>n</b>, which must be no more than 128. */
+#define WORD_HAS_BYTE_BELOW(w, n) \
+  (((w) - WORD_ONES*(n)) & ~(w) & (WORD_ONES*0x80))
+/** Return nonzero iff some byte of the 64-bit word <b>w</b> is <b>c</b>. */
+#define WORD_HAS_BYTE(w, c) WORD_HAS_BYTE_BELOW((w) ^ (WORD_ONES*(c)), 1)
+
 /** As find_whitespace, but stop at <b>eos</b> whether we have found a
  * whitespace or not. */
 const char *
 find_whitespace_eos(const char *s, const char *eos)
 {
   /* spider_assert(s); */
+
+  /* Skip ahead a word at a time while none of the bytes could be whitespace,
+   * NUL, or '#'.  Every one of those but '#' is below '!', so a single test
+   * rules out nearly all of them. */
+  while (eos - s >= 8) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    if (WORD_HAS_BYTE_BELOW(w, '!') || WORD_HAS_BYTE(w, '#'))
+      break;
+    s += 8;
+  }
+
   while (s < eos) {
     switch (*s)
     {
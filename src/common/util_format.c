@@ -49,6 +49,26 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   /* Make sure we leave no uninitialized data in the destination buffer. */
   memset(dest, 0, destlen);
 
+  /* Every 5 bytes of input become exactly 8 characters of output, so we can
+   * handle whole blocks without any bit-at-a-time bookkeeping. */
+  while (srclen >= 5) {
+    const uint8_t *s = (const uint8_t *)src;
+    const uint64_t block = ((uint64_t)s[0] << 32) | ((uint64_t)s[1] << 24) |
+      ((uint64_t)s[2] << 16) | ((uint64_t)s[3] << 8) | s[4];
+    dest[0] = BASE32_CHARS[(block >> 35) & 0x1F];
+    dest[1] = BASE32_CHARS[(block >> 30) & 0x1F];
+    dest[2] = BASE32_CHARS[(block >> 25) & 0x1F];
+    dest[3] = BASE32_CHARS[(block >> 20) & 0x1F];
+    dest[4] = BASE32_CHARS[(block >> 15) & 0x1F];
+    dest[5] = BASE32_CHARS[(block >> 10) & 0x1F];
+    dest[6] = BASE32_CHARS[(block >> 5) & 0x1F];
+    dest[7] = BASE32_CHARS[block & 0x1F];
+    src += 5;
+    srclen -= 5;
+    dest += 8;
+  }
+  nbits = srclen * 8;
+
   for (i=0,bit=0; bit < nbits; ++i, bit+=5) {
     /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
     v = ((uint8_t)src[bit/8]) << 8;
@@ -169,6 +189,24 @@ static const char base64_encode_table[64] = {
   '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
+/** Base64 encode the <b>n_blocks</b> 3-byte blocks at <b>src</b> into the
+ * 4*<b>n_blocks</b> characters at <b>dest</b>, without padding or newlines.
+ * Return a pointer just after the last character written. */
+static inline char *
+base64_encode_blocks(char *dest, const unsigned char *src, size_t n_blocks)
+{
+  while (n_blocks--) {
+    const uint32_t n = ((uint32_t)src[0] << 16) | (src[1] << 8) | src[2];
+    dest[0] = base64_encode_table[n >> 18];
+    dest[1] = base64_encode_table[(n >> 12) & 0x3f];
+    dest[2] = base64_encode_table[(n >> 6) & 0x3f];
+    dest[3] = base64_encode_table[n & 0x3f];
+    src += 3;
+    dest += 4;
+  }
+  return dest;
+}
+
 /** Base64 encode <b>srclen</b> bytes of data from <b>src</b>.  Write
  * the result into <b>dest</b>, if it will fit within <b>destlen</b>
  * bytes. Return the number of bytes written on success; -1 if
@@ -204,10 +242,24 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
   /* Make sure we leave no uninitialized data in the destination buffer. */
   memset(dest, 0, destlen);
 
-  /* XXX/Yawning: If this ends up being too slow, this can be sped up
-   * by separating the multiline format case and the normal case, and
-   * processing 48 bytes of input at a time when newlines are desired.
-   */
+  /* Encode all the whole 3-byte blocks first.  In multiline format, every 48
+   * bytes of input make one full 64-character line. */
+  {
+    size_t n_blocks = srclen / 3;
+    if (flags & BASE64_ENCODE_MULTILINE) {
+      const size_t blocks_per_line = BASE64_OPENSSL_LINELEN / 4;
+      while (n_blocks >= blocks_per_line) {
+        d = base64_encode_blocks(d, usrc, blocks_per_line);
+        *d++ = '\n';
+        usrc += blocks_per_line * 3;
+        n_blocks -= blocks_per_line;
+      }
+      linelen = n_blocks * 4;
+    }
+    d = base64_encode_blocks(d, usrc, n_blocks);
+    usrc += n_blocks * 3;
+  }
+
 #define ENCODE_CHAR(ch) \
   STMT_BEGIN                                                    \
     *d++ = ch;                                                  \
@@ -224,8 +276,8 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
 
 #define ENCODE_PAD() ENCODE_CHAR('=')
 
-  /* Iterate over all the bytes in src.  Each one will add 8 bits to the
-   * value we're encoding.  Accumulate bits in <b>n</b>, and whenever we
+  /* Iterate over the remaining bytes in src.  Each one will add 8 bits to
+   * the value we're encoding.  Accumulate bits in <b>n</b>, and whenever we
    * have 24 bits, batch them into 4 bytes and flush those bytes to dest.
    */
   for ( ; usrc < eous; ++usrc) {
@@ -411,8 +463,37 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
-    unsigned char c = (unsigned char) *src;
-    uint8_t v = base64_decode_table[c];
+    unsigned char c;
+    uint8_t v;
+
+    /* Fast path: while we're at a 24-bit boundary, decode four characters
+     * at a time for as long as they're all ordinary base64 characters.  The
+     * special values (SP, PAD, and X) all have one of the top two bits set,
+     * so one test catches any of them; then we fall back to the loop below,
+     * which handles that character exactly as before. */
+    if (n_idx == 0) {
+      while (eos - src >= 4) {
+        const uint8_t *u = (const uint8_t *) src;
+        const uint8_t v0 = base64_decode_table[u[0]];
+        const uint8_t v1 = base64_decode_table[u[1]];
+        const uint8_t v2 = base64_decode_table[u[2]];
+        const uint8_t v3 = base64_decode_table[u[3]];
+        if ((v0 | v1 | v2 | v3) & 0xc0)
+          break;
+        n = ((uint32_t)v0 << 18) | ((uint32_t)v1 << 12) | (v2 << 6) | v3;
+        dest[0] = (n>>16);
+        dest[1] = (n>>8) & 0xff;
+        dest[2] = (n) & 0xff;
+        dest += 3;
+        src += 4;
+      }
+      n = 0;
+      if (src == eos)
+        break;
+    }
+
+    c = (unsigned char) *src;
+    v = base64_decode_table[c];
     switch (v) {
       case X:
         /* This character isn't allowed in base64. */
@@ -491,30 +572,37 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   *cp = '\0';
 }
 
+/** @{ */
+/** Special value used for the base16_decode_table */
+#define X -1
+/** @} */
+/** Internal table mapping byte values to their value as a hex digit, or to
+ * X if they aren't hex digits. */
+static const int8_t base16_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
 static inline int
 hex_decode_digit_(char c)
 {
-  switch (c) {
-    case '0': return 0;
-    case '1': return 1;
-    case '2': return 2;
-    case '3': return 3;
-    case '4': return 4;
-    case '5': return 5;
-    case '6': return 6;
-    case '7': return 7;
-    case '8': return 8;
-    case '9': return 9;
-    case 'A': case 'a': return 10;
-    case 'B': case 'b': return 11;
-    case 'C': case 'c': return 12;
-    case 'D': case 'd': return 13;
-    case 'E': case 'e': return 14;
-    case 'F': case 'f': return 15;
-    default:
-      return -1;
-  }
+  return base16_decode_table[(uint8_t)c];
 }
 
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
@@ -548,7 +636,7 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   while (src<end) {
     v1 = hex_decode_digit_(*src);
     v2 = hex_decode_digit_(*(src+1));
-    if (v1<0||v2<0)
+    if ((v1|v2) < 0)
       return -1;
     *(uint8_t*)dest = (v1<<4)|v2;
     ++dest;
@@ -12,9 +12,20 @@
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in compat_threads.c.
+ * Each worker thread has its own queue of pending work, protected by its own
+ * lock, so that the workers don't all contend for a single lock.  The main
+ * thread gives each new item of work to an idle thread if there is one, and
+ * wakes only that thread, using that thread's condition variable.  If every
+ * thread is busy, it spreads the work among their queues.  A thread that runs
+ * out of work steals from the other threads' queues before it goes idle.
+ * The workers inform the main process of completed work by using an
+ * alert_sockets_t object, as implemented in compat_threads.c.
+ *
+ * Each item of work has a priority.  Workers take high-priority work before
+ * lower-priority work, except that every so often they look at the
+ * lowest-priority work first, so that it can't starve.  The main thread
+ * handles replies in priority order too, and only spends a limited amount of
+ * time on them per pass through the event loop (see replyqueue_set_budget()).
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -32,14 +43,17 @@
 
 struct threadpool_s {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This array doesn't change once the threads are started. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  spider_cond_t condition;
-  /** Queue of pending work that we have to do. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) work;
+  /** Stack of the threads that are waiting for work, most recently idle
+   * last. */
+  struct workerthread_s **idle_threads;
+  /** Number of elements in idle_threads. */
+  int n_idle;
+  /** Index of the thread that should get the next item of work if no thread
+   * is idle. */
+  int next_thread;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
    * at an earlier generation needs to run the update function. */
@@ -54,12 +68,17 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields.  Worker threads only take it
+   * when they go idle or run an update: not for every item of work. */
   spider_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
   replyqueue_t *reply_queue;
 
+  /** How long work of each priority has waited for a thread.  Only the main
+   * thread touches these, when it handles the replies. */
+  workqueue_wait_stats_t wait_stats[WORKQUEUE_N_PRIORITIES];
+
   /** Functions used to allocate and free thread state. */
   void *(*new_thread_state_fn)(void*);
   void (*free_thread_state_fn)(void*);
@@ -74,8 +93,21 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The worker thread on whose queue this entry was put.  (Another thread
+   * may steal it from there.) */
+  struct workerthread_s *on_thread;
+  /** The update generation of the pool when this entry was queued.  No
+   * thread may run it until it has caught up with that generation. */
+  unsigned generation;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by on_thread's lock. */
   uint8_t pending;
+  /** The priority of this entry: a workqueue_priority_t. */
+  uint8_t priority;
+  /** When the main thread queued this entry. */
+  monotime_coarse_t queued_at;
+  /** When a worker thread started processing this entry. */
+  monotime_coarse_t started_at;
   /** Function to run in the worker thread. */
   workqueue_reply_t (*fn)(void *state, void *arg);
   /** Function to run while processing the reply queue. */
@@ -87,13 +119,25 @@ struct workqueue_entry_s {
 struct replyqueue_s {
   /** Mutex to protect the answers field */
   spider_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
+  /** Doubly-linked lists of answers that the reply queue needs to handle,
+   * one for each priority. */
+  TOR_TAILQ_HEAD(, workqueue_entry_s) answers[WORKQUEUE_N_PRIORITIES];
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
+
+  /** Most replies to handle in one call to replyqueue_process(), or 0 for
+   * no limit. */
+  int max_replies;
+  /** Most microseconds to spend in one call to replyqueue_process(), or 0
+   * for no limit. */
+  int max_usec;
 };
 
+/** A worker thread looks at the lowest-priority work first once in this
+ * many items. */
+#define WORKQUEUE_LOW_PRIORITY_INTERVAL 32
+
 /** A worker thread represents a single thread in a thread pool.  To avoid
  * contention, each gets its own queue. This breaks the guarantee that that
  * queued work will get executed strictly in order. */
@@ -107,8 +151,28 @@ typedef struct workerthread_s {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
-  /** The current update generation of this thread */
+  /** The current update generation of this thread.  Only this thread
+   * touches it. */
   unsigned generation;
+  /** How many items of work has this thread taken?  Only this thread
+   * touches it. */
+  unsigned n_taken;
+
+  /** Mutex to protect the fields below. */
+  spider_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when somebody wants us to wake up. */
+  spider_cond_t condition;
+  /** Queues of pending work for this thread, one for each priority. */
+  TOR_TAILQ_HEAD(, workqueue_entry_s) work[WORKQUEUE_N_PRIORITIES];
+  /** True iff somebody has woken us up since we last checked. */
+  unsigned wakeup_pending : 1;
+  /** True iff the pool has a new update for us. */
+  unsigned update_pending : 1;
+
+  /** True iff this thread is in in_pool->idle_threads.  Protected by
+   * in_pool->lock, so it mustn't share a bitfield with the fields above. */
+  uint8_t is_idle;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -117,11 +181,13 @@ static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
  * thread. See threadpool_queue_work() for full documentation. */
 static workqueue_entry_t *
-workqueue_entry_new(workqueue_reply_t (*fn)(void*, void*),
+workqueue_entry_new(workqueue_priority_t prio,
+                    workqueue_reply_t (*fn)(void*, void*),
                     void (*reply_fn)(void*),
                     void *arg)
 {
   workqueue_entry_t *ent = spider_malloc_zero(sizeof(workqueue_entry_t));
+  ent->priority = prio;
   ent->fn = fn;
   ent->reply_fn = reply_fn;
   ent->arg = arg;
@@ -160,13 +226,14 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  spider_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  spider_mutex_acquire(&thread->lock);
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work, ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[ent->priority], ent, next_work);
     cancelled = 1;
     result = ent->arg;
   }
-  spider_mutex_release(&ent->on_pool->lock);
+  spider_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -174,14 +241,184 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
+/** Return true iff the entry <b>work</b> was queued after an update that
+ * <b>thread</b> hasn't run yet. */
+static inline int
+work_is_from_later_generation(const workqueue_entry_t *work,
+                              const workerthread_t *thread)
+{
+  return (int)(work->generation - thread->generation) > 0;
+}
+
+/** Return the order in which <b>thread</b> should look at the priorities
+ * for its next item of work. */
+static const int *
+worker_thread_priority_order(const workerthread_t *thread)
+{
+  static const int high_first[WORKQUEUE_N_PRIORITIES] =
+    { WQ_PRI_HIGH, WQ_PRI_MED, WQ_PRI_LOW };
+  static const int low_first[WORKQUEUE_N_PRIORITIES] =
+    { WQ_PRI_LOW, WQ_PRI_MED, WQ_PRI_HIGH };
+
+  if (thread->n_taken % WORKQUEUE_LOW_PRIORITY_INTERVAL ==
+      WORKQUEUE_LOW_PRIORITY_INTERVAL - 1)
+    return low_first;
+  else
+    return high_first;
+}
+
+/** Try to take the oldest pending entry from <b>victim</b>'s queues, so that
+ * <b>thread</b> can run it.  (<b>victim</b> may be <b>thread</b> itself.)
+ * Look at the <b>n_prios</b> priorities in <b>prios</b>, in order.
+ * Return the entry, or NULL if there is none.  If there is one, but
+ * <b>thread</b> needs to run an update first, leave it where it is, set
+ * *<b>need_update_out</b>, and return NULL. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *thread, workerthread_t *victim,
+                        const int *prios, int n_prios,
+                        int *need_update_out)
+{
+  workqueue_entry_t *work = NULL;
+  int i;
+
+  spider_mutex_acquire(&victim->lock);
+  for (i = 0; i < n_prios && !work; ++i)
+    work = TOR_TAILQ_FIRST(&victim->work[prios[i]]);
+  if (work && work_is_from_later_generation(work, thread)) {
+    *need_update_out = 1;
+    work = NULL;
+  } else if (work) {
+    TOR_TAILQ_REMOVE(&victim->work[work->priority], work, next_work);
+    work->pending = 0;
+  }
+  spider_mutex_release(&victim->lock);
+
+  if (work) {
+    ++thread->n_taken;
+    monotime_coarse_get(&work->started_at);
+  }
+  return work;
+}
+
+/** Look for work for <b>thread</b> in the other threads' queues, and return
+ * the first entry we find, or NULL if there is none.  We look at every
+ * thread's queue for one priority before we look at the next priority.  Set
+ * *<b>need_update_out</b> as in worker_thread_take_work(). */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread, int *need_update_out)
+{
+  threadpool_t *pool = thread->in_pool;
+  const int *prios = worker_thread_priority_order(thread);
+  workqueue_entry_t *work;
+  int p, i;
+
+  for (p = 0; p < WORKQUEUE_N_PRIORITIES; ++p) {
+    for (i = 1; i < pool->n_threads; ++i) {
+      workerthread_t *victim =
+        pool->threads[(thread->index + i) % pool->n_threads];
+      work = worker_thread_take_work(thread, victim, &prios[p], 1,
+                                     need_update_out);
+      if (work || *need_update_out)
+        return work;
+    }
+  }
+  return NULL;
+}
+
+/** Bring <b>thread</b> up to date with its pool's current update generation,
+ * running the pool's update function if necessary.  Return 0 on success,
+ * and -1 if the thread should exit. */
+static int
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_reply_t (*update_fn)(void*,void*) = NULL;
+  void *arg = NULL;
+
+  spider_mutex_acquire(&pool->lock);
+  if (pool->generation != thread->generation) {
+    arg = pool->update_args[thread->index];
+    pool->update_args[thread->index] = NULL;
+    update_fn = pool->update_fn;
+    thread->generation = pool->generation;
+  }
+  spider_mutex_release(&pool->lock);
+
+  if (update_fn && update_fn(thread->state, arg) != WQ_RPL_REPLY)
+    return -1;
+  return 0;
+}
+
+/** Remove <b>thread</b> from its pool's idle stack, if it's there.  Must hold
+ * the pool's lock. */
+static void
+worker_thread_clear_idle(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int i;
+  if (!thread->is_idle)
+    return;
+  for (i = 0; i < pool->n_idle; ++i) {
+    if (pool->idle_threads[i] == thread) {
+      memmove(&pool->idle_threads[i], &pool->idle_threads[i+1],
+              sizeof(workerthread_t *) * (pool->n_idle - i - 1));
+      --pool->n_idle;
+      break;
+    }
+  }
+  thread->is_idle = 0;
+}
 
-   must hold lock */
+/** Return true iff <b>thread</b> has any work in its own queues.  Must hold
+ * the thread's lock. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+worker_thread_has_own_work(const workerthread_t *thread)
 {
-  return !TOR_TAILQ_EMPTY(&thread->in_pool->work) ||
-    thread->generation != thread->in_pool->generation;
+  int i;
+  for (i = 0; i < WORKQUEUE_N_PRIORITIES; ++i) {
+    if (!TOR_TAILQ_EMPTY(&thread->work[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/** Called when <b>thread</b> has no work of its own: tell the pool that
+ * we're idle, so that new work comes to us.  Then try to steal work from the
+ * other threads: if there is none, wait until somebody wakes us up.  Return
+ * the work we stole, if any, and set *<b>need_update_out</b> as in
+ * worker_thread_take_work(). */
+static workqueue_entry_t *
+worker_thread_idle(workerthread_t *thread, int *need_update_out)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+
+  spider_mutex_acquire(&pool->lock);
+  spider_assert(!thread->is_idle);
+  thread->is_idle = 1;
+  pool->idle_threads[pool->n_idle++] = thread;
+  spider_mutex_release(&pool->lock);
+
+  /* Anything queued after this point goes to an idle thread, so if we find
+   * nothing to steal, it's safe to sleep. */
+  work = worker_thread_steal_work(thread, need_update_out);
+
+  if (!work && !*need_update_out) {
+    spider_mutex_acquire(&thread->lock);
+    while (!thread->wakeup_pending && !worker_thread_has_own_work(thread)) {
+      if (spider_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail spider_cond_wait.");
+      }
+    }
+    thread->wakeup_pending = 0;
+    spider_mutex_release(&thread->lock);
+  }
+
+  spider_mutex_acquire(&pool->lock);
+  worker_thread_clear_idle(thread);
+  spider_mutex_release(&pool->lock);
+
+  return work;
 }
 
 /**
@@ -191,62 +428,64 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  spider_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        spider_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        spider_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = TOR_TAILQ_FIRST(&pool->work);
-      TOR_TAILQ_REMOVE(&pool->work, work, next_work);
-      work->pending = 0;
-      spider_mutex_release(&pool->lock);
+    int need_update = 0;
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
-
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
-
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
+    spider_mutex_acquire(&thread->lock);
+    if (thread->update_pending) {
+      thread->update_pending = 0;
+      need_update = 1;
+    }
+    spider_mutex_release(&thread->lock);
+
+    work = NULL;
+    if (!need_update)
+      work = worker_thread_take_work(thread, thread,
+                                     worker_thread_priority_order(thread),
+                                     WORKQUEUE_N_PRIORITIES, &need_update);
+    if (!work && !need_update)
+      work = worker_thread_idle(thread, &need_update);
+
+    if (need_update) {
+      spider_assert(!work);
+      if (worker_thread_run_update(thread) < 0)
         return;
-      }
-      spider_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    if (!work)
+      continue;
+
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (spider_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail spider_cond_wait.");
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
 
+/** Return the reply that <b>queue</b> should handle next, or NULL if it has
+ * none.  Must hold the queue's lock. */
+static workqueue_entry_t *
+replyqueue_first_answer(replyqueue_t *queue)
+{
+  int i;
+  for (i = 0; i < WORKQUEUE_N_PRIORITIES; ++i) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers[i]);
+    if (work)
+      return work;
+  }
+  return NULL;
+}
+
 /** Put a reply on the reply queue.  The reply must not currently be on
  * any thread's work queue. */
 static void
@@ -254,8 +493,8 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
   int was_empty;
   spider_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  was_empty = replyqueue_first_answer(queue) == NULL;
+  TOR_TAILQ_INSERT_TAIL(&queue->answers[work->priority], work, next_work);
   spider_mutex_release(&queue->lock);
 
   if (was_empty) {
@@ -265,30 +504,27 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  Don't start it yet. */
 static workerthread_t *
 workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = spider_malloc_zero(sizeof(workerthread_t));
+  int i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
-
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    //LCOV_EXCL_START
-    spider_assert_nonfatal_unreached();
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    spider_free(thr);
-    return NULL;
-    //LCOV_EXCL_STOP
-  }
+  spider_mutex_init_nonrecursive(&thr->lock);
+  spider_cond_init(&thr->condition);
+  for (i = 0; i < WORKQUEUE_N_PRIORITIES; ++i)
+    TOR_TAILQ_INIT(&thr->work[i]);
 
   return thr;
 }
 
 /**
- * Queue an item of work for a thread in a thread pool.  The function
+ * Queue an item of work with priority <b>prio</b> for a thread in a thread
+ * pool.  The function
  * <b>fn</b> will be run in a worker thread, and will receive as arguments the
  * thread's state object, and the provided object <b>arg</b>. It must return
  * one of WQ_RPL_REPLY, WQ_RPL_ERROR, or WQ_RPL_SHUTDOWN.
@@ -305,26 +541,63 @@ workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
  * be executed strictly in order.
  */
 workqueue_entry_t *
-threadpool_queue_work(threadpool_t *pool,
-                      workqueue_reply_t (*fn)(void *, void *),
-                      void (*reply_fn)(void *),
-                      void *arg)
+threadpool_queue_work_priority(threadpool_t *pool,
+                               workqueue_priority_t prio,
+                               workqueue_reply_t (*fn)(void *, void *),
+                               void (*reply_fn)(void *),
+                               void *arg)
 {
-  workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workqueue_entry_t *ent;
+  workerthread_t *thread;
+  int wake;
+
+  if (BUG(pool->n_threads == 0))
+    return NULL; // LCOV_EXCL_LINE
+  if (BUG(prio < WQ_PRI_HIGH || prio > WQ_PRI_LOW))
+    prio = WQ_PRI_LOW; // LCOV_EXCL_LINE
+
+  ent = workqueue_entry_new(prio, fn, reply_fn, arg);
   ent->on_pool = pool;
   ent->pending = 1;
+  monotime_coarse_get(&ent->queued_at);
 
+  /* Give the work to the thread that went idle most recently, if any: its
+   * cache is the warmest.  Otherwise, take turns. */
   spider_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work, ent, next_work);
-
-  spider_cond_signal_one(&pool->condition);
-
+  ent->generation = pool->generation;
+  wake = (pool->n_idle > 0);
+  if (wake) {
+    thread = pool->idle_threads[--pool->n_idle];
+    thread->is_idle = 0;
+  } else {
+    thread = pool->threads[pool->next_thread];
+    if (++pool->next_thread == pool->n_threads)
+      pool->next_thread = 0;
+  }
   spider_mutex_release(&pool->lock);
 
+  ent->on_thread = thread;
+  spider_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  if (wake) {
+    thread->wakeup_pending = 1;
+    spider_cond_signal_one(&thread->condition);
+  }
+  spider_mutex_release(&thread->lock);
+
   return ent;
 }
 
+/** As threadpool_queue_work_priority(), but with WQ_PRI_HIGH. */
+workqueue_entry_t *
+threadpool_queue_work(threadpool_t *pool,
+                      workqueue_reply_t (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg)
+{
+  return threadpool_queue_work_priority(pool, WQ_PRI_HIGH, fn, reply_fn, arg);
+}
+
 /**
  * Queue a copy of a work item for every thread in a pool.  This can be used,
  * for example, to tell the threads to update some parameter in their states.
@@ -370,10 +643,17 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  spider_cond_signal_all(&pool->condition);
-
   spider_mutex_release(&pool->lock);
 
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    spider_mutex_acquire(&thr->lock);
+    thr->update_pending = 1;
+    thr->wakeup_pending = 1;
+    spider_cond_signal_one(&thr->condition);
+    spider_mutex_release(&thr->lock);
+  }
+
   if (old_args) {
     for (i = 0; i < n_threads; ++i) {
       if (old_args[i] && old_args_free_fn)
@@ -388,35 +668,42 @@ threadpool_queue_update(threadpool_t *pool,
 /** Don't have more than this many threads per pool. */
 #define MAX_THREADS 1024
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch <b>n</b> threads in <b>pool</b>, which must not have any yet.
+ * We set up all the threads before we start any, since each one may look at
+ * the others' queues. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int i;
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads))
+    return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
   spider_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = spider_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  pool->threads = spider_calloc(n, sizeof(workerthread_t*));
+  pool->idle_threads = spider_calloc(n, sizeof(workerthread_t*));
 
-  while (pool->n_threads < n) {
+  for (i = 0; i < n; ++i) {
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(state, pool, pool->reply_queue);
+    thr->index = i;
+    pool->threads[i] = thr;
+  }
+  pool->n_threads = n;
 
-    if (!thr) {
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
       //LCOV_EXCL_START
       spider_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       spider_mutex_release(&pool->lock);
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
   spider_mutex_release(&pool->lock);
 
@@ -440,8 +727,6 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = spider_malloc_zero(sizeof(threadpool_t));
   spider_mutex_init_nonrecursive(&pool->lock);
-  spider_cond_init(&pool->condition);
-  TOR_TAILQ_INIT(&pool->work);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -451,7 +736,6 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     spider_assert_nonfatal_unreached();
-    spider_cond_uninit(&pool->condition);
     spider_mutex_uninit(&pool->lock);
     spider_free(pool);
     return NULL;
@@ -468,6 +752,22 @@ threadpool_get_replyqueue(threadpool_t *tp)
   return tp->reply_queue;
 }
 
+/** Return the statistics on how long the work of priority <b>prio</b> has
+ * waited in <b>tp</b>'s queues, since we started or last reset them. */
+const workqueue_wait_stats_t *
+threadpool_get_wait_stats(const threadpool_t *tp, workqueue_priority_t prio)
+{
+  spider_assert(prio >= WQ_PRI_HIGH && prio <= WQ_PRI_LOW);
+  return &tp->wait_stats[prio];
+}
+
+/** Reset all the wait time statistics for <b>tp</b>. */
+void
+threadpool_reset_wait_stats(threadpool_t *tp)
+{
+  memset(tp->wait_stats, 0, sizeof(tp->wait_stats));
+}
+
 /** Allocate a new reply queue.  Reply queues are used to pass results from
  * worker threads to the main thread.  Since the main thread is running an
  * IO-centric event loop, it needs to get woken up with means other than a
@@ -476,6 +776,7 @@ replyqueue_t *
 replyqueue_new(uint32_t alertsocks_flags)
 {
   replyqueue_t *rq;
+  int i;
 
   rq = spider_malloc_zero(sizeof(replyqueue_t));
   if (alert_sockets_create(&rq->alert, alertsocks_flags) < 0) {
@@ -486,7 +787,8 @@ replyqueue_new(uint32_t alertsocks_flags)
   }
 
   spider_mutex_init(&rq->lock);
-  TOR_TAILQ_INIT(&rq->answers);
+  for (i = 0; i < WORKQUEUE_N_PRIORITIES; ++i)
+    TOR_TAILQ_INIT(&rq->answers[i]);
 
   return rq;
 }
@@ -502,14 +804,65 @@ replyqueue_get_socket(replyqueue_t *rq)
   return rq->alert.read_fd;
 }
 
+/** Tell <b>queue</b> to handle no more than <b>max_replies</b> replies,
+ * and to spend no more than about <b>max_usec</b> microseconds, each time
+ * that replyqueue_process() is called.  Either may be 0 for "no limit".
+ * When it stops early, the reply queue alerts itself, so that the main loop
+ * calls it again after handling its other events. */
+void
+replyqueue_set_budget(replyqueue_t *queue, int max_replies, int max_usec)
+{
+  queue->max_replies = max_replies;
+  queue->max_usec = max_usec;
+}
+
+/** Return true iff <b>queue</b> has used up its budget for this call to
+ * replyqueue_process(), having handled <b>n_handled</b> replies since
+ * <b>started</b>. */
+static int
+replyqueue_budget_exhausted(const replyqueue_t *queue, int n_handled,
+                            const monotime_t *started)
+{
+  if (n_handled == 0)
+    return 0;
+  if (queue->max_replies && n_handled >= queue->max_replies)
+    return 1;
+  if (queue->max_usec) {
+    monotime_t now;
+    monotime_get(&now);
+    if (monotime_diff_usec(started, &now) >= queue->max_usec)
+      return 1;
+  }
+  return 0;
+}
+
+/** Note in the statistics of <b>pool</b> how long <b>work</b> waited for a
+ * thread to start it. */
+static void
+threadpool_note_wait_time(threadpool_t *pool, const workqueue_entry_t *work)
+{
+  workqueue_wait_stats_t *stats = &pool->wait_stats[work->priority];
+  int64_t usec = monotime_coarse_diff_usec(&work->queued_at,
+                                           &work->started_at);
+  if (usec < 0)
+    usec = 0;
+  ++stats->n_started;
+  stats->total_wait_usec += usec;
+  if ((uint64_t)usec > stats->max_wait_usec)
+    stats->max_wait_usec = usec;
+}
+
 /**
- * Process all pending replies on a reply queue. The main thread should call
- * this function every time the socket returned by replyqueue_get_socket() is
- * readable.
+ * Process all pending replies on a reply queue, highest priority first,
+ * within the queue's budget. The main thread should call this function every
+ * time the socket returned by replyqueue_get_socket() is readable.
  */
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  workqueue_entry_t *work;
+  monotime_t started;
+  int n_handled = 0, out_of_budget = 0;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -520,20 +873,38 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  monotime_get(&started);
+
   spider_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
+  while ((work = replyqueue_first_answer(queue))) {
     /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
+    if (replyqueue_budget_exhausted(queue, n_handled, &started)) {
+      out_of_budget = 1;
+      break;
+    }
+    TOR_TAILQ_REMOVE(&queue->answers[work->priority], work, next_work);
     spider_mutex_release(&queue->lock);
+    if (work->on_pool)
+      threadpool_note_wait_time(work->on_pool, work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
+    ++n_handled;
 
     spider_mutex_acquire(&queue->lock);
   }
 
   spider_mutex_release(&queue->lock);
+
+  if (out_of_budget) {
+    /* Come back for the rest once the main loop has handled its other
+     * events. */
+    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+      //LCOV_EXCL_START
+      log_warn(LD_GENERAL, "Couldn't reschedule reply queue processing.");
+      //LCOV_EXCL_STOP
+    }
+  }
 }
 
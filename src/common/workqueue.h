@@ -22,6 +22,34 @@ typedef enum {
   WQ_RPL_SHUTDOWN = 2, /** indicates thread is shutting down */
 } workqueue_reply_t;
 
+/** Possible priorities for work.  Workers run higher-priority work first,
+ * and the main thread handles replies to it first. */
+typedef enum {
+  WQ_PRI_HIGH = 0, /** latency-critical work, like circuit handshakes */
+  WQ_PRI_MED = 1,
+  WQ_PRI_LOW = 2, /** bulk background work */
+} workqueue_priority_t;
+
+/** Number of distinct workqueue_priority_t values. */
+#define WORKQUEUE_N_PRIORITIES 3
+
+/** How long the work of one priority has waited for a worker thread to
+ * start it. */
+typedef struct workqueue_wait_stats_t {
+  /** Number of items that a worker started, and whose replies we have
+   * handled. */
+  uint64_t n_started;
+  /** Total microseconds that those items spent waiting in the queue. */
+  uint64_t total_wait_usec;
+  /** Longest that any of those items waited in the queue. */
+  uint64_t max_wait_usec;
+} workqueue_wait_stats_t;
+
+workqueue_entry_t *threadpool_queue_work_priority(threadpool_t *pool,
+                                    workqueue_priority_t prio,
+                                    workqueue_reply_t (*fn)(void *, void *),
+                                    void (*reply_fn)(void *),
+                                    void *arg);
 workqueue_entry_t *threadpool_queue_work(threadpool_t *pool,
                                          workqueue_reply_t (*fn)(void *,
                                                                  void *),
@@ -40,9 +68,14 @@ threadpool_t *threadpool_new(int n_threads,
                              void (*free_thread_state_fn)(void*),
                              void *arg);
 replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
+const workqueue_wait_stats_t *threadpool_get_wait_stats(const threadpool_t *tp,
+                                                workqueue_priority_t prio);
+void threadpool_reset_wait_stats(threadpool_t *tp);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 spider_socket_t replyqueue_get_socket(replyqueue_t *rq);
+void replyqueue_set_budget(replyqueue_t *queue, int max_replies,
+                          int max_usec);
 void replyqueue_process(replyqueue_t *queue);
 
 #endif
@@ -38,6 +38,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 //#define PARANOIA
 
@@ -68,6 +71,24 @@
  * forever.
  */
 
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+/** Defined if we can use readv() and writev() to move data between a socket
+ * and several chunks of a buffer in a single system call. */
+#define BUF_USE_IOVEC
+/** Largest number of chunks that we'll hand to a single readv() or
+ * writev().  A flush is bounded by the write bucket anyway, so there's no
+ * point in building a bigger iovec array than this on the stack. */
+#if defined(IOV_MAX) && IOV_MAX < 128
+#define BUF_MAX_IOV IOV_MAX
+#else
+#define BUF_MAX_IOV 128
+#endif
+/** Largest number of fresh chunks that read_to_buf() will allocate ahead of
+ * a single readv().  Any that the kernel doesn't fill get freed again, so
+ * we don't want to speculate too much. */
+#define BUF_MAX_READV_NEW_CHUNKS 8
+#endif
+
 static void socks_request_set_socks5_error(socks_request_t *req,
                               socks5_reply_status_t reason);
 
@@ -131,6 +152,8 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->release_fn)
+    return 0; /* We don't own this memory: see buf_add_external(). */
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -158,6 +181,8 @@ buf_chunk_free_unchecked(chunk_t *chunk)
   spider_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (chunk->release_fn)
+    chunk->release_fn(chunk->release_arg);
   spider_free(chunk);
 }
 static inline chunk_t *
@@ -167,6 +192,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch = spider_malloc(alloc);
   ch->next = NULL;
   ch->datalen = 0;
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
 #ifdef DEBUG_CHUNK_ALLOC
   ch->DBG_alloc = alloc;
 #endif
@@ -243,6 +270,22 @@ buf_pullup(buf_t *buf, size_t bytes)
   if (buf->head->datalen >= bytes)
     return;
 
+  if (buf->head->release_fn) {
+    /* We can't write into memory that we don't own, so move the head's
+     * data into a chunk of our own first. */
+    chunk_t *oldhead = buf->head;
+    chunk_t *newhead =
+      chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+    memcpy(newhead->mem, oldhead->data, oldhead->datalen);
+    newhead->datalen = oldhead->datalen;
+    newhead->inserted_time = oldhead->inserted_time;
+    newhead->next = oldhead->next;
+    if (buf->tail == oldhead)
+      buf->tail = newhead;
+    buf->head = newhead;
+    buf_chunk_free_unchecked(oldhead);
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -456,10 +499,19 @@ buf_free(buf_t *buf)
   spider_free(buf);
 }
 
-/** Return a new copy of <b>in_chunk</b> */
+/** Return a new copy of <b>in_chunk</b>.  If <b>in_chunk</b> refers to
+ * external memory, the copy holds its own copy of the data. */
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (in_chunk->release_fn) {
+    chunk_t *newch =
+      chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->datalen));
+    memcpy(newch->mem, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
   chunk_t *newch = spider_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -543,6 +595,24 @@ buf_get_total_allocation(void)
   return total_bytes_allocated_in_chunks;
 }
 
+/** How many times have we called recv() or readv() on a socket on behalf of
+ * a buffer? */
+static uint64_t n_socket_read_calls = 0;
+/** How many times have we called send() or writev() on a socket on behalf
+ * of a buffer? */
+static uint64_t n_socket_write_calls = 0;
+
+/** Set *<b>n_reads_out</b> and *<b>n_writes_out</b> to the number of
+ * system calls that read_to_buf() and flush_buf() have made so far. */
+void
+buf_get_socket_syscall_counts(uint64_t *n_reads_out, uint64_t *n_writes_out)
+{
+  if (n_reads_out)
+    *n_reads_out = n_socket_read_calls;
+  if (n_writes_out)
+    *n_writes_out = n_socket_write_calls;
+}
+
 /** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
  * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
@@ -555,6 +625,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, spider_socket_t fd, size_t at_most,
   if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
     at_most = CHUNK_REMAINING_CAPACITY(chunk);
   read_result = spider_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
+  ++n_socket_read_calls;
 
   if (read_result < 0) {
     int e = spider_socket_errno(fd);
@@ -581,6 +652,101 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, spider_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef BUF_USE_IOVEC
+/** Read up to *<b>at_most</b> bytes from the socket <b>fd</b> onto the end
+ * of <b>buf</b> with a single system call, allocating as many new chunks
+ * as we need (within BUF_MAX_READV_NEW_CHUNKS) to hold them.  Lower
+ * *<b>at_most</b> to the number of bytes we actually asked for.  Chunks that
+ * the kernel doesn't fill are freed again.  Return values are as for
+ * read_to_chunk(). */
+static int
+read_to_chunks_iov(buf_t *buf, spider_socket_t fd, size_t *at_most,
+                   int *reached_eof, int *socket_error)
+{
+  struct iovec iov[BUF_MAX_READV_NEW_CHUNKS + 1];
+  chunk_t *chunks[BUF_MAX_READV_NEW_CHUNKS + 1];
+  size_t want = *at_most, total = 0;
+  ssize_t read_result;
+  int n = 0, n_new = 0, i, last_used;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    chunk_t *chunk = buf->tail;
+    size_t len = CHUNK_REMAINING_CAPACITY(chunk);
+    if (len > want)
+      len = want;
+    chunks[n] = chunk;
+    iov[n].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n].iov_len = len;
+    total += len;
+    ++n;
+  }
+  while (total < want && n_new < BUF_MAX_READV_NEW_CHUNKS) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, want - total, 1);
+    size_t len = chunk->memlen;
+    if (len > want - total)
+      len = want - total;
+    chunks[n] = chunk;
+    iov[n].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n].iov_len = len;
+    total += len;
+    ++n;
+    ++n_new;
+  }
+  *at_most = total;
+
+  if (n == 1)
+    return read_to_chunk(buf, chunks[0], fd, total, reached_eof, socket_error);
+
+  read_result = readv(fd, iov, n);
+  ++n_socket_read_calls;
+
+  /* Put the bytes we got into the chunks that they landed in. */
+  last_used = 0;
+  if (read_result > 0) {
+    size_t left = (size_t)read_result;
+    for (i = 0; i < n && left; ++i) {
+      size_t got = left < iov[i].iov_len ? left : iov[i].iov_len;
+      chunks[i]->datalen += got;
+      left -= got;
+      last_used = i;
+    }
+    buf->datalen += read_result;
+  }
+
+  /* Free the new chunks that we didn't need.  The tail is the only chunk
+   * that may be left empty. */
+  if (last_used < n - 1) {
+    chunk_t *chunk = chunks[last_used]->next;
+    chunks[last_used]->next = NULL;
+    buf->tail = chunks[last_used];
+    while (chunk) {
+      chunk_t *next = chunk->next;
+      buf_chunk_free_unchecked(chunk);
+      chunk = next;
+    }
+  }
+  check();
+
+  if (read_result < 0) {
+    int e = spider_socket_errno(fd);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      *socket_error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+              (long)read_result, last_used + 1, (int)buf->datalen);
+    spider_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif
+
 /** As read_to_chunk(), but return (negative) error code on error, blocking,
  * or TLS, and the number of bytes read otherwise. */
 static inline int
@@ -625,6 +791,9 @@ read_to_buf(spider_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+#ifdef BUF_USE_IOVEC
+    r = read_to_chunks_iov(buf, s, &readlen, reached_eof, socket_error);
+#else
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
@@ -638,6 +807,7 @@ read_to_buf(spider_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
     }
 
     r = read_to_chunk(buf, chunk, s, readlen, reached_eof, socket_error);
+#endif
     check();
     if (r < 0)
       return r; /* Error */
@@ -725,6 +895,7 @@ flush_chunk(spider_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   if (sz > chunk->datalen)
     sz = chunk->datalen;
   write_result = spider_socket_send(s, chunk->data, sz, 0);
+  ++n_socket_write_calls;
 
   if (write_result < 0) {
     int e = spider_socket_errno(s);
@@ -745,6 +916,55 @@ flush_chunk(spider_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef BUF_USE_IOVEC
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from the front of
+ * <b>buf</b> onto socket <b>s</b>, gathering up to BUF_MAX_IOV chunks into
+ * a single writev().  Set *<b>attempted_out</b> to the number of bytes we
+ * tried to write.  Otherwise behaves as flush_chunk().
+ */
+static int
+flush_chunks_iov(spider_socket_t s, buf_t *buf, size_t sz,
+                 size_t *attempted_out, size_t *buf_flushlen)
+{
+  struct iovec iov[BUF_MAX_IOV];
+  const chunk_t *chunk;
+  size_t total = 0;
+  ssize_t write_result;
+  int n = 0;
+
+  for (chunk = buf->head; chunk && total < sz && n < BUF_MAX_IOV;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len > sz - total)
+      len = sz - total;
+    iov[n].iov_base = chunk->data;
+    iov[n].iov_len = len;
+    total += len;
+    ++n;
+  }
+  *attempted_out = total;
+
+  if (n == 1)
+    return flush_chunk(s, buf, buf->head, total, buf_flushlen);
+
+  write_result = writev(s, iov, n);
+  ++n_socket_write_calls;
+
+  if (write_result < 0) {
+    int e = spider_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) /* it's a real error */
+      return -1;
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_remove_from_front(buf, write_result);
+    spider_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif
+
 /** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
  * more if there is a forced pending write size.)  On success, deduct the
@@ -805,12 +1025,16 @@ flush_buf(spider_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     spider_assert(buf->head);
+#ifdef BUF_USE_IOVEC
+    r = flush_chunks_iov(s, buf, sz, &flushlen0, buf_flushlen);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -1023,15 +1247,104 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** Remove the first chunk of <b>buf_in</b> and append it to
+ * <b>buf_out</b>, without copying its data. */
+static inline void
+buf_move_head_chunk(buf_t *buf_out, buf_t *buf_in)
+{
+  chunk_t *chunk = buf_in->head;
+  spider_assert(chunk);
+
+  buf_in->head = chunk->next;
+  if (buf_in->tail == chunk)
+    buf_in->tail = NULL;
+  buf_in->datalen -= chunk->datalen;
+
+  chunk->next = NULL;
+  chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec();
+  if (buf_out->tail) {
+    buf_out->tail->next = chunk;
+  } else {
+    buf_out->head = chunk;
+  }
+  buf_out->tail = chunk;
+  buf_out->datalen += chunk->datalen;
+}
+
+/** Append <b>len</b> bytes at <b>data</b> to the end of <b>buf</b> without
+ * copying them.  The caller must keep that memory valid and unchanged until
+ * the buffer calls <b>release_fn</b>(<b>release_arg</b>), which it does
+ * exactly once, when it no longer needs any of those bytes -- possibly
+ * before this function returns.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t len,
+                 buf_release_fn_t release_fn, void *release_arg)
+{
+  chunk_t *chunk;
+
+  spider_assert(release_fn);
+  if (BUG(buf->datalen >= INT_MAX - len)) {
+    release_fn(release_arg);
+    return -1;
+  }
+  if (!len) {
+    release_fn(release_arg);
+    return (int)buf->datalen;
+  }
+  check();
+
+  if (buf->tail && buf->tail->datalen == 0) {
+    /* Only the tail may be empty, so we can't put anything after it.  Any
+     * empty tail is ours, so put the data there if it fits. */
+    if (CHUNK_REMAINING_CAPACITY(buf->tail) >= len) {
+      write_to_buf(data, len, buf);
+      release_fn(release_arg);
+      return (int)buf->datalen;
+    }
+    if (buf->head == buf->tail) {
+      buf_chunk_free_unchecked(buf->head);
+      buf->head = buf->tail = NULL;
+    } else {
+      size_t n = CHUNK_REMAINING_CAPACITY(buf->tail);
+      write_to_buf(data, n, buf);
+      data += n;
+      len -= n;
+    }
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)data;
+  chunk->datalen = len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+  } else {
+    buf->head = chunk;
+  }
+  buf->tail = chunk;
+  buf->datalen += len;
+  check();
+  return (int)buf->datalen;
+}
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
- * Return the number of bytes actually copied.
+ * Return the number of bytes actually moved.
+ *
+ * Whole chunks are moved from one buffer to the other without copying
+ * their contents; we only copy a chunk that is too small to be worth
+ * keeping separately, or the part of the last chunk that we aren't moving
+ * in full.
  */
 int
 move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
 
   if (BUG(buf_out->datalen >= INT_MAX))
@@ -1043,17 +1356,46 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   if (len > buf_in->datalen)
     len = buf_in->datalen;
 
-  cp = len; /* Remember the number of bytes we intend to copy. */
+  cp = len; /* Remember the number of bytes we intend to move. */
   spider_assert(cp < INT_MAX);
+
+  if (len && buf_out->tail && buf_out->tail->datalen == 0) {
+    /* Only the tail may be empty, so we can't put a chunk after an empty
+     * tail.  If it's the only chunk, just drop it; otherwise, top it up. */
+    if (buf_out->head == buf_out->tail) {
+      buf_chunk_free_unchecked(buf_out->head);
+      buf_out->head = buf_out->tail = NULL;
+    } else {
+      size_t n = CHUNK_REMAINING_CAPACITY(buf_out->tail);
+      if (n > len)
+        n = len;
+      if (n > buf_in->head->datalen)
+        n = buf_in->head->datalen;
+      write_to_buf(buf_in->head->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+      len -= n;
+    }
+  }
+
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    fetch_from_buf(b, n, buf_in);
-    write_to_buf(b, n, buf_out);
-    len -= n;
+    chunk_t *chunk = buf_in->head;
+    spider_assert(chunk);
+    if (chunk->datalen > len ||
+        (buf_out->tail &&
+         chunk->datalen <= CHUNK_REMAINING_CAPACITY(buf_out->tail) &&
+         chunk->datalen < MIN_CHUNK_ALLOC)) {
+      /* Copy a partial chunk, or a small one that fits in what we have. */
+      size_t n = chunk->datalen > len ? len : chunk->datalen;
+      write_to_buf(chunk->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+      len -= n;
+    } else {
+      len -= chunk->datalen;
+      buf_move_head_chunk(buf_out, buf_in);
+    }
   }
+  check();
+
   *buf_flushlen -= cp;
   return (int)cp;
 }
@@ -2165,6 +2507,15 @@ assert_buf_ok(buf_t *buf)
     spider_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (ch->release_fn) {
+        /* External memory: we can't say much about it. */
+        spider_assert(ch->memlen == 0);
+        spider_assert(ch->data);
+        spider_assert(ch->datalen > 0);
+        if (!ch->next)
+          spider_assert(ch == buf->tail);
+        continue;
+      }
       spider_assert(ch->datalen <= ch->memlen);
       spider_assert(ch->data >= &ch->mem[0]);
       spider_assert(ch->data <= &ch->mem[0]+ch->memlen);
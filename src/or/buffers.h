@@ -14,6 +14,10 @@
 
 #include "testsupport.h"
 
+/** A function that buf_add_external() calls to give back memory that a
+ * buffer no longer needs. */
+typedef void (*buf_release_fn_t)(void *arg);
+
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 size_t buf_get_default_chunk_size(const buf_t *buf);
@@ -27,6 +31,8 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+void buf_get_socket_syscall_counts(uint64_t *n_reads_out,
+                                   uint64_t *n_writes_out);
 
 int read_to_buf(spider_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
                 int *socket_error);
@@ -36,6 +42,8 @@ int flush_buf(spider_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(spider_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int buf_add_external(buf_t *buf, const char *data, size_t len,
+                     buf_release_fn_t release_fn, void *release_arg);
 int write_to_buf_zlib(buf_t *buf, spider_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
@@ -82,6 +90,12 @@ typedef struct chunk_t {
   char *data; /**< A pointer to the first byte of data sspidered in <b>mem</b>. */
   uint32_t inserted_time; /**< Timestamp in truncated ms since epoch
                            * when this chunk was inserted. */
+  /** If this chunk's data lives in memory that the buffer doesn't own (see
+   * buf_add_external()), a function to call with <b>release_arg</b> when we
+   * no longer need it.  Such a chunk has no <b>mem</b> of its own, and we
+   * never write into it. */
+  buf_release_fn_t release_fn;
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for sspiderage in
                 * this chunk. */
 } chunk_t;
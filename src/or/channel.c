@@ -57,6 +57,7 @@
 #include "circuitmux.h"
 #include "entrynodes.h"
 #include "geoip.h"
+#include "main.h"
 #include "nodelist.h"
 #include "relay.h"
 #include "rephist.h"
@@ -911,6 +912,9 @@ channel_free(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  /* ...and of the circuit IDs it was keeping track of */
+  channel_free_circid_table(chan);
+
   /* We're in CLOSED or ERROR, so the cell queue is already empty */
 
   spider_free(chan);
@@ -986,6 +990,7 @@ channel_force_free(channel_t *chan)
     circuitmux_free(chan->cmux);
     chan->cmux = NULL;
   }
+  channel_free_circid_table(chan);
 
   /* We might still have a cell queue; kill it */
   TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->incoming_queue, next, cell_tmp) {
@@ -1160,6 +1165,28 @@ channel_set_cell_handlers(channel_t *chan,
        chan->var_cell_handler)) channel_process_cells(chan);
 }
 
+/**
+ * Set the packed cell handler for a channel
+ *
+ * This function sets the optional handler that channel_queue_packed_cell()
+ * offers incoming fixed-length cells to before they are unpacked.
+ */
+
+void
+channel_set_packed_cell_handler(channel_t *chan,
+                                channel_packed_cell_handler_fn_ptr
+                                  packed_cell_handler)
+{
+  spider_assert(chan);
+  spider_assert(CHANNEL_CAN_HANDLE_CELLS(chan));
+
+  log_debug(LD_CHANNEL,
+           "Setting packed_cell_handler callback for channel %p to %p",
+           chan, packed_cell_handler);
+
+  chan->packed_cell_handler = packed_cell_handler;
+}
+
 /*
  * On closing channels
  *
@@ -1898,7 +1925,22 @@ channel_write_cell_generic_(channel_t *chan, const char *cell_type,
     log_debug(LD_CHANNEL, "Discarding %c %p on closing channel %p with "
               "global ID "U64_FORMAT, *cell_type, cell, chan,
               U64_PRINTF_ARG(chan->global_identifier));
-    spider_free(cell);
+    /* Free it the right way for its type: packed cells belong to the
+     * cell pool. */
+    switch (q->type) {
+      case CELL_QUEUE_FIXED:
+        spider_free(cell);
+        break;
+      case CELL_QUEUE_PACKED:
+        packed_cell_free(q->u.packed.packed_cell);
+        break;
+      case CELL_QUEUE_VAR:
+        var_cell_free(q->u.var.var_cell);
+        break;
+      default:
+        spider_free(cell);
+        break;
+    }
     return;
   }
   log_debug(LD_CHANNEL,
@@ -2468,8 +2510,8 @@ channel_flush_cells(channel_t *chan)
  * available.
  */
 
-int
-channel_more_to_flush(channel_t *chan)
+MOCK_IMPL(int,
+channel_more_to_flush, (channel_t *chan))
 {
   spider_assert(chan);
 
@@ -2792,6 +2834,42 @@ channel_queue_cell(channel_t *chan, cell_t *cell)
   }
 }
 
+/**
+ * Offer incoming packed cell
+ *
+ * This may be called by a channel_t subclass with an incoming fixed-length
+ * cell that it has not yet unpacked, so that cells we only forward need
+ * never be copied into a cell_t.  If the upper layer takes ownership of
+ * <b>cell</b>, return 1.  Otherwise return 0; the caller still owns the
+ * cell, and should unpack it and pass it to channel_queue_cell().
+ */
+
+int
+channel_queue_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  spider_assert(chan);
+  spider_assert(cell);
+  spider_assert(CHANNEL_IS_OPEN(chan));
+
+  /* Only bypass the incoming queue if doing so can't reorder cells */
+  if (!(chan->packed_cell_handler) ||
+      !(chan->cell_handler) ||
+      ! TOR_SIMPLEQ_EMPTY(&chan->incoming_queue))
+    return 0;
+
+  if (! chan->packed_cell_handler(chan, cell))
+    return 0;
+
+  /* Timestamp for receiving */
+  channel_timestamp_recv(chan);
+
+  /* Update the counters */
+  ++(chan->n_cells_recved);
+  chan->n_bytes_recved += get_cell_network_size(chan->wide_circ_ids);
+
+  return 1;
+}
+
 /**
  * Queue incoming variable-length cell
  *
@@ -3911,6 +3989,12 @@ channel_mark_bad_for_new_circs(channel_t *chan)
   spider_assert(chan);
 
   chan->is_bad_for_new_circs = 1;
+
+  /* Housekeeping closes bad channels as soon as they have no circuits:
+   * make sure it looks at this one soon. */
+  if (chan->magic == TLS_CHAN_MAGIC && BASE_CHAN_TO_TLS(chan)->conn)
+    connection_housekeeping_schedule(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn),
+                                     approx_time());
 }
 
 /**
@@ -4131,6 +4215,36 @@ channel_num_cells_writeable(channel_t *chan)
   return result;
 }
 
+/**
+ * Return the socket that <b>chan</b> writes to, or TOR_INVALID_SOCKET if it
+ * has none or the lower layer won't say.
+ */
+
+spider_socket_t
+channel_get_socket(channel_t *chan)
+{
+  spider_assert(chan);
+
+  if (!chan->get_socket || CHANNEL_CONDEMNED(chan))
+    return TOR_INVALID_SOCKET;
+
+  return chan->get_socket(chan);
+}
+
+/**
+ * Ask the lower layer of <b>chan</b> to hand whatever it has queued to the
+ * kernel now, if it knows how.
+ */
+
+void
+channel_flush_to_kernel(channel_t *chan)
+{
+  spider_assert(chan);
+
+  if (chan->flush_to_kernel && CHANNEL_IS_OPEN(chan))
+    chan->flush_to_kernel(chan);
+}
+
 /*********************
  * Timestamp updates *
  ********************/
@@ -16,6 +16,8 @@
 typedef void (*channel_listener_fn_ptr)(channel_listener_t *, channel_t *);
 typedef void (*channel_cell_handler_fn_ptr)(channel_t *, cell_t *);
 typedef void (*channel_var_cell_handler_fn_ptr)(channel_t *, var_cell_t *);
+typedef int (*channel_packed_cell_handler_fn_ptr)(channel_t *,
+                                                  packed_cell_t *);
 
 struct cell_queue_entry_s;
 TOR_SIMPLEQ_HEAD(chan_cell_queue, cell_queue_entry_s);
@@ -83,6 +85,20 @@ struct channel_s {
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
 
+  /** Per-tick state for use by the KIST scheduler; see scheduler.c */
+  struct {
+    /** The scheduler tick for which <b>limit</b> and <b>written</b> were
+     * last reset. */
+    uint64_t tick;
+    /** How many bytes the kernel will accept from us during <b>tick</b>. */
+    int64_t limit;
+    /** How many bytes we've queued on this channel during <b>tick</b>,
+     * counting any that were still queued when it began. */
+    int64_t written;
+    /** The last scheduler tick during which we wrote cells here. */
+    uint64_t last_write_tick;
+  } sched_kist;
+
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
   time_t timestamp_active; /* Any activity */
@@ -101,6 +117,10 @@ struct channel_s {
   /** Registered handlers for incoming cells */
   channel_cell_handler_fn_ptr cell_handler;
   channel_var_cell_handler_fn_ptr var_cell_handler;
+  /** Optional handler for incoming fixed-length cells that are still in
+   * network format; it may decline a cell by returning 0 without touching
+   * it, or return 1 to take ownership of it. */
+  channel_packed_cell_handler_fn_ptr packed_cell_handler;
 
   /* Methods implemented by the lower layer */
 
@@ -145,6 +165,16 @@ struct channel_s {
   size_t (*num_bytes_queued)(channel_t *);
   /* Ask the lower layer how many cells can be written */
   int (*num_cells_writeable)(channel_t *);
+  /**
+   * Optional: return the socket that the lower layer writes to, so that
+   * the scheduler can ask the kernel about it, or TOR_INVALID_SOCKET.
+   */
+  spider_socket_t (*get_socket)(channel_t *);
+  /**
+   * Optional: hand any bytes queued in the lower layer to the kernel now,
+   * rather than waiting for the socket to become writeable.
+   */
+  void (*flush_to_kernel)(channel_t *);
   /* Write a cell to an open channel */
   int (*write_cell)(channel_t *, cell_t *);
   /** Write a packed cell to an open channel */
@@ -200,6 +230,16 @@ struct channel_s {
   circ_id_type_bitfield_t circ_id_type:2;
   /* DOCDOC */
   unsigned wide_circ_ids:1;
+  /**
+   * The circuit ID in our half of the space at which to start looking for
+   * an unused one, or 0 if we haven't picked one yet.
+   */
+  circid_t next_circ_id;
+
+  /** Map from circuit ID to the circuits on this channel, and to the IDs
+   * we're keeping unusable until we send a DESTROY for them; see
+   * circuitlist.c. */
+  struct chan_circid_table_t *circid_table;
 
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
@@ -238,9 +278,9 @@ struct channel_s {
   time_t timestamp_recv; /* Cell received from lower layer */
   time_t timestamp_xmit; /* Cell sent to lower layer */
 
-  /** Timestamp for run_connection_housekeeping(). We update this once a
-   * second when we run housekeeping and find a circuit on this channel, and
-   * whenever we add a circuit to the channel. */
+  /** Timestamp for run_connection_housekeeping(). We update this when we
+   * run housekeeping and find a circuit on this channel, and whenever we add
+   * a circuit to the channel or remove one from it. */
   time_t timestamp_last_had_circuits;
 
   /** Unique ID for measuring direct network status requests;vtunneled ones
@@ -351,6 +391,9 @@ void channel_set_cell_handlers(channel_t *chan,
                                channel_cell_handler_fn_ptr cell_handler,
                                channel_var_cell_handler_fn_ptr
                                  var_cell_handler);
+void channel_set_packed_cell_handler(channel_t *chan,
+                                     channel_packed_cell_handler_fn_ptr
+                                       packed_cell_handler);
 
 /* Clean up closed channels and channel listeners periodically; these are
  * called from run_scheduled_events() in main.c.
@@ -471,6 +514,7 @@ void channel_listener_queue_incoming(channel_listener_t *listener,
 /* Incoming cell handling */
 void channel_process_cells(channel_t *chan);
 void channel_queue_cell(channel_t *chan, cell_t *cell);
+int channel_queue_packed_cell(channel_t *chan, packed_cell_t *cell);
 void channel_queue_var_cell(channel_t *chan, var_cell_t *var_cell);
 
 /* Outgoing cell handling */
@@ -481,7 +525,7 @@ MOCK_DECL(ssize_t, channel_flush_some_cells,
           (channel_t *chan, ssize_t num_cells));
 
 /* Query if data available on this channel */
-int channel_more_to_flush(channel_t *chan);
+MOCK_DECL(int, channel_more_to_flush, (channel_t *chan));
 
 /* Notify flushed outgoing for dirreq handling */
 void channel_notify_flushed(channel_t *chan);
@@ -607,6 +651,8 @@ void channel_update_bad_for_new_circs(const char *digest, int force);
 /* Flow control queries */
 uint64_t channel_get_global_queue_estimate(void);
 int channel_num_cells_writeable(channel_t *chan);
+spider_socket_t channel_get_socket(channel_t *chan);
+void channel_flush_to_kernel(channel_t *chan);
 
 /* Timestamp queries */
 time_t channel_when_created(channel_t *chan);
@@ -98,6 +98,8 @@ channel_tls_matches_extend_info_method(channel_t *chan,
 static int channel_tls_matches_target_method(channel_t *chan,
                                              const spider_addr_t *target);
 static int channel_tls_num_cells_writeable_method(channel_t *chan);
+static spider_socket_t channel_tls_get_socket_method(channel_t *chan);
+static void channel_tls_flush_to_kernel_method(channel_t *chan);
 static size_t channel_tls_num_bytes_queued_method(channel_t *chan);
 static int channel_tls_write_cell_method(channel_t *chan,
                                          cell_t *cell);
@@ -152,6 +154,8 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->matches_target = channel_tls_matches_target_method;
   chan->num_bytes_queued = channel_tls_num_bytes_queued_method;
   chan->num_cells_writeable = channel_tls_num_cells_writeable_method;
+  chan->get_socket = channel_tls_get_socket_method;
+  chan->flush_to_kernel = channel_tls_flush_to_kernel_method;
   chan->write_cell = channel_tls_write_cell_method;
   chan->write_packed_cell = channel_tls_write_packed_cell_method;
   chan->write_var_cell = channel_tls_write_var_cell_method;
@@ -784,6 +788,50 @@ channel_tls_num_cells_writeable_method(channel_t *chan)
   return (int)n;
 }
 
+/**
+ * Return the socket of a channel_tls_t
+ *
+ * This implements the get_socket method for channel_tls_t.
+ */
+
+static spider_socket_t
+channel_tls_get_socket_method(channel_t *chan)
+{
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(chan);
+
+  spider_assert(tlschan);
+
+  if (!tlschan->conn)
+    return TOR_INVALID_SOCKET;
+
+  return TO_CONN(tlschan->conn)->s;
+}
+
+/**
+ * Write a channel_tls_t's output buffer to the kernel
+ *
+ * This implements the flush_to_kernel method for channel_tls_t; the
+ * connection's bandwidth limits still apply.
+ */
+
+static void
+channel_tls_flush_to_kernel_method(channel_t *chan)
+{
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(chan);
+  connection_t *conn;
+
+  spider_assert(tlschan);
+
+  if (!tlschan->conn)
+    return;
+  conn = TO_CONN(tlschan->conn);
+  if (conn->marked_for_close || !SOCKET_OK(conn->s) ||
+      !connection_get_outbuf_len(conn))
+    return;
+
+  connection_handle_write(conn, 0);
+}
+
 /**
  * Write a cell to a channel_tls_t
  *
@@ -1135,6 +1183,47 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Offer an incoming packed cell on a channel_tls_t to the upper layer
+ *
+ * This is called from connection_or.c with a fixed-length <b>cell</b> that
+ * was fetched from <b>conn</b>'s inbuf but not yet unpacked.  If it's a
+ * RELAY or RELAY_EARLY cell on an open connection, offer it to the channel
+ * layer, so that cells we're only forwarding can move to the next hop's
+ * queue without a copy.  Return 1 if the cell was taken; otherwise return 0,
+ * and the caller should unpack it and use channel_tls_handle_cell().
+ */
+
+int
+channel_tls_handle_packed_cell(packed_cell_t *cell, or_connection_t *conn)
+{
+  channel_tls_t *chan;
+  uint8_t command;
+
+  spider_assert(cell);
+  spider_assert(conn);
+
+  chan = conn->chan;
+
+  if (!chan ||
+      conn->base_.marked_for_close ||
+      TO_CONN(conn)->state != OR_CONN_STATE_OPEN)
+    return 0;
+
+  command = packed_cell_get_command(cell, conn->wide_circ_ids);
+  if (command != CELL_RELAY && command != CELL_RELAY_EARLY)
+    return 0;
+
+  if (!channel_queue_packed_cell(TLS_CHAN_TO_BASE(chan), cell))
+    return 0;
+
+  /* We note that we're on the internet whenever we read a cell. This is
+   * a fast operation. */
+  entry_guards_note_internet_connectivity(get_guard_selection_info());
+
+  return 1;
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t
  *
@@ -97,22 +97,24 @@ channel_connect_for_circuit(const spider_addr_t *addr, uint16_t port,
  * outbound circuit, until we get a circ_id that is not in use by any other
  * circuit on that conn.
  *
+ * We hand out the IDs in our half of the space in order, starting from a
+ * random one, and skipping any that are still in use.  Since circuits
+ * mostly close in about the order we opened them, the IDs just after the
+ * last one we handed out are the ones most likely to be free again.
+ *
  * Return it, or 0 if can't get a unique circ_id.
  */
 STATIC circid_t
 get_unique_circ_id_by_chan(channel_t *chan)
 {
-/* This number is chosen somewhat arbitrarily; see comment below for more
- * info.  When the space is 80% full, it gives a one-in-a-million failure
- * chance; when the space is 90% full, it gives a one-in-850 chance; and when
- * the space is 95% full, it gives a one-in-26 failure chance.  That seems
- * okay, though you could make a case IMO for anything between N=32 and
- * N=256. */
-#define MAX_CIRCID_ATTEMPTS 64
+/* The longest run of in-use circuit IDs we'll walk past before giving up.
+ * That's the whole space for narrow circuit IDs; with wide ones, we'd need
+ * this many circuits open at once before we could fail. */
+#define MAX_CIRCID_ATTEMPTS (1u<<16)
   int in_use;
   unsigned n_with_circ = 0, n_pending_destroy = 0, n_weird_pending_destroy = 0;
-  circid_t test_circ_id;
-  circid_t attempts=0;
+  circid_t test_circ_id, next_circ_id;
+  circid_t attempts=0, max_attempts;
   circid_t high_bit, max_range, mask;
   int64_t pending_destroy_time_total = 0;
   int64_t pending_destroy_time_max = 0;
@@ -128,23 +130,23 @@ get_unique_circ_id_by_chan(channel_t *chan)
   max_range = (chan->wide_circ_ids) ? (1u<<31) : (1u<<15);
   mask = max_range - 1;
   high_bit = (chan->circ_id_type == CIRC_ID_TYPE_HIGHER) ? max_range : 0;
+  max_attempts = MIN(mask, MAX_CIRCID_ATTEMPTS);
+
+  next_circ_id = chan->next_circ_id & mask;
+  while (next_circ_id == 0) {
+    /* Start somewhere unpredictable. */
+    crypto_rand((char*) &next_circ_id, sizeof(next_circ_id));
+    next_circ_id &= mask;
+  }
+
   do {
-    if (++attempts > MAX_CIRCID_ATTEMPTS) {
+    if (++attempts > max_attempts) {
       /* Make sure we don't loop forever because all circuit IDs are used.
        *
-       * Once, we would try until we had tried every possible circuit ID.  But
-       * that's quite expensive.  Instead, we try MAX_CIRCID_ATTEMPTS random
-       * circuit IDs, and then give up.
-       *
-       * This potentially causes us to give up early if our circuit ID space
-       * is nearly full.  If we have N circuit IDs in use, then we will reject
-       * a new circuit with probability (N / max_range) ^ MAX_CIRCID_ATTEMPTS.
-       * This means that in practice, a few percent of our circuit ID capacity
-       * will go unused.
-       *
-       * The alternative here, though, is to do a linear search over the
-       * whole circuit ID space every time we extend a circuit, which is
-       * not so great either.
+       * With narrow circuit IDs, we have looked at every one in our half of
+       * the space by now.  With wide ones, we have walked past
+       * MAX_CIRCID_ATTEMPTS in-use IDs in a row, which shouldn't happen
+       * unless something is leaking them.
        */
       int64_t queued_destroys;
       char *m = rate_limit_log(&chan->last_warned_circ_ids_exhausted,
@@ -202,12 +204,10 @@ get_unique_circ_id_by_chan(channel_t *chan)
       return 0;
     }
 
-    do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
-      test_circ_id &= mask;
-    } while (test_circ_id == 0);
-
-    test_circ_id |= high_bit;
+    test_circ_id = next_circ_id | high_bit;
+    next_circ_id = (next_circ_id + 1) & mask;
+    if (next_circ_id == 0)
+      next_circ_id = 1;
 
     in_use = circuit_id_in_use_on_channel(test_circ_id, chan);
     if (in_use == 1)
@@ -227,6 +227,7 @@ get_unique_circ_id_by_chan(channel_t *chan)
       }
     }
   } while (in_use);
+  chan->next_circ_id = next_circ_id;
   return test_circ_id;
 }
 
@@ -1524,6 +1525,8 @@ onionskin_answer(or_circuit_t *circ,
   memcpy(circ->rend_circ_nonce, rend_circ_nonce, DIGEST_LEN);
 
   circ->is_first_hop = (created_cell->cell_type == CELL_CREATED_FAST);
+  if (circ->is_first_hop)
+    circuit_schedule_idle_expiry(circ, approx_time());
 
   append_cell_to_circuit_queue(TO_CIRCUIT(circ),
                                circ->p_chan, &cell, CELL_DIRECTION_IN, 0);
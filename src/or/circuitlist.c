@@ -15,13 +15,16 @@
  * find which circuit it is associated with, based on the channel and the
  * circuit ID in the relay cell.
  *
- * To handle that, we maintain a global list of circuits, and a hashtable
- * mapping [channel,circID] pairs to circuits.  Circuits are added to and
- * removed from this mapping using circuit_set_p_circid_chan() and
- * circuit_set_n_circid_chan().  To look up a circuit from this map, most
- * callers should use circuit_get_by_circid_channel(), though
+ * To handle that, we maintain a global list of circuits, and for each
+ * channel, a hashtable mapping circIDs to the circuits on that channel.
+ * Circuits are added to and removed from these maps using
+ * circuit_set_p_circid_chan() and circuit_set_n_circid_chan().  To look up
+ * a circuit from them, most callers should use
+ * circuit_get_by_circid_channel(), though
  * circuit_get_by_circid_channel_even_if_marked() is appropriate under some
- * circumstances.
+ * circumstances.  Because each channel has its own map, we can also find
+ * all of a channel's circuits directly when it closes; see
+ * circuit_unlink_all_from_channel().
  *
  * We also need to allow for the possibility that we have blocked use of a
  * circuit ID (because we are waiting to send a DESTROY cell), but the
@@ -73,11 +76,13 @@
 #include "onion_fast.h"
 #include "policies.h"
 #include "relay.h"
+#include "relaycrypt.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rephist.h"
 #include "routerlist.h"
 #include "routerset.h"
+#include "streammap.h"
 
 #include "ht.h"
 
@@ -108,57 +113,101 @@ static void circuit_about_to_free(circuit_t *circ);
 
 /********* END VARIABLES ************/
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+/** An entry in a channel's map from circuit ID to circuit.  (Lookup
+ * performance is very important here, since we need to do it every time a
+ * cell arrives.) */
 typedef struct chan_circid_circuit_map_t {
   HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
   circid_t circ_id;
   circuit_t *circuit;
   /* For debugging 12184: when was this placeholder item added? */
   time_t made_placeholder_at;
 } chan_circid_circuit_map_t;
 
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
+/** Helper for hash tables: return true iff a and b have the same circuit
+ * ID. */
 static inline int
 chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
                         chan_circid_circuit_map_t *b)
 {
-  return a->chan == b->chan && a->circ_id == b->circ_id;
+  return a->circ_id == b->circ_id;
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
+/** Helper: return a hash based on the circuit ID in <b>a</b>.  (Our peer
+ * picks half the circuit IDs on a channel, so this needs to be keyed.) */
 static inline unsigned int
 chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
 {
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
+  uint32_t circ_id = a->circ_id;
+  return (unsigned) siphash24g(&circ_id, sizeof(circ_id));
 }
 
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
+HT_HEAD(chan_circid_map, chan_circid_circuit_map_t);
 HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_)
 HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              spider_reallocarray_, spider_free_)
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** The circuits on one channel, indexed by circuit ID. */
+typedef struct chan_circid_table_t {
+  /** Map from circid to circuit, or to a placeholder entry with no
+   * circuit. */
+  struct chan_circid_map map;
+  /** The most recently returned entry from this map; used to improve
+   * performance when many cells arrive in a row from the same circuit. */
+  chan_circid_circuit_map_t *last_ent;
+} chan_circid_table_t;
+
+/** Return the entry for <b>circ_id</b> in the circuit ID table of
+ * <b>chan</b>, or NULL if there is none. */
+static inline chan_circid_circuit_map_t *
+chan_circid_find(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_table_t *table = chan->circid_table;
+  chan_circid_circuit_map_t search, *found;
+
+  if (!table)
+    return NULL;
+  if (table->last_ent && table->last_ent->circ_id == circ_id)
+    return table->last_ent;
+
+  search.circ_id = circ_id;
+  found = HT_FIND(chan_circid_map, &table->map, &search);
+  if (found)
+    table->last_ent = found;
+  return found;
+}
+
+/** Add <b>ent</b> to the circuit ID table of <b>chan</b>, creating the
+ * table if necessary.  There must not be an entry with its ID already. */
+static void
+chan_circid_insert(channel_t *chan, chan_circid_circuit_map_t *ent)
+{
+  if (!chan->circid_table) {
+    chan->circid_table = spider_malloc_zero(sizeof(chan_circid_table_t));
+    HT_INIT(chan_circid_map, &chan->circid_table->map);
+  }
+  HT_INSERT(chan_circid_map, &chan->circid_table->map, ent);
+}
+
+/** Remove and return the entry for <b>circ_id</b> from the circuit ID table
+ * of <b>chan</b>, or return NULL if there is none.  The caller must free
+ * it. */
+static chan_circid_circuit_map_t *
+chan_circid_remove(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_table_t *table = chan->circid_table;
+  chan_circid_circuit_map_t search, *found;
+
+  if (!table)
+    return NULL;
+  search.circ_id = circ_id;
+  found = HT_REMOVE(chan_circid_map, &table->map, &search);
+  if (found && found == table->last_ent)
+    table->last_ent = NULL;
+  return found;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -169,7 +218,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
@@ -191,14 +239,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -212,12 +252,13 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
       circuitmux_detach_circuit(old_chan->cmux, circ);
     }
 
-    /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    /* we may need to remove it from the old channel's circid map */
+    found = old_id ? chan_circid_remove(old_chan, old_id) : NULL;
     if (found) {
       spider_free(found);
+      /* old_chan had this circuit until now: connection housekeeping uses
+       * this to tell how long the channel has been idle. */
+      old_chan->timestamp_last_had_circuits = approx_time();
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -233,22 +274,20 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   *chan_ptr = chan;
   *circid_ptr = id;
 
-  if (chan == NULL)
+  /* No cell can refer to circuit ID 0, so we don't index it. */
+  if (chan == NULL || id == 0)
     return;
 
-  /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  /* now add the new one to the new channel's circid map */
+  found = chan_circid_find(chan, id);
   if (found) {
     found->circuit = circ;
     found->made_placeholder_at = 0;
   } else {
     found = spider_malloc_zero(sizeof(chan_circid_circuit_map_t));
     found->circ_id = id;
-    found->chan = chan;
     found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
+    chan_circid_insert(chan, found);
   }
 
   /*
@@ -285,14 +324,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_find(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -304,11 +339,10 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
       ent->made_placeholder_at = approx_time();
   } else {
     ent = spider_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
     ent->circ_id = id;
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_insert(chan, ent);
   }
 }
 
@@ -318,22 +352,83 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_find(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  spider_free(ent);
+  if (ent) {
+    ent = chan_circid_remove(chan, id);
+    spider_free(ent);
+  }
+}
+
+/** Release the circuit ID table of <b>chan</b>, which is going away, and
+ * any placeholders in it.  No circuit should still be using <b>chan</b>; if
+ * one is, forget that it was. */
+void
+channel_free_circid_table(channel_t *chan)
+{
+  chan_circid_table_t *table;
+  chan_circid_circuit_map_t **elt, **next, *c;
+
+  spider_assert(chan);
+  table = chan->circid_table;
+  if (!table)
+    return;
+
+  for (elt = HT_START(chan_circid_map, &table->map); elt; elt = next) {
+    c = *elt;
+    next = HT_NEXT_RMV(chan_circid_map, &table->map, elt);
+    if (c->circuit) {
+      circuit_t *circ = c->circuit;
+      log_warn(LD_BUG, "Circuit %p was still using circuit ID %u on "
+               "channel %p when we freed it.", circ, (unsigned)c->circ_id,
+               chan);
+      if (circ->n_chan == chan) {
+        circ->n_chan = NULL;
+        circ->n_circ_id = 0;
+        circ->n_mux = NULL;
+      }
+      if (! CIRCUIT_IS_ORIGIN(circ) && TO_OR_CIRCUIT(circ)->p_chan == chan) {
+        TO_OR_CIRCUIT(circ)->p_chan = NULL;
+        TO_OR_CIRCUIT(circ)->p_circ_id = 0;
+        TO_OR_CIRCUIT(circ)->p_mux = NULL;
+      }
+    }
+    spider_free(c);
+  }
+  HT_CLEAR(chan_circid_map, &table->map);
+  spider_free(table);
+  chan->circid_table = NULL;
+}
+
+/** Add to <b>circuits_out</b> every circuit, marked or not, that has
+ * <b>chan</b> as its n_chan or p_chan.  Each circuit appears once, even if
+ * <b>chan</b> is both. */
+STATIC void
+channel_get_all_circuits(channel_t *chan, smartlist_t *circuits_out)
+{
+  chan_circid_circuit_map_t **elt;
+
+  spider_assert(chan);
+  if (!chan->circid_table)
+    return;
+
+  HT_FOREACH(elt, chan_circid_map, &chan->circid_table->map) {
+    circuit_t *circ = (*elt)->circuit;
+    if (!circ)
+      continue;
+    /* A circuit with chan on both sides has two entries: take the one for
+     * its n_chan. */
+    if (circ->n_chan == chan && circ->n_circ_id != (*elt)->circ_id)
+      continue;
+    smartlist_add(circuits_out, circ);
+  }
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -779,19 +874,37 @@ circuit_purpose_to_string(uint8_t purpose)
   }
 }
 
+/** Cached return value for circuit_initial_package_window(), or -1 if we
+ * need to look at the consensus again. */
+static int32_t cached_initial_package_window = -1;
+
+/** Called when the "circwindow" consensus parameter changes. */
+static void
+circuit_initial_package_window_changed(const networkstatus_t *ns)
+{
+  (void)ns;
+  cached_initial_package_window = -1;
+}
+
 /** Pick a reasonable package_window to start out for our circuits.
  * Originally this was hard-coded at 1000, but now the consensus votes
  * on the answer. See proposal 168. */
 int32_t
 circuit_initial_package_window(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "circwindow", CIRCWINDOW_START,
-                                        CIRCWINDOW_START_MIN,
-                                        CIRCWINDOW_START_MAX);
-  /* If the consensus tells us a negative number, we'd assert. */
-  if (num < 0)
-    num = CIRCWINDOW_START;
-  return num;
+  if (cached_initial_package_window < 0) {
+    int32_t num = networkstatus_get_param(NULL, "circwindow",
+                                          CIRCWINDOW_START,
+                                          CIRCWINDOW_START_MIN,
+                                          CIRCWINDOW_START_MAX);
+    /* If the consensus tells us a negative number, we'd assert. */
+    if (num < 0)
+      num = CIRCWINDOW_START;
+    networkstatus_watch_param("circwindow",
+                              circuit_initial_package_window_changed);
+    cached_initial_package_window = num;
+  }
+  return cached_initial_package_window;
 }
 
 /** Initialize the common elements in a circuit_t, and add it to the global
@@ -927,6 +1040,7 @@ circuit_free(circuit_t *circ)
       spider_free(ocirc->socks_password);
     }
     addr_policy_list_free(ocirc->prepend_policy);
+    stream_map_free(ocirc->p_stream_map);
   } else {
     or_circuit_t *ocirc = TO_OR_CIRCUIT(circ);
     /* Remember cell statistics for this circuit before deallocating. */
@@ -938,10 +1052,14 @@ circuit_free(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    /* A cpuworker may still be using some of the crypto state below. */
+    relay_crypt_pipes_free(ocirc);
     crypto_cipher_free(ocirc->p_crypto);
     crypto_digest_free(ocirc->p_digest);
     crypto_cipher_free(ocirc->n_crypto);
     crypto_digest_free(ocirc->n_digest);
+    timer_free(ocirc->idle_expiry_timer);
+    ocirc->idle_expiry_timer = NULL;
 
     if (ocirc->hs_token) {
       hs_circuitmap_remove_circuit(ocirc);
@@ -959,6 +1077,8 @@ circuit_free(circuit_t *circ)
     /* Clear cell queue _after_ removing it from the map.  Otherwise our
      * "active" checks will be violated. */
     cell_queue_clear(&ocirc->p_chan_cells);
+    stream_map_free(ocirc->n_stream_map);
+    stream_map_free(ocirc->resolving_stream_map);
   }
 
   extend_info_free(circ->n_hop);
@@ -1058,19 +1178,10 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
 
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      spider_assert(c->circuit == NULL);
-      spider_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
+  cached_initial_package_window = -1;
+
+  /* The channels' circuit ID tables now hold only placeholders; they go
+   * away with the channels. */
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -1197,19 +1308,9 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
+  found = chan_circid_find(chan, circ_id);
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1306,14 +1407,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -1346,7 +1442,11 @@ circuit_unlink_all_from_channel(channel_t *chan, int reason)
 
 /* #define DEBUG_CIRCUIT_UNLINK_ALL */
 
-  channel_unlink_all_circuits(chan, detached);
+  /* Find the circuits in our own table, before the cmux forgets them; that
+   * includes the ones already marked for close, which the cmux doesn't
+   * know about, but which mustn't keep pointing at this channel either. */
+  channel_get_all_circuits(chan, detached);
+  channel_unlink_all_circuits(chan, NULL);
 
 #ifdef DEBUG_CIRCUIT_UNLINK_ALL
   {
@@ -1419,6 +1519,10 @@ circuit_unlink_all_from_channel(channel_t *chan, int reason)
       circuit_mark_for_close(circ, reason);
   } SMARTLIST_FOREACH_END(circ);
 
+  /* channel_unlink_all_circuits() zeroed these before we unlinked each
+   * circuit in turn. */
+  chan->num_n_circuits = chan->num_p_circuits = 0;
+
   smartlist_free(detached);
 }
 
@@ -1921,6 +2025,8 @@ circuit_about_to_free(circuit_t *circ)
     for (conn=or_circ->n_streams; conn; conn=conn->next_stream)
       connection_edge_destroy(or_circ->p_circ_id, conn);
     or_circ->n_streams = NULL;
+    stream_map_free(or_circ->n_stream_map);
+    or_circ->n_stream_map = NULL;
 
     while (or_circ->resolving_streams) {
       conn = or_circ->resolving_streams;
@@ -1936,6 +2042,8 @@ circuit_about_to_free(circuit_t *circ)
       }
       conn->on_circuit = NULL;
     }
+    stream_map_free(or_circ->resolving_stream_map);
+    or_circ->resolving_stream_map = NULL;
 
     if (or_circ->p_chan) {
       circuit_clear_cell_queue(circ, or_circ->p_chan);
@@ -1952,6 +2060,8 @@ circuit_about_to_free(circuit_t *circ)
     for (conn=ocirc->p_streams; conn; conn=conn->next_stream)
       connection_edge_destroy(circ->n_circ_id, conn);
     ocirc->p_streams = NULL;
+    stream_map_free(ocirc->p_stream_map);
+    ocirc->p_stream_map = NULL;
   }
 }
 
@@ -1972,6 +2082,7 @@ marked_circuit_free_cells(circuit_t *circ)
     cell_queue_clear(&orcirc->p_chan_cells);
     if (orcirc->p_mux)
       circuitmux_clear_num_cells(orcirc->p_mux, circ);
+    relay_crypt_pipes_clear(orcirc);
   }
 }
 
@@ -2034,6 +2145,7 @@ n_cells_in_circ_queues(const circuit_t *c)
   if (! CIRCUIT_IS_ORIGIN(c)) {
     circuit_t *cc = (circuit_t *) c;
     n += TO_OR_CIRCUIT(cc)->p_chan_cells.n;
+    n += relay_crypt_pipes_n_pending(TO_OR_CIRCUIT(cc));
   }
   return n;
 }
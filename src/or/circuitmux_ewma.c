@@ -18,9 +18,11 @@
  * For efficiency, we do not re-scale these averages every time we send a
  * cell: that would be horribly inefficient.  Instead, we we keep the cell
  * count on all circuits on the same circuitmux scaled relative to a single
- * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * base tick.  When we add a new cell, we scale its weight depending on the
+ * time that has elapsed since that tick.  Only when new cells would come to
+ * outweigh old ones by so much that we risk losing precision do we re-scale
+ * all the circuits on the circuitmux to the current tick; with the usual
+ * halflives, that's about once an hour, rather than once a tick.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -35,8 +37,10 @@
 #include <math.h>
 
 #include "or.h"
+#include "channel.h"
 #include "circuitmux.h"
 #include "circuitmux_ewma.h"
+#include "config.h"
 #include "networkstatus.h"
 
 /*** EWMA parameter #defines ***/
@@ -55,6 +59,9 @@
 #define EPSILON 0.00001
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
+/** How much more may a cell sent now count than a cell sent at the tick
+ * relative to which a circuitmux keeps its cell counts? */
+#define EWMA_MAX_RESCALE_FACTOR 1e30
 
 /*** EWMA structures ***/
 
@@ -99,7 +106,8 @@ struct ewma_policy_data_s {
 
   /**
    * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
+   * their ewma values rescaled: the cell counts of all of them are relative
+   * to the start of this tick.  This was formerly in channel_t, and in
    * or_connection_t before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
@@ -169,6 +177,10 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static int compare_cell_ewma_counts(const void *p1, const void *p2);
+static int compare_scaled_cell_ewma_counts(const cell_ewma_t *e1,
+                                           unsigned tick1,
+                                           const cell_ewma_t *e2,
+                                           unsigned tick2);
 static unsigned cell_ewma_tick_from_timeval(const struct timeval *now,
                                             double *remainder_out);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
@@ -223,6 +235,12 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  * has value ewma_scale_facspider ** N.)
  */
 static double ewma_scale_facspider = 0.1;
+/** How many ticks after a circuitmux's counts were last rescaled must we
+ * rescale them again?  Computed from ewma_scale_facspider so that no cell
+ * ever counts more than EWMA_MAX_RESCALE_FACTOR times as much as a cell
+ * sent at the base tick.
+ */
+static unsigned ewma_ticks_per_rescale = 30;
 /* DOCDOC ewma_enabled */
 static int ewma_enabled = 0;
 
@@ -415,6 +433,7 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
   unsigned int tick;
+  int ticks_since_rescale;
   double fractional_tick, ewma_increment;
   /* The current (hi-res) time */
   struct timeval now_hires;
@@ -429,17 +448,23 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
+  /* Rescale the EWMAs if needed: only when new cells would otherwise
+   * count for too much more than the ones at the base tick. */
   spider_gettimeofday_cached(&now_hires);
   tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
+  ticks_since_rescale =
+    (int)(tick - pol->active_circuit_pqueue_last_recalibrated);
+  if (ticks_since_rescale > (int)ewma_ticks_per_rescale ||
+      ticks_since_rescale < -(int)ewma_ticks_per_rescale) {
     scale_active_circuits(pol, tick);
+    ticks_since_rescale = 0;
   }
 
   /* How much do we adjust the cell count in cell_ewma by? */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_facspider, -fractional_tick);
+    ((double)(n_cells)) * pow(ewma_scale_facspider,
+                              -(ticks_since_rescale + fractional_tick));
 
   /* Do the adjustment */
   cell_ewma = &(cdata->cell_ewma);
@@ -514,8 +539,11 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      /* Pick whichever one has the better best circuit, allowing for the
+       * cmuxes' counts being relative to different ticks. */
+      return compare_scaled_cell_ewma_counts(
+                 ce1, p1->active_circuit_pqueue_last_recalibrated,
+                 ce2, p2->active_circuit_pqueue_last_recalibrated);
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -548,6 +576,25 @@ compare_cell_ewma_counts(const void *p1, const void *p2)
     return 0;
 }
 
+/** Compare the cell counts of <b>e1</b>, relative to <b>tick1</b>, and
+ * <b>e2</b>, relative to <b>tick2</b>, as for compare_cell_ewma_counts(). */
+static int
+compare_scaled_cell_ewma_counts(const cell_ewma_t *e1, unsigned tick1,
+                                const cell_ewma_t *e2, unsigned tick2)
+{
+  double count1 = e1->cell_count;
+
+  if (tick1 != tick2)
+    count1 *= get_scale_facspider(tick1, tick2);
+
+  if (count1 < e2->cell_count)
+    return -1;
+  else if (count1 > e2->cell_count)
+    return 1;
+  else
+    return 0;
+}
+
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -585,11 +632,13 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    time we wanted to send a cell.
 
    So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   increments) and say that a cell sent at the start of a circuitmux's base
+   tick is worth 1.0, a cell sent N seconds before the start of that tick is
+   worth F^N, and a cell sent N seconds after the start of that tick is
+   worth F^-N.  We only move the base tick forward, rescaling every active
+   circuit on the circuitmux, once F^-N would grow beyond
+   EWMA_MAX_RESCALE_FACTOR.  This way we don't overflow, and we don't need to
+   rescale more than every few hundred ticks.
  */
 
 /** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
@@ -626,6 +675,21 @@ cell_ewma_get_tick(void)
   return ((unsigned)approx_time() / EWMA_TICK_LEN);
 }
 
+/** Called when the usable consensus changes CircuitPriorityHalflifeMsec:
+ * recompute the scale facspider, and turn the EWMA policy on or off on every
+ * channel if that changed whether it's enabled. */
+static void
+cell_ewma_halflife_param_changed(const networkstatus_t *ns)
+{
+  int old_ewma_enabled = ewma_enabled;
+  cell_ewma_set_scale_facspider(get_options(), ns);
+  if (ewma_enabled && !old_ewma_enabled) {
+    channel_set_cmux_policy_everywhere(&ewma_policy);
+  } else if (!ewma_enabled && old_ewma_enabled) {
+    channel_set_cmux_policy_everywhere(NULL);
+  }
+}
+
 /** Adjust the global cell scale facspider based on <b>options</b> */
 void
 cell_ewma_set_scale_facspider(const or_options_t *options,
@@ -634,6 +698,9 @@ cell_ewma_set_scale_facspider(const or_options_t *options,
   int32_t halflife_ms;
   double halflife;
   const char *source;
+
+  networkstatus_watch_param("CircuitPriorityHalflifeMsec",
+                            cell_ewma_halflife_param_changed);
   if (options && options->CircuitPriorityHalflife >= -EPSILON) {
     halflife = options->CircuitPriorityHalflife;
     source = "CircuitPriorityHalflife in configuration";
@@ -651,6 +718,7 @@ cell_ewma_set_scale_facspider(const or_options_t *options,
     /* The cell EWMA algorithm is disabled. */
     ewma_scale_facspider = 0.1;
     ewma_enabled = 0;
+    ewma_ticks_per_rescale = 30;
     log_info(LD_OR,
              "Disabled cell_ewma algorithm because of value in %s",
              source);
@@ -660,6 +728,10 @@ cell_ewma_set_scale_facspider(const or_options_t *options,
     /* compute per-tick scale facspider. */
     ewma_scale_facspider = exp( LOG_ONEHALF / halflife );
     ewma_enabled = 1;
+    /* F^-N reaches EWMA_MAX_RESCALE_FACTOR after this many ticks. */
+    ewma_ticks_per_rescale =
+      (unsigned) MAX(1.0, MIN((double)INT_MAX,
+        floor(log(EWMA_MAX_RESCALE_FACTOR) / -log(ewma_scale_facspider))));
     log_info(LD_OR,
              "Enabled cell_ewma algorithm because of value in %s; "
              "scale facspider is %f per %d seconds",
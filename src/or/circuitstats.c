@@ -62,6 +62,100 @@ static int unit_tests = 0;
 #define unit_tests 0
 #endif
 
+/** The consensus parameters that we look at for every circuit we build,
+ * cached from the usable consensus. */
+typedef struct cbt_params_t {
+  /** The cbtdisabled parameter. */
+  int32_t disabled;
+  /** The cbtmaxtimeouts parameter. */
+  int32_t max_timeouts;
+  /** The cbtnummodes parameter. */
+  int32_t num_xm_modes;
+  /** The cbtmincircs parameter. */
+  int32_t min_circs;
+  /** The cbtquantile parameter. */
+  int32_t quantile;
+  /** The cbtclosequantile parameter. */
+  int32_t close_quantile;
+  /** The cbttestfreq parameter. */
+  int32_t test_freq;
+  /** The cbtmintimeout parameter. */
+  int32_t min_timeout;
+  /** The cbtinitialtimeout parameter. */
+  int32_t initial_timeout;
+} cbt_params_t;
+
+/** Our cached copy of the consensus parameters; only valid if
+ * cbt_params_cached is true. */
+static cbt_params_t cbt_params;
+/** True iff cbt_params holds the values from the usable consensus. */
+static int cbt_params_cached = 0;
+
+/** Called when the usable consensus changes one of the parameters in
+ * cbt_params. */
+static void
+cbt_params_changed(const networkstatus_t *ns)
+{
+  (void)ns;
+  cbt_params_cached = 0;
+}
+
+/** Look up the consensus parameter <b>name</b> for cbt_params, as
+ * networkstatus_get_param() does, and ask to hear when it changes. */
+static int32_t
+cbt_lookup_param(const char *name, int32_t default_val, int32_t min_val,
+                 int32_t max_val)
+{
+  networkstatus_watch_param(name, cbt_params_changed);
+  return networkstatus_get_param(NULL, name, default_val, min_val, max_val);
+}
+
+/** Return the bounds-checked consensus parameters that the circuit build
+ * time code uses, looking them up only if the consensus has changed them
+ * since we last did. */
+static const cbt_params_t *
+cbt_get_params(void)
+{
+  cbt_params_t *p = &cbt_params;
+  if (!cbt_params_cached) {
+    p->disabled = cbt_lookup_param("cbtdisabled", 0, 0, 1);
+    p->max_timeouts = cbt_lookup_param("cbtmaxtimeouts",
+                                       CBT_DEFAULT_MAX_RECENT_TIMEOUT_COUNT,
+                                       CBT_MIN_MAX_RECENT_TIMEOUT_COUNT,
+                                       CBT_MAX_MAX_RECENT_TIMEOUT_COUNT);
+    p->num_xm_modes = cbt_lookup_param("cbtnummodes",
+                                       CBT_DEFAULT_NUM_XM_MODES,
+                                       CBT_MIN_NUM_XM_MODES,
+                                       CBT_MAX_NUM_XM_MODES);
+    p->min_circs = cbt_lookup_param("cbtmincircs",
+                                    CBT_DEFAULT_MIN_CIRCUITS_TO_OBSERVE,
+                                    CBT_MIN_MIN_CIRCUITS_TO_OBSERVE,
+                                    CBT_MAX_MIN_CIRCUITS_TO_OBSERVE);
+    p->quantile = cbt_lookup_param("cbtquantile",
+                                   CBT_DEFAULT_QUANTILE_CUTOFF,
+                                   CBT_MIN_QUANTILE_CUTOFF,
+                                   CBT_MAX_QUANTILE_CUTOFF);
+    p->close_quantile = cbt_lookup_param("cbtclosequantile",
+                                         CBT_DEFAULT_CLOSE_QUANTILE,
+                                         CBT_MIN_CLOSE_QUANTILE,
+                                         CBT_MAX_CLOSE_QUANTILE);
+    p->test_freq = cbt_lookup_param("cbttestfreq",
+                                    CBT_DEFAULT_TEST_FREQUENCY,
+                                    CBT_MIN_TEST_FREQUENCY,
+                                    CBT_MAX_TEST_FREQUENCY);
+    p->min_timeout = cbt_lookup_param("cbtmintimeout",
+                                      CBT_DEFAULT_TIMEOUT_MIN_VALUE,
+                                      CBT_MIN_TIMEOUT_MIN_VALUE,
+                                      CBT_MAX_TIMEOUT_MIN_VALUE);
+    p->initial_timeout = cbt_lookup_param("cbtinitialtimeout",
+                                          CBT_DEFAULT_TIMEOUT_INITIAL_VALUE,
+                                          CBT_MIN_TIMEOUT_INITIAL_VALUE,
+                                          CBT_MAX_TIMEOUT_INITIAL_VALUE);
+    cbt_params_cached = 1;
+  }
+  return p;
+}
+
 /** Return a pointer to the data structure describing our current circuit
  * build time hisspidery and computations. */
 const circuit_build_times_t *
@@ -110,8 +204,7 @@ circuit_build_times_disabled(const or_options_t *options)
   if (unit_tests) {
     return 0;
   } else {
-    int consensus_disabled = networkstatus_get_param(NULL, "cbtdisabled",
-                                                     0, 0, 1);
+    int consensus_disabled = cbt_get_params()->disabled;
     int config_disabled = !options->LearnCircuitBuildTimeout;
     int dirauth_disabled = options->AuthoritativeDir;
     int state_disabled = did_last_state_file_write_fail() ? 1 : 0;
@@ -166,10 +259,7 @@ circuit_build_times_max_timeouts(void)
 {
   int32_t cbt_maxtimeouts;
 
-  cbt_maxtimeouts = networkstatus_get_param(NULL, "cbtmaxtimeouts",
-                                 CBT_DEFAULT_MAX_RECENT_TIMEOUT_COUNT,
-                                 CBT_MIN_MAX_RECENT_TIMEOUT_COUNT,
-                                 CBT_MAX_MAX_RECENT_TIMEOUT_COUNT);
+  cbt_maxtimeouts = cbt_get_params()->max_timeouts;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -193,10 +283,7 @@ circuit_build_times_max_timeouts(void)
 static int32_t
 circuit_build_times_default_num_xm_modes(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtnummodes",
-                                        CBT_DEFAULT_NUM_XM_MODES,
-                                        CBT_MIN_NUM_XM_MODES,
-                                        CBT_MAX_NUM_XM_MODES);
+  int32_t num = cbt_get_params()->num_xm_modes;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -217,10 +304,7 @@ circuit_build_times_default_num_xm_modes(void)
 static int32_t
 circuit_build_times_min_circs_to_observe(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtmincircs",
-                                        CBT_DEFAULT_MIN_CIRCUITS_TO_OBSERVE,
-                                        CBT_MIN_MIN_CIRCUITS_TO_OBSERVE,
-                                        CBT_MAX_MIN_CIRCUITS_TO_OBSERVE);
+  int32_t num = cbt_get_params()->min_circs;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -249,10 +333,7 @@ circuit_build_times_enough_to_compute(const circuit_build_times_t *cbt)
 double
 circuit_build_times_quantile_cutoff(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtquantile",
-                                        CBT_DEFAULT_QUANTILE_CUTOFF,
-                                        CBT_MIN_QUANTILE_CUTOFF,
-                                        CBT_MAX_QUANTILE_CUTOFF);
+  int32_t num = cbt_get_params()->quantile;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -277,10 +358,7 @@ circuit_build_times_close_quantile(void)
   int32_t param;
   /* Cast is safe - circuit_build_times_quantile_cutoff() is capped */
   int32_t min = (int)spider_lround(100*circuit_build_times_quantile_cutoff());
-  param = networkstatus_get_param(NULL, "cbtclosequantile",
-             CBT_DEFAULT_CLOSE_QUANTILE,
-             CBT_MIN_CLOSE_QUANTILE,
-             CBT_MAX_CLOSE_QUANTILE);
+  param = cbt_get_params()->close_quantile;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -306,10 +384,7 @@ circuit_build_times_close_quantile(void)
 static int32_t
 circuit_build_times_test_frequency(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbttestfreq",
-                                        CBT_DEFAULT_TEST_FREQUENCY,
-                                        CBT_MIN_TEST_FREQUENCY,
-                                        CBT_MAX_TEST_FREQUENCY);
+  int32_t num = cbt_get_params()->test_freq;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -330,10 +405,7 @@ circuit_build_times_test_frequency(void)
 static int32_t
 circuit_build_times_min_timeout(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtmintimeout",
-                                        CBT_DEFAULT_TIMEOUT_MIN_VALUE,
-                                        CBT_MIN_TIMEOUT_MIN_VALUE,
-                                        CBT_MAX_TIMEOUT_MIN_VALUE);
+  int32_t num = cbt_get_params()->min_timeout;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -353,10 +425,7 @@ int32_t
 circuit_build_times_initial_timeout(void)
 {
   int32_t min = circuit_build_times_min_timeout();
-  int32_t param = networkstatus_get_param(NULL, "cbtinitialtimeout",
-                                          CBT_DEFAULT_TIMEOUT_INITIAL_VALUE,
-                                          CBT_MIN_TIMEOUT_INITIAL_VALUE,
-                                          CBT_MAX_TIMEOUT_INITIAL_VALUE);
+  int32_t param = cbt_get_params()->initial_timeout;
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
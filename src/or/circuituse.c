@@ -42,6 +42,7 @@
 #include "control.h"
 #include "entrynodes.h"
 #include "hs_common.h"
+#include "main.h"
 #include "nodelist.h"
 #include "networkstatus.h"
 #include "policies.h"
@@ -51,6 +52,7 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "streammap.h"
 
 static void circuit_expire_old_circuits_clientside(void);
 static void circuit_increment_failure_count(void);
@@ -406,9 +408,12 @@ circuit_expire_building(void)
    * we want to be more lenient with timeouts, in case the
    * user has relocated and/or changed network connections.
    * See bug #3443. */
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, next_circ) {
-    if (!CIRCUIT_IS_ORIGIN(next_circ) || /* didn't originate here */
-        next_circ->marked_for_close) { /* don't mess with marked circs */
+  /* Only circuits that originate here can time out while building: look
+   * at those alone, since a relay may have many more of the others. */
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, next_origin_circ) {
+    circuit_t *next_circ = TO_CIRCUIT(next_origin_circ);
+    if (next_circ->marked_for_close) { /* don't mess with marked circs */
       continue;
     }
 
@@ -420,7 +425,7 @@ circuit_expire_building(void)
       any_opened_circs = 1;
       break;
     }
-  } SMARTLIST_FOREACH_END(next_circ);
+  } SMARTLIST_FOREACH_END(next_origin_circ);
 
 #define SET_CUTOFF(target, msec) do {                       \
     long ms = spider_lround(msec);                             \
@@ -491,10 +496,11 @@ circuit_expire_building(void)
              MAX(get_circuit_build_close_time_ms()*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_victim) {
+    circuit_t *victim = TO_CIRCUIT(origin_victim);
     struct timeval cutoff;
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close)     /* don't mess with marked circs */
+    if (victim->marked_for_close)     /* don't mess with marked circs */
       continue;
 
     /* If we haven't yet started the first hop, it means we don't have
@@ -794,7 +800,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
-  } SMARTLIST_FOREACH_END(victim);
+  } SMARTLIST_FOREACH_END(origin_victim);
 }
 
 /**
@@ -1336,6 +1342,7 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
       }
     }
     if (removed) {
+      stream_map_remove(origin_circ->p_stream_map, conn);
       log_debug(LD_APP, "Removing stream %d from circ %u",
                 conn->stream_id, (unsigned)circ->n_circ_id);
 
@@ -1352,10 +1359,12 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     if (conn == or_circ->n_streams) {
       or_circ->n_streams = conn->next_stream;
+      stream_map_remove(or_circ->n_stream_map, conn);
       return;
     }
     if (conn == or_circ->resolving_streams) {
       or_circ->resolving_streams = conn->next_stream;
+      stream_map_remove(or_circ->resolving_stream_map, conn);
       return;
     }
 
@@ -1365,6 +1374,7 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
       ;
     if (prevconn && prevconn->next_stream) {
       prevconn->next_stream = conn->next_stream;
+      stream_map_remove(or_circ->n_stream_map, conn);
       return;
     }
 
@@ -1374,6 +1384,7 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
       ;
     if (prevconn && prevconn->next_stream) {
       prevconn->next_stream = conn->next_stream;
+      stream_map_remove(or_circ->resolving_stream_map, conn);
       return;
     }
   }
@@ -1481,34 +1492,63 @@ circuit_expire_old_circuits_clientside(void)
  */
 #define IDLE_ONE_HOP_CIRC_TIMEOUT 60
 
-/** Find each non-origin circuit that has been unused for too long,
- * has no streams on it, used a create_fast, and ends here: mark it
- * for close.
+/** If <b>or_circ</b> has been unused for too long, has no streams on it,
+ * used a create_fast, and ends here, mark it for close.
+ *
+ * Return the next time at which we should look at <b>or_circ</b> again, or
+ * 0 if we never need to.
  */
-void
-circuit_expire_old_circuits_serverside(time_t now)
+STATIC time_t
+circuit_expire_old_circuit_serverside(or_circuit_t *or_circ, time_t now)
 {
-  or_circuit_t *or_circ;
-  time_t cutoff = now - IDLE_ONE_HOP_CIRC_TIMEOUT;
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  time_t last_xmit;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    or_circ = TO_OR_CIRCUIT(circ);
-    /* If the circuit has been idle for too long, and there are no streams
-     * on it, and it ends here, and it used a create_fast, mark it for close.
-     */
-    if (or_circ->is_first_hop && !circ->n_chan &&
-        !or_circ->n_streams && !or_circ->resolving_streams &&
-        or_circ->p_chan &&
-        channel_when_last_xmit(or_circ->p_chan) <= cutoff) {
-      log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
-               (unsigned)or_circ->p_circ_id,
-               (int)(now - channel_when_last_xmit(or_circ->p_chan)));
-      circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
-    }
+  if (circ->marked_for_close || !or_circ->is_first_hop || !or_circ->p_chan)
+    return 0;
+
+  if (circ->n_chan || or_circ->n_streams || or_circ->resolving_streams) {
+    /* The last stream to close will send a cell on p_chan, so the circuit
+     * can't be idle for long enough until this much later at the soonest.
+     * Likewise, an extended circuit can become a one-hop circuit again if
+     * it's truncated, and that will send a cell on p_chan too. */
+    return now + IDLE_ONE_HOP_CIRC_TIMEOUT;
   }
-  SMARTLIST_FOREACH_END(circ);
+
+  last_xmit = channel_when_last_xmit(or_circ->p_chan);
+  if (last_xmit <= now - IDLE_ONE_HOP_CIRC_TIMEOUT) {
+    log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
+             (unsigned)or_circ->p_circ_id,
+             (int)(now - last_xmit));
+    circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
+    return 0;
+  }
+  return last_xmit + IDLE_ONE_HOP_CIRC_TIMEOUT;
+}
+
+/** Timer callback: see whether the circuit in <b>arg</b> has been idle for
+ * too long, and if it hasn't, when it might be. */
+static void
+circuit_idle_expiry_cb(spider_timer_t *timer, void *arg,
+                       const monotime_t *now_mono)
+{
+  or_circuit_t *or_circ = arg;
+  time_t next;
+  (void)timer;
+  (void)now_mono;
+
+  next = circuit_expire_old_circuit_serverside(or_circ, time(NULL));
+  if (next)
+    circuit_schedule_idle_expiry(or_circ, next);
+}
+
+/** Arrange to check at <b>when</b> whether <b>or_circ</b>, a circuit that
+ * used a create_fast, has been idle for too long. */
+void
+circuit_schedule_idle_expiry(or_circuit_t *or_circ, time_t when)
+{
+  housekeeping_timer_schedule(&or_circ->idle_expiry_timer,
+                              circuit_idle_expiry_cb, or_circ, when);
 }
 
 /** Number of testing circuits we want open before testing our bandwidth. */
@@ -2356,6 +2396,7 @@ link_apconn_to_circ(entry_connection_t *apconn, origin_circuit_t *circ,
   ENTRY_TO_EDGE_CONN(apconn)->on_circuit = TO_CIRCUIT(circ);
   /* assert_connection_ok(conn, time(NULL)); */
   circ->p_streams = ENTRY_TO_EDGE_CONN(apconn);
+  stream_map_add(&circ->p_stream_map, ENTRY_TO_EDGE_CONN(apconn));
 
   if (connection_edge_is_rendezvous_stream(ENTRY_TO_EDGE_CONN(apconn))) {
     /* We are attaching a stream to a rendezvous circuit.  That means
@@ -26,7 +26,7 @@ void circuit_build_needed_circs(time_t now);
 void circuit_expire_old_circs_as_needed(time_t now);
 void circuit_detach_stream(circuit_t *circ, edge_connection_t *conn);
 
-void circuit_expire_old_circuits_serverside(time_t now);
+void circuit_schedule_idle_expiry(or_circuit_t *or_circ, time_t when);
 
 void reset_bandwidth_test(void);
 int circuit_enough_testing_circs(void);
@@ -78,6 +78,9 @@ STATIC int needs_hs_client_circuits(time_t now,
 
 STATIC int needs_circuits_for_build(int num);
 
+STATIC time_t circuit_expire_old_circuit_serverside(or_circuit_t *or_circ,
+                                                    time_t now);
+
 #endif
 
 #endif
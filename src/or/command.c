@@ -208,6 +208,71 @@ command_process_cell(channel_t *chan, cell_t *cell)
   }
 }
 
+/** Process a fixed-length <b>cell</b> that just arrived on <b>chan</b> and
+ * is still packed in network format.  We only take RELAY and RELAY_EARLY
+ * cells that we are in a position to forward without unpacking (see
+ * circuit_can_receive_relay_packed_cell()); for those, do the same checks
+ * as command_process_relay_cell(), take ownership of <b>cell</b> and return
+ * 1.  Otherwise, leave the cell untouched and return 0 so that the channel
+ * unpacks it and calls command_process_cell().
+ */
+int
+command_process_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  const or_options_t *options = get_options();
+  const int wide_circ_ids = chan->wide_circ_ids;
+  const circid_t circ_id = packed_cell_get_circid(cell, wide_circ_ids);
+  const uint8_t command = packed_cell_get_command(cell, wide_circ_ids);
+  circuit_t *circ;
+  or_circuit_t *or_circ;
+  int reason, direction;
+
+  if (command != CELL_RELAY && command != CELL_RELAY_EARLY)
+    return 0;
+
+  circ = circuit_get_by_circid_channel(circ_id, chan);
+  if (!circ || CIRCUIT_IS_ORIGIN(circ) ||
+      circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING)
+    return 0;
+
+  or_circ = TO_OR_CIRCUIT(circ);
+  if (chan == or_circ->p_chan && circ_id == or_circ->p_circ_id)
+    direction = CELL_DIRECTION_OUT;
+  else
+    direction = CELL_DIRECTION_IN;
+
+  if (!circuit_can_receive_relay_packed_cell(circ, direction))
+    return 0;
+
+  /* Let command_process_relay_cell() complain about misused RELAY_EARLY
+   * cells. */
+  if (command == CELL_RELAY_EARLY) {
+    if (direction == CELL_DIRECTION_IN ||
+        or_circ->remaining_relay_early_cells == 0)
+      return 0;
+    --or_circ->remaining_relay_early_cells;
+  }
+
+  ++stats_n_relay_cells_processed;
+
+  if ((reason = circuit_receive_relay_packed_cell(cell, circ, direction,
+                                                  wide_circ_ids)) < 0) {
+    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_packed_cell "
+           "(%s) failed. Closing.",
+           direction==CELL_DIRECTION_OUT?"forward":"backward");
+    circuit_mark_for_close(circ, -reason);
+  }
+
+  /* If this is a cell in an RP circuit, count it as part of the
+     hidden service stats */
+  if (options->HiddenServiceStatistics &&
+      or_circ->circuit_carries_hs_traffic_stats) {
+    rep_hist_seen_new_rp_cell();
+  }
+
+  return 1;
+}
+
 /** Process an incoming var_cell from a channel; in the current protocol all
  * the var_cells are handshake-related and handled below the channel layer,
  * so this just logs a warning and drops the cell.
@@ -616,6 +681,7 @@ command_setup_channel(channel_t *chan)
   channel_set_cell_handlers(chan,
                             command_process_cell,
                             command_process_var_cell);
+  channel_set_packed_cell_handler(chan, command_process_packed_cell);
 }
 
 /** Given a listener, install the right handler to process incoming
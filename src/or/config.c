@@ -96,6 +96,7 @@
 #include "routerlist.h"
 #include "routerset.h"
 #include "scheduler.h"
+#include "spoolcache.h"
 #include "statefile.h"
 #include "transports.h"
 #include "ext_orport.h"
@@ -285,6 +286,7 @@ static config_var_t option_vars_[] = {
   VAR("DirReqStatistics",        BOOL,     DirReqStatistics_option, "1"),
   VAR("DirAuthority",            LINELIST, DirAuthorities, NULL),
   V(DirCache,                    BOOL,     "1"),
+  V(DirCompressedCacheSize,      MEMUNIT,  "16 MB"),
   V(DirAuthorityFallbackRate,    DOUBLE,   "1.0"),
   V(DisableAllSwap,              BOOL,     "0"),
   V(DisableDebuggerAttachment,   BOOL,     "1"),
@@ -408,6 +410,7 @@ static config_var_t option_vars_[] = {
   V(NumDirecspideryGuards,          UINT,     "0"),
   V(NumEntryGuards,              UINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
+  V(OnionQueueDeadline,          MSEC_INTERVAL, "0 msec"),
   V(ORListenAddress,             LINELIST, NULL),
   VPORT(ORPort),
   V(OutboundBindAddress,         LINELIST,   NULL),
@@ -462,6 +465,7 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoOffload,          AUTOBOOL, "auto"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -480,6 +484,9 @@ static config_var_t option_vars_[] = {
   V(SchedulerLowWaterMark__,     MEMUNIT,  "100 MB"),
   V(SchedulerHighWaterMark__,    MEMUNIT,  "101 MB"),
   V(SchedulerMaxFlushCells__,    UINT,     "1000"),
+  V(Schedulers,                  CSV,      "Vanilla"),
+  V(KISTSchedRunInterval,        MSEC_INTERVAL, "10 msec"),
+  V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -1833,6 +1840,10 @@ options_act(const or_options_t *old_options)
                            (uint32_t)options->SchedulerHighWaterMark__,
                            (options->SchedulerMaxFlushCells__ > 0) ?
                            options->SchedulerMaxFlushCells__ : 1000);
+  scheduler_conf_changed(options);
+
+  /* Apply a smaller DirCompressedCacheSize now, not on the next insert. */
+  spoolcache_conf_changed(options);
 
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
@@ -2125,6 +2136,11 @@ options_act(const or_options_t *old_options)
        * we had expected. */
       update_consensus_networkstatus_fetch_time(time(NULL));
     }
+    /* Connection housekeeping deadlines depend on these. */
+    if (old_options->KeepalivePeriod != options->KeepalivePeriod ||
+        old_options->TestingDirConnectionMaxStall !=
+          options->TestingDirConnectionMaxStall)
+      connection_housekeeping_reschedule_all();
   }
 
   /* Load the webpage we're going to serve every time someone asks for '/' on
@@ -3144,6 +3160,21 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->Schedulers) {
+    SMARTLIST_FOREACH_BEGIN(options->Schedulers, const char *, name) {
+      if (strcasecmp(name, "KIST") && strcasecmp(name, "Vanilla")) {
+        spider_asprintf(msg, "Unrecognized scheduler type %s in Schedulers",
+                        escaped(name));
+        return -1;
+      }
+    } SMARTLIST_FOREACH_END(name);
+  }
+  if (options->KISTSchedRunInterval < 0 ||
+      options->KISTSchedRunInterval > 1000)
+    REJECT("KISTSchedRunInterval must be at most 1000 msec.");
+  if (options->KISTSockBufSizeFactor < 0)
+    REJECT("KISTSockBufSizeFactor must not be negative.");
+
   if (options->NodeFamilies) {
     options->NodeFamilySets = smartlist_new();
     for (cl = options->NodeFamilies; cl; cl = cl->next) {
@@ -149,6 +149,11 @@ static spider_addr_t *last_interface_ipv6 = NULL;
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
 
+/** Connections that have stopped reading or writing until the token buckets
+ * have more tokens for them.  connection_bucket_refill() looks at these,
+ * and only these. */
+static smartlist_t *conns_blocked_on_bw = NULL;
+
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
     case CONN_TYPE_EXT_OR_LISTENER: \
@@ -501,6 +506,10 @@ connection_free_(connection_t *conn)
   if (!conn)
     return;
 
+  if (conn->in_bw_wakeup_list)
+    smartlist_remove(conns_blocked_on_bw, conn);
+  timer_free(conn->housekeeping_timer);
+
   switch (conn->type) {
     case CONN_TYPE_OR:
     case CONN_TYPE_EXT_OR:
@@ -2790,6 +2799,13 @@ connection_is_rate_limited(connection_t *conn)
  * tokens we just put in. */
 static int write_buckets_empty_last_second = 0;
 
+/** Total number of milliseconds' worth of tokens that
+ * connection_bucket_refill() has added to the global buckets.  Rather than
+ * refilling every OR connection's buckets on every refill, we remember this
+ * value in each connection when we refill it, and let it catch up the next
+ * time we look at its buckets: see connection_buckets_catch_up(). */
+static uint64_t bucket_refill_clock_msec = 0;
+
 /** How many seconds of no active local circuits will make the
  * connection revert to the "relayed" bandwidth class? */
 #define CLIENT_IDLE_TIME_FOR_PRIORITY 30
@@ -2855,6 +2871,7 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_buckets_catch_up(or_conn);
     if (conn->state == OR_CONN_STATE_OPEN)
       conn_bucket = or_conn->read_bucket;
     base = get_cell_network_size(or_conn->wide_circ_ids);
@@ -2891,6 +2908,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_buckets_catch_up(or_conn);
     if (conn->state == OR_CONN_STATE_OPEN)
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
@@ -3061,6 +3079,9 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
 
+  if (connection_speaks_cells(conn))
+    connection_buckets_catch_up(TO_OR_CONN(conn));
+
   /* If one or more of our token buckets ran dry just now, note the
    * timestamp for TB_EMPTY events. */
   if (get_options()->TestingEnableTbEmptyEvent) {
@@ -3121,6 +3142,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(conn);
   connection_stop_reading(conn);
 }
 
@@ -3148,6 +3170,7 @@ connection_consider_empty_write_buckets(connection_t *conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->write_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(conn);
   connection_stop_writing(conn);
 }
 
@@ -3197,12 +3220,85 @@ connection_bucket_refill_helper(int *bucket, int rate, int burst,
   }
 }
 
-/** Time has passed; increment buckets appropriately. */
+/** Give <b>or_conn</b>'s token buckets the tokens that they would have
+ * received if connection_bucket_refill() had refilled them along with the
+ * global buckets ever since the last time we did so.  Call this before
+ * looking at or changing the buckets. */
+void
+connection_buckets_catch_up(or_connection_t *or_conn)
+{
+  const uint64_t elapsed =
+    bucket_refill_clock_msec - or_conn->buckets_refilled_at_msec;
+  int milliseconds_elapsed, prev_conn_read, prev_conn_write;
+
+  if (!elapsed)
+    return;
+  or_conn->buckets_refilled_at_msec = bucket_refill_clock_msec;
+  milliseconds_elapsed = elapsed > INT_MAX ? INT_MAX : (int)elapsed;
+
+  prev_conn_read = or_conn->read_bucket;
+  prev_conn_write = or_conn->write_bucket;
+
+  if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->read_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->read_bucket");
+  }
+  if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->write_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->write_bucket");
+  }
+
+  /* If buckets were empty before and have now been refilled, tell any
+   * interested controllers. */
+  if (get_options()->TestingEnableTbEmptyEvent) {
+    char *bucket;
+    struct timeval tvnow;
+    uint32_t conn_read_empty_time, conn_write_empty_time;
+    spider_gettimeofday_cached(&tvnow);
+    spider_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                 U64_PRINTF_ARG(or_conn->base_.global_identifier));
+    conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                           or_conn->read_emptied_time,
+                           or_conn->read_bucket,
+                           milliseconds_elapsed, &tvnow);
+    conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                            or_conn->write_emptied_time,
+                            or_conn->write_bucket,
+                            milliseconds_elapsed, &tvnow);
+    control_event_tb_empty(bucket, conn_read_empty_time,
+                           conn_write_empty_time,
+                           milliseconds_elapsed);
+    spider_free(bucket);
+  }
+}
+
+/** Remember that <b>conn</b> has stopped reading or writing until we have
+ * more tokens for it, so that connection_bucket_refill() will wake it up. */
+void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  if (conn->in_bw_wakeup_list)
+    return;
+  if (!conns_blocked_on_bw)
+    conns_blocked_on_bw = smartlist_new();
+  smartlist_add(conns_blocked_on_bw, conn);
+  conn->in_bw_wakeup_list = 1;
+}
+
+/** Time has passed; increment buckets appropriately.  We refill the global
+ * buckets here, and the per-connection buckets of the connections that are
+ * waiting for bandwidth.  The other connections catch up the next time we
+ * look at their buckets. */
 void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
 
   int prev_global_read = global_read_bucket;
@@ -3271,52 +3367,15 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
+  /* The per-connection buckets have now earned these tokens too. */
+  bucket_refill_clock_msec += milliseconds_elapsed;
 
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        spider_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        spider_free(bucket);
-      }
-    }
+  if (!conns_blocked_on_bw)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(conns_blocked_on_bw, connection_t *, conn) {
+    if (connection_speaks_cells(conn))
+      connection_buckets_catch_up(TO_OR_CONN(conn));
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
@@ -3344,6 +3403,11 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw) {
+      conn->in_bw_wakeup_list = 0;
+      SMARTLIST_DEL_CURRENT(conns_blocked_on_bw, conn);
+    }
   } SMARTLIST_FOREACH_END(conn);
 }
 
@@ -3606,6 +3670,8 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
               result, (long)n_read, (long)n_written);
   } else if (conn->linked) {
     if (conn->linked_conn) {
+      /* This hands over whole chunks of the other side's outbuf, so big
+       * responses on a linked connection don't get copied. */
       result = move_buf_to_buf(conn->inbuf, conn->linked_conn->outbuf,
                                &conn->linked_conn->outbuf_flushlen);
     } else {
@@ -3890,6 +3956,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
           conn->write_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -4057,6 +4124,10 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
     return;
 
   old_datalen = buf_datalen(conn->outbuf);
+  /* The outbuf was empty until now: remember when, so that housekeeping can
+   * tell how long an OR connection has been unable to flush. */
+  if (old_datalen == 0 && conn->type == CONN_TYPE_OR)
+    TO_OR_CONN(conn)->timestamp_lastempty = approx_time();
   if (zlib) {
     dir_connection_t *dir_conn = TO_DIR_CONN(conn);
     int done = zlib < 0;
@@ -4103,6 +4174,36 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   }
 }
 
+/** As connection_write_to_buf(), but don't copy the <b>len</b> bytes at
+ * <b>data</b>: refer to them from <b>conn</b>'s outbuf instead, and call
+ * <b>release_fn</b>(<b>release_arg</b>) once the outbuf is done with them.
+ * See buf_add_external(). */
+void
+connection_write_external_to_buf(const char *data, size_t len,
+                                 connection_t *conn,
+                                 void (*release_fn)(void *),
+                                 void *release_arg)
+{
+  int r;
+  if (!len || (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  r = buf_add_external(conn->outbuf, data, len, release_fn, release_arg);
+  if (r < 0) {
+    log_warn(LD_NET, "buf_add_external failed. Closing connection (fd %d).",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += len;
+}
+
 /** Return a connection_t * from get_connection_array() that satisfies test on
  * var, and that is not marked for close. */
 #define CONN_GET_TEMPLATE(var, test)               \
@@ -5151,11 +5252,14 @@ connection_free_all(void)
   /* Unlink everything from the identity map. */
   connection_or_clear_identity_map();
   connection_or_clear_ext_or_id_map();
+  connection_or_clear_inbound_packed_cell();
 
   /* Clear out our list of broken connections */
   clear_broken_connection_map(0);
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, connection_free_(conn));
+  smartlist_free(conns_blocked_on_bw);
+  conns_blocked_on_bw = NULL;
 
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, spider_addr_t *, addr, spider_free(addr));
@@ -120,6 +120,8 @@ ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_buckets_catch_up(or_connection_t *or_conn);
+void connection_note_blocked_on_bw(connection_t *conn);
 
 int connection_handle_read(connection_t *conn);
 
@@ -138,6 +140,10 @@ int connection_flush(connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, connection_t *conn, int zlib));
+void connection_write_external_to_buf(const char *data, size_t len,
+                                      connection_t *conn,
+                                      void (*release_fn)(void *),
+                                      void *release_arg);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
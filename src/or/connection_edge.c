@@ -88,6 +88,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerset.h"
+#include "streammap.h"
 #include "circuitbuild.h"
 
 #ifdef HAVE_LINUX_TYPES_H
@@ -690,130 +691,128 @@ compute_retry_timeout(entry_connection_t *conn)
   return 15;
 }
 
-/** Find all general-purpose AP streams waiting for a response that sent their
- * begin/resolve cell too long ago. Detach from their current circuit, and
- * mark their current circuit as unsuitable for new streams. Then call
- * connection_ap_handshake_attach_circuit() to attach to a new circuit (if
- * available) or launch a new one.
+/** If <b>entry_conn</b> is a general-purpose AP stream waiting for a
+ * response that sent its begin/resolve cell too long ago, detach it from its
+ * current circuit, and mark that circuit as unsuitable for new streams. Then
+ * call connection_ap_handshake_attach_circuit() to attach to a new circuit
+ * (if available) or launch a new one.
  *
  * For rendezvous streams, simply give up after SocksTimeout seconds (with no
  * retry attempt).
+ *
+ * We get called about once a second for every AP stream that isn't open
+ * yet; see connection_housekeeping_cb().
  */
 void
-connection_ap_expire_beginning(void)
+connection_ap_expire_beginning(entry_connection_t *entry_conn, time_t now)
 {
-  edge_connection_t *conn;
-  entry_connection_t *entry_conn;
+  connection_t *base_conn = ENTRY_TO_CONN(entry_conn);
+  edge_connection_t *conn = ENTRY_TO_EDGE_CONN(entry_conn);
   circuit_t *circ;
-  time_t now = time(NULL);
   const or_options_t *options = get_options();
   int severity;
   int cutoff;
   int seconds_idle, seconds_since_born;
-  smartlist_t *conns = get_connection_array();
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP || base_conn->marked_for_close)
-      continue;
-    entry_conn = TO_ENTRY_CONN(base_conn);
-    conn = ENTRY_TO_EDGE_CONN(entry_conn);
-    /* if it's an internal linked connection, don't yell its status. */
-    severity = (spider_addr_is_null(&base_conn->addr) && !base_conn->port)
-      ? LOG_INFO : LOG_NOTICE;
-    seconds_idle = (int)( now - base_conn->timestamp_lastread );
-    seconds_since_born = (int)( now - base_conn->timestamp_created );
-
-    if (base_conn->state == AP_CONN_STATE_OPEN)
-      continue;
+  if (base_conn->marked_for_close)
+    return;
 
-    /* We already consider SocksTimeout in
-     * connection_ap_handshake_attach_circuit(), but we need to consider
-     * it here too because controllers that put streams in controller_wait
-     * state never ask Spider to attach the circuit. */
-    if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
-      if (seconds_since_born >= options->SocksTimeout) {
-        log_fn(severity, LD_APP,
-            "Tried for %d seconds to get a connection to %s:%d. "
-            "Giving up. (%s)",
-            seconds_since_born,
-            safe_str_client(entry_conn->socks_request->address),
-            entry_conn->socks_request->port,
-            conn_state_to_string(CONN_TYPE_AP, base_conn->state));
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
-    }
+  /* if it's an internal linked connection, don't yell its status. */
+  severity = (spider_addr_is_null(&base_conn->addr) && !base_conn->port)
+    ? LOG_INFO : LOG_NOTICE;
+  seconds_idle = (int)( now - base_conn->timestamp_lastread );
+  seconds_since_born = (int)( now - base_conn->timestamp_created );
 
-    /* We're in state connect_wait or resolve_wait now -- waiting for a
-     * reply to our relay cell. See if we want to retry/give up. */
+  if (base_conn->state == AP_CONN_STATE_OPEN)
+    return;
 
-    cutoff = compute_retry_timeout(entry_conn);
-    if (seconds_idle < cutoff)
-      continue;
-    circ = circuit_get_by_edge_conn(conn);
-    if (!circ) { /* it's vanished? */
-      log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
-               safe_str_client(entry_conn->socks_request->address));
+  /* We already consider SocksTimeout in
+   * connection_ap_handshake_attach_circuit(), but we need to consider
+   * it here too because controllers that put streams in controller_wait
+   * state never ask Spider to attach the circuit. */
+  if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
+    if (seconds_since_born >= options->SocksTimeout) {
+      log_fn(severity, LD_APP,
+          "Tried for %d seconds to get a connection to %s:%d. "
+          "Giving up. (%s)",
+          seconds_since_born,
+          safe_str_client(entry_conn->socks_request->address),
+          entry_conn->socks_request->port,
+          conn_state_to_string(CONN_TYPE_AP, base_conn->state));
       connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      continue;
     }
-    if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
-      if (seconds_idle >= options->SocksTimeout) {
-        log_fn(severity, LD_REND,
-               "Rend stream is %d seconds late. Giving up on address"
-               " '%s.onion'.",
-               seconds_idle,
-               safe_str_client(entry_conn->socks_request->address));
-        /* Roll back path bias use state so that we probe the circuit
-         * if nothing else succeeds on it */
-        pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
-
-        connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
-    }
-    if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
-        circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
-        circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
-      log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
-               "The purpose on the circuit was %s; it was in state %s, "
-               "path_state %s.",
-               circuit_purpose_to_string(circ->purpose),
-               circuit_state_to_string(circ->state),
-               CIRCUIT_IS_ORIGIN(circ) ?
-                pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
-                "none");
-    }
-    log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
-           "We tried for %d seconds to connect to '%s' using exit %s."
-           " Retrying on a new circuit.",
-           seconds_idle,
-           safe_str_client(entry_conn->socks_request->address),
-           conn->cpath_layer ?
-             extend_info_describe(conn->cpath_layer->extend_info):
-             "*unnamed*");
-    /* send an end down the circuit */
-    connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-    /* un-mark it as ending, since we're going to reuse it */
-    conn->edge_has_sent_end = 0;
-    conn->end_reason = 0;
-    /* make us not try this circuit again, but allow
-     * current streams on it to survive if they can */
-    mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
-
-    /* give our stream another 'cutoff' seconds to try */
-    conn->base_.timestamp_lastread += cutoff;
-    if (entry_conn->num_socks_retries < 250) /* avoid overflow */
-      entry_conn->num_socks_retries++;
-    /* move it back into 'pending' state, and try to attach. */
-    if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
-                                       END_STREAM_REASON_TIMEOUT)<0) {
-      if (!base_conn->marked_for_close)
-        connection_mark_unattached_ap(entry_conn,
-                                      END_STREAM_REASON_CANT_ATTACH);
+    return;
+  }
+
+  /* We're in state connect_wait or resolve_wait now -- waiting for a
+   * reply to our relay cell. See if we want to retry/give up. */
+
+  cutoff = compute_retry_timeout(entry_conn);
+  if (seconds_idle < cutoff)
+    return;
+  circ = circuit_get_by_edge_conn(conn);
+  if (!circ) { /* it's vanished? */
+    log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
+             safe_str_client(entry_conn->socks_request->address));
+    connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
+    return;
+  }
+  if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
+    if (seconds_idle >= options->SocksTimeout) {
+      log_fn(severity, LD_REND,
+             "Rend stream is %d seconds late. Giving up on address"
+             " '%s.onion'.",
+             seconds_idle,
+             safe_str_client(entry_conn->socks_request->address));
+      /* Roll back path bias use state so that we probe the circuit
+       * if nothing else succeeds on it */
+      pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
+
+      connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
+      connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
     }
-  } SMARTLIST_FOREACH_END(base_conn);
+    return;
+  }
+  if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
+      circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
+      circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
+    log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
+             "The purpose on the circuit was %s; it was in state %s, "
+             "path_state %s.",
+             circuit_purpose_to_string(circ->purpose),
+             circuit_state_to_string(circ->state),
+             CIRCUIT_IS_ORIGIN(circ) ?
+              pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
+              "none");
+  }
+  log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
+         "We tried for %d seconds to connect to '%s' using exit %s."
+         " Retrying on a new circuit.",
+         seconds_idle,
+         safe_str_client(entry_conn->socks_request->address),
+         conn->cpath_layer ?
+           extend_info_describe(conn->cpath_layer->extend_info):
+           "*unnamed*");
+  /* send an end down the circuit */
+  connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
+  /* un-mark it as ending, since we're going to reuse it */
+  conn->edge_has_sent_end = 0;
+  conn->end_reason = 0;
+  /* make us not try this circuit again, but allow
+   * current streams on it to survive if they can */
+  mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
+
+  /* give our stream another 'cutoff' seconds to try */
+  conn->base_.timestamp_lastread += cutoff;
+  if (entry_conn->num_socks_retries < 250) /* avoid overflow */
+    entry_conn->num_socks_retries++;
+  /* move it back into 'pending' state, and try to attach. */
+  if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
+                                     END_STREAM_REASON_TIMEOUT)<0) {
+    if (!base_conn->marked_for_close)
+      connection_mark_unattached_ap(entry_conn,
+                                    END_STREAM_REASON_CANT_ATTACH);
+  }
 }
 
 /**
@@ -2353,7 +2352,6 @@ connection_ap_process_natd(entry_connection_t *conn)
 streamid_t
 get_unique_stream_id_by_circ(origin_circuit_t *circ)
 {
-  edge_connection_t *tmpconn;
   streamid_t test_stream_id;
   uint32_t attempts=0;
 
@@ -2366,9 +2364,8 @@ get_unique_stream_id_by_circ(origin_circuit_t *circ)
   }
   if (test_stream_id == 0)
     goto again;
-  for (tmpconn = circ->p_streams; tmpconn; tmpconn=tmpconn->next_stream)
-    if (tmpconn->stream_id == test_stream_id)
-      goto again;
+  if (stream_map_lookup(circ->p_stream_map, test_stream_id, NULL))
+    goto again;
   return test_stream_id;
 }
 
@@ -2472,6 +2469,8 @@ connection_ap_handshake_send_begin(entry_connection_t *ap_conn)
   spider_assert(ap_conn->socks_request);
   spider_assert(SOCKS_COMMAND_IS_CONNECT(ap_conn->socks_request->command));
 
+  /* The stream is already on circ->p_streams; reindex it under its new ID. */
+  stream_map_remove(circ->p_stream_map, edge_conn);
   edge_conn->stream_id = get_unique_stream_id_by_circ(circ);
   if (edge_conn->stream_id==0) {
     /* XXXX+ Instead of closing this stream, we should make it get
@@ -2482,6 +2481,7 @@ connection_ap_handshake_send_begin(entry_connection_t *ap_conn)
     mark_circuit_unusable_for_new_conns(circ);
     return -1;
   }
+  stream_map_add(&circ->p_stream_map, edge_conn);
 
   /* Set up begin cell flags. */
   edge_conn->begincell_flags = connection_ap_get_begincell_flags(ap_conn);
@@ -2593,6 +2593,8 @@ connection_ap_handshake_send_resolve(entry_connection_t *ap_conn)
   command = ap_conn->socks_request->command;
   spider_assert(SOCKS_COMMAND_IS_RESOLVE(command));
 
+  /* The stream is already on circ->p_streams; reindex it under its new ID. */
+  stream_map_remove(circ->p_stream_map, edge_conn);
   edge_conn->stream_id = get_unique_stream_id_by_circ(circ);
   if (edge_conn->stream_id==0) {
     /* XXXX+ Instead of closing this stream, we should make it get
@@ -2603,6 +2605,7 @@ connection_ap_handshake_send_resolve(entry_connection_t *ap_conn)
     mark_circuit_unusable_for_new_conns(circ);
     return -1;
   }
+  stream_map_add(&circ->p_stream_map, edge_conn);
 
   if (command == SOCKS_COMMAND_RESOLVE) {
     string_addr = ap_conn->socks_request->address;
@@ -3252,6 +3255,7 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
     n_stream->next_stream = origin_circ->p_streams;
     n_stream->on_circuit = circ;
     origin_circ->p_streams = n_stream;
+    stream_map_add(&origin_circ->p_stream_map, n_stream);
     assert_circuit_ok(circ);
 
     origin_circ->rend_data->nr_streams++;
@@ -3531,6 +3535,7 @@ connection_exit_connect_dir(edge_connection_t *exitconn)
   /* link exitconn to circ, now that we know we can use it. */
   exitconn->next_stream = circ->n_streams;
   circ->n_streams = exitconn;
+  stream_map_add(&circ->n_stream_map, exitconn);
 
   if (connection_add(TO_CONN(dirconn))<0) {
     connection_edge_end(exitconn, END_STREAM_REASON_RESOURCELIMIT);
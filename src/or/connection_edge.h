@@ -63,7 +63,8 @@ void connection_exit_connect(edge_connection_t *conn);
 int connection_edge_is_rendezvous_stream(const edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
-void connection_ap_expire_beginning(void);
+void connection_ap_expire_beginning(entry_connection_t *entry_conn,
+                                    time_t now);
 void connection_ap_rescan_and_attach_pending(void);
 void connection_ap_attach_pending(int retry);
 void connection_ap_mark_as_pending_circuit_(entry_connection_t *entry_conn,
@@ -207,6 +207,20 @@ connection_or_clear_ext_or_id_map(void)
   orconn_ext_or_id_map = NULL;
 }
 
+/** A packed cell that connection_or_process_cells_from_inbuf() fetches
+ * fixed-length cells into.  When the channel layer takes ownership of one
+ * (because we're just forwarding it), we allocate another; otherwise we
+ * reuse it for the next cell. */
+static packed_cell_t *inbound_packed_cell = NULL;
+
+/** Release the packed cell we keep for fetching incoming cells. */
+void
+connection_or_clear_inbound_packed_cell(void)
+{
+  packed_cell_free(inbound_packed_cell);
+  inbound_packed_cell = NULL;
+}
+
 /** Creates an Extended ORPort identifier for <b>conn</b> and deposits
  *  it into the global list of identifiers. */
 void
@@ -421,7 +435,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
   } else {
     set_uint16(dest, htons(src->circ_id));
     dest += 2;
-    memset(dest+CELL_MAX_NETWORK_SIZE-2, 0, 2); /*make sure it's clear */
+    memset(dest+CELL_MAX_NETWORK_SIZE-4, 0, 2); /*make sure it's clear */
   }
   set_uint8(dest, src->command);
   memcpy(dest+1, src->payload, CELL_PAYLOAD_SIZE);
@@ -430,7 +444,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
 /** Unpack the network-order buffer <b>src</b> into a host-order
  * cell_t structure <b>dest</b>.
  */
-static void
+void
 cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
 {
   if (wide_circ_ids) {
@@ -786,6 +800,8 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
                                 (int)options->BandwidthBurst, 1, INT32_MAX);
   }
 
+  /* Give the buckets the tokens they've earned at the old rate. */
+  connection_buckets_catch_up(conn);
   conn->bandwidthrate = rate;
   conn->bandwidthburst = burst;
   if (reset) { /* set up the token buckets to be full */
@@ -851,6 +867,8 @@ connection_or_set_canonical(or_connection_t *or_conn,
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
   or_conn->idle_timeout = timeout_base + crypto_rand_int(timeout_base / 2);
+  /* The connection may now be idle for too long sooner than we thought. */
+  connection_housekeeping_schedule(TO_CONN(or_conn), approx_time());
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -2029,7 +2047,9 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Fixed-length cells are first
+ * offered to the channel in packed form, so that RELAY cells we only
+ * forward go straight to the next hop without being unpacked.
  *
  * Always return 0.
  */
@@ -2071,7 +2091,6 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
     } else {
       const int wide_circ_ids = conn->wide_circ_ids;
       size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-      char buf[CELL_MAX_NETWORK_SIZE];
       cell_t cell;
       if (connection_get_inbuf_len(TO_CONN(conn))
           < cell_network_size) /* whole response available? */
@@ -2082,11 +2101,22 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_fetch_from_buf(buf, cell_network_size, TO_CONN(conn));
+      if (!inbound_packed_cell)
+        inbound_packed_cell = packed_cell_new();
+      connection_fetch_from_buf(inbound_packed_cell->body, cell_network_size,
+                                TO_CONN(conn));
+      if (!wide_circ_ids) /* make sure it's clear */
+        memset(inbound_packed_cell->body+CELL_MAX_NETWORK_SIZE-2, 0, 2);
+
+      if (channel_tls_handle_packed_cell(inbound_packed_cell, conn)) {
+        /* It's on its way to the next hop; we'll need a new one. */
+        inbound_packed_cell = NULL;
+        continue;
+      }
 
       /* retrieve cell info from buf (create the host-order struct from the
        * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
+      cell_unpack(&cell, inbound_packed_cell->body, wide_circ_ids);
 
       channel_tls_handle_cell(&cell, conn);
     }
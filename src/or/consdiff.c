@@ -46,6 +46,9 @@
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
 
+/** Which algorithm gen_ed_diff uses to compare chunks of two consensuses. */
+static consdiff_engine_t consdiff_engine = CONSDIFF_ENGINE_MYERS;
+
 static char *consensus_join_lines(const smartlist_t *inp);
 
 /** Return true iff a and b have the same contents. */
@@ -331,6 +334,219 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+/** State shared by the helpers of calc_changes_myers. */
+typedef struct myers_state_t {
+  /** The two slices being compared. */
+  const smartlist_slice_t *slice1, *slice2;
+  /** A hash of each line in slice1 and slice2, indexed from the start of the
+   * slice, so that most unequal lines can be told apart cheaply. */
+  uint64_t *hashes1, *hashes2;
+  /** Scratch space for the forward and reverse frontiers, each with room for
+   * the diagonals -<b>v_offset</b> through <b>v_offset</b>-1. */
+  int *v1, *v2;
+  int v_offset;
+  /** Where to record the changed lines, as in calc_changes. */
+  bitarray_t *changed1, *changed2;
+} myers_state_t;
+
+/** Return true iff line <b>i1</b> of the first slice in <b>st</b> is equal
+ * to line <b>i2</b> of the second. */
+static inline int
+myers_lines_eq(const myers_state_t *st, int i1, int i2)
+{
+  if (st->hashes1[i1] != st->hashes2[i2])
+    return 0;
+  return lines_eq(smartlist_get(st->slice1->list, st->slice1->offset + i1),
+                  smartlist_get(st->slice2->list, st->slice2->offset + i2));
+}
+
+/** Helper for calc_changes_myers: find a point (*<b>x_out</b>,
+ * *<b>y_out</b>) on a shortest edit path between lines <b>a0</b> through
+ * <b>a0</b>+<b>n</b>-1 of the first slice and lines <b>b0</b> through
+ * <b>b0</b>+<b>m</b>-1 of the second, by running Myers' algorithm forward
+ * from the start and backward from the end until the two meet.  The point
+ * is relative to (<b>a0</b>, <b>b0</b>).  Return 0 on success, or -1 if the
+ * searches never met. */
+static int
+myers_bisect(myers_state_t *st, int a0, int n, int b0, int m,
+             int *x_out, int *y_out)
+{
+  const int max_d = (n + m + 1) / 2;
+  const int v_offset = max_d;
+  const int v_length = 2 * max_d;
+  const int delta = n - m;
+  /* If the total number of lines is odd, the forward path will meet the
+   * reverse path; otherwise the reverse path meets the forward one. */
+  const int front = (delta % 2 != 0);
+  int *v1 = st->v1, *v2 = st->v2;
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+  spider_assert(v_offset <= st->v_offset);
+  /* Use the part of the scratch arrays centered on diagonal 0. */
+  v1 += st->v_offset - v_offset;
+  v2 += st->v_offset - v_offset;
+  for (int i = 0; i < v_length + 2; ++i)
+    v1[i] = v2[i] = -1;
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (int d = 0; d < max_d; ++d) {
+    /* Extend the forward path by one edit. */
+    for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      const int k1_offset = v_offset + k1;
+      int x1, y1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+        x1 = v1[k1_offset + 1];
+      else
+        x1 = v1[k1_offset - 1] + 1;
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m && myers_lines_eq(st, a0 + x1, b0 + y1)) {
+        ++x1;
+        ++y1;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > n) {
+        /* Ran off the right of the graph. */
+        k1end += 2;
+      } else if (y1 > m) {
+        /* Ran off the bottom of the graph. */
+        k1start += 2;
+      } else if (front) {
+        const int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1 &&
+            x1 >= n - v2[k2_offset]) {
+          *x_out = x1;
+          *y_out = y1;
+          return 0;
+        }
+      }
+    }
+
+    /* Extend the reverse path by one edit. */
+    for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      const int k2_offset = v_offset + k2;
+      int x2, y2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+        x2 = v2[k2_offset + 1];
+      else
+        x2 = v2[k2_offset - 1] + 1;
+      y2 = x2 - k2;
+      while (x2 < n && y2 < m &&
+             myers_lines_eq(st, a0 + n - x2 - 1, b0 + m - y2 - 1)) {
+        ++x2;
+        ++y2;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > n) {
+        /* Ran off the left of the graph. */
+        k2end += 2;
+      } else if (y2 > m) {
+        /* Ran off the top of the graph. */
+        k2start += 2;
+      } else if (!front) {
+        const int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+          const int x1 = v1[k1_offset];
+          const int y1 = v_offset + x1 - k1_offset;
+          if (x1 >= n - x2) {
+            *x_out = x1;
+            *y_out = y1;
+            return 0;
+          }
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+/** Helper for calc_changes_myers: mark the changes between lines <b>a0</b>
+ * through <b>a0</b>+<b>n</b>-1 of the first slice and lines <b>b0</b>
+ * through <b>b0</b>+<b>m</b>-1 of the second. */
+static void
+myers_changes(myers_state_t *st, int a0, int n, int b0, int m)
+{
+  int x, y;
+
+  /* Skip any lines that are equal at the start or the end of both. */
+  while (n > 0 && m > 0 && myers_lines_eq(st, a0, b0)) {
+    ++a0; ++b0; --n; --m;
+  }
+  while (n > 0 && m > 0 && myers_lines_eq(st, a0 + n - 1, b0 + m - 1)) {
+    --n; --m;
+  }
+
+  if (n == 0 || m == 0 || myers_bisect(st, a0, n, b0, m, &x, &y) < 0 ||
+      (x == 0 && y == 0) || (x == n && y == m)) {
+    /* Either one side is empty, or (which shouldn't happen) we couldn't
+     * split the problem: everything left has changed. */
+    for (int i = 0; i < n; ++i)
+      bitarray_set(st->changed1, st->slice1->offset + a0 + i);
+    for (int i = 0; i < m; ++i)
+      bitarray_set(st->changed2, st->slice2->offset + b0 + i);
+    return;
+  }
+
+  myers_changes(st, a0, x, b0, y);
+  myers_changes(st, a0 + x, n - x, b0 + y, m - y);
+}
+
+/**
+ * Helper: Like calc_changes, but use Myers' O(ND) difference algorithm,
+ * where D is the number of lines added or removed, instead of computing
+ * longest common subsequences in O(N*M) time.  Lines are compared by hash
+ * first, so most comparisons don't need to look at their contents.
+ *
+ * Both functions find a shortest edit script, but where there is more than
+ * one, they may not pick the same one.
+ */
+STATIC void
+calc_changes_myers(smartlist_slice_t *slice1,
+                   smartlist_slice_t *slice2,
+                   bitarray_t *changed1, bitarray_t *changed2)
+{
+  myers_state_t st;
+  int n, m;
+
+  /* Most chunks differ in a line or two; handle those without hashing. */
+  trim_slices(slice1, slice2);
+  if (slice1->len == 0 || slice2->len == 0) {
+    for (int i = 0; i < slice1->len; ++i)
+      bitarray_set(changed1, slice1->offset + i);
+    for (int i = 0; i < slice2->len; ++i)
+      bitarray_set(changed2, slice2->offset + i);
+    return;
+  }
+  n = slice1->len;
+  m = slice2->len;
+
+  memset(&st, 0, sizeof(st));
+  st.slice1 = slice1;
+  st.slice2 = slice2;
+  st.changed1 = changed1;
+  st.changed2 = changed2;
+  st.hashes1 = spider_calloc(n + 1, sizeof(uint64_t));
+  st.hashes2 = spider_calloc(m + 1, sizeof(uint64_t));
+  for (int i = 0; i < n; ++i) {
+    const cdline_t *line = smartlist_get(slice1->list, slice1->offset + i);
+    st.hashes1[i] = siphash24g(line->s, line->len);
+  }
+  for (int i = 0; i < m; ++i) {
+    const cdline_t *line = smartlist_get(slice2->list, slice2->offset + i);
+    st.hashes2[i] = siphash24g(line->s, line->len);
+  }
+  st.v_offset = (n + m + 1) / 2;
+  st.v1 = spider_calloc(2 * st.v_offset + 2, sizeof(int));
+  st.v2 = spider_calloc(2 * st.v_offset + 2, sizeof(int));
+
+  myers_changes(&st, 0, n, 0, m);
+
+  spider_free(st.hashes1);
+  spider_free(st.hashes2);
+  spider_free(st.v1);
+  spider_free(st.v2);
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -660,7 +876,10 @@ gen_ed_diff(const smartlist_t *cons1, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    if (consdiff_engine == CONSDIFF_ENGINE_LCS)
+      calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    else
+      calc_changes_myers(cons1_sl, cons2_sl, changed1, changed2);
     spider_free(cons1_sl);
     spider_free(cons2_sl);
     start1 = i1, start2 = i2;
@@ -1266,6 +1485,22 @@ consensus_diff_generate(const char *cons1,
   return result;
 }
 
+/** Make future calls to consensus_diff_generate use <b>engine</b> to find
+ * the changed lines.  Not threadsafe: call this before any diffs are being
+ * generated. */
+void
+consdiff_set_engine(consdiff_engine_t engine)
+{
+  consdiff_engine = engine;
+}
+
+/** Return the algorithm that consensus_diff_generate currently uses. */
+consdiff_engine_t
+consdiff_get_engine(void)
+{
+  return consdiff_engine;
+}
+
 /** Given a consensus document and a diff, try to apply the diff to the
  * consensus.  On success return a newly allocated string containing the new
  * consensus.  On failure, return NULL. */
@@ -1274,15 +1509,29 @@ consensus_diff_apply(const char *consensus,
                      const char *diff)
 {
   consensus_digest_t d1;
-  smartlist_t *lines1 = NULL, *lines2 = NULL;
   int r1;
-  char *result = NULL;
-  memarea_t *area = memarea_new();
 
   r1 = consensus_compute_digest(consensus, &d1);
   if (BUG(r1 < 0))
     return NULL; // LCOV_EXCL_LINE
 
+  return consensus_diff_apply_digest(consensus, d1.sha3_256, diff);
+}
+
+/** As consensus_diff_apply, but for a caller that already knows the
+ * SHA3-256 digest <b>consensus_sha3</b> of <b>consensus</b>. */
+char *
+consensus_diff_apply_digest(const char *consensus,
+                            const uint8_t *consensus_sha3,
+                            const char *diff)
+{
+  consensus_digest_t d1;
+  smartlist_t *lines1 = NULL, *lines2 = NULL;
+  char *result = NULL;
+  memarea_t *area = memarea_new();
+
+  memcpy(d1.sha3_256, consensus_sha3, DIGEST256_LEN);
+
   lines1 = smartlist_new();
   lines2 = smartlist_new();
   if (consensus_split_lines(lines1, consensus, area) < 0)
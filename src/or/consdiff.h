@@ -7,10 +7,25 @@
 
 #include "or.h"
 
+/** Algorithms that consensus_diff_generate can use to find the changed
+ * lines between two consensuses. */
+typedef enum consdiff_engine_t {
+  /** Hirschberg's longest-common-subsequence algorithm: O(N*M) time. */
+  CONSDIFF_ENGINE_LCS = 0,
+  /** Myers' difference algorithm on hashed lines: O((N+M)*D) time, where
+   * D is the number of changed lines. */
+  CONSDIFF_ENGINE_MYERS = 1,
+} consdiff_engine_t;
+
 char *consensus_diff_generate(const char *cons1,
                               const char *cons2);
 char *consensus_diff_apply(const char *consensus,
                            const char *diff);
+char *consensus_diff_apply_digest(const char *consensus,
+                                  const uint8_t *consensus_sha3,
+                                  const char *diff);
+void consdiff_set_engine(consdiff_engine_t engine);
+consdiff_engine_t consdiff_get_engine(void);
 
 #ifdef CONSDIFF_PRIVATE
 struct memarea_t;
@@ -59,6 +74,9 @@ STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   int start_line);
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
+STATIC void calc_changes_myers(smartlist_slice_t *slice1,
+                               smartlist_slice_t *slice2,
+                               bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
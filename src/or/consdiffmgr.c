@@ -0,0 +1,474 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiffmgr.c
+ *
+ * \brief Keep recent consensuses around, and build the diffs that we serve
+ * to clients that already have one of them.
+ *
+ * A client or cache that fetches a new consensus every hour usually has the
+ * previous one already, and the two differ in only a small fraction of their
+ * lines.  So when it asks for a consensus, it lists the SHA3-256 digests of
+ * the consensuses it has in an X-Or-Diff-From-Consensus header, and if we
+ * have a diff (see consdiff.c) from one of them to our newest consensus, we
+ * send that instead of the whole document.
+ *
+ * For each flavor, we remember the newest consensus we're serving and up to
+ * CONSDIFF_MAX_OLD_CONSENSUSES older ones.  We keep their text in files
+ * under the "diff-cache" subdirectory of the data directory, not in memory:
+ * only the cpuworkers read them, while building diffs.  Whenever a new
+ * consensus arrives, we hand the work of diffing each older consensus
+ * against it, and of compressing the result, to the cpuworker threads.  If
+ * there are no cpuworkers, we build no diffs.  Until a diff is ready,
+ * clients that ask for it just get the full consensus.
+ *
+ * The diffs themselves live in memory, and count towards MaxMemInQueues:
+ * when we're low on memory, the OOM handler can discard them.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "consdiff.h"
+#include "consdiffmgr.h"
+#include "cpuworker.h"
+#include "dirserv.h"
+#include "networkstatus.h"
+#include "workqueue.h"
+
+/** The name of the data directory subdirectory where we keep the text of
+ * the consensuses that we diff. */
+#define CONSDIFF_CACHE_DIR "diff-cache"
+
+/** A file holding the text of a consensus that we're keeping, shared
+ * between our list of consensuses and any diff jobs that use it.  Only the
+ * main thread may change the reference count; the file goes away with the
+ * last reference. */
+typedef struct consdiff_body_t {
+  /** The name of the file. */
+  char *fname;
+  /** The length of the consensus. */
+  size_t len;
+  /** Number of consdiff_entry_t and consdiff_job_t that refer to this. */
+  int refcnt;
+} consdiff_body_t;
+
+/** A consensus that we're keeping, and the diff (once we have built it)
+ * from that consensus to the newest one of the same flavor. */
+typedef struct consdiff_entry_t {
+  /** The text of this consensus. */
+  consdiff_body_t *body;
+  /** SHA3-256 digest of the text of this consensus. */
+  uint8_t digest[DIGEST256_LEN];
+  /** The valid-after time of this consensus. */
+  time_t valid_after;
+  /** A diff from this consensus to the newest one, or NULL if we haven't
+   * built it yet (or this is the newest consensus). */
+  cached_dir_t *diff;
+} consdiff_entry_t;
+
+/** A request for a cpuworker to compute and compress a diff. */
+typedef struct consdiff_job_t {
+  /** Which flavor of consensus are we diffing? */
+  consensus_flavor_t flavor;
+  /** The consensus to diff from, and its digest. */
+  consdiff_body_t *from;
+  uint8_t from_digest[DIGEST256_LEN];
+  /** The consensus to diff to, and its digest. */
+  consdiff_body_t *to;
+  uint8_t to_digest[DIGEST256_LEN];
+  /** The valid-after time of <b>to</b>. */
+  time_t to_valid_after;
+  /** Output: the diff, or NULL if we couldn't make one. */
+  char *diff;
+  /** Output: the diff compressed with ZLIB_METHOD, and its length. */
+  char *diff_z;
+  size_t diff_z_len;
+  /** How many bytes do we expect the cpuworker to need for this job? */
+  size_t mem_cost;
+} consdiff_job_t;
+
+/** For each flavor, a list of consdiff_entry_t for the consensuses that
+ * we're keeping, oldest first.  The last one is the newest. */
+static smartlist_t *consensus_entries[N_CONSENSUS_FLAVORS];
+
+/** True iff we have made sure that CONSDIFF_CACHE_DIR exists and holds
+ * nothing left over from an earlier run. */
+static int cache_dir_ready = 0;
+
+/** How many bytes are held by the diffs that we're keeping? */
+static size_t total_diff_bytes = 0;
+/** How many bytes do we expect the diff jobs on the cpuworkers to be
+ * using? */
+static size_t total_job_bytes = 0;
+
+/** Drop one reference to <b>b</b>, removing its file and freeing it if that
+ * was the last. */
+static void
+consdiff_body_decref(consdiff_body_t *b)
+{
+  if (!b || --b->refcnt > 0)
+    return;
+  if (unlink(b->fname) != 0) {
+    log_warn(LD_FS, "Failed to unlink %s: %s", b->fname, strerror(errno));
+  }
+  spider_free(b->fname);
+  spider_free(b);
+}
+
+/** Return the number of bytes of memory used by <b>d</b>. */
+static size_t
+consdiff_diff_mem_cost(const cached_dir_t *d)
+{
+  return sizeof(cached_dir_t) + d->dir_len + d->dir_z_len;
+}
+
+/** Drop our reference to the diff from <b>ent</b>, if it has one. */
+static void
+consdiff_entry_clear_diff(consdiff_entry_t *ent)
+{
+  if (!ent->diff)
+    return;
+  total_diff_bytes -= consdiff_diff_mem_cost(ent->diff);
+  cached_dir_decref(ent->diff);
+  ent->diff = NULL;
+}
+
+/** Release all storage held by <b>ent</b>. */
+static void
+consdiff_entry_free(consdiff_entry_t *ent)
+{
+  if (!ent)
+    return;
+  consdiff_body_decref(ent->body);
+  consdiff_entry_clear_diff(ent);
+  spider_free(ent);
+}
+
+/** Release all storage held by <b>job</b>. */
+static void
+consdiff_job_free(consdiff_job_t *job)
+{
+  if (!job)
+    return;
+  consdiff_body_decref(job->from);
+  consdiff_body_decref(job->to);
+  spider_free(job->diff);
+  spider_free(job->diff_z);
+  spider_free(job);
+}
+
+/** Return the entry for the consensus of flavor <b>flavor</b> with digest
+ * <b>digest</b>, or NULL if we aren't keeping one. */
+static consdiff_entry_t *
+consdiff_find_entry(consensus_flavor_t flavor, const uint8_t *digest)
+{
+  smartlist_t *entries = consensus_entries[flavor];
+  if (!entries)
+    return NULL;
+  SMARTLIST_FOREACH(entries, consdiff_entry_t *, ent,
+                    if (fast_memeq(ent->digest, digest, DIGEST256_LEN))
+                      return ent);
+  return NULL;
+}
+
+/** Return the newest consensus entry of flavor <b>flavor</b>, or NULL if we
+ * don't have any. */
+static consdiff_entry_t *
+consdiff_newest_entry(consensus_flavor_t flavor)
+{
+  smartlist_t *entries = consensus_entries[flavor];
+  if (!entries || !smartlist_len(entries))
+    return NULL;
+  return smartlist_get(entries, smartlist_len(entries) - 1);
+}
+
+/** Make sure that CONSDIFF_CACHE_DIR exists, and remove any consensuses
+ * that an earlier run left in it.  Return 0 on success, -1 on failure. */
+static int
+consdiff_prepare_cache_dir(void)
+{
+  char *dirname;
+  smartlist_t *files;
+
+  if (cache_dir_ready)
+    return 0;
+  if (check_or_create_data_subdir(CONSDIFF_CACHE_DIR) < 0)
+    return -1;
+
+  dirname = get_datadir_fname(CONSDIFF_CACHE_DIR);
+  files = spider_listdir(dirname);
+  if (files) {
+    SMARTLIST_FOREACH_BEGIN(files, char *, fn) {
+      char *path = get_datadir_fname2(CONSDIFF_CACHE_DIR, fn);
+      if (unlink(path) != 0) {
+        log_warn(LD_FS, "Failed to unlink %s: %s", path, strerror(errno));
+      }
+      spider_free(path);
+      spider_free(fn);
+    } SMARTLIST_FOREACH_END(fn);
+    smartlist_free(files);
+  }
+  spider_free(dirname);
+  cache_dir_ready = 1;
+  return 0;
+}
+
+/** Write <b>consensus</b>, of flavor <b>flavor</b> and with the SHA3-256
+ * digest <b>digest</b>, to a file in CONSDIFF_CACHE_DIR.  Return a new
+ * consdiff_body_t for it on success, or NULL on failure. */
+static consdiff_body_t *
+consdiff_body_new(const char *consensus, consensus_flavor_t flavor,
+                  const uint8_t *digest)
+{
+  consdiff_body_t *b;
+  char hex[HEX_DIGEST256_LEN+1];
+  char fn[128];
+
+  if (consdiff_prepare_cache_dir() < 0)
+    return NULL;
+
+  base16_encode(hex, sizeof(hex), (const char*)digest, DIGEST256_LEN);
+  spider_snprintf(fn, sizeof(fn), "%s-%s",
+                  networkstatus_get_flavor_name(flavor), hex);
+  b = spider_malloc_zero(sizeof(consdiff_body_t));
+  b->fname = get_datadir_fname2(CONSDIFF_CACHE_DIR, fn);
+  b->len = strlen(consensus);
+  b->refcnt = 1;
+  if (write_str_to_file(b->fname, consensus, 0) < 0) {
+    spider_free(b->fname);
+    spider_free(b);
+    return NULL;
+  }
+  return b;
+}
+
+/** Worker function: build and compress the diff that <b>job_</b> asks
+ * for.  Runs in a cpuworker thread. */
+static workqueue_reply_t
+consdiff_job_threadfn(void *state_, void *job_)
+{
+  consdiff_job_t *job = job_;
+  char *from, *to;
+  (void)state_;
+
+  from = read_file_to_str(job->from->fname, 0, NULL);
+  to = read_file_to_str(job->to->fname, 0, NULL);
+  if (from && to)
+    job->diff = consensus_diff_generate(from, to);
+  spider_free(from);
+  spider_free(to);
+
+  if (job->diff &&
+      spider_gzip_compress(&job->diff_z, &job->diff_z_len,
+                           job->diff, strlen(job->diff), ZLIB_METHOD) < 0) {
+    spider_free(job->diff);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: if the diff in <b>job_</b> is still one that we would
+ * serve, remember it.  Runs in the main thread. */
+static void
+consdiff_job_replyfn(void *job_)
+{
+  consdiff_job_t *job = job_;
+  consdiff_entry_t *from_ent, *newest;
+
+  total_job_bytes -= job->mem_cost;
+  newest = consdiff_newest_entry(job->flavor);
+  from_ent = consdiff_find_entry(job->flavor, job->from_digest);
+
+  if (!job->diff) {
+    log_info(LD_DIRSERV, "Couldn't build a %s consensus diff.",
+             networkstatus_get_flavor_name(job->flavor));
+  } else if (newest && from_ent && from_ent != newest && !from_ent->diff &&
+             fast_memeq(newest->digest, job->to_digest, DIGEST256_LEN)) {
+    cached_dir_t *d = spider_malloc_zero(sizeof(cached_dir_t));
+    d->refcnt = 1;
+    d->dir = job->diff;
+    d->dir_len = strlen(job->diff);
+    d->dir_z = job->diff_z;
+    d->dir_z_len = job->diff_z_len;
+    d->published = job->to_valid_after;
+    job->diff = job->diff_z = NULL;
+    from_ent->diff = d;
+    total_diff_bytes += consdiff_diff_mem_cost(d);
+    log_info(LD_DIRSERV, "Built a %s consensus diff of %lu bytes "
+             "(%lu compressed).", networkstatus_get_flavor_name(job->flavor),
+             (unsigned long)d->dir_len, (unsigned long)d->dir_z_len);
+  }
+  /* Otherwise, a newer consensus arrived while we were working, or we
+   * stopped keeping the old one: this diff is no use to anybody. */
+
+  consdiff_job_free(job);
+}
+
+/** Arrange to compute a diff from <b>from_ent</b> to <b>to_ent</b>, both
+ * consensuses of flavor <b>flavor</b>. */
+static void
+consdiff_launch_job(consensus_flavor_t flavor,
+                    consdiff_entry_t *from_ent, consdiff_entry_t *to_ent)
+{
+  consdiff_job_t *job = spider_malloc_zero(sizeof(consdiff_job_t));
+  job->flavor = flavor;
+  job->from = from_ent->body;
+  ++job->from->refcnt;
+  memcpy(job->from_digest, from_ent->digest, DIGEST256_LEN);
+  job->to = to_ent->body;
+  ++job->to->refcnt;
+  memcpy(job->to_digest, to_ent->digest, DIGEST256_LEN);
+  job->to_valid_after = to_ent->valid_after;
+  /* Both consensuses, and about as much again for the lines of each. */
+  job->mem_cost = 2 * (job->from->len + job->to->len);
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW, consdiff_job_threadfn,
+                            consdiff_job_replyfn, job)) {
+    /* Building diffs is far too slow to do in the main thread: without
+     * cpuworkers, we just serve full consensuses. */
+    log_info(LD_DIRSERV, "No cpuworkers to build a %s consensus diff on.",
+             networkstatus_get_flavor_name(flavor));
+    consdiff_job_free(job);
+    return;
+  }
+  total_job_bytes += job->mem_cost;
+}
+
+/** Note that we are now serving <b>consensus</b> as our newest consensus of
+ * flavor <b>flavor</b>, valid after <b>valid_after</b>.  Keep a copy of it,
+ * forget any diffs to the consensus it replaces, and start building diffs to
+ * it from the older consensuses that we're keeping. */
+void
+consdiffmgr_add_consensus(const char *consensus,
+                          consensus_flavor_t flavor,
+                          time_t valid_after)
+{
+  uint8_t digest[DIGEST256_LEN];
+  consdiff_entry_t *ent;
+  consdiff_body_t *body;
+  smartlist_t *entries;
+
+  spider_assert(consensus);
+  if (BUG((int)flavor < 0 || (int)flavor >= N_CONSENSUS_FLAVORS))
+    return;
+
+  if (crypto_digest256((char*)digest, consensus, strlen(consensus),
+                       DIGEST_SHA3_256) < 0)
+    return;
+  if (consdiff_find_entry(flavor, digest)) {
+    /* We've seen this one before; probably we just reloaded it. */
+    return;
+  }
+  if (!(body = consdiff_body_new(consensus, flavor, digest))) {
+    log_warn(LD_DIRSERV, "Couldn't store a %s consensus to build diffs "
+             "from.", networkstatus_get_flavor_name(flavor));
+    return;
+  }
+
+  if (!consensus_entries[flavor])
+    consensus_entries[flavor] = smartlist_new();
+  entries = consensus_entries[flavor];
+
+  /* Diffs to the old newest consensus are no longer what anybody wants. */
+  SMARTLIST_FOREACH(entries, consdiff_entry_t *, old,
+                    consdiff_entry_clear_diff(old));
+
+  ent = spider_malloc_zero(sizeof(consdiff_entry_t));
+  ent->body = body;
+  memcpy(ent->digest, digest, DIGEST256_LEN);
+  ent->valid_after = valid_after;
+  smartlist_add(entries, ent);
+
+  while (smartlist_len(entries) > CONSDIFF_MAX_OLD_CONSENSUSES + 1) {
+    consdiff_entry_free(smartlist_get(entries, 0));
+    smartlist_del_keeporder(entries, 0);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(entries, consdiff_entry_t *, old) {
+    if (old != ent)
+      consdiff_launch_job(flavor, old, ent);
+  } SMARTLIST_FOREACH_END(old);
+}
+
+/** If we have a diff from the consensus of flavor <b>flavor</b> with the
+ * SHA3-256 digest <b>digest</b> to our newest consensus of that flavor,
+ * return it.  Otherwise return NULL.  The caller must increment the
+ * reference count of the result if it keeps it. */
+cached_dir_t *
+consdiffmgr_find_diff_from(consensus_flavor_t flavor, const uint8_t *digest)
+{
+  consdiff_entry_t *ent;
+  if ((int)flavor < 0 || (int)flavor >= N_CONSENSUS_FLAVORS)
+    return NULL;
+  ent = consdiff_find_entry(flavor, digest);
+  return ent ? ent->diff : NULL;
+}
+
+/** Return the number of consensuses of flavor <b>flavor</b>, including the
+ * newest, that we are keeping. */
+int
+consdiffmgr_n_consensuses(consensus_flavor_t flavor)
+{
+  if ((int)flavor < 0 || (int)flavor >= N_CONSENSUS_FLAVORS ||
+      !consensus_entries[flavor])
+    return 0;
+  return smartlist_len(consensus_entries[flavor]);
+}
+
+/** Return the number of bytes of memory that this module is using for
+ * diffs, including the ones that the cpuworkers are building. */
+size_t
+consdiffmgr_get_total_allocation(void)
+{
+  return total_diff_bytes + total_job_bytes;
+}
+
+/** We're low on memory: discard diffs, starting with the ones from the
+ * oldest consensuses, until we have freed at least <b>min_remove_bytes</b>
+ * bytes or have none left.  Return the number of bytes freed.  We don't
+ * build the diffs again until a new consensus arrives. */
+size_t
+consdiffmgr_handle_oom(size_t min_remove_bytes)
+{
+  size_t freed = 0;
+  int i, idx, any_left = 1;
+
+  for (idx = 0; any_left && freed < min_remove_bytes; ++idx) {
+    any_left = 0;
+    for (i = 0; i < N_CONSENSUS_FLAVORS && freed < min_remove_bytes; ++i) {
+      consdiff_entry_t *ent;
+      if (!consensus_entries[i] || idx >= smartlist_len(consensus_entries[i]))
+        continue;
+      any_left = 1;
+      ent = smartlist_get(consensus_entries[i], idx);
+      if (ent->diff) {
+        freed += consdiff_diff_mem_cost(ent->diff);
+        consdiff_entry_clear_diff(ent);
+      }
+    }
+  }
+  if (freed) {
+    log_notice(LD_DIRSERV, "Discarded %lu bytes of consensus diffs to save "
+               "memory.", (unsigned long)freed);
+  }
+  return freed;
+}
+
+/** Release all storage held by this module, and remove the files that hold
+ * our consensuses.  Jobs that are still running keep their own references
+ * to the consensuses they need. */
+void
+consdiffmgr_free_all(void)
+{
+  int i;
+  for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
+    if (!consensus_entries[i])
+      continue;
+    SMARTLIST_FOREACH(consensus_entries[i], consdiff_entry_t *, ent,
+                      consdiff_entry_free(ent));
+    smartlist_free(consensus_entries[i]);
+    consensus_entries[i] = NULL;
+  }
+  cache_dir_ready = 0;
+}
+
@@ -0,0 +1,31 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiffmgr.h
+ * \brief Header file for consdiffmgr.c.
+ **/
+
+#ifndef TOR_CONSDIFFMGR_H
+#define TOR_CONSDIFFMGR_H
+
+/** The HTTP header a client uses to list the SHA3-256 digests (in hex) of
+ * the consensuses it has, so that we can send it a diff from one of them. */
+#define X_OR_DIFF_FROM_CONSENSUS_HEADER "X-Or-Diff-From-Consensus: "
+
+/** How many consensuses of each flavor, besides the newest, do we keep on
+ * disk so that we can serve diffs from them? */
+#define CONSDIFF_MAX_OLD_CONSENSUSES 12
+
+void consdiffmgr_add_consensus(const char *consensus,
+                               consensus_flavor_t flavor,
+                               time_t valid_after);
+cached_dir_t *consdiffmgr_find_diff_from(consensus_flavor_t flavor,
+                                         const uint8_t *digest);
+int consdiffmgr_n_consensuses(consensus_flavor_t flavor);
+size_t consdiffmgr_get_total_allocation(void);
+size_t consdiffmgr_handle_oom(size_t min_remove_bytes);
+void consdiffmgr_free_all(void);
+
+#endif
+
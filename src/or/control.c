@@ -72,6 +72,7 @@
 #include "routerlist.h"
 #include "routerparse.h"
 #include "shared_random.h"
+#include "spoolcache.h"
 
 #ifndef _WIN32
 #include <pwd.h>
@@ -3074,6 +3075,14 @@ static const getinfo_item_t getinfo_items[] = {
          "v2 networkstatus docs as retrieved from a DirPort."),
   ITEM("dir/status-vote/current/consensus", dir,
        "v3 Networkstatus consensus as retrieved from a DirPort."),
+  ITEM("dir/compressed-cache/hits", spoolcache,
+       "Compressed descriptor responses served from the cache."),
+  ITEM("dir/compressed-cache/misses", spoolcache,
+       "Compressed descriptor responses not found in the cache."),
+  ITEM("dir/compressed-cache/bytes-saved", spoolcache,
+       "Bytes that we didn't have to compress, thanks to the cache."),
+  ITEM("dir/compressed-cache/bytes", spoolcache,
+       "Total size of the compressed responses in the cache."),
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   ITEM("exit-policy/reject-private/default", policies,
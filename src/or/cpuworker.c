@@ -14,6 +14,7 @@
  * Right now, we only use this for processing onionskins, and invoke it mostly
  * from onion.c.
  **/
+#define CPUWORKER_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitbuild.h"
@@ -29,8 +30,6 @@
 
 #include <event2/event.h>
 
-static void queue_pending_tasks(void);
-
 typedef struct worker_state_s {
   int generation;
   server_onion_keys_t *onion_keys;
@@ -55,6 +54,8 @@ worker_state_free(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** How many threads did we start in <b>threadpool</b>? */
+static int n_threads = 0;
 static struct event *reply_event = NULL;
 
 static spider_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
@@ -62,6 +63,10 @@ static spider_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
 
+/** Most time that we spend handling cpuworker replies before we let the
+ * main loop handle its other events. */
+#define CPUWORKER_REPLY_BUDGET_USEC 10000
+
 static void
 replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
 {
@@ -79,6 +84,7 @@ cpu_init(void)
 {
   if (!replyqueue) {
     replyqueue = replyqueue_new(0);
+    replyqueue_set_budget(replyqueue, 0, CPUWORKER_REPLY_BUDGET_USEC);
   }
   if (!reply_event) {
     reply_event = spider_event_new(spider_libevent_get_base(),
@@ -89,7 +95,8 @@ cpu_init(void)
     event_add(reply_event, NULL);
   }
   if (!threadpool) {
-    threadpool = threadpool_new(get_num_cpus(get_options()),
+    n_threads = get_num_cpus(get_options());
+    threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
                                 worker_state_free,
@@ -298,11 +305,11 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle the reply to a single onionskin in a batch from the worker
+ * threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -384,18 +391,30 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   spider_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_reply_one(batch->jobs[i]);
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
+  memwipe(batch, 0, sizeof(*batch));
+  spider_free(batch);
+  queue_pending_tasks();
+}
+
+/** Process a single onionskin in a batch, using the keys in
+ * <b>onion_keys</b>.  Return 0 on success, and -1 if the job was so broken
+ * that the worker should shut down. */
+static int
+cpuworker_onion_handshake_one(server_onion_keys_t *onion_keys,
+                              cpuworker_job_t *job)
+{
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
@@ -437,7 +456,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
       spider_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      return -1;
     }
     rpl.success = 1;
   }
@@ -458,24 +477,157 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 
   memwipe(&req, 0, sizeof(req));
   memwipe(&rpl, 0, sizeof(req));
+  return 0;
+}
+
+/** Implementation function for onion handshake requests: process every
+ * onionskin in a batch, back to back. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (cpuworker_onion_handshake_one(state->onion_keys, batch->jobs[i]) < 0)
+      return WQ_RPL_SHUTDOWN;
+  }
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
-static void
+/** Return the number of onionskins that we should try to put in the next
+ * batch that we hand to a cpuworker. */
+static int
+onionskin_batch_target_size(void)
+{
+  int n_pending = onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+                  onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR);
+  int n = n_threads > 1 ? CEIL_DIV(n_pending, n_threads) : n_pending;
+
+  /* Leave some of the work for the other threads, and don't go past our
+   * limit on pending tasks. */
+  if (n > max_pending_tasks - total_pending_tasks)
+    n = max_pending_tasks - total_pending_tasks;
+  if (n > MAX_ONIONSKIN_BATCH)
+    n = MAX_ONIONSKIN_BATCH;
+  if (n < 1)
+    n = 1;
+  return n;
+}
+
+/** Make a new cpuworker_job_t to process <b>onionskin</b> for <b>circ</b>,
+ * and free <b>onionskin</b>. */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  spider_free(onionskin);
+
+  if (should_time)
+    spider_gettimeofday(&req.started_at);
+
+  job = spider_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+  return job;
+}
+
+/** Hand <b>batch</b> to the cpuworkers.  Return 0 on success.  On failure,
+ * mark every circuit in the batch for close, except for <b>caller_circ</b>
+ * (if any), which our caller will close itself; then free the batch and
+ * return -1.  Either way, no circuit in the batch is left waiting for an
+ * answer that will never come. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch,
+                      const or_circuit_t *caller_circ)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    for (i = 0; i < batch->n_jobs; ++i) {
+      or_circuit_t *circ = batch->jobs[i]->circ;
+      circ->workqueue_entry = NULL;
+      if (circ != caller_circ && !TO_CIRCUIT(circ)->marked_for_close)
+        circuit_mark_for_close(TO_CIRCUIT(circ),
+                               END_CIRC_REASON_RESOURCELIMIT);
+      memwipe(batch->jobs[i], 0, sizeof(cpuworker_job_t));
+      spider_free(batch->jobs[i]);
+      --total_pending_tasks;
+    }
+    spider_free(batch);
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued batch %p of %d tasks (qe=%p)",
+            batch, batch->n_jobs, queue_entry);
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    batch->jobs[i]->circ->workqueue_entry = queue_entry;
+
+  return 0;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers.  When
+ * there are a lot of them, hand them over in batches, sized so that each
+ * thread gets a share of the queue, but so that no batch is expected to take
+ * more than MAX_ONIONSKIN_BATCH_USEC. */
+STATIC void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    const int target = onionskin_batch_target_size();
+    cpuworker_batch_t *batch = NULL;
+    uint64_t usec = 0;
+
+    while (!batch || (batch->n_jobs < target &&
+                      usec < MAX_ONIONSKIN_BATCH_USEC)) {
+      circ = onion_next_task(&onionskin);
+      if (!circ)
+        break;
+
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        spider_free(onionskin);
+        log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+        continue;
+      }
+
+      usec += estimated_usec_for_onionskins(1, onionskin->handshake_type);
+      if (!batch)
+        batch = spider_malloc_zero(sizeof(cpuworker_batch_t));
+      batch->jobs[batch->n_jobs++] = cpuworker_job_new(circ, onionskin);
+      ++total_pending_tasks;
+    }
 
-    if (!circ)
+    if (!batch)
       return;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin))
-      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    if (cpuworker_queue_batch(batch, NULL) < 0)
+      log_warn(LD_OR,"assign_to_cpuworker failed. Closing its circuits.");
   }
 }
 
@@ -488,10 +640,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
+  cpuworker_batch_t *batch;
 
   spider_assert(threadpool);
 
@@ -510,43 +659,11 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  spider_free(onionskin);
-
-  if (should_time)
-    spider_gettimeofday(&req.started_at);
-
-  job = spider_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
+  batch = spider_malloc_zero(sizeof(cpuworker_batch_t));
+  batch->jobs[batch->n_jobs++] = cpuworker_job_new(circ, onionskin);
   ++total_pending_tasks;
-  queue_entry = threadpool_queue_work(threadpool,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    spider_free(job);
-    return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
 
-  circ->workqueue_entry = queue_entry;
-
-  return 0;
+  return cpuworker_queue_batch(batch, circ);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -554,19 +671,87 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    spider_free(job);
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  Take this circuit's job out of the
+     * batch. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      if (batch->jobs[i]->circ == circ)
+        break;
+    }
+    spider_assert(i < batch->n_jobs);
+    memwipe(batch->jobs[i], 0xe0, sizeof(cpuworker_job_t));
+    spider_free(batch->jobs[i]);
+    memmove(&batch->jobs[i], &batch->jobs[i+1],
+            sizeof(cpuworker_job_t *) * (batch->n_jobs - i - 1));
+    --batch->n_jobs;
     spider_assert(total_pending_tasks > 0);
     --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+    /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
     circ->workqueue_entry = NULL;
+
+    /* The other circuits in the batch still want their answers.  If we
+     * can't queue them again, cpuworker_queue_batch() closes them. */
+    if (batch->n_jobs)
+      cpuworker_queue_batch(batch, NULL);
+    else
+      spider_free(batch);
   }
 }
 
+/** Return the number of cpuworker threads, or 0 if we haven't started
+ * any. */
+MOCK_IMPL(int,
+cpuworker_get_n_threads,(void))
+{
+  return threadpool ? n_threads : 0;
+}
+
+/** Queue an arbitrary job with priority <b>priority</b> to run on the
+ * cpuworker threads: <b>fn</b> runs in a worker thread, and <b>reply_fn</b>
+ * is then called with <b>arg</b> in the main thread.  Return the queue entry
+ * on success, or NULL if there are no cpuworkers or the job couldn't be
+ * queued. */
+MOCK_IMPL(workqueue_entry_t *,
+cpuworker_queue_work,(workqueue_priority_t priority,
+                      workqueue_reply_t (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return NULL;
+  return threadpool_queue_work_priority(threadpool, priority,
+                                        fn, reply_fn, arg);
+}
+
+/** Log, at severity <b>severity</b>, how long the cpuworker jobs of each
+ * priority have waited for a thread since we last did so, and reset the
+ * statistics. */
+void
+cpuworker_log_queue_wait_stats(int severity)
+{
+  static const char *names[WORKQUEUE_N_PRIORITIES] = {
+    "high", "medium", "low"
+  };
+  int prio;
+  if (!threadpool)
+    return;
+  for (prio = WQ_PRI_HIGH; prio <= WQ_PRI_LOW; ++prio) {
+    const workqueue_wait_stats_t *stats =
+      threadpool_get_wait_stats(threadpool, prio);
+    if (!stats->n_started)
+      continue;
+    spider_log(severity, LD_HEARTBEAT,
+               U64_FORMAT" %s-priority cpuworker jobs waited %d usec on "
+               "average, and at most "U64_FORMAT" usec, for a thread.",
+               U64_PRINTF_ARG(stats->n_started), names[prio],
+               (int)(stats->total_wait_usec / stats->n_started),
+               U64_PRINTF_ARG(stats->max_wait_usec));
+  }
+  threadpool_reset_wait_stats(threadpool);
+}
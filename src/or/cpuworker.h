@@ -12,6 +12,8 @@
 #ifndef TOR_CPUWORKER_H
 #define TOR_CPUWORKER_H
 
+#include "workqueue.h"
+
 void cpu_init(void);
 void cpuworkers_rotate_keyinfo(void);
 
@@ -25,5 +27,34 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+MOCK_DECL(int, cpuworker_get_n_threads, (void));
+MOCK_DECL(workqueue_entry_t *, cpuworker_queue_work,
+          (workqueue_priority_t priority,
+           workqueue_reply_t (*fn)(void *, void *),
+           void (*reply_fn)(void *),
+           void *arg));
+void cpuworker_log_queue_wait_stats(int severity);
+
+#ifdef CPUWORKER_PRIVATE
+/** Largest number of onionskins that we'll hand to a cpuworker at once. */
+#define MAX_ONIONSKIN_BATCH 16
+/** Don't give a cpuworker a batch that we expect to take more than this many
+ * microseconds: the circuits at the end of the batch have to wait for all
+ * the ones before them. */
+#define MAX_ONIONSKIN_BATCH_USEC 4000
+
+/** A set of onionskins that a single cpuworker processes one after another,
+ * as a single item of work, and answers in a single reply.  When we're busy,
+ * this saves us a queue entry, a wakeup, and a reply per onionskin. */
+typedef struct cpuworker_batch_t {
+  /** How many elements of <b>jobs</b> are in use? */
+  int n_jobs;
+  /** The onionskins to process, in order. */
+  struct cpuworker_job_u *jobs[MAX_ONIONSKIN_BATCH];
+} cpuworker_batch_t;
+
+STATIC void queue_pending_tasks(void);
+#endif
+
 #endif
 
@@ -13,6 +13,8 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
+#include "consdiffmgr.h"
 #include "control.h"
 #include "compat.h"
 #define DIRECTORY_PRIVATE
@@ -1461,6 +1463,33 @@ copy_ipv6_address(char* destination, const char* source, size_t len,
   }
 }
 
+/** For each consensus flavor, true iff the last consensus diff we fetched
+ * for it turned out to be unusable.  While this is set, we ask for the full
+ * consensus instead of a diff. */
+static int consensus_diff_failed[N_CONSENSUS_FLAVORS];
+
+/** If we have a consensus of the flavor named by <b>resource</b> (or of
+ * the ns flavor if <b>resource</b> is NULL), add a header to
+ * <b>headers</b> asking the directory server for a diff from it. */
+static void
+add_consensus_diff_header(smartlist_t *headers, const char *resource)
+{
+  int flav = resource ? networkstatus_parse_flavor_name(resource) : FLAV_NS;
+  uint8_t digest[DIGEST256_LEN];
+  char hex[HEX_DIGEST256_LEN+1];
+
+  if (flav < 0 || consensus_diff_failed[flav])
+    return;
+  if (!networkstatus_get_latest_consensus_by_flavor(flav))
+    return;
+  if (networkstatus_get_cached_consensus_sha3(flav, digest) < 0)
+    return;
+
+  base16_encode(hex, sizeof(hex), (const char*)digest, sizeof(digest));
+  smartlist_add_asprintf(headers, "%s%s\r\n",
+                         X_OR_DIFF_FROM_CONSENSUS_HEADER, hex);
+}
+
 /** Queue an appropriate HTTP command on conn-\>outbuf.  The other args
  * are as in directory_initiate_command().
  */
@@ -1541,6 +1570,7 @@ directory_send_command(dir_connection_t *conn,
       url = directory_get_consensus_url(resource);
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
+      add_consensus_diff_header(headers, resource);
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
       spider_assert(resource);
@@ -2122,7 +2152,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
   if (conn->base_.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
-    int r;
+    int r, flav, from_diff = 0;
     const char *flavname = conn->requested_resource;
     if (status_code != 200) {
       int severity = (status_code == 304) ? LOG_INFO : LOG_WARN;
@@ -2137,16 +2167,47 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (body size %d) from server "
              "'%s:%d'", (int)body_len, conn->base_.address, conn->base_.port);
+    flav = flavname ? networkstatus_parse_flavor_name(flavname) : FLAV_NS;
+    if (!strcmpstart(body, "network-status-diff-version") && flav >= 0) {
+      /* We asked for a diff from the consensus we have, and got one. */
+      uint8_t digest[DIGEST256_LEN];
+      char *cached = NULL, *applied = NULL;
+      if (networkstatus_get_cached_consensus_sha3(flav, digest) == 0)
+        cached = networkstatus_read_cached_consensus(flav);
+      if (cached)
+        applied = consensus_diff_apply_digest(cached, digest, body);
+      spider_free(cached);
+      if (!applied) {
+        log_warn(LD_DIR, "Unable to apply %s consensus diff downloaded "
+                 "from server '%s:%d'. I'll fetch the full consensus.",
+                 networkstatus_get_flavor_name(flav),
+                 conn->base_.address, conn->base_.port);
+        consensus_diff_failed[flav] = 1;
+        spider_free(body); spider_free(headers); spider_free(reason);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      log_info(LD_DIR, "Applied a consensus diff of %d bytes.",
+               (int)body_len);
+      spider_free(body);
+      body = applied;
+      body_len = strlen(body);
+      from_diff = 1;
+    }
     if ((r=networkstatus_set_current_consensus(body, flavname, 0,
                                                conn->identity_digest))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
              "Unable to load %s consensus directory downloaded from "
              "server '%s:%d'. I'll try again soon.",
              flavname, conn->base_.address, conn->base_.port);
+      if (from_diff && r < -1)
+        consensus_diff_failed[flav] = 1;
       spider_free(body); spider_free(headers); spider_free(reason);
       networkstatus_consensus_download_failed(0, flavname);
       return -1;
     }
+    if (flav >= 0)
+      consensus_diff_failed[flav] = 0;
 
     /* If we launched other fetches for this consensus, cancel them. */
     connection_dir_close_consensus_fetches(conn, flavname);
@@ -3052,6 +3113,37 @@ warn_consensus_is_too_old(networkstatus_t *v, const char *flavor, time_t now)
   }
 }
 
+/** If the client that sent <b>headers</b> told us which consensuses of
+ * flavor <b>flav</b> it has, and we have a diff from one of them to our
+ * newest consensus, return that diff.  Otherwise return NULL. */
+static cached_dir_t *
+find_consensus_diff_for_request(const char *headers, int flav)
+{
+  cached_dir_t *result = NULL;
+  char *header = http_get_header(headers, X_OR_DIFF_FROM_CONSENSUS_HEADER);
+  smartlist_t *hexdigests;
+  if (!header)
+    return NULL;
+
+  hexdigests = smartlist_new();
+  smartlist_split_string(hexdigests, header, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(hexdigests, const char *, hex) {
+    uint8_t digest[DIGEST256_LEN];
+    if (result || strlen(hex) != HEX_DIGEST256_LEN)
+      continue;
+    if (base16_decode((char*)digest, sizeof(digest),
+                      hex, HEX_DIGEST256_LEN) != DIGEST256_LEN)
+      continue;
+    result = consdiffmgr_find_diff_from(flav, digest);
+  } SMARTLIST_FOREACH_END(hex);
+
+  SMARTLIST_FOREACH(hexdigests, char *, cp, spider_free(cp));
+  smartlist_free(hexdigests);
+  spider_free(header);
+  return result;
+}
+
 /** Helper function for GET /spider/status-vote/current/consensus
  */
 static int
@@ -3116,7 +3208,12 @@ handle_get_current_consensus(dir_connection_t *conn,
     clear_spool = 1;
     {
       spooled_resource_t *spooled;
-      if (flavor)
+      cached_dir_t *diff = NULL;
+      if (v && (!flavor || networkstatus_parse_flavor_name(flavor) == flav))
+        diff = find_consensus_diff_for_request(args->headers, flav);
+      if (diff)
+        spooled = spooled_resource_new_from_cached_dir(diff);
+      else if (flavor)
         spooled = spooled_resource_new(DIR_SPOOL_NETWORKSTATUS,
                                        (uint8_t*)flavor, strlen(flavor));
       else
@@ -3334,9 +3431,12 @@ handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
     clear_spool = 0;
     write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
 
-    if (compressed)
-      conn->zlib_state = spider_zlib_new(1, ZLIB_METHOD,
-                                      choose_compression_level(size_guess));
+    if (compressed) {
+      const zlib_compression_level_t level =
+        choose_compression_level(size_guess);
+      if (!dirserv_spool_use_compressed_cache(conn, level))
+        conn->zlib_state = spider_zlib_new(1, ZLIB_METHOD, level);
+    }
 
     const int initial_flush_result = connection_dirserv_flushed_some(conn);
     spider_assert_nonfatal(initial_flush_result == 0);
@@ -3427,9 +3527,12 @@ handle_get_descripspider(dir_connection_t *conn, const get_handler_args_t *args)
         goto done;
       }
       write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
-        conn->zlib_state = spider_zlib_new(1, ZLIB_METHOD,
-                                        choose_compression_level(size_guess));
+      if (compressed) {
+        const zlib_compression_level_t level =
+          choose_compression_level(size_guess);
+        if (!dirserv_spool_use_compressed_cache(conn, level))
+          conn->zlib_state = spider_zlib_new(1, ZLIB_METHOD, level);
+      }
       clear_spool = 0;
       /* Prime the connection with some data. */
       int initial_flush_result = connection_dirserv_flushed_some(conn);
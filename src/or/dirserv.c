@@ -8,6 +8,7 @@
 #include "buffers.h"
 #include "config.h"
 #include "confparse.h"
+#include "consdiffmgr.h"
 #include "channel.h"
 #include "channeltls.h"
 #include "command.h"
@@ -31,6 +32,7 @@
 #include "routerparse.h"
 #include "routerset.h"
 #include "spidercert.h"
+#include "spoolcache.h"
 
 /**
  * \file dirserv.c
@@ -92,7 +94,8 @@ static int spooled_resource_lookup_body(const spooled_resource_t *spooled,
                                         int conn_is_encrypted,
                                         const uint8_t **body_out,
                                         size_t *size_out,
-                                        time_t *published_out);
+                                        time_t *published_out,
+                                        const char **digest_out);
 static cached_dir_t *spooled_resource_lookup_cached_dir(
                                    const spooled_resource_t *spooled,
                                    time_t *published_out);
@@ -1224,6 +1227,13 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
                                  new_networkstatus);
   if (old_networkstatus)
     cached_dir_decref(old_networkstatus);
+
+  /* Caches also serve diffs from older consensuses to this one. */
+  if (directory_caches_dir_info(get_options())) {
+    int flav = networkstatus_parse_flavor_name(flavor_name);
+    if (flav >= 0)
+      consdiffmgr_add_consensus(networkstatus, flav, published);
+  }
 }
 
 /** Return the latest downloaded consensus networkstatus in encoded, signed,
@@ -3097,7 +3107,7 @@ dirserv_get_routerdesc_spool(smartlist_t *spool_out,
       const uint8_t *body = NULL;
       size_t bodylen = 0;
       int r = spooled_resource_lookup_body(spooled, conn_is_encrypted,
-                                           &body, &bodylen, NULL);
+                                           &body, &bodylen, NULL, NULL);
       if (r < 0 || body == NULL || bodylen == 0) {
         SMARTLIST_DEL_CURRENT(spool_out, spooled);
         spooled_resource_free(spooled);
@@ -3399,6 +3409,18 @@ spooled_resource_new(dir_spool_source_t source,
   return spooled;
 }
 
+/** Return a new spooled_resource_t that will send the contents of
+ * <b>d</b>, holding a reference to it. */
+spooled_resource_t *
+spooled_resource_new_from_cached_dir(cached_dir_t *d)
+{
+  spooled_resource_t *spooled =
+    spooled_resource_new(DIR_SPOOL_NETWORKSTATUS, NULL, 0);
+  spooled->cached_dir_ref = d;
+  ++d->refcnt;
+  return spooled;
+}
+
 /** Release all sspiderage held by <b>spooled</b>. */
 void
 spooled_resource_free(spooled_resource_t *spooled)
@@ -3446,7 +3468,7 @@ spooled_resource_estimate_size(const spooled_resource_t *spooled,
     int r = spooled_resource_lookup_body(spooled,
                                          connection_dir_is_encrypted(conn),
                                          &body, &bodylen,
-                                         published_out);
+                                         published_out, NULL);
     if (r == -1 || body == NULL || bodylen == 0)
       return 0;
     if (compressed) {
@@ -3458,6 +3480,8 @@ spooled_resource_estimate_size(const spooled_resource_t *spooled,
     cached_dir_t *cached;
     if (spooled->cached_dir_ref) {
       cached = spooled->cached_dir_ref;
+      if (published_out)
+        *published_out = cached->published;
     } else {
       cached = spooled_resource_lookup_cached_dir(spooled,
                                                   published_out);
@@ -3470,6 +3494,14 @@ spooled_resource_estimate_size(const spooled_resource_t *spooled,
   }
 }
 
+/** Helper for spooled_resource_flush_some(): release a reference to a
+ * cached_dir_t that a connection's outbuf was using. */
+static void
+cached_dir_release_(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
 /** Return code for spooled_resource_flush_some */
 typedef enum {
   SRFS_ERR = -1,
@@ -3492,7 +3524,7 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     size_t bodylen = 0;
     int r = spooled_resource_lookup_body(spooled,
                                          connection_dir_is_encrypted(conn),
-                                         &body, &bodylen, NULL);
+                                         &body, &bodylen, NULL, NULL);
     if (r == -1 || body == NULL || bodylen == 0) {
       /* Absent objects count as "done". */
       return SRFS_DONE;
@@ -3522,14 +3554,20 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     remaining = cached->dir_z_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
-    ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
-    if (conn->zlib_state) {
-      connection_write_to_buf_zlib(cached->dir_z + spooled->cached_dir_offset,
-                                   bytes, conn, 0);
-    } else {
-      connection_write_to_buf(cached->dir_z + spooled->cached_dir_offset,
-                              bytes, TO_CONN(conn));
+    if (!conn->zlib_state) {
+      /* The body is already compressed, and it won't change while we hold a
+       * reference to it: let the outbuf refer to it rather than copy it. */
+      ++cached->refcnt;
+      connection_write_external_to_buf(
+                               cached->dir_z + spooled->cached_dir_offset,
+                               (size_t)remaining, TO_CONN(conn),
+                               cached_dir_release_, cached);
+      spooled->cached_dir_offset += remaining;
+      return SRFS_DONE;
     }
+    ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
+    connection_write_to_buf_zlib(cached->dir_z + spooled->cached_dir_offset,
+                                 bytes, conn, 0);
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)cached->dir_z_len) {
       return SRFS_DONE;
@@ -3564,13 +3602,16 @@ spooled_resource_lookup_cached_dir(const spooled_resource_t *spooled,
  * shouldn't be sent over an unencrypted connection.  On success, set
  * <b>body_out</b>, <b>size_out</b>, and <b>published_out</b> to refer
  * to the resource's body, size, and publication date, and return 0.
+ * If <b>digest_out</b> is provided, also set it to a digest of the body:
+ * DIGEST256_LEN bytes for microdescripspiders, DIGEST_LEN bytes otherwise.
  * On failure return -1. */
 static int
 spooled_resource_lookup_body(const spooled_resource_t *spooled,
                              int conn_is_encrypted,
                              const uint8_t **body_out,
                              size_t *size_out,
-                             time_t *published_out)
+                             time_t *published_out,
+                             const char **digest_out)
 {
   spider_assert(spooled->spool_eagerly == 1);
 
@@ -3604,6 +3645,8 @@ spooled_resource_lookup_body(const spooled_resource_t *spooled,
       *size_out = md->bodylen;
       if (published_out)
         *published_out = TIME_MAX;
+      if (digest_out)
+        *digest_out = md->digest;
       return 0;
     }
     case DIR_SPOOL_NETWORKSTATUS:
@@ -3630,6 +3673,8 @@ spooled_resource_lookup_body(const spooled_resource_t *spooled,
   *size_out = sd->signed_descripspider_len;
   if (published_out)
     *published_out = sd->published_on;
+  if (digest_out)
+    *digest_out = sd->signed_descripspider_digest;
   return 0;
 }
 
@@ -3700,6 +3745,91 @@ dirserv_spool_remove_missing_and_guess_size(dir_connection_t *conn,
     *n_expired_out = n_expired;
 }
 
+/** Try to answer a request for compressed objects from a cached bundle.
+ *
+ * If every object in <b>conn</b>'s spool is one that we send all at once
+ * (descripspiders, extra-info documents, or microdescripspiders), look for a
+ * compressed bundle of exactly those objects in the spool cache.  If there
+ * is one, replace the contents of the spool with that bundle, and return 1:
+ * the caller must not compress the spool again.  Otherwise, leave the spool
+ * alone and return 0, so that the caller compresses it as it goes; but
+ * first, have a cpuworker build a bundle at compression level
+ * <b>level</b> for the next client that asks.
+ *
+ * The key for a bundle is the SHA256 of the spool source and content
+ * digest of each object in order, so a bundle can only ever match a
+ * request for the same bytes.
+ */
+int
+dirserv_spool_use_compressed_cache(dir_connection_t *conn,
+                                   zlib_compression_level_t level)
+{
+  const int encrypted = connection_dir_is_encrypted(conn);
+  const size_t max_size = spoolcache_max_entry_size();
+  crypto_digest_t *d;
+  uint8_t key[DIGEST256_LEN];
+  cached_dir_t *bundle;
+  uint64_t total = 0;
+  double ratio = 1.0;
+
+  if (!conn->spool || smartlist_len(conn->spool) == 0 || max_size == 0)
+    return 0;
+
+  d = crypto_digest256_new(DIGEST_SHA256);
+  SMARTLIST_FOREACH_BEGIN(conn->spool, spooled_resource_t *, spooled) {
+    const uint8_t *body = NULL;
+    const char *digest = NULL;
+    size_t bodylen = 0;
+    const uint8_t source = spooled->spool_source;
+    if (!spooled->spool_eagerly ||
+        spooled_resource_lookup_body(spooled, encrypted, &body, &bodylen,
+                                     NULL, &digest) < 0) {
+      crypto_digest_free(d);
+      return 0;
+    }
+    crypto_digest_add_bytes(d, (const char *)&source, 1);
+    crypto_digest_add_bytes(d, digest, source == DIR_SPOOL_MICRODESC ?
+                            DIGEST256_LEN : DIGEST_LEN);
+    total += bodylen;
+    ratio = estimate_compression_ratio(source);
+  } SMARTLIST_FOREACH_END(spooled);
+  crypto_digest_get_digest(d, (char *)key, sizeof(key));
+  crypto_digest_free(d);
+
+  /* Don't bother with responses too big for the cache to keep. */
+  if (total > SPOOLCACHE_MAX_BUNDLE_LEN || total * ratio > max_size)
+    return 0;
+
+  bundle = spoolcache_lookup(key);
+  if (!bundle) {
+    char *body;
+    size_t off = 0;
+    if (!spoolcache_can_build(key))
+      return 0;
+    body = spider_malloc(total ? total : 1);
+    SMARTLIST_FOREACH_BEGIN(conn->spool, spooled_resource_t *, spooled) {
+      const uint8_t *b = NULL;
+      size_t blen = 0;
+      if (spooled_resource_lookup_body(spooled, encrypted, &b, &blen,
+                                       NULL, NULL) == 0) {
+        spider_assert(off + blen <= total);
+        memcpy(body + off, b, blen);
+        off += blen;
+      }
+    } SMARTLIST_FOREACH_END(spooled);
+    spoolcache_build(key, body, off, level);
+    return 0;
+  }
+
+  ++bundle->refcnt;
+  SMARTLIST_FOREACH(conn->spool, spooled_resource_t *, spooled,
+                    spooled_resource_free(spooled));
+  smartlist_clear(conn->spool);
+  smartlist_add(conn->spool, spooled_resource_new_from_cached_dir(bundle));
+  cached_dir_decref(bundle);
+  return 1;
+}
+
 /** Helper: used to sort a connection's spool. */
 static int
 dirserv_spool_sort_comparison_(const void **a_, const void **b_)
@@ -184,6 +184,7 @@ int dirserv_read_guardfraction_file(const char *fname,
 spooled_resource_t *spooled_resource_new(dir_spool_source_t source,
                                          const uint8_t *digest,
                                          size_t digestlen);
+spooled_resource_t *spooled_resource_new_from_cached_dir(cached_dir_t *d);
 void spooled_resource_free(spooled_resource_t *spooled);
 void dirserv_spool_remove_missing_and_guess_size(dir_connection_t *conn,
                                                  time_t cutoff,
@@ -191,6 +192,8 @@ void dirserv_spool_remove_missing_and_guess_size(dir_connection_t *conn,
                                                  size_t *size_out,
                                                  int *n_expired_out);
 void dirserv_spool_sort(dir_connection_t *conn);
+int dirserv_spool_use_compressed_cache(dir_connection_t *conn,
+                                       zlib_compression_level_t level);
 void dir_conn_clear_spool(dir_connection_t *conn);
 
 #endif
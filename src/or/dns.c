@@ -61,6 +61,7 @@
 #include "policies.h"
 #include "relay.h"
 #include "router.h"
+#include "streammap.h"
 #include "ht.h"
 #include "sandbox.h"
 #include <event2/event.h>
@@ -629,6 +630,7 @@ dns_resolve(edge_connection_t *exitconn)
          * connected cell. */
         exitconn->next_stream = oncirc->n_streams;
         oncirc->n_streams = exitconn;
+        stream_map_add(&oncirc->n_stream_map, exitconn);
       }
       break;
     case 0:
@@ -637,6 +639,7 @@ dns_resolve(edge_connection_t *exitconn)
       exitconn->base_.state = EXIT_CONN_STATE_RESOLVING;
       exitconn->next_stream = oncirc->resolving_streams;
       oncirc->resolving_streams = exitconn;
+      stream_map_add(&oncirc->resolving_stream_map, exitconn);
       break;
     case -2:
     case -1:
@@ -1232,6 +1235,7 @@ inform_pending_connections(cached_resolve_t *resolve)
         pend->conn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
         pend->conn->on_circuit = circ;
         TO_OR_CIRCUIT(circ)->n_streams = pend->conn;
+        stream_map_add(&TO_OR_CIRCUIT(circ)->n_stream_map, pend->conn);
 
         connection_exit_connect(pend->conn);
       } else {
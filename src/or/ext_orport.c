@@ -86,6 +86,8 @@ connection_ext_or_transition(or_connection_t *conn)
 
   conn->base_.type = CONN_TYPE_OR;
   TO_CONN(conn)->state = 0; // set the state to a neutral value
+  /* EXT_OR connections get no housekeeping; OR connections do. */
+  connection_housekeeping_schedule(TO_CONN(conn), approx_time());
   control_event_or_conn_status(conn, OR_CONN_EVENT_NEW, 0);
   connection_tls_start_handshake(conn, 1);
 }
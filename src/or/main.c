@@ -60,6 +60,7 @@
 #include "command.h"
 #include "config.h"
 #include "confparse.h"
+#include "consdiffmgr.h"
 #include "connection.h"
 #include "connection_edge.h"
 #include "connection_or.h"
@@ -98,6 +99,7 @@
 #include "routerparse.h"
 #include "scheduler.h"
 #include "shared_random.h"
+#include "spoolcache.h"
 #include "statefile.h"
 #include "status.h"
 #include "util_process.h"
@@ -188,6 +190,10 @@ static smartlist_t *active_linked_connection_lst = NULL;
  * to handle linked connections. */
 static int called_loop_once = 0;
 
+/** True iff the main loop has started the timer wheel, so that we can
+ * schedule per-connection and per-circuit housekeeping timers on it. */
+static int housekeeping_timers_enabled = 0;
+
 /** We set this to 1 when we've opened a circuit, so we can print a log
  * entry to inform the user that Spider is working.  We set it to 0 when
  * we think the fact that we once opened a circuit doesn't mean we can do so
@@ -274,6 +280,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
 
+  connection_housekeeping_schedule(conn, time(NULL) + 1);
+
   return 0;
 }
 
@@ -873,6 +881,7 @@ conn_close_if_marked(int i)
          */
         if (connection_is_writing(conn)) {
           conn->write_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           connection_stop_writing(conn);
         }
         if (connection_is_reading(conn)) {
@@ -883,6 +892,7 @@ conn_close_if_marked(int i)
            * connection_handle_read_impl, or to just stop reading in
            * mark_and_flush */
           conn->read_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           connection_stop_reading(conn);
         }
       }
@@ -999,13 +1009,13 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
 }
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by connection_housekeeping_cb() whenever the
+ * connection's housekeeping timer fires.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
@@ -1122,6 +1132,149 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Return the earliest time after <b>now</b> at which
+ * run_connection_housekeeping() could do anything to <b>conn</b>, or 0 if
+ * it never will.
+ *
+ * Every deadline here is computed from timestamps that only move forward,
+ * so if we look at a connection too early we just find a later deadline.
+ * Anything that could move a deadline earlier must call
+ * connection_housekeeping_schedule() itself. */
+STATIC time_t
+connection_housekeeping_next_check(connection_t *conn, time_t now)
+{
+  const or_options_t *options = get_options();
+  or_connection_t *or_conn;
+  channel_t *chan;
+  time_t next;
+
+  if (conn->marked_for_close)
+    return 0;
+
+  if (conn->type == CONN_TYPE_DIR) {
+    if (DIR_CONN_IS_SERVER(conn))
+      next = conn->timestamp_lastwritten;
+    else
+      next = conn->timestamp_lastread;
+    return MAX(next + options->TestingDirConnectionMaxStall + 1, now + 1);
+  }
+
+  if (conn->type != CONN_TYPE_OR)
+    return 0;
+
+  or_conn = TO_OR_CONN(conn);
+  chan = or_conn->chan ? TLS_CHAN_TO_BASE(or_conn->chan) : NULL;
+  /* These can close a connection as soon as its last circuit goes away:
+   * look at them every second, the way we used to look at everything. */
+  if (!chan || channel_is_bad_for_new_circs(chan) ||
+      we_are_hibernating())
+    return now + 1;
+
+  /* Keepalive, or give up on a connection that never opened.  If that's
+   * already due, we either just queued a padding cell or are waiting for
+   * the outbuf to drain; either way the timestamp will move forward. */
+  next = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  if (next <= now)
+    next = now + options->KeepalivePeriod;
+  if (connection_state_is_open(conn)) {
+    /* Idle connection, with no circuits for idle_timeout seconds. */
+    next = MIN(next, chan->timestamp_last_had_circuits +
+                     or_conn->idle_timeout);
+    /* Stuck connection, unable to flush for a long time. */
+    next = MIN(next, MAX(or_conn->timestamp_lastempty,
+                         conn->timestamp_lastwritten) +
+                     options->KeepalivePeriod*10);
+  }
+  return MAX(next, now + 1);
+}
+
+/** Timer callback: do housekeeping for the connection in <b>arg</b>, and
+ * decide when to look at it next. */
+static void
+connection_housekeeping_cb(spider_timer_t *timer, void *arg,
+                           const monotime_t *now_mono)
+{
+  connection_t *conn = arg;
+  const time_t now = time(NULL);
+  time_t next = 0;
+  (void)timer;
+  (void)now_mono;
+
+  if (conn->type == CONN_TYPE_AP) {
+    if (conn->marked_for_close || conn->state == AP_CONN_STATE_OPEN)
+      return;
+    connection_ap_expire_beginning(TO_ENTRY_CONN(conn), now);
+    /* A stream that's still waiting might be waiting on a circuit or a
+     * reply, and both can time out: check it every second. */
+    if (!conn->marked_for_close && conn->state != AP_CONN_STATE_OPEN)
+      next = now + 1;
+  } else {
+    run_connection_housekeeping(conn, now);
+    next = connection_housekeeping_next_check(conn, now);
+  }
+
+  if (next)
+    connection_housekeeping_schedule(conn, next);
+}
+
+/** Arrange for the housekeeping timer in *<b>timer_ptr</b> to fire at
+ * <b>when</b>, or a second from now if that's later, creating it with
+ * callback <b>cb</b> and argument <b>arg</b> if it doesn't exist yet.  Do
+ * nothing if the main loop hasn't started the timer wheel. */
+void
+housekeeping_timer_schedule(spider_timer_t **timer_ptr, timer_cb_fn_t cb,
+                            void *arg, time_t when)
+{
+  struct timeval delay;
+  const time_t now = time(NULL);
+
+  if (!housekeeping_timers_enabled)
+    return;
+
+  if (!*timer_ptr)
+    *timer_ptr = timer_new(cb, arg);
+  delay.tv_sec = when > now + 1 ? when - now : 1;
+  delay.tv_usec = 0;
+  timer_schedule(*timer_ptr, &delay);
+}
+
+/** Arrange for <b>conn</b> to get housekeeping at <b>when</b>, or in a
+ * second if that's later.  Only directory, OR, and AP connections need
+ * housekeeping. */
+void
+connection_housekeeping_schedule(connection_t *conn, time_t when)
+{
+  if (conn->type != CONN_TYPE_DIR && conn->type != CONN_TYPE_OR &&
+      conn->type != CONN_TYPE_AP)
+    return;
+  housekeeping_timer_schedule(&conn->housekeeping_timer,
+                              connection_housekeeping_cb, conn, when);
+}
+
+/** Start the timer wheel, if we haven't yet, and give every connection that
+ * we've already opened its housekeeping timer. */
+STATIC void
+housekeeping_timers_start(void)
+{
+  if (housekeeping_timers_enabled)
+    return;
+  timers_initialize();
+  housekeeping_timers_enabled = 1;
+  connection_housekeeping_reschedule_all();
+}
+
+/** Look at every connection again within a second: something that all of
+ * their housekeeping deadlines depend on has changed. */
+void
+connection_housekeeping_reschedule_all(void)
+{
+  const time_t now = time(NULL);
+  if (!connection_array)
+    return;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                    connection_housekeeping_schedule(conn, now));
+}
+
 /** Honor a NEWNYM request: make future requests unlinkable to past
  * requests. */
 static void
@@ -1180,7 +1333,6 @@ CALLBACK(check_descripspider);
 CALLBACK(check_for_reachability_bw);
 CALLBACK(fetch_networkstatus);
 CALLBACK(retry_listeners);
-CALLBACK(expire_old_ciruits_serverside);
 CALLBACK(check_dns_honesty);
 CALLBACK(write_bridge_ns);
 CALLBACK(check_fw_helper_app);
@@ -1212,7 +1364,6 @@ static periodic_event_item_t periodic_events[] = {
   CALLBACK(check_for_reachability_bw),
   CALLBACK(fetch_networkstatus),
   CALLBACK(retry_listeners),
-  CALLBACK(expire_old_ciruits_serverside),
   CALLBACK(check_dns_honesty),
   CALLBACK(write_bridge_ns),
   CALLBACK(check_fw_helper_app),
@@ -1410,12 +1561,10 @@ run_scheduled_events(time_t now)
   circuit_expire_building();
   circuit_expire_waiting_for_better_guard();
 
-  /* 3b. Also look at pending streams and prune the ones that 'began'
-   *     a long time ago but haven't gotten a 'connected' yet.
-   *     Do this before step 4, so we can put them back into pending
-   *     state to be picked up by the new circuit.
+  /* 3b. Pending streams that 'began' a long time ago but haven't gotten a
+   *     'connected' yet get pruned by their own housekeeping timers; see
+   *     connection_housekeeping_cb().
    */
-  connection_ap_expire_beginning();
 
   /* 3c. And expire connections that we've held open for too long.
    */
@@ -1439,12 +1588,10 @@ run_scheduled_events(time_t now)
     connection_ap_attach_pending(0);
   }
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. Each connection does its own housekeeping when its timer fires;
+   * here we only notice which channels have become bad for new circuits,
+   * which reschedules their connections. */
   channel_update_bad_for_new_circs(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
 
   /* 6. And remove any marked circuits... */
   circuit_close_all_marked();
@@ -1932,18 +2079,6 @@ retry_listeners_callback(time_t now, const or_options_t *options)
   return PERIODIC_EVENT_NO_UPDATE;
 }
 
-/**
- * Periodic callback: as a server, see if we have any old unused circuits
- * that should be expired */
-static int
-expire_old_ciruits_serverside_callback(time_t now, const or_options_t *options)
-{
-  (void)options;
-  /* every 11 seconds, so not usually the same second as other such events */
-  circuit_expire_old_circuits_serverside(now);
-  return 11;
-}
-
 /**
  * Periodic event: if we're an exit, see if our DNS server is telling us
  * obvious lies.
@@ -2441,6 +2576,8 @@ do_main_loop(void)
   /* Initialize relay-side HS circuitmap */
   hs_circuitmap_init();
 
+  housekeeping_timers_start();
+
   /* set up once-a-second callback. */
   if (! second_timer) {
     struct timeval one_second;
@@ -3133,6 +3270,8 @@ spider_free_all(int postfork)
   networkstatus_free_all();
   addressmap_free_all();
   dirserv_free_all();
+  consdiffmgr_free_all();
+  spoolcache_free_all();
   rend_service_free_all();
   rend_cache_free_all();
   rend_service_authorization_free_all();
@@ -3178,6 +3317,10 @@ spider_free_all(int postfork)
   periodic_timer_free(second_timer);
   teardown_periodic_events();
   periodic_timer_free(refill_timer);
+  if (housekeeping_timers_enabled) {
+    timers_shutdown();
+    housekeeping_timers_enabled = 0;
+  }
 
   if (!postfork) {
     release_lockfile();
@@ -49,6 +49,11 @@ void tell_event_loop_to_finish(void);
 
 void connection_stop_reading_from_linked_conn(connection_t *conn);
 
+void housekeeping_timer_schedule(spider_timer_t **timer_ptr,
+                                 timer_cb_fn_t cb, void *arg, time_t when);
+void connection_housekeeping_schedule(connection_t *conn, time_t when);
+void connection_housekeeping_reschedule_all(void);
+
 MOCK_DECL(int, connection_count_moribund, (void));
 
 void directory_all_unreachable(time_t now);
@@ -92,6 +97,9 @@ STATIC void init_connection_lists(void);
 STATIC void close_closeable_connections(void);
 STATIC void initialize_periodic_events(void);
 STATIC void teardown_periodic_events(void);
+STATIC time_t connection_housekeeping_next_check(connection_t *conn,
+                                                 time_t now);
+STATIC void housekeeping_timers_start(void);
 #endif
 
 #endif
@@ -40,8 +40,6 @@
 #include "or.h"
 #include "bridges.h"
 #include "channel.h"
-#include "circuitmux.h"
-#include "circuitmux_ewma.h"
 #include "circuitstats.h"
 #include "config.h"
 #include "connection.h"
@@ -70,6 +68,34 @@ static strmap_t *named_server_map = NULL;
  * as unnamed for some server in the consensus. */
 static strmap_t *unnamed_server_map = NULL;
 
+/** Parsed values of the integer parameters in a consensus, indexed by
+ * interned parameter ID (see net_param_intern()). */
+struct net_param_table_t {
+  /** Number of entries in <b>values</b> and bits in <b>present</b>. */
+  int n_params;
+  /** The value of each parameter that the consensus sets. */
+  int32_t *values;
+  /** Bit N is set iff the consensus sets the parameter with ID N. */
+  bitarray_t *present;
+};
+
+/** Map from consensus parameter name to its interned ID, plus one. */
+static strmap_t *net_param_ids = NULL;
+/** List of interned consensus parameter names, indexed by ID. */
+static smartlist_t *net_param_names = NULL;
+
+/** A request from some module to be told when the value of a consensus
+ * parameter changes. */
+typedef struct net_param_watcher_t {
+  /** Interned ID of the parameter being watched. */
+  int param_id;
+  /** Function to call when the parameter changes. */
+  networkstatus_param_changed_fn_t fn;
+} net_param_watcher_t;
+
+/** List of net_param_watcher_t for every watched consensus parameter. */
+static smartlist_t *net_param_watchers = NULL;
+
 /** Most recently received and validated v3 "ns"-flavored consensus network
  * status. */
 static networkstatus_t *current_ns_consensus = NULL;
@@ -147,6 +173,61 @@ static void update_consensus_bootstrap_multiple_downloads(
 static int networkstatus_check_required_protocols(const networkstatus_t *ns,
                                                   int client_mode,
                                                   char **warning_out);
+static void net_param_table_free(net_param_table_t *table);
+static int net_param_list_get(const smartlist_t *net_params,
+                              const char *param_name, int32_t *value_out);
+static smartlist_t *net_param_watchers_to_notify(const networkstatus_t *old_c,
+                                                 const networkstatus_t *new_c);
+static void net_param_watchers_notify(smartlist_t *watchers,
+                                      const networkstatus_t *ns);
+
+/** Return a newly allocated string holding the name of the file where we
+ * keep our current consensus of flavor <b>flav</b>. */
+static char *
+networkstatus_get_cache_fname(int flav)
+{
+  char buf[128];
+  if (flav == FLAV_NS)
+    return get_datadir_fname("cached-consensus");
+  spider_snprintf(buf, sizeof(buf), "cached-%s-consensus",
+                  networkstatus_get_flavor_name(flav));
+  return get_datadir_fname(buf);
+}
+
+/** Read and return the text of the consensus of flavor <b>flav</b> that we
+ * cached on disk, or NULL if we don't have one.  The caller must free the
+ * result. */
+char *
+networkstatus_read_cached_consensus(int flav)
+{
+  char *filename, *result;
+  if (flav < 0 || flav >= N_CONSENSUS_FLAVORS)
+    return NULL;
+  filename = networkstatus_get_cache_fname(flav);
+  result = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
+  spider_free(filename);
+  return result;
+}
+
+/** For each consensus flavor, the SHA3-256 digest of the consensus that we
+ * last loaded or stored in its cache file, so that we needn't hash the file
+ * each time we ask for a diff from it. */
+static uint8_t cached_consensus_sha3[N_CONSENSUS_FLAVORS][DIGEST256_LEN];
+/** For each consensus flavor, true iff cached_consensus_sha3 is set. */
+static int have_cached_consensus_sha3[N_CONSENSUS_FLAVORS];
+
+/** If we know the SHA3-256 digest of the consensus of flavor <b>flav</b>
+ * that we cached on disk, copy it into <b>digest_out</b> and return 0.
+ * Otherwise return -1. */
+int
+networkstatus_get_cached_consensus_sha3(int flav, uint8_t *digest_out)
+{
+  if (flav < 0 || flav >= N_CONSENSUS_FLAVORS ||
+      !have_cached_consensus_sha3[flav])
+    return -1;
+  memcpy(digest_out, cached_consensus_sha3[flav], DIGEST256_LEN);
+  return 0;
+}
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -191,12 +272,7 @@ router_reload_consensus_networkstatus(void)
   for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
     char buf[128];
     const char *flavor = networkstatus_get_flavor_name(flav);
-    if (flav == FLAV_NS) {
-      filename = get_datadir_fname("cached-consensus");
-    } else {
-      spider_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
-      filename = get_datadir_fname(buf);
-    }
+    filename = networkstatus_get_cache_fname(flav);
     s = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
     if (s) {
       if (networkstatus_set_current_consensus(s, flavor, flags, NULL) < -1) {
@@ -314,6 +390,7 @@ networkstatus_vote_free(networkstatus_t *ns)
     SMARTLIST_FOREACH(ns->net_params, char *, c, spider_free(c));
     smartlist_free(ns->net_params);
   }
+  net_param_table_free(ns->net_param_table);
   if (ns->supported_methods) {
     SMARTLIST_FOREACH(ns->supported_methods, char *, c, spider_free(c));
     smartlist_free(ns->supported_methods);
@@ -1611,6 +1688,11 @@ networkstatus_set_current_consensus_from_ns(networkstatus_t *c,
                                             const char *flavor)
 {
   int flav = networkstatus_parse_flavor_name(flavor);
+  smartlist_t *param_watchers = NULL;
+  networkstatus_parse_net_params(c);
+  if (flav == usable_consensus_flavor())
+    param_watchers = net_param_watchers_to_notify(
+                         networkstatus_get_latest_consensus(), c);
   switch (flav) {
     case FLAV_NS:
       if (current_ns_consensus) {
@@ -1627,6 +1709,7 @@ networkstatus_set_current_consensus_from_ns(networkstatus_t *c,
       current_md_consensus = c;
       break;
   }
+  net_param_watchers_notify(param_watchers, c);
   return current_md_consensus ? 0 : -1;
 }
 #endif //TOR_UNIT_TESTS
@@ -1733,7 +1816,7 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
-  int old_ewma_enabled;
+  smartlist_t *param_watchers = NULL;
   int checked_protocols_already = 0;
 
   if (flav < 0) {
@@ -1749,6 +1832,7 @@ networkstatus_set_current_consensus(const char *consensus,
     result = -2;
     goto done;
   }
+  networkstatus_parse_net_params(c);
 
   if (from_cache && !was_waiting_for_certs) {
     /* We previously sspidered this; check _now_ to make sure that version-kills
@@ -1898,6 +1982,8 @@ networkstatus_set_current_consensus(const char *consensus,
   if (is_usable_flavor) {
     notify_control_networkstatus_changed(
                          networkstatus_get_latest_consensus(), c);
+    param_watchers = net_param_watchers_to_notify(
+                         networkstatus_get_latest_consensus(), c);
   }
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
@@ -1940,6 +2026,11 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   if (is_usable_flavor) {
+    /* Let modules refresh what they cache from the parameters first, so
+     * that everything below sees the new values. */
+    net_param_watchers_notify(param_watchers, c);
+    param_watchers = NULL;
+
     nodelist_set_consensus(c);
 
     /* XXXXNM Microdescs: needs a non-ns variant. ???? NM*/
@@ -1948,18 +2039,6 @@ networkstatus_set_current_consensus(const char *consensus,
     dirvote_recalculate_timing(options, now);
     routerstatus_list_update_named_server_map();
 
-    /* Update ewma and adjust policy if needed; first cache the old value */
-    old_ewma_enabled = cell_ewma_enabled();
-    /* Change the cell EWMA settings */
-    cell_ewma_set_scale_facspider(options, c);
-    /* If we just enabled ewma, set the cmux policy on all active channels */
-    if (cell_ewma_enabled() && !old_ewma_enabled) {
-      channel_set_cmux_policy_everywhere(&ewma_policy);
-    } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-      /* Turn it off everywhere */
-      channel_set_cmux_policy_everywhere(NULL);
-    }
-
     /* XXXX this call might be unnecessary here: can changing the
      * current consensus really alter our view of any OR's rate limits? */
     connection_or_update_token_buckets(get_connection_array(), options);
@@ -1986,6 +2065,9 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_str_to_file(consensus_fname, consensus, 0);
   }
+  have_cached_consensus_sha3[flav] =
+    crypto_digest256((char*)cached_consensus_sha3[flav], consensus,
+                     strlen(consensus), DIGEST_SHA3_256) == 0;
 
 /** If a consensus appears more than this many seconds before its declared
  * valid-after time, declare that our clock is skewed. */
@@ -2009,6 +2091,7 @@ networkstatus_set_current_consensus(const char *consensus,
 
   result = 0;
  done:
+  smartlist_free(param_watchers);
   if (free_consensus)
     networkstatus_vote_free(c);
   spider_free(consensus_fname);
@@ -2288,30 +2371,207 @@ networkstatus_dump_bridge_status_to_file(time_t now)
   spider_free(status);
 }
 
-/* DOCDOC get_net_param_from_list */
-static int32_t
-get_net_param_from_list(smartlist_t *net_params, const char *param_name,
-                        int32_t default_val, int32_t min_val, int32_t max_val)
+/** Return the interned ID of the consensus parameter called
+ * <b>param_name</b>, assigning it a new one if it doesn't have one yet.
+ *
+ * Interned names are never freed, so only call this with names that the
+ * code asks about, never with names taken from a consensus. */
+static int
+net_param_intern(const char *param_name)
 {
-  int32_t res = default_val;
-  size_t name_len = strlen(param_name);
+  void *idp;
 
-  spider_assert(max_val > min_val);
-  spider_assert(min_val <= default_val);
-  spider_assert(max_val >= default_val);
+  if (!net_param_ids) {
+    net_param_ids = strmap_new();
+    net_param_names = smartlist_new();
+  }
+  idp = strmap_get(net_param_ids, param_name);
+  if (idp)
+    return (int)(intptr_t)idp - 1;
 
-  SMARTLIST_FOREACH_BEGIN(net_params, const char *, p) {
-    if (!strcmpstart(p, param_name) && p[name_len] == '=') {
-      int ok=0;
-      long v = spider_parse_long(p+name_len+1, 10, INT32_MIN,
-                              INT32_MAX, &ok, NULL);
-      if (ok) {
-        res = (int32_t) v;
-        break;
-      }
-    }
+  smartlist_add_strdup(net_param_names, param_name);
+  strmap_set(net_param_ids, param_name,
+             (void*)(intptr_t)smartlist_len(net_param_names));
+  return smartlist_len(net_param_names) - 1;
+}
+
+/** Return the interned ID of the consensus parameter called
+ * <b>param_name</b>, or -1 if the code has never asked about it. */
+STATIC int
+net_param_lookup_id(const char *param_name)
+{
+  void *idp = net_param_ids ? strmap_get(net_param_ids, param_name) : NULL;
+  return idp ? (int)(intptr_t)idp - 1 : -1;
+}
+
+/** Release all storage held in <b>table</b>. */
+static void
+net_param_table_free(net_param_table_t *table)
+{
+  if (!table)
+    return;
+  spider_free(table->values);
+  bitarray_free(table->present);
+  spider_free(table);
+}
+
+/** If <b>table</b> sets the parameter with ID <b>param_id</b>, set
+ * *<b>value_out</b> to its value and return true.  Otherwise return
+ * false. */
+static int
+net_param_table_get(const net_param_table_t *table, int param_id,
+                    int32_t *value_out)
+{
+  if (param_id < 0 || param_id >= table->n_params ||
+      !bitarray_is_set(table->present, param_id))
+    return 0;
+  *value_out = table->values[param_id];
+  return 1;
+}
+
+/** Parse the key=value strings in the net_params of <b>ns</b> once, into a
+ * table that networkstatus_get_param() can consult without scanning the
+ * list.  Only the parameters that the code has asked about so far go in the
+ * table; the rest are left for the list scan, so that a consensus can't make
+ * us intern names without bound.  As with the list scan, the first
+ * well-formed value for a parameter wins, and malformed values are ignored.
+ * Does nothing if the table has already been built.
+ *
+ * The table must be rebuilt (by freeing it) if net_params is changed. */
+void
+networkstatus_parse_net_params(networkstatus_t *ns)
+{
+  net_param_table_t *table;
+
+  if (!ns->net_params || ns->net_param_table)
+    return;
+
+  table = spider_malloc_zero(sizeof(net_param_table_t));
+  table->n_params = net_param_names ? smartlist_len(net_param_names) : 0;
+  table->values = spider_calloc(table->n_params ? table->n_params : 1,
+                                sizeof(int32_t));
+  table->present = bitarray_init_zero(table->n_params);
+
+  SMARTLIST_FOREACH_BEGIN(ns->net_params, const char *, p) {
+    const char *eq = strchr(p, '=');
+    char *name;
+    int id, ok = 0;
+    long v;
+    if (!eq || eq == p)
+      continue;
+    name = spider_strndup(p, eq - p);
+    id = net_param_lookup_id(name);
+    spider_free(name);
+    if (id < 0 || bitarray_is_set(table->present, id))
+      continue;
+    v = spider_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
+    if (!ok)
+      continue;
+    bitarray_set(table->present, id);
+    table->values[id] = (int32_t) v;
   } SMARTLIST_FOREACH_END(p);
 
+  ns->net_param_table = table;
+}
+
+/** Arrange for <b>fn</b> to be called whenever the usable consensus changes
+ * the value of the parameter called <b>param_name</b>, including when it
+ * starts or stops setting it.  Modules can use this to cache values derived
+ * from consensus parameters.  Registering the same function for the same
+ * parameter more than once has no further effect. */
+void
+networkstatus_watch_param(const char *param_name,
+                          networkstatus_param_changed_fn_t fn)
+{
+  const int param_id = net_param_intern(param_name);
+  net_param_watcher_t *w;
+
+  if (!net_param_watchers)
+    net_param_watchers = smartlist_new();
+  SMARTLIST_FOREACH(net_param_watchers, net_param_watcher_t *, old,
+                    if (old->param_id == param_id && old->fn == fn) return);
+
+  w = spider_malloc_zero(sizeof(net_param_watcher_t));
+  w->param_id = param_id;
+  w->fn = fn;
+  smartlist_add(net_param_watchers, w);
+}
+
+/** If <b>ns</b> sets the parameter with ID <b>param_id</b>, set
+ * *<b>value_out</b> to its value and return true.  Otherwise return false.
+ * Use the table if it covers the parameter, and scan the list if the
+ * parameter was interned after the table was built. */
+static int
+net_param_get(const networkstatus_t *ns, int param_id, int32_t *value_out)
+{
+  if (!ns->net_params)
+    return 0;
+  if (ns->net_param_table && param_id < ns->net_param_table->n_params)
+    return net_param_table_get(ns->net_param_table, param_id, value_out);
+  return net_param_list_get(ns->net_params,
+                            smartlist_get(net_param_names, param_id),
+                            value_out);
+}
+
+/** Return true iff the parameter with ID <b>param_id</b> has a different
+ * value (or presence) in <b>old_c</b> and <b>new_c</b>, either of which may
+ * be NULL. */
+static int
+net_param_differs(const networkstatus_t *old_c, const networkstatus_t *new_c,
+                  int param_id)
+{
+  int32_t old_val = 0, new_val = 0;
+  const int had_old = old_c && net_param_get(old_c, param_id, &old_val);
+  const int has_new = new_c && net_param_get(new_c, param_id, &new_val);
+
+  return had_old != has_new || old_val != new_val;
+}
+
+/** Return a newly allocated list of the watchers, with no two sharing a
+ * callback, that should hear about replacing <b>old_c</b> with
+ * <b>new_c</b>, or NULL if there are none. */
+static smartlist_t *
+net_param_watchers_to_notify(const networkstatus_t *old_c,
+                             const networkstatus_t *new_c)
+{
+  smartlist_t *result = NULL;
+
+  if (!net_param_watchers)
+    return NULL;
+
+  SMARTLIST_FOREACH_BEGIN(net_param_watchers, net_param_watcher_t *, w) {
+    int dup = 0;
+    if (!net_param_differs(old_c, new_c, w->param_id))
+      continue;
+    if (!result)
+      result = smartlist_new();
+    SMARTLIST_FOREACH(result, net_param_watcher_t *, w2,
+                      if (w2->fn == w->fn) dup = 1);
+    if (!dup)
+      smartlist_add(result, w);
+  } SMARTLIST_FOREACH_END(w);
+
+  return result;
+}
+
+/** Tell every watcher in <b>watchers</b> (from
+ * net_param_watchers_to_notify()) that <b>ns</b> is now the usable
+ * consensus, and free the list. */
+static void
+net_param_watchers_notify(smartlist_t *watchers, const networkstatus_t *ns)
+{
+  if (!watchers)
+    return;
+  SMARTLIST_FOREACH(watchers, net_param_watcher_t *, w, w->fn(ns));
+  smartlist_free(watchers);
+}
+
+/** Make sure that <b>res</b> is between <b>min_val</b> and <b>max_val</b>
+ * for the parameter <b>param_name</b>, and warn if it wasn't. */
+static int32_t
+net_param_clamp(const char *param_name, int32_t res,
+                int32_t min_val, int32_t max_val)
+{
   if (res < min_val) {
     log_warn(LD_DIR, "Consensus parameter %s is too small. Got %d, raising to "
              "%d.", param_name, res, min_val);
@@ -2325,6 +2585,47 @@ get_net_param_from_list(smartlist_t *net_params, const char *param_name,
   return res;
 }
 
+/** If the list of key=value strings <b>net_params</b> sets the parameter
+ * <b>param_name</b> to a well-formed value, set *<b>value_out</b> to the
+ * first such value and return true.  Otherwise return false. */
+static int
+net_param_list_get(const smartlist_t *net_params, const char *param_name,
+                   int32_t *value_out)
+{
+  size_t name_len = strlen(param_name);
+
+  SMARTLIST_FOREACH_BEGIN(net_params, const char *, p) {
+    if (!strcmpstart(p, param_name) && p[name_len] == '=') {
+      int ok=0;
+      long v = spider_parse_long(p+name_len+1, 10, INT32_MIN,
+                              INT32_MAX, &ok, NULL);
+      if (ok) {
+        *value_out = (int32_t) v;
+        return 1;
+      }
+    }
+  } SMARTLIST_FOREACH_END(p);
+
+  return 0;
+}
+
+/** Return the value of the parameter <b>param_name</b> in the list of
+ * key=value strings <b>net_params</b>, or <b>default_val</b> if it isn't
+ * there, clamped to the range <b>min_val</b>..<b>max_val</b>. */
+static int32_t
+get_net_param_from_list(smartlist_t *net_params, const char *param_name,
+                        int32_t default_val, int32_t min_val, int32_t max_val)
+{
+  int32_t res = default_val;
+
+  spider_assert(max_val > min_val);
+  spider_assert(min_val <= default_val);
+  spider_assert(max_val >= default_val);
+
+  net_param_list_get(net_params, param_name, &res);
+  return net_param_clamp(param_name, res, min_val, max_val);
+}
+
 /** Return the value of a integer parameter from the networkstatus <b>ns</b>
  * whose name is <b>param_name</b>.  If <b>ns</b> is NULL, try loading the
  * latest consensus ourselves. Return <b>default_val</b> if no latest
@@ -2336,14 +2637,23 @@ int32_t
 networkstatus_get_param(const networkstatus_t *ns, const char *param_name,
                         int32_t default_val, int32_t min_val, int32_t max_val)
 {
+  int32_t res;
+
   if (!ns) /* if they pass in null, go find it ourselves */
     ns = networkstatus_get_latest_consensus();
 
   if (!ns || !ns->net_params)
     return default_val;
 
-  return get_net_param_from_list(ns->net_params, param_name,
-                                 default_val, min_val, max_val);
+  spider_assert(max_val > min_val);
+  spider_assert(min_val <= default_val);
+  spider_assert(max_val >= default_val);
+
+  /* Callers that look a parameter up often should cache its value with
+   * networkstatus_watch_param() rather than come through here each time. */
+  res = default_val;
+  net_param_get(ns, net_param_intern(param_name), &res);
+  return net_param_clamp(param_name, res, min_val, max_val);
 }
 
 /**
@@ -2613,9 +2923,24 @@ networkstatus_free_all(void)
       waiting->consensus = NULL;
     }
     spider_free(waiting->body);
+    have_cached_consensus_sha3[i] = 0;
   }
 
   strmap_free(named_server_map, spider_free_);
   strmap_free(unnamed_server_map, NULL);
+
+  if (net_param_watchers) {
+    SMARTLIST_FOREACH(net_param_watchers, net_param_watcher_t *, w,
+                      spider_free(w));
+    smartlist_free(net_param_watchers);
+    net_param_watchers = NULL;
+  }
+  strmap_free(net_param_ids, NULL);
+  net_param_ids = NULL;
+  if (net_param_names) {
+    SMARTLIST_FOREACH(net_param_names, char *, cp, spider_free(cp));
+    smartlist_free(net_param_names);
+    net_param_names = NULL;
+  }
 }
 
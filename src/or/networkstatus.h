@@ -17,6 +17,8 @@
 void networkstatus_reset_warnings(void);
 void networkstatus_reset_download_failures(void);
 int router_reload_consensus_networkstatus(void);
+char *networkstatus_read_cached_consensus(int flav);
+int networkstatus_get_cached_consensus_sha3(int flav, uint8_t *digest_out);
 void routerstatus_free(routerstatus_t *rs);
 void networkstatus_vote_free(networkstatus_t *ns);
 networkstatus_voter_info_t *networkstatus_get_voter_by_id(
@@ -115,6 +117,12 @@ int32_t networkstatus_get_param(const networkstatus_t *ns,
                                 const char *param_name,
                                 int32_t default_val, int32_t min_val,
                                 int32_t max_val);
+void networkstatus_parse_net_params(networkstatus_t *ns);
+/** A function to call when a consensus parameter changes; its argument is
+ * the new usable consensus. */
+typedef void (*networkstatus_param_changed_fn_t)(const networkstatus_t *ns);
+void networkstatus_watch_param(const char *param_name,
+                               networkstatus_param_changed_fn_t fn);
 int32_t networkstatus_get_overridable_param(const networkstatus_t *ns,
                                             int32_t spiderrc_value,
                                             const char *param_name,
@@ -135,6 +143,7 @@ int networkstatus_get_weight_scale_param(networkstatus_t *ns);
 void vote_routerstatus_free(vote_routerstatus_t *rs);
 
 #ifdef NETWORKSTATUS_PRIVATE
+STATIC int net_param_lookup_id(const char *param_name);
 #ifdef TOR_UNIT_TESTS
 STATIC int networkstatus_set_current_consensus_from_ns(networkstatus_t *c,
                                                 const char *flavor);
@@ -87,6 +87,8 @@ typedef struct onion_queue_t {
   uint16_t handshake_type;
   create_cell_t *onionskin;
   time_t when_added;
+  /** When did we add this entry?  Used to enforce OnionQueueDeadline. */
+  monotime_coarse_t queued_at;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
@@ -114,68 +116,93 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
  * MAX_ONIONSKIN_CHALLENGE/REPLY_LEN."  Also, make sure that we can pass
  * over-large values via EXTEND2/EXTENDED2, for future-compatibility.*/
 
+/** Return an estimate of how many microseconds our cpuworkers would need to
+ * process all the onionskins in the queue for <b>type</b>, along with the
+ * onionskins from the other queue that we expect to process in the meantime.
+ * If <b>own_usec_out</b> is provided, set it to the part of that time that
+ * goes to the <b>type</b> queue alone. */
+static uint64_t
+onion_queue_drain_usec(uint16_t type, uint64_t *own_usec_out)
+{
+  const int num_cpus = get_num_cpus(get_options());
+  const int n_tap = ol_entries[ONION_HANDSHAKE_TYPE_TAP];
+  const int n_nspider = ol_entries[ONION_HANDSHAKE_TYPE_NTOR];
+  uint64_t own_usec, other_usec;
+
+  if (type == ONION_HANDSHAKE_TYPE_NTOR) {
+    /* How long would it take to process all the NSpider cells in the queue,
+     * and the tap cells that we expect to process while draining it? */
+    own_usec = estimated_usec_for_onionskins(n_nspider,
+                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+    other_usec = estimated_usec_for_onionskins(
+                                    MIN(n_tap, n_nspider / num_nspiders_per_tap()),
+                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+  } else {
+    /* How long would it take to process all the TAP cells in the queue, and
+     * the nspider cells that we expect to process while draining it? */
+    own_usec = estimated_usec_for_onionskins(n_tap,
+                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
+    other_usec = estimated_usec_for_onionskins(
+                                    MIN(n_nspider, n_tap * num_nspiders_per_tap()),
+                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+  }
+
+  if (own_usec_out)
+    *own_usec_out = own_usec;
+  return own_usec + other_usec;
+}
+
 /** Return true iff we have room to queue another onionskin of type
  * <b>type</b>. */
 static int
 have_room_for_onionskin(uint16_t type)
 {
   const or_options_t *options = get_options();
-  int num_cpus;
-  uint64_t tap_usec, nspider_usec;
-  uint64_t nspider_during_tap_usec, tap_during_nspider_usec;
+  uint64_t drain_usec, own_usec;
 
   /* If we've got fewer than 50 entries, we always have room for one more. */
   if (ol_entries[type] < 50)
     return 1;
-  num_cpus = get_num_cpus(options);
-  /* Compute how many microseconds we'd expect to need to clear all
-   * onionskins in various combinations of the queues. */
-
-  /* How long would it take to process all the TAP cells in the queue? */
-  tap_usec  = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
-
-  /* How long would it take to process all the NSpider cells in the queue? */
-  nspider_usec = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
-
-  /* How long would it take to process the tap cells that we expect to
-   * process while draining the nspider queue? */
-  tap_during_nspider_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-        ol_entries[ONION_HANDSHAKE_TYPE_NTOR] / num_nspiders_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
-
-  /* How long would it take to process the nspider cells that we expect to
-   * process while draining the tap queue? */
-  nspider_during_tap_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-        ol_entries[ONION_HANDSHAKE_TYPE_TAP] * num_nspiders_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+  if (type != ONION_HANDSHAKE_TYPE_TAP && type != ONION_HANDSHAKE_TYPE_NTOR)
+    return 1;
 
-  /* See whether that exceeds MaxOnionQueueDelay. If so, we can't queue
-   * this. */
-  if (type == ONION_HANDSHAKE_TYPE_NTOR &&
-      (nspider_usec + tap_during_nspider_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
-    return 0;
-
-  if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      (tap_usec + nspider_during_tap_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
+  /* See whether the time to clear the queue exceeds MaxOnionQueueDelay. If
+   * so, we can't queue this. */
+  drain_usec = onion_queue_drain_usec(type, &own_usec);
+  if (drain_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay)
     return 0;
 
   /* If we support the nspider handshake, then don't let TAP handshakes use
    * more than 2/3 of the space on the queue. */
   if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
+      own_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
     return 0;
 
   return 1;
 }
 
+/** Return true iff OnionQueueDeadline is set, and we don't expect to finish
+ * an onionskin of type <b>type</b> within it, if it has already waited
+ * <b>waited_usec</b> and has another <b>ahead_usec</b> of work ahead of it.
+ *
+ * (We don't count the onionskins that the cpuworkers already have: there
+ * are never more than a few milliseconds' worth of them per thread.) */
+static int
+onionskin_misses_deadline(uint16_t type, int64_t waited_usec,
+                          uint64_t ahead_usec)
+{
+  const int deadline_msec = get_options()->OnionQueueDeadline;
+  uint64_t finish_usec;
+
+  if (deadline_msec <= 0)
+    return 0;
+  if (waited_usec < 0)
+    waited_usec = 0;
+  finish_usec = (uint64_t)waited_usec + ahead_usec +
+    estimated_usec_for_onionskins(1, type);
+  return finish_usec / 1000 > (uint64_t)deadline_msec;
+}
+
 /** Add <b>circ</b> to the end of ol_list and return 0, except
  * if ol_list is too long, in which case do nothing and return -1.
  */
@@ -199,6 +226,18 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  monotime_coarse_get(&tmp->queued_at);
+
+  if (onionskin->handshake_type != ONION_HANDSHAKE_TYPE_FAST &&
+      onionskin_misses_deadline(onionskin->handshake_type, 0,
+                    onion_queue_drain_usec(onionskin->handshake_type, NULL))) {
+    /* Tell the client now, rather than making it wait for a timeout. */
+    log_info(LD_CIRC, "Too many onionskins queued to answer this one before "
+             "OnionQueueDeadline; rejecting it.");
+    rep_hist_note_circuit_handshake_dropped(onionskin->handshake_type);
+    spider_free(tmp);
+    return -1;
+  }
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -214,6 +253,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       spider_free(m);
     }
+    rep_hist_note_circuit_handshake_dropped(onionskin->handshake_type);
     spider_free(tmp);
     return -1;
   }
@@ -235,6 +275,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
     circ = head->circ;
     circ->onionqueue_entry = NULL;
+    rep_hist_note_circuit_handshake_dropped(head->handshake_type);
     onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
@@ -303,16 +344,42 @@ decide_next_handshake_type(void)
 
 /** Remove the highest priority item from ol_list[] and return it, or
  * return NULL if the lists are empty.
+ *
+ * If OnionQueueDeadline is set, close the circuits of any items that we come
+ * to that we no longer expect to answer in time, and skip them.
  */
 or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint16_t handshake_to_choose;
+  onion_queue_t *head;
+  monotime_coarse_t now;
+
+  monotime_coarse_get(&now);
+  while (1) {
+    handshake_to_choose = decide_next_handshake_type();
+    head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+
+    if (!head)
+      return NULL; /* no onions pending, we're done */
+
+    if (!onionskin_misses_deadline(head->handshake_type,
+                         monotime_coarse_diff_usec(&head->queued_at, &now), 0))
+      break;
 
-  if (!head)
-    return NULL; /* no onions pending, we're done */
+    /* The client will have given up on this one before we can answer it:
+     * don't waste a cpuworker on it. */
+    circ = head->circ;
+    circ->onionqueue_entry = NULL;
+    rep_hist_note_circuit_handshake_dropped(head->handshake_type);
+    onion_queue_entry_remove(head);
+    log_info(LD_CIRC, "Circuit create request waited too long to finish "
+             "before OnionQueueDeadline; canceling due to overload.");
+    if (! TO_CIRCUIT(circ)->marked_for_close) {
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    }
+  }
 
   spider_assert(head->circ);
   spider_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
@@ -74,6 +74,7 @@
 #include "spidergzip.h"
 #include "address.h"
 #include "compat_libevent.h"
+#include "timers.h"
 #include "ht.h"
 #include "replaycache.h"
 #include "crypto_curve25519.h"
@@ -1140,6 +1141,7 @@ typedef struct packed_cell_t {
   /** Next cell queued on this circuit. */
   TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
+  uint16_t pool_idx; /**< Index of this cell within its cell pool slab. */
   uint32_t inserted_time; /**< Time (in milliseconds since epoch, with high
                            * bits truncated) when this cell was inserted. */
 } packed_cell_t;
@@ -1163,6 +1165,8 @@ typedef struct {
 
 typedef struct buf_t buf_t;
 typedef struct socks_request_t socks_request_t;
+typedef struct stream_map_t stream_map_t;
+typedef struct net_param_table_t net_param_table_t;
 
 #define buf_t buf_t
 
@@ -1259,6 +1263,9 @@ typedef struct connection_t {
   unsigned int write_blocked_on_bw:1; /**< Boolean: should we start writing
                              * again once the bandwidth throttler allows
                              * writes? */
+  unsigned int in_bw_wakeup_list:1; /**< Boolean: is this connection in the
+                             * list of connections that are blocked on
+                             * bandwidth? */
   unsigned int hold_open_until_flushed:1; /**< Despite this connection's being
                                       * marked for close, do we flush it
                                       * before closing it? */
@@ -1296,6 +1303,9 @@ typedef struct connection_t {
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** Timer that fires when this connection next needs housekeeping; see
+   * connection_housekeeping_schedule(). */
+  spider_timer_t *housekeeping_timer;
   buf_t *inbuf; /**< Buffer holding data read over this connection. */
   buf_t *outbuf; /**< Buffer holding data to write over this connection. */
   size_t outbuf_flushlen; /**< How much data should we try to flush from the
@@ -1592,6 +1602,10 @@ typedef struct or_connection_t {
                     * add 'bandwidthrate' to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** How many milliseconds' worth of tokens had the global buckets received
+   * when we last refilled read_bucket and write_bucket?  See
+   * connection_buckets_catch_up(). */
+  uint64_t buckets_refilled_at_msec;
 
   /** Last emptied read token bucket in msec since midnight; only used if
    * TB_EMPTY events are enabled. */
@@ -2616,6 +2630,9 @@ typedef struct networkstatus_t {
   /** List of key=value strings for the parameters in this vote or
    * consensus, sorted by key. */
   smartlist_t *net_params;
+  /** The integers in net_params, parsed once for fast lookup; NULL if
+   * networkstatus_parse_net_params() hasn't been called on this document. */
+  net_param_table_t *net_param_table;
 
   /** List of key=value strings for the bw weight parameters in the
    * consensus. */
@@ -3134,6 +3151,8 @@ typedef struct origin_circuit_t {
   /** Linked list of AP streams (or EXIT streams if hidden service)
    * associated with this circuit. */
   edge_connection_t *p_streams;
+  /** Index of p_streams by stream ID. */
+  stream_map_t *p_stream_map;
 
   /** Bytes read from any attached stream since last call to
    * control_event_circ_bandwidth_used().  Only used if we're configured
@@ -3335,6 +3354,12 @@ typedef struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_s *workqueue_entry;
+  /** Cells heading away from the origin that are waiting for, or undergoing,
+   * decryption on a cpuworker, or NULL.  Used only in relaycrypt.c. */
+  struct relay_crypt_pipe_t *n_crypt_pipe;
+  /** Cells heading toward the origin that are waiting for, or undergoing,
+   * encryption on a cpuworker, or NULL.  Used only in relaycrypt.c. */
+  struct relay_crypt_pipe_t *p_crypt_pipe;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -3349,9 +3374,13 @@ typedef struct or_circuit_t {
   circuitmux_t *p_mux;
   /** Linked list of Exit streams associated with this circuit. */
   edge_connection_t *n_streams;
+  /** Index of n_streams by stream ID. */
+  stream_map_t *n_stream_map;
   /** Linked list of Exit streams associated with this circuit that are
    * still being resolved. */
   edge_connection_t *resolving_streams;
+  /** Index of resolving_streams by stream ID. */
+  stream_map_t *resolving_stream_map;
   /** The cipher used by intermediate hops for cells heading toward the
    * OP. */
   crypto_cipher_t *p_crypto;
@@ -3396,6 +3425,10 @@ typedef struct or_circuit_t {
    *  statistics. */
   unsigned int circuit_carries_hs_traffic_stats : 1;
 
+  /** If is_first_hop is set: timer that fires when this circuit might have
+   * been idle for too long.  See circuit_expire_old_circuit_serverside(). */
+  spider_timer_t *idle_expiry_timer;
+
   /** Number of cells that were removed from circuit queue; reset every
    * time when writing buffer stats to disk. */
   uint32_t processed_cells;
@@ -3888,6 +3921,14 @@ typedef struct {
                              * waiting for this many seconds. If zero, use
                              * our default internal timeout schedule. */
   int MaxOnionQueueDelay; /*< DOCDOC */
+  /** If nonzero, give up on any queued onionskin that we don't expect to
+   * finish processing within this many msec of its arrival: by then, the
+   * client will have given up on the circuit anyway. */
+  int OnionQueueDeadline;
+  /** If 1, crypt the relay cells that we pass along in the middle of a
+   * circuit on the cpuworkers.  If 0, crypt them on the main thread.  If -1
+   * (auto), use the cpuworkers if there is more than one of them. */
+  int RelayCryptoOffload;
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
@@ -4093,6 +4134,10 @@ typedef struct {
                  * tunnelled dir conns from clients. If 1, enabled (default);
                  * If 0, disabled. */
 
+  /** How many bytes of compressed descriptor and microdescriptor responses
+   * should we keep around to serve again?  0 means none. */
+  uint64_t DirCompressedCacheSize;
+
   char *VirtualAddrNetworkIPv4; /**< Address and mask to hand out for virtual
                                  * MAPADDRESS requests for IPv4 addresses */
   char *VirtualAddrNetworkIPv6; /**< Address and mask to hand out for virtual
@@ -4538,6 +4583,13 @@ typedef struct {
    * when sending.
    */
   int SchedulerMaxFlushCells__;
+  /** Which scheduler types to use, in order of preference. */
+  smartlist_t *Schedulers;
+  /** How often does the KIST scheduler run, in msec? */
+  int KISTSchedRunInterval;
+  /** How many congestion windows' worth of unsent data does the KIST
+   * scheduler let each socket buffer hold? */
+  double KISTSockBufSizeFactor;
 
   /** Is this an exit node?  This is a tristate, where "1" means "yes, and use
    * the default exit policy if none is given" and "0" means "no; exit policy
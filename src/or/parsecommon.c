@@ -157,16 +157,22 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 {
 /** Largest number of arguments we'll accept to any token, ever. */
 #define MAX_ARGS 512
-  char *mem = memarea_strndup(area, s, eol-s);
+  const char *nul = memchr(s, '\0', eol-s);
+  const size_t len = nul ? (size_t)(nul-s) : (size_t)(eol-s);
+  char *mem = memarea_alloc(area, len+1);
   char *cp = mem;
+  const char *end = mem + len;
   int j = 0;
   char *args[MAX_ARGS];
+  memcpy(mem, s, len);
+  mem[len] = '\0';
   while (*cp) {
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    /* Use the _eos variant: it can scan a word at a time. */
+    cp = (char*)find_whitespace_eos(cp, end);
+    if (!*cp)
       break; /* End of the line. */
     *cp++ = '\0';
     cp = (char*)eat_whitespace(cp);
@@ -258,7 +264,7 @@ get_next_token(memarea_t *area,
 #define MAX_LINE_LENGTH (128*1024)
 
   const char *next, *eol, *obstart;
-  size_t obname_len;
+  size_t obname_len, kwd_len;
   int i;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
@@ -281,7 +287,7 @@ get_next_token(memarea_t *area,
 
   next = find_whitespace_eos(*s, eol);
 
-  if (!strcmp_len(*s, "opt", next-*s)) {
+  if (next-*s == 3 && fast_memeq(*s, "opt", 3)) {
     /* Skip past an "opt" at the start of the line. */
     *s = eat_whitespace_eos_no_nl(next, eol);
     next = find_whitespace_eos(*s, eol);
@@ -290,9 +296,13 @@ get_next_token(memarea_t *area,
   }
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Comparing the precomputed keyword
+   * lengths and the first characters rules out nearly every entry before we
+   * have to compare any strings. */
+  kwd_len = next-*s;
   for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
+    if (table[i].t_len == kwd_len && table[i].t[0] == **s &&
+        fast_memeq(*s, table[i].t, kwd_len)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
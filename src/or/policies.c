@@ -2646,6 +2646,18 @@ policy_summarize(smartlist_t *policy, sa_family_t family)
   return result;
 }
 
+/** Log a protocol warning about the bad policy summary <b>summary</b>,
+ * starting with <b>msg</b>.  We don't use escaped() here: microdescripspiders
+ * can get parsed in worker threads, and escaped() isn't threadsafe. */
+static void
+warn_bad_short_policy(const char *msg, const char *summary)
+{
+  char *esc = esc_for_log(summary);
+  log_fn_(LOG_PROTOCOL_WARN, LD_DIR, "parse_short_policy", "%s %s",
+          msg, esc);
+  spider_free(esc);
+}
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
  * if the string is not well-formed. */
 short_policy_t *
@@ -2681,8 +2693,7 @@ parse_short_policy(const char *summary)
     len = comma ? (size_t)(comma - summary) : strlen(summary);
 
     if (n_entries == MAX_EXITPOLICY_SUMMARY_LEN) {
-      log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Impossibly long policy summary %s",
-             escaped(orig_summary));
+      warn_bad_short_policy("Impossibly long policy summary", orig_summary);
       return NULL;
     }
 
@@ -2702,20 +2713,20 @@ parse_short_policy(const char *summary)
 
     if (spider_sscanf(ent_buf, "%u-%u%c", &low, &high, &dummy) == 2) {
       if (low<1 || low>65535 || high<1 || high>65535 || low>high) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-               "Found bad entry in policy summary %s", escaped(orig_summary));
+        warn_bad_short_policy("Found bad entry in policy summary",
+                              orig_summary);
         return NULL;
       }
     } else if (spider_sscanf(ent_buf, "%u%c", &low, &dummy) == 1) {
       if (low<1 || low>65535) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-               "Found bad entry in policy summary %s", escaped(orig_summary));
+        warn_bad_short_policy("Found bad entry in policy summary",
+                              orig_summary);
         return NULL;
       }
       high = low;
     } else {
-      log_fn(LOG_PROTOCOL_WARN, LD_DIR,"Found bad entry in policy summary %s",
-             escaped(orig_summary));
+      warn_bad_short_policy("Found bad entry in policy summary",
+                            orig_summary);
       return NULL;
     }
 
@@ -2725,8 +2736,8 @@ parse_short_policy(const char *summary)
   }
 
   if (n_entries == 0) {
-    log_fn(LOG_PROTOCOL_WARN, LD_DIR,
-           "Found no port-range entries in summary %s", escaped(orig_summary));
+    warn_bad_short_policy("Found no port-range entries in summary",
+                          orig_summary);
     return NULL;
   }
 
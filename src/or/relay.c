@@ -58,6 +58,7 @@
 #include "connection.h"
 #include "connection_edge.h"
 #include "connection_or.h"
+#include "consdiffmgr.h"
 #include "control.h"
 #include "geoip.h"
 #include "hs_cache.h"
@@ -68,12 +69,14 @@
 #include "policies.h"
 #include "reasons.h"
 #include "relay.h"
+#include "relaycrypt.h"
 #include "rendcache.h"
 #include "rendcommon.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
 #include "scheduler.h"
+#include "streammap.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -82,6 +85,18 @@ static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
 static int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
                                               edge_connection_t *conn,
                                               crypt_path_t *layer_hint);
+static int relay_handle_crypted_cell(cell_t *cell, circuit_t *circ,
+                                     cell_direction_t cell_direction,
+                                     crypt_path_t *layer_hint,
+                                     char recognized);
+static int relay_crypt_payload(circuit_t *circ, uint8_t *payload,
+                               cell_direction_t cell_direction,
+                               crypt_path_t **layer_hint, char *recognized);
+static void packed_cell_set_circid(packed_cell_t *cell, circid_t circ_id,
+                                   int wide_circ_ids_in,
+                                   int wide_circ_ids_out);
+static inline packed_cell_t *packed_cell_copy(const cell_t *cell,
+                                              int wide_circ_ids);
 static void circuit_consider_sending_sendme(circuit_t *circ,
                                             crypt_path_t *layer_hint);
 static void circuit_resume_edge_reading(circuit_t *circ,
@@ -139,12 +154,12 @@ relay_set_digest(crypto_digest_t *digest, cell_t *cell)
 
 /** Does the digest for this circuit indicate that this cell is for us?
  *
- * Update digest from the payload of cell (with the integrity part set
- * to 0). If the integrity part is valid, return 1, else resspidere digest
- * and cell to their original state and return 0.
+ * Update digest from the relay cell <b>payload</b> (with the integrity part
+ * set to 0). If the integrity part is valid, return 1, else resspidere digest
+ * and payload to their original state and return 0.
  */
 static int
-relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
+relay_digest_matches(crypto_digest_t *digest, uint8_t *payload)
 {
   uint32_t received_integrity, calculated_integrity;
   relay_header_t rh;
@@ -152,16 +167,16 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 
   backup_digest = crypto_digest_dup(digest);
 
-  relay_header_unpack(&rh, cell->payload);
+  relay_header_unpack(&rh, payload);
   memcpy(&received_integrity, rh.integrity, 4);
   memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
+  relay_header_pack(payload, &rh);
 
 //  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
 //    received_integrity[0], received_integrity[1],
 //    received_integrity[2], received_integrity[3]);
 
-  crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_add_bytes(digest, (char*) payload, CELL_PAYLOAD_SIZE);
   crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
 
   if (calculated_integrity != received_integrity) {
@@ -171,7 +186,7 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
     crypto_digest_assign(digest, backup_digest);
     /* resspidere the relay header */
     memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
+    relay_header_pack(payload, &rh);
     crypto_digest_free(backup_digest);
     return 0;
   }
@@ -196,6 +211,53 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
   return 0;
 }
 
+/** Deliver the already-decrypted relay <b>cell</b>, which was recognized
+ * as being for us at <b>layer_hint</b>, to the right edge connection on
+ * <b>circ</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+static int
+relay_deliver_recognized_cell(cell_t *cell, circuit_t *circ,
+                              cell_direction_t cell_direction,
+                              crypt_path_t *layer_hint)
+{
+  edge_connection_t *conn = NULL;
+  int reason;
+
+  if (circ->purpose == CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
+    pathbias_check_probe_response(circ, cell);
+
+    /* We need to drop this cell no matter what to avoid code that expects
+     * a certain purpose (such as the hidserv code). */
+    return 0;
+  }
+
+  conn = relay_lookup_conn(circ, cell, cell_direction, layer_hint);
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    ++stats_n_relay_cells_delivered;
+    log_debug(LD_OR,"Sending away from origin.");
+    if ((reason=connection_edge_process_relay_cell(cell, circ, conn, NULL))
+        < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "connection_edge_process_relay_cell (away from origin) "
+             "failed.");
+      return reason;
+    }
+  }
+  if (cell_direction == CELL_DIRECTION_IN) {
+    ++stats_n_relay_cells_delivered;
+    log_debug(LD_OR,"Sending to origin.");
+    if ((reason = connection_edge_process_relay_cell(cell, circ, conn,
+                                                     layer_hint)) < 0) {
+      log_warn(LD_OR,
+               "connection_edge_process_relay_cell (at origin) failed.");
+      return reason;
+    }
+  }
+  return 0;
+}
+
 /** Receive a relay cell:
  *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
  *    origin; decrypt if we're headed toward the exit).
@@ -212,10 +274,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   spider_assert(cell);
   spider_assert(circ);
@@ -224,46 +284,42 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (! CIRCUIT_IS_ORIGIN(circ) &&
+      relay_crypt_pipe_is_busy(TO_OR_CIRCUIT(circ), cell_direction)) {
+    /* Earlier cells in this direction are still being crypted on a
+     * cpuworker: this one has to wait its turn behind them. */
+    relay_crypt_pipe_add(TO_OR_CIRCUIT(circ), cell_direction,
+                         packed_cell_copy(cell, 1));
+    return 0;
+  }
+
   if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
   }
 
-  if (recognized) {
-    edge_connection_t *conn = NULL;
-
-    if (circ->purpose == CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
-      pathbias_check_probe_response(circ, cell);
+  return relay_handle_crypted_cell(cell, circ, cell_direction, layer_hint,
+                                   recognized);
+}
 
-      /* We need to drop this cell no matter what to avoid code that expects
-       * a certain purpose (such as the hidserv code). */
-      return 0;
-    }
+/** Handle the relay <b>cell</b> that circuit_receive_relay_cell() has just
+ * crypted for <b>circ</b> in <b>cell_direction</b>.  If it was
+ * <b>recognized</b>, at <b>layer_hint</b>, deliver it; otherwise append it
+ * to the appropriate cell_queue on <b>circ</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+static int
+relay_handle_crypted_cell(cell_t *cell, circuit_t *circ,
+                          cell_direction_t cell_direction,
+                          crypt_path_t *layer_hint, char recognized)
+{
+  channel_t *chan = NULL;
+  int reason;
 
-    conn = relay_lookup_conn(circ, cell, cell_direction, layer_hint);
-    if (cell_direction == CELL_DIRECTION_OUT) {
-      ++stats_n_relay_cells_delivered;
-      log_debug(LD_OR,"Sending away from origin.");
-      if ((reason=connection_edge_process_relay_cell(cell, circ, conn, NULL))
-          < 0) {
-        log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
-               "connection_edge_process_relay_cell (away from origin) "
-               "failed.");
-        return reason;
-      }
-    }
-    if (cell_direction == CELL_DIRECTION_IN) {
-      ++stats_n_relay_cells_delivered;
-      log_debug(LD_OR,"Sending to origin.");
-      if ((reason = connection_edge_process_relay_cell(cell, circ, conn,
-                                                       layer_hint)) < 0) {
-        log_warn(LD_OR,
-                 "connection_edge_process_relay_cell (at origin) failed.");
-        return reason;
-      }
-    }
-    return 0;
-  }
+  if (recognized)
+    return relay_deliver_recognized_cell(cell, circ, cell_direction,
+                                         layer_hint);
 
   /* not recognized. pass it on. */
   if (cell_direction == CELL_DIRECTION_OUT) {
@@ -321,8 +377,119 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   return 0;
 }
 
-/** Do the appropriate en/decryptions for <b>cell</b> arriving on
- * <b>circ</b> in direction <b>cell_direction</b>.
+/** Return true iff a RELAY or RELAY_EARLY cell arriving on <b>circ</b> in
+ * <b>cell_direction</b> could be handed to circuit_receive_relay_packed_cell()
+ * without first being unpacked: that is, if we are a hop in the middle of
+ * <b>circ</b> and there is a channel on the far side to forward it to. */
+int
+circuit_can_receive_relay_packed_cell(const circuit_t *circ,
+                                      cell_direction_t cell_direction)
+{
+  if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
+    return 0;
+  if (cell_direction == CELL_DIRECTION_OUT)
+    return circ->n_chan != NULL;
+  else
+    return CONST_TO_OR_CIRCUIT(circ)->p_chan != NULL;
+}
+
+/** As circuit_receive_relay_cell(), but for a <b>cell</b> that is still
+ * in the network format used on a channel with <b>wide_circ_ids</b>, and
+ * that circuit_can_receive_relay_packed_cell() has approved.
+ *
+ * The payload is crypted in place.  If the cell turns out not to be for
+ * us, it is re-addressed and moved as-is onto the queue for the next hop,
+ * without ever being unpacked; otherwise it is unpacked and delivered as
+ * usual.  Either way, this function takes ownership of <b>cell</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_packed_cell(packed_cell_t *cell, circuit_t *circ,
+                                  cell_direction_t cell_direction,
+                                  int wide_circ_ids)
+{
+  crypt_path_t *layer_hint = NULL;
+  char recognized = 0;
+  uint8_t *payload;
+
+  spider_assert(cell);
+  spider_assert(circ);
+  spider_assert(circuit_can_receive_relay_packed_cell(circ, cell_direction));
+
+  if (relay_crypt_pipe_wants_cell(TO_OR_CIRCUIT(circ), cell_direction)) {
+    /* Hand the crypto to a cpuworker.  Cells in a crypt pipe always use
+     * wide circuit IDs, so that the payload is in the same place in all of
+     * them. */
+    packed_cell_set_circid(cell, 0, wide_circ_ids, 1);
+    relay_crypt_pipe_add(TO_OR_CIRCUIT(circ), cell_direction, cell);
+    return 0;
+  }
+
+  payload = (uint8_t *) cell->body +
+    (get_cell_network_size(wide_circ_ids) - CELL_PAYLOAD_SIZE);
+
+  if (relay_crypt_payload(circ, payload, cell_direction,
+                          &layer_hint, &recognized) < 0) {
+    log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+    packed_cell_free(cell);
+    return -END_CIRC_REASON_INTERNAL;
+  }
+
+  return circuit_relay_crypted_packed_cell(cell, circ, cell_direction,
+                                           wide_circ_ids, recognized);
+}
+
+/** Finish handling the packed relay <b>cell</b>, in the network format used
+ * on a channel with <b>wide_circ_ids</b>, whose payload has already been
+ * crypted for <b>circ</b> in <b>cell_direction</b> at a middle hop.
+ *
+ * If the cell was <b>recognized</b>, or there's no longer a channel to
+ * forward it on, it is unpacked and handled as usual.  Otherwise it is
+ * re-addressed and moved as-is onto the queue for the next hop.  Either
+ * way, this function takes ownership of <b>cell</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_relay_crypted_packed_cell(packed_cell_t *cell, circuit_t *circ,
+                                  cell_direction_t cell_direction,
+                                  int wide_circ_ids, char recognized)
+{
+  channel_t *chan;
+  circid_t circ_id;
+
+  spider_assert(! CIRCUIT_IS_ORIGIN(circ));
+
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    circ_id = circ->n_circ_id;
+    chan = circ->n_chan;
+  } else {
+    circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    chan = TO_OR_CIRCUIT(circ)->p_chan;
+  }
+
+  if (recognized || !chan) {
+    /* Rare at a middle hop: take the ordinary route. */
+    cell_t unpacked;
+    cell_unpack(&unpacked, cell->body, wide_circ_ids);
+    packed_cell_free(cell);
+    return relay_handle_crypted_cell(&unpacked, circ, cell_direction,
+                                     NULL, recognized);
+  }
+
+  packed_cell_set_circid(cell, circ_id, wide_circ_ids, chan->wide_circ_ids);
+
+  log_debug(LD_OR,"Passing on unrecognized packed cell.");
+
+  ++stats_n_relay_cells_relayed;
+
+  append_packed_cell_to_circuit_queue(circ, chan, cell, cell_direction, 0);
+  return 0;
+}
+
+/** Do the appropriate en/decryptions for the relay cell <b>payload</b>
+ * arriving on <b>circ</b> in direction <b>cell_direction</b>.
  *
  * If cell_direction == CELL_DIRECTION_IN:
  *   - If we're at the origin (we're the OP), for hops 1..N,
@@ -338,14 +505,15 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
  * Return -1 to indicate that we should mark the circuit for close,
  * else return 0.
  */
-int
-relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
-            crypt_path_t **layer_hint, char *recognized)
+static int
+relay_crypt_payload(circuit_t *circ, uint8_t *payload,
+                    cell_direction_t cell_direction,
+                    crypt_path_t **layer_hint, char *recognized)
 {
   relay_header_t rh;
 
   spider_assert(circ);
-  spider_assert(cell);
+  spider_assert(payload);
   spider_assert(recognized);
   spider_assert(cell_direction == CELL_DIRECTION_IN ||
              cell_direction == CELL_DIRECTION_OUT);
@@ -363,13 +531,13 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       do { /* Remember: cpath is in forward order, that is, first hop first. */
         spider_assert(thishop);
 
-        if (relay_crypt_one_payload(thishop->b_crypto, cell->payload, 0) < 0)
+        if (relay_crypt_one_payload(thishop->b_crypto, payload, 0) < 0)
           return -1;
 
-        relay_header_unpack(&rh, cell->payload);
+        relay_header_unpack(&rh, payload);
         if (rh.recognized == 0) {
           /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(thishop->b_digest, cell)) {
+          if (relay_digest_matches(thishop->b_digest, payload)) {
             *recognized = 1;
             *layer_hint = thishop;
             return 0;
@@ -382,23 +550,71 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else { /* we're in the middle. Just one crypt. */
-      if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
-                                  cell->payload, 1) < 0)
-        return -1;
+      return relay_crypt_middle_payload(TO_OR_CIRCUIT(circ)->p_crypto, NULL,
+                                        payload, recognized);
 //      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
 //             "the client.");
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* we're in the middle. Just one crypt. */
+    return relay_crypt_middle_payload(TO_OR_CIRCUIT(circ)->n_crypto,
+                                      TO_OR_CIRCUIT(circ)->n_digest,
+                                      payload, recognized);
+  }
+}
 
-    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
-                                cell->payload, 0) < 0)
-      return -1;
+/** Queue the packed relay <b>cell</b>, which we packaged ourselves on
+ * <b>circ</b> from the stream <b>fromstream</b>, towards the origin.  Its
+ * payload has already been crypted, and it's in the network format used
+ * on a channel with <b>wide_circ_ids</b>.  Takes ownership of <b>cell</b>.
+ *
+ * This is the end of circuit_package_relay_cell(), for cells whose crypto
+ * was done by a cpuworker.
+ */
+void
+circuit_queue_packaged_packed_cell(packed_cell_t *cell, circuit_t *circ,
+                                   int wide_circ_ids, streamid_t fromstream)
+{
+  or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+  channel_t *chan = or_circ->p_chan;
+
+  if (!chan) {
+    log_warn(LD_BUG,"packaged relay cell has p_chan==NULL. Dropping.");
+    packed_cell_free(cell);
+    return;
+  }
+
+  packed_cell_set_circid(cell, or_circ->p_circ_id, wide_circ_ids,
+                         chan->wide_circ_ids);
+  append_packed_cell_to_circuit_queue(circ, chan, cell, CELL_DIRECTION_IN,
+                                      fromstream);
+}
+
+/** Do the one crypt that a middle hop does to the relay cell
+ * <b>payload</b>, with <b>cipher</b>.  If <b>digest</b> is set, the cell is
+ * heading away from the origin: check whether it's for us, and if so, set
+ * *<b>recognized</b> to 1.
+ *
+ * This touches nothing but its arguments, so a cpuworker may call it for a
+ * circuit whose cipher and digest it has been lent (see relaycrypt.c).
+ *
+ * Return -1 to indicate that we should mark the circuit for close, else
+ * return 0.
+ */
+int
+relay_crypt_middle_payload(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                           uint8_t *payload, char *recognized)
+{
+  relay_header_t rh;
 
-    relay_header_unpack(&rh, cell->payload);
+  if (relay_crypt_one_payload(cipher, payload, digest == NULL) < 0)
+    return -1;
+
+  if (digest) {
+    relay_header_unpack(&rh, payload);
     if (rh.recognized == 0) {
       /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
+      if (relay_digest_matches(digest, payload)) {
         *recognized = 1;
         return 0;
       }
@@ -407,6 +623,16 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
   return 0;
 }
 
+/** As relay_crypt_payload(), but operate on the payload of <b>cell</b>. */
+int
+relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
+            crypt_path_t **layer_hint, char *recognized)
+{
+  spider_assert(cell);
+  return relay_crypt_payload(circ, cell->payload, cell_direction,
+                             layer_hint, recognized);
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -460,6 +686,14 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     or_circ = TO_OR_CIRCUIT(circ);
     chan = or_circ->p_chan;
     relay_set_digest(or_circ->p_digest, cell);
+    if (relay_crypt_pipe_is_busy(or_circ, CELL_DIRECTION_IN)) {
+      /* p_crypto is lent to a cpuworker: queue this cell behind the ones
+       * it's crypting, so that they all leave in order. */
+      ++stats_n_relay_cells_relayed;
+      relay_crypt_pipe_add_packaged(or_circ, packed_cell_copy(cell, 1),
+                                    on_stream);
+      return 0;
+    }
     if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
       return -1;
   }
@@ -469,6 +703,31 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
   return 0;
 }
 
+/** Return the first stream to check when looking for <b>stream_id</b> on
+ * the stream list <b>list</b>, which is indexed by <b>map</b>.  Set
+ * *<b>only_out</b> to true if that stream is the only candidate, or to false
+ * if the caller needs to walk the rest of the list after it. */
+static edge_connection_t *
+relay_lookup_stream_candidates(edge_connection_t *list,
+                               const stream_map_t *map,
+                               streamid_t stream_id, int *only_out)
+{
+  edge_connection_t *conn = NULL;
+
+  switch (stream_map_lookup(map, stream_id, &conn)) {
+    case 0:
+      *only_out = 1;
+      return NULL;
+    case 1:
+      *only_out = 1;
+      return conn;
+    default:
+      /* More than one stream with this ID: let the list order decide. */
+      *only_out = 0;
+      return list;
+  }
+}
+
 /** If cell's stream_id matches the stream_id of any conn that's
  * attached to circ, return that conn, else return NULL.
  */
@@ -478,6 +737,7 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
 {
   edge_connection_t *tmpconn;
   relay_header_t rh;
+  int only;
 
   relay_header_unpack(&rh, cell->payload);
 
@@ -489,8 +749,11 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
    */
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
-    for (tmpconn = TO_ORIGIN_CIRCUIT(circ)->p_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+    origin_circuit_t *origin_circ = TO_ORIGIN_CIRCUIT(circ);
+    for (tmpconn = relay_lookup_stream_candidates(origin_circ->p_streams,
+                                                  origin_circ->p_stream_map,
+                                                  rh.stream_id, &only);
+         tmpconn; tmpconn = only ? NULL : tmpconn->next_stream) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->base_.marked_for_close &&
           tmpconn->cpath_layer == layer_hint) {
@@ -499,8 +762,11 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
       }
     }
   } else {
-    for (tmpconn = TO_OR_CIRCUIT(circ)->n_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    for (tmpconn = relay_lookup_stream_candidates(or_circ->n_streams,
+                                                  or_circ->n_stream_map,
+                                                  rh.stream_id, &only);
+         tmpconn; tmpconn = only ? NULL : tmpconn->next_stream) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->base_.marked_for_close) {
         log_debug(LD_EXIT,"found conn for stream %d.", rh.stream_id);
@@ -509,8 +775,11 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
           return tmpconn;
       }
     }
-    for (tmpconn = TO_OR_CIRCUIT(circ)->resolving_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+    for (tmpconn = relay_lookup_stream_candidates(
+                                              or_circ->resolving_streams,
+                                              or_circ->resolving_stream_map,
+                                              rh.stream_id, &only);
+         tmpconn; tmpconn = only ? NULL : tmpconn->next_stream) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->base_.marked_for_close) {
         log_debug(LD_EXIT,"found conn for stream %d.", rh.stream_id);
@@ -2306,20 +2575,150 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/*
+ * Cell pool.
+ *
+ * Rather than malloc()ing and free()ing every packed cell, we carve them out
+ * of fixed-size slabs, each with its own stack of free cell indices.  Cells
+ * that are queued together thus tend to sit next to each other in memory,
+ * and a cell that was just freed is the first to be reused while it's still
+ * in cache.  Slabs with some free cells are kept on a list that we allocate
+ * from first; a handful of completely empty slabs are kept around to absorb
+ * bursts, and any others are returned to the allocator.
+ *
+ * All cell queue manipulation happens in the main thread, so the pool's
+ * free lists need no locking, and per-thread free lists would buy nothing.
+ * The cpuworkers that crypt relay cells (see relaycrypt.c) only read and
+ * write the bodies of cells that the main thread allocated, and hand them
+ * back to the main thread to be queued or freed.
+ */
+
+/** How many packed cells do we carve out of each slab in the cell pool? */
+#define CELL_POOL_CELLS_PER_SLAB 64
+/** How many completely unused slabs do we keep around for reuse before
+ * returning their memory to the allocator? */
+#define CELL_POOL_MAX_EMPTY_SLABS 4
+
+/** A slab of packed cells in the cell pool. */
+typedef struct cell_slab_t {
+  /** Links for whichever of the pool's slab lists this slab is on. */
+  TOR_LIST_ENTRY(cell_slab_t) next;
+  /** How many entries of <b>free_idx</b> are in use? */
+  int n_free;
+  /** Stack of the indices of the unused cells in <b>cells</b>. */
+  uint16_t free_idx[CELL_POOL_CELLS_PER_SLAB];
+  /** The cells themselves. */
+  packed_cell_t cells[CELL_POOL_CELLS_PER_SLAB];
+} cell_slab_t;
+
+TOR_LIST_HEAD(cell_slab_list_t, cell_slab_t);
+
+/** Slabs with some cells in use and some free. */
+static struct cell_slab_list_t partial_cell_slabs =
+  TOR_LIST_HEAD_INITIALIZER(partial_cell_slabs);
+/** Slabs with every cell in use. */
+static struct cell_slab_list_t full_cell_slabs =
+  TOR_LIST_HEAD_INITIALIZER(full_cell_slabs);
+/** Slabs with no cells in use. */
+static struct cell_slab_list_t empty_cell_slabs =
+  TOR_LIST_HEAD_INITIALIZER(empty_cell_slabs);
+/** How many slabs do we have allocated in total? */
+static int n_cell_slabs = 0;
+/** How many slabs are on <b>empty_cell_slabs</b>? */
+static int n_empty_cell_slabs = 0;
+
+/** Allocate and return a new slab with all of its cells free. */
+static cell_slab_t *
+cell_slab_new(void)
+{
+  cell_slab_t *slab = spider_malloc(sizeof(cell_slab_t));
+  int i;
+  /* Push the indices in reverse, so we hand out cells in address order. */
+  for (i = 0; i < CELL_POOL_CELLS_PER_SLAB; ++i)
+    slab->free_idx[i] = CELL_POOL_CELLS_PER_SLAB - 1 - i;
+  slab->n_free = CELL_POOL_CELLS_PER_SLAB;
+  ++n_cell_slabs;
+  return slab;
+}
+
+/** Return the slab that <b>cell</b> was carved out of. */
+static inline cell_slab_t *
+cell_slab_of(packed_cell_t *cell)
+{
+  packed_cell_t *first = cell - cell->pool_idx;
+  return (cell_slab_t *) (((char*)first) - offsetof(cell_slab_t, cells));
+}
+
+/** Return every slab that has no cells in use to the allocator. */
+STATIC void
+cell_pool_release_empty_slabs(void)
+{
+  cell_slab_t *slab, *tmp;
+  TOR_LIST_FOREACH_SAFE(slab, &empty_cell_slabs, next, tmp) {
+    TOR_LIST_REMOVE(slab, next);
+    spider_free(slab);
+    --n_cell_slabs;
+  }
+  n_empty_cell_slabs = 0;
+}
+
 /** Release sspiderage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
+  cell_slab_t *slab = cell_slab_of(cell);
+
   --total_cells_allocated;
-  spider_free(cell);
+  spider_assert(slab->n_free < CELL_POOL_CELLS_PER_SLAB);
+  slab->free_idx[slab->n_free++] = cell->pool_idx;
+
+  if (slab->n_free == CELL_POOL_CELLS_PER_SLAB) {
+    /* That was the last cell in use on this slab. */
+    TOR_LIST_REMOVE(slab, next);
+    if (n_empty_cell_slabs < CELL_POOL_MAX_EMPTY_SLABS) {
+      TOR_LIST_INSERT_HEAD(&empty_cell_slabs, slab, next);
+      ++n_empty_cell_slabs;
+    } else {
+      spider_free(slab);
+      --n_cell_slabs;
+    }
+  } else if (slab->n_free == 1) {
+    /* The slab was full; now it has room. */
+    TOR_LIST_REMOVE(slab, next);
+    TOR_LIST_INSERT_HEAD(&partial_cell_slabs, slab, next);
+  }
 }
 
 /** Allocate and return a new packed_cell_t. */
-STATIC packed_cell_t *
+packed_cell_t *
 packed_cell_new(void)
 {
+  cell_slab_t *slab = TOR_LIST_FIRST(&partial_cell_slabs);
+  packed_cell_t *cell;
+  uint16_t idx;
+
+  if (!slab) {
+    slab = TOR_LIST_FIRST(&empty_cell_slabs);
+    if (slab) {
+      TOR_LIST_REMOVE(slab, next);
+      --n_empty_cell_slabs;
+    } else {
+      slab = cell_slab_new();
+    }
+    TOR_LIST_INSERT_HEAD(&partial_cell_slabs, slab, next);
+  }
+
+  idx = slab->free_idx[--slab->n_free];
+  if (slab->n_free == 0) {
+    TOR_LIST_REMOVE(slab, next);
+    TOR_LIST_INSERT_HEAD(&full_cell_slabs, slab, next);
+  }
+
   ++total_cells_allocated;
-  return spider_malloc_zero(sizeof(packed_cell_t));
+  cell = &slab->cells[idx];
+  memset(cell, 0, sizeof(packed_cell_t));
+  cell->pool_idx = idx;
+  return cell;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2348,6 +2747,21 @@ dump_cell_pool_usage(int severity)
   spider_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  spider_log(severity, LD_MM,
+          "Cell pool: %d slabs (%d empty) with room for %d cells; "
+          "%d in use. "U64_FORMAT" bytes allocated.",
+          n_cell_slabs, n_empty_cell_slabs,
+          n_cell_slabs * CELL_POOL_CELLS_PER_SLAB,
+          (int)total_cells_allocated,
+          U64_PRINTF_ARG(cell_pool_get_total_allocation()));
+}
+
+/** Return the number of bytes that the cell pool currently holds from the
+ * allocator, including cells that aren't in use. */
+size_t
+cell_pool_get_total_allocation(void)
+{
+  return n_cell_slabs * sizeof(cell_slab_t);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2409,7 +2823,7 @@ cell_queue_clear(cell_queue_t *queue)
 
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
  * <b>queue</b> is empty. */
-STATIC packed_cell_t *
+packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
   packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
@@ -2451,6 +2865,8 @@ cell_queues_check_size(void)
   alloc += spider_zlib_get_total_allocation();
   const size_t rend_cache_total = rend_cache_get_total_allocation();
   alloc += rend_cache_total;
+  const size_t consdiff_total = consdiffmgr_get_total_allocation();
+  alloc += consdiff_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
@@ -2462,7 +2878,15 @@ cell_queues_check_size(void)
           rend_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
         alloc -= hs_cache_handle_oom(time(NULL), bytes_to_remove);
       }
+      /* Likewise for consensus diffs: without them, clients just get the
+       * full consensus. */
+      if (consdiff_total > get_options()->MaxMemInQueues / 5) {
+        const size_t bytes_to_remove =
+          consdiff_total - (size_t)(get_options()->MaxMemInQueues / 10);
+        alloc -= consdiffmgr_handle_oom(bytes_to_remove);
+      }
       circuits_handle_oom(alloc);
+      cell_pool_release_empty_slabs();
       return 1;
     }
   }
@@ -2597,7 +3021,7 @@ set_streams_blocked_on_circ(circuit_t *circ, channel_t *chan,
 }
 
 /** Extract the command from a packed cell. */
-static uint8_t
+uint8_t
 packed_cell_get_command(const packed_cell_t *cell, int wide_circ_ids)
 {
   if (wide_circ_ids) {
@@ -2618,6 +3042,27 @@ packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids)
   }
 }
 
+/** Set the circuit ID of the packed <b>cell</b> to <b>circ_id</b>.  The cell
+ * is currently packed for a channel with <b>wide_circ_ids_in</b>; repack its
+ * header in place if it's headed for one with different-width circuit IDs. */
+static void
+packed_cell_set_circid(packed_cell_t *cell, circid_t circ_id,
+                       int wide_circ_ids_in, int wide_circ_ids_out)
+{
+  if (wide_circ_ids_in && !wide_circ_ids_out) {
+    memmove(cell->body+2, cell->body+4, CELL_MAX_NETWORK_SIZE-4);
+    memset(cell->body+CELL_MAX_NETWORK_SIZE-2, 0, 2);
+  } else if (!wide_circ_ids_in && wide_circ_ids_out) {
+    memmove(cell->body+4, cell->body+2, CELL_MAX_NETWORK_SIZE-4);
+  }
+
+  if (wide_circ_ids_out) {
+    set_uint32(cell->body, htonl(circ_id));
+  } else {
+    set_uint16(cell->body, htons(circ_id));
+  }
+}
+
 /** Pull as many cells as possible (but no more than <b>max</b>) from the
  * queue of the first active circuit on <b>chan</b>, and write them to
  * <b>chan</b>-&gt;outbuf.  Return the number of cells written.  Advance
@@ -2777,6 +3222,24 @@ void
 append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  if (circ->marked_for_close)
+    return;
+
+  append_packed_cell_to_circuit_queue(circ, chan,
+                                      packed_cell_copy(cell,
+                                                       chan->wide_circ_ids),
+                                      direction, fromstream);
+}
+
+/** Add the already-packed <b>cell</b> to the queue of <b>circ</b> writing to
+ * <b>chan</b> transmitting in <b>direction</b>.  The cell must be packed
+ * for <b>chan</b>'s circuit ID width.  Takes ownership of <b>cell</b>. */
+void
+append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                    packed_cell_t *cell,
+                                    cell_direction_t direction,
+                                    streamid_t fromstream)
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
@@ -2786,8 +3249,10 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
 #endif
 
   int exitward;
-  if (circ->marked_for_close)
+  if (circ->marked_for_close) {
+    packed_cell_free(cell);
     return;
+  }
 
   exitward = (direction == CELL_DIRECTION_OUT);
   if (exitward) {
@@ -2860,6 +3325,7 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                         circ->n_chan->global_identifier :
                         orcirc->p_chan->global_identifier));
           circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+          packed_cell_free(cell);
           return;
         } else if ((unsigned)queue->n + 1 == orcirc->max_middle_cells) {
           /* Only use ==, not >= for this test so we don't spam the log */
@@ -2881,8 +3347,8 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   }
 #endif
 
-  cell_queue_append_packed_copy(circ, queue, exitward, cell,
-                                chan->wide_circ_ids, 1);
+  cell->inserted_time = (uint32_t) monotime_coarse_absolute_msec();
+  cell_queue_append(queue, cell);
 
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
     /* We ran the OOM handler */
@@ -17,6 +17,17 @@ extern uint64_t stats_n_relay_cells_delivered;
 
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_can_receive_relay_packed_cell(const circuit_t *circ,
+                                          cell_direction_t cell_direction);
+int circuit_receive_relay_packed_cell(packed_cell_t *cell, circuit_t *circ,
+                                      cell_direction_t cell_direction,
+                                      int wide_circ_ids);
+int circuit_relay_crypted_packed_cell(packed_cell_t *cell, circuit_t *circ,
+                                      cell_direction_t cell_direction,
+                                      int wide_circ_ids, char recognized);
+void circuit_queue_packaged_packed_cell(packed_cell_t *cell,
+                                        circuit_t *circ, int wide_circ_ids,
+                                        streamid_t fromstream);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
 void relay_header_unpack(relay_header_t *dest, const uint8_t *src);
@@ -47,15 +58,18 @@ extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
+size_t cell_pool_get_total_allocation(void);
 
 int have_been_under_memory_pressure(void);
 
 /* For channeltls.c */
+packed_cell_t *packed_cell_new(void);
 void packed_cell_free(packed_cell_t *cell);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -63,6 +77,10 @@ void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
 void append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                         packed_cell_t *cell,
+                                         cell_direction_t direction,
+                                         streamid_t fromstream);
 void channel_unlink_all_circuits(channel_t *chan, smartlist_t *detached_out);
 MOCK_DECL(int, channel_flush_from_first_active_circuit,
           (channel_t *chan, int max));
@@ -82,8 +100,12 @@ void stream_choice_seed_weak_rng(void);
 
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
+int relay_crypt_middle_payload(crypto_cipher_t *cipher,
+                               crypto_digest_t *digest,
+                               uint8_t *payload, char *recognized);
 
 circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
+uint8_t packed_cell_get_command(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
 STATIC int connected_cell_parse(const relay_header_t *rh, const cell_t *cell,
@@ -100,10 +122,9 @@ STATIC int resolved_cell_parse(const cell_t *cell, const relay_header_t *rh,
 STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
-STATIC packed_cell_t *packed_cell_new(void);
-STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC size_t cell_queues_get_total_allocation(void);
 STATIC int cell_queues_check_size(void);
+STATIC void cell_pool_release_empty_slabs(void);
 #endif
 
 #endif
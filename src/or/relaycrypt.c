@@ -0,0 +1,421 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relaycrypt.c
+ *
+ * \brief Crypt the relay cells on a middle-hop circuit on the cpuworkers.
+ *
+ * A middle hop does one AES-CTR pass over every relay cell it forwards, and
+ * for cells heading away from the origin it also checks the running digest
+ * to see whether the cell is for us.  On a busy relay that is most of the
+ * work the main thread does per cell.  When RelayCryptoOffload is on, we
+ * hand that work to the cpuworker threads instead.
+ *
+ * Each direction of an or_circuit_t gets a relay_crypt_pipe_t.  Cells that
+ * arrive for the circuit are appended to the pipe's pending queue; whenever
+ * no batch is in flight, we take up to RELAY_CRYPT_MAX_BATCH of them and lend
+ * the circuit's cipher (and digest) to a cpuworker, which crypts them in
+ * order.  When the batch comes back, the main thread forwards or delivers
+ * each cell exactly as circuit_receive_relay_packed_cell() would have, and
+ * launches the next batch.
+ *
+ * Since there is never more than one batch in flight per pipe, the cells on
+ * a circuit leave in the order they arrived, and the crypto state only ever
+ * has one user at a time: the cpuworker while a batch is in flight, and the
+ * main thread otherwise.  Any cell that would touch that crypto state while
+ * a batch is in flight -- an unpacked cell in circuit_receive_relay_cell(),
+ * or a cell we package ourselves towards the origin -- joins the pipe
+ * instead.  Cells that we package are counted as such when they are
+ * packaged, and keep their stream ID for the circuitmux when they are
+ * queued.
+ *
+ * If the circuit is freed while a batch is in flight, and we can't cancel
+ * it, the batch takes over the cipher and digest and the pipe is orphaned;
+ * the reply then frees them all.
+ **/
+
+#define RELAYCRYPT_PRIVATE
+#include "or.h"
+#include "circuitlist.h"
+#include "config.h"
+#include "cpuworker.h"
+#include "relay.h"
+#include "relaycrypt.h"
+
+/** Offset of the relay payload within a packed cell in a crypt pipe. */
+#define PIPE_PAYLOAD_OFFSET (CELL_MAX_NETWORK_SIZE - CELL_PAYLOAD_SIZE)
+
+static void relay_crypt_pipe_launch(relay_crypt_pipe_t *pipe);
+static void relay_crypt_pipe_clear_pending(relay_crypt_pipe_t *pipe);
+
+/** Return the pipe for <b>direction</b> on <b>circ</b>, or NULL if it
+ * hasn't got one. */
+static inline relay_crypt_pipe_t *
+relay_crypt_pipe_get(const or_circuit_t *circ, cell_direction_t direction)
+{
+  return direction == CELL_DIRECTION_OUT ? circ->n_crypt_pipe
+                                         : circ->p_crypt_pipe;
+}
+
+/** Return true iff our options say that we should crypt relay cells on the
+ * cpuworkers. */
+static int
+relay_crypt_offload_enabled(void)
+{
+  const int n_threads = cpuworker_get_n_threads();
+  switch (get_options()->RelayCryptoOffload) {
+    case 0:
+      return 0;
+    case 1:
+      return n_threads > 0;
+    default:
+      /* With a single cpuworker, it's busy enough with onionskins. */
+      return n_threads > 1;
+  }
+}
+
+/** Return true iff <b>circ</b> has cells in <b>direction</b> waiting for a
+ * cpuworker, or being crypted by one.  While this is true, every cell in
+ * that direction must go through relay_crypt_pipe_add(). */
+int
+relay_crypt_pipe_is_busy(const or_circuit_t *circ,
+                         cell_direction_t direction)
+{
+  const relay_crypt_pipe_t *pipe = relay_crypt_pipe_get(circ, direction);
+  return pipe && (pipe->in_flight || pipe->pending.n > 0);
+}
+
+/** Return true iff we should hand the relay cell that has just arrived on
+ * <b>circ</b> in <b>direction</b> to a cpuworker to crypt, rather than
+ * crypting it ourselves. */
+int
+relay_crypt_pipe_wants_cell(const or_circuit_t *circ,
+                            cell_direction_t direction)
+{
+  channel_t *chan;
+
+  if (relay_crypt_pipe_is_busy(circ, direction))
+    return 1;
+
+  chan = direction == CELL_DIRECTION_OUT ? circ->base_.n_chan : circ->p_chan;
+  if (!chan || circ->base_.marked_for_close)
+    return 0;
+
+  return relay_crypt_offload_enabled();
+}
+
+/** Append <b>cell</b> to the pending queue of the pipe for
+ * <b>direction</b> on <b>circ</b>, creating the pipe if need be, and return
+ * the pipe.  If the circuit is marked for close, free <b>cell</b> and
+ * return NULL instead. */
+static relay_crypt_pipe_t *
+relay_crypt_pipe_append(or_circuit_t *circ, cell_direction_t direction,
+                        packed_cell_t *cell)
+{
+  relay_crypt_pipe_t **pipep = direction == CELL_DIRECTION_OUT ?
+    &circ->n_crypt_pipe : &circ->p_crypt_pipe;
+
+  if (circ->base_.marked_for_close) {
+    /* Its pending cells are already gone; don't start another queue. */
+    packed_cell_free(cell);
+    return NULL;
+  }
+
+  if (! *pipep) {
+    *pipep = spider_malloc_zero(sizeof(relay_crypt_pipe_t));
+    (*pipep)->circ = circ;
+    (*pipep)->direction = direction;
+    cell_queue_init(&(*pipep)->pending);
+  }
+
+  cell_queue_append(&(*pipep)->pending, cell);
+  return *pipep;
+}
+
+/** Append <b>cell</b>, which must be packed with wide circuit IDs, to the
+ * pipe for <b>direction</b> on <b>circ</b>, and send it to a cpuworker if
+ * none is busy with this pipe.  Takes ownership of <b>cell</b>, and drops
+ * it if the circuit is marked for close. */
+void
+relay_crypt_pipe_add(or_circuit_t *circ, cell_direction_t direction,
+                     packed_cell_t *cell)
+{
+  relay_crypt_pipe_t *pipe = relay_crypt_pipe_append(circ, direction, cell);
+  if (pipe && ! pipe->in_flight)
+    relay_crypt_pipe_launch(pipe);
+}
+
+/** As relay_crypt_pipe_add(), for a <b>cell</b> that we have packaged
+ * ourselves on <b>circ</b>, towards the origin, from the stream
+ * <b>fromstream</b>.  The caller has already counted it. */
+void
+relay_crypt_pipe_add_packaged(or_circuit_t *circ, packed_cell_t *cell,
+                              streamid_t fromstream)
+{
+  relay_crypt_pipe_t *pipe;
+  relay_crypt_packaged_t *ent;
+
+  pipe = relay_crypt_pipe_append(circ, CELL_DIRECTION_IN, cell);
+  if (!pipe)
+    return;
+
+  ent = spider_malloc_zero(sizeof(relay_crypt_packaged_t));
+  ent->cell = cell;
+  ent->fromstream = fromstream;
+  if (!pipe->packaged)
+    pipe->packaged = smartlist_new();
+  smartlist_add(pipe->packaged, ent);
+
+  if (! pipe->in_flight)
+    relay_crypt_pipe_launch(pipe);
+}
+
+/** Free every cell in <b>batch</b>, and <b>batch</b> itself. */
+static void
+relay_crypt_batch_free(relay_crypt_batch_t *batch)
+{
+  int i;
+  for (i = 0; i < batch->n_cells; ++i)
+    packed_cell_free(batch->cells[i]);
+  if (batch->owns_crypto) {
+    crypto_cipher_free(batch->cipher);
+    crypto_digest_free(batch->digest);
+  }
+  spider_free(batch);
+}
+
+/** Worker thread function: crypt every cell in the relay_crypt_batch_t
+ * <b>work_</b>, in order. */
+STATIC workqueue_reply_t
+relay_crypt_batch_threadfn(void *state_, void *work_)
+{
+  relay_crypt_batch_t *batch = work_;
+  int i;
+  (void)state_;
+
+  for (i = 0; i < batch->n_cells; ++i) {
+    uint8_t *payload =
+      (uint8_t *)batch->cells[i]->body + PIPE_PAYLOAD_OFFSET;
+    if (relay_crypt_middle_payload(batch->cipher, batch->digest, payload,
+                                   &batch->recognized[i]) < 0) {
+      /* The crypto state is no good past this point. */
+      batch->failed_at = i;
+      break;
+    }
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Handle the cells in <b>batch</b>, which a cpuworker has just crypted,
+ * and free it.  Return the pipe they came from, or NULL if that pipe is
+ * gone. */
+static relay_crypt_pipe_t *
+relay_crypt_batch_finish(relay_crypt_batch_t *batch)
+{
+  relay_crypt_pipe_t *pipe = batch->pipe;
+  or_circuit_t *circ = pipe->circ;
+  int i, reason;
+
+  pipe->in_flight = NULL;
+  pipe->in_flight_entry = NULL;
+
+  if (!circ) {
+    /* The circuit was freed while the batch was out. */
+    spider_assert(batch->owns_crypto);
+    relay_crypt_batch_free(batch);
+    spider_free(pipe);
+    return NULL;
+  }
+
+  for (i = 0; i < batch->n_cells; ++i) {
+    packed_cell_t *cell = batch->cells[i];
+    batch->cells[i] = NULL;
+    if (circ->base_.marked_for_close) {
+      packed_cell_free(cell);
+      continue;
+    }
+    if (i == batch->failed_at) {
+      packed_cell_free(cell);
+      log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+      continue;
+    }
+    if (batch->packaged[i]) {
+      circuit_queue_packaged_packed_cell(cell, TO_CIRCUIT(circ), 1,
+                                         batch->fromstream[i]);
+      continue;
+    }
+    if ((reason = circuit_relay_crypted_packed_cell(cell, TO_CIRCUIT(circ),
+                                                    pipe->direction, 1,
+                                                    batch->recognized[i]))
+        < 0) {
+      log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,
+             "circuit_relay_crypted_packed_cell (%s) failed. Closing.",
+             pipe->direction==CELL_DIRECTION_OUT?"forward":"backward");
+      circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+    }
+  }
+
+  batch->n_cells = 0;
+  relay_crypt_batch_free(batch);
+
+  if (circ->base_.marked_for_close) {
+    relay_crypt_pipe_clear_pending(pipe);
+    return NULL;
+  }
+  return pipe;
+}
+
+/** Main thread reply function: handle the cells in the relay_crypt_batch_t
+ * <b>work_</b>, and start on the next batch from the same pipe. */
+STATIC void
+relay_crypt_batch_replyfn(void *work_)
+{
+  relay_crypt_pipe_t *pipe = relay_crypt_batch_finish(work_);
+  if (pipe)
+    relay_crypt_pipe_launch(pipe);
+}
+
+/** If <b>pipe</b> has cells pending and none in flight, send the next batch
+ * of them to a cpuworker.  If there's no cpuworker to take them, crypt them
+ * here instead. */
+static void
+relay_crypt_pipe_launch(relay_crypt_pipe_t *pipe)
+{
+  while (pipe && !pipe->in_flight && pipe->pending.n > 0) {
+    or_circuit_t *circ = pipe->circ;
+    relay_crypt_batch_t *batch = spider_malloc_zero(sizeof(*batch));
+    workqueue_entry_t *entry;
+
+    batch->pipe = pipe;
+    batch->failed_at = -1;
+    if (pipe->direction == CELL_DIRECTION_OUT) {
+      batch->cipher = circ->n_crypto;
+      batch->digest = circ->n_digest;
+    } else {
+      batch->cipher = circ->p_crypto;
+    }
+    while (batch->n_cells < RELAY_CRYPT_MAX_BATCH && pipe->pending.n > 0) {
+      packed_cell_t *cell = cell_queue_pop(&pipe->pending);
+      if (pipe->packaged && smartlist_len(pipe->packaged) &&
+          ((relay_crypt_packaged_t *)smartlist_get(pipe->packaged, 0))->cell
+            == cell) {
+        relay_crypt_packaged_t *ent = smartlist_get(pipe->packaged, 0);
+        smartlist_del_keeporder(pipe->packaged, 0);
+        batch->packaged[batch->n_cells] = 1;
+        batch->fromstream[batch->n_cells] = ent->fromstream;
+        spider_free(ent);
+      }
+      batch->cells[batch->n_cells++] = cell;
+    }
+
+    pipe->in_flight = batch;
+    entry = cpuworker_queue_work(WQ_PRI_MED, relay_crypt_batch_threadfn,
+                                 relay_crypt_batch_replyfn, batch);
+    if (entry) {
+      pipe->in_flight_entry = entry;
+      return;
+    }
+
+    /* Loop rather than recursing through the reply function. */
+    relay_crypt_batch_threadfn(NULL, batch);
+    pipe = relay_crypt_batch_finish(batch);
+  }
+}
+
+/** Return the number of cells on <b>circ</b> that are waiting for a
+ * cpuworker to crypt them, or being crypted. */
+int
+relay_crypt_pipes_n_pending(const or_circuit_t *circ)
+{
+  int n = 0;
+  cell_direction_t direction;
+  for (direction = CELL_DIRECTION_IN; direction <= CELL_DIRECTION_OUT;
+       ++direction) {
+    const relay_crypt_pipe_t *pipe = relay_crypt_pipe_get(circ, direction);
+    if (!pipe)
+      continue;
+    n += pipe->pending.n;
+    if (pipe->in_flight)
+      n += pipe->in_flight->n_cells;
+  }
+  return n;
+}
+
+/** Free every cell on <b>pipe</b> that is waiting for a cpuworker. */
+static void
+relay_crypt_pipe_clear_pending(relay_crypt_pipe_t *pipe)
+{
+  cell_queue_clear(&pipe->pending);
+  if (pipe->packaged) {
+    SMARTLIST_FOREACH(pipe->packaged, relay_crypt_packaged_t *, ent,
+                      spider_free(ent));
+    smartlist_clear(pipe->packaged);
+  }
+}
+
+/** Free every cell on <b>circ</b> that is waiting for a cpuworker.  Cells
+ * already on a cpuworker are dropped when they come back, once the circuit
+ * is marked. */
+void
+relay_crypt_pipes_clear(or_circuit_t *circ)
+{
+  if (circ->n_crypt_pipe)
+    relay_crypt_pipe_clear_pending(circ->n_crypt_pipe);
+  if (circ->p_crypt_pipe)
+    relay_crypt_pipe_clear_pending(circ->p_crypt_pipe);
+}
+
+/** Release <b>pipe</b>, which belongs to <b>circ</b>.  If a batch from it
+ * is on a cpuworker and can't be cancelled, hand that batch the crypto
+ * state that it's using, and leave the pipe for the reply to free. */
+static void
+relay_crypt_pipe_release(or_circuit_t *circ, relay_crypt_pipe_t *pipe)
+{
+  relay_crypt_batch_t *batch;
+
+  relay_crypt_pipe_clear_pending(pipe);
+  smartlist_free(pipe->packaged);
+  pipe->packaged = NULL;
+
+  if (!pipe->in_flight) {
+    spider_free(pipe);
+    return;
+  }
+
+  batch = workqueue_entry_cancel(pipe->in_flight_entry);
+  if (batch) {
+    /* It never started: the crypto state is still the circuit's. */
+    spider_assert(batch == pipe->in_flight);
+    relay_crypt_batch_free(batch);
+    spider_free(pipe);
+    return;
+  }
+
+  batch = pipe->in_flight;
+  batch->owns_crypto = 1;
+  if (pipe->direction == CELL_DIRECTION_OUT) {
+    circ->n_crypto = NULL;
+    circ->n_digest = NULL;
+  } else {
+    circ->p_crypto = NULL;
+  }
+  pipe->circ = NULL;
+}
+
+/** Release the crypt pipes on <b>circ</b>, which is about to be freed.  Call
+ * this before freeing the circuit's crypto state. */
+void
+relay_crypt_pipes_free(or_circuit_t *circ)
+{
+  if (circ->n_crypt_pipe) {
+    relay_crypt_pipe_release(circ, circ->n_crypt_pipe);
+    circ->n_crypt_pipe = NULL;
+  }
+  if (circ->p_crypt_pipe) {
+    relay_crypt_pipe_release(circ, circ->p_crypt_pipe);
+    circ->p_crypt_pipe = NULL;
+  }
+}
+
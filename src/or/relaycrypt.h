@@ -0,0 +1,93 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relaycrypt.h
+ * \brief Header file for relaycrypt.c.
+ **/
+
+#ifndef TOR_RELAYCRYPT_H
+#define TOR_RELAYCRYPT_H
+
+int relay_crypt_pipe_wants_cell(const or_circuit_t *circ,
+                                cell_direction_t direction);
+int relay_crypt_pipe_is_busy(const or_circuit_t *circ,
+                             cell_direction_t direction);
+void relay_crypt_pipe_add(or_circuit_t *circ, cell_direction_t direction,
+                          packed_cell_t *cell);
+void relay_crypt_pipe_add_packaged(or_circuit_t *circ, packed_cell_t *cell,
+                                   streamid_t fromstream);
+int relay_crypt_pipes_n_pending(const or_circuit_t *circ);
+void relay_crypt_pipes_clear(or_circuit_t *circ);
+void relay_crypt_pipes_free(or_circuit_t *circ);
+
+typedef struct relay_crypt_pipe_t relay_crypt_pipe_t;
+
+#ifdef RELAYCRYPT_PRIVATE
+/** Largest number of cells from one circuit that we hand to a cpuworker at
+ * once. */
+#define RELAY_CRYPT_MAX_BATCH 32
+
+/** A cell in a pipe that we packaged ourselves, rather than relaying it. */
+typedef struct relay_crypt_packaged_t {
+  /** The cell, which is also on the pipe's pending queue. */
+  packed_cell_t *cell;
+  /** The stream it came from, for circuitmux accounting. */
+  streamid_t fromstream;
+} relay_crypt_packaged_t;
+
+/** The cells on one direction of an or_circuit_t that are waiting for a
+ * cpuworker to crypt them, or being crypted. */
+struct relay_crypt_pipe_t {
+  /** The circuit that these cells are on, or NULL if it was freed while a
+   * batch was on a cpuworker. */
+  or_circuit_t *circ;
+  /** Which way these cells are heading. */
+  cell_direction_t direction;
+  /** Cells waiting for the batch in flight to come back. All of them are
+   * packed with wide circuit IDs. */
+  cell_queue_t pending;
+  /** The relay_crypt_packaged_t for each cell on <b>pending</b> that we
+   * packaged ourselves, in the same order, or NULL if there are none. */
+  smartlist_t *packaged;
+  /** The batch that a cpuworker is crypting, or NULL. */
+  struct relay_crypt_batch_t *in_flight;
+  /** The workqueue entry for in_flight. */
+  workqueue_entry_t *in_flight_entry;
+};
+
+/** A batch of cells from one pipe, crypted by a cpuworker in one go. */
+typedef struct relay_crypt_batch_t {
+  /** The pipe that these cells came from. */
+  struct relay_crypt_pipe_t *pipe;
+  /** The cipher to crypt them with: the circuit lends it to the cpuworker
+   * until the batch comes back. */
+  crypto_cipher_t *cipher;
+  /** For cells heading away from the origin, the digest to check them
+   * against; otherwise NULL.  Lent like cipher. */
+  crypto_digest_t *digest;
+  /** True iff the circuit was freed while this batch was on a cpuworker, so
+   * that the batch now owns cipher and digest. */
+  unsigned owns_crypto : 1;
+  /** Index of the cell that we failed to crypt, or -1.  We don't crypt the
+   * cells after it. */
+  int failed_at;
+  /** How many elements of <b>cells</b> are in use? */
+  int n_cells;
+  /** The cells to crypt, in order. */
+  packed_cell_t *cells[RELAY_CRYPT_MAX_BATCH];
+  /** For each cell, true iff it turned out to be for us. */
+  char recognized[RELAY_CRYPT_MAX_BATCH];
+  /** For each cell, true iff we packaged it ourselves. */
+  char packaged[RELAY_CRYPT_MAX_BATCH];
+  /** For each cell that we packaged, the stream it came from. */
+  streamid_t fromstream[RELAY_CRYPT_MAX_BATCH];
+} relay_crypt_batch_t;
+
+STATIC workqueue_reply_t relay_crypt_batch_threadfn(void *state_,
+                                                    void *work_);
+STATIC void relay_crypt_batch_replyfn(void *work_);
+#endif
+
+#endif
+
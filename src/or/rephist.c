@@ -2952,11 +2952,13 @@ rep_hist_conn_stats_write(time_t now)
 }
 
 /** Internal statistics to track how many requests of each type of
- * handshake we've received, and how many we've assigned to cpuworkers.
+ * handshake we've received, how many we've assigned to cpuworkers, and how
+ * many we've dropped because we were overloaded.
  * Useful for seeing trends in cpu load.
  * @{ */
 STATIC int onion_handshakes_requested[MAX_ONION_HANDSHAKE_TYPE+1] = {0};
 STATIC int onion_handshakes_assigned[MAX_ONION_HANDSHAKE_TYPE+1] = {0};
+STATIC int onion_handshakes_dropped[MAX_ONION_HANDSHAKE_TYPE+1] = {0};
 /**@}*/
 
 /** A new onionskin (using the <b>type</b> handshake) has arrived. */
@@ -2976,6 +2978,26 @@ rep_hist_note_circuit_handshake_assigned(uint16_t type)
     onion_handshakes_assigned[type]++;
 }
 
+/** We've given up on an onionskin (using the <b>type</b> handshake) before
+ * sending it to a cpuworker, because we were too busy to answer it in
+ * time. */
+void
+rep_hist_note_circuit_handshake_dropped(uint16_t type)
+{
+  if (type <= MAX_ONION_HANDSHAKE_TYPE)
+    onion_handshakes_dropped[type]++;
+}
+
+/** Return the number of onionskins using the <b>type</b> handshake that we
+ * have dropped since the last time we logged our onionskin statistics. */
+int
+rep_hist_get_circuit_handshake_dropped(uint16_t type)
+{
+  if (type <= MAX_ONION_HANDSHAKE_TYPE)
+    return onion_handshakes_dropped[type];
+  return 0;
+}
+
 /** Log our onionskin statistics since the last time we were called. */
 void
 rep_hist_log_circuit_handshake_stats(time_t now)
@@ -2987,8 +3009,16 @@ rep_hist_log_circuit_handshake_stats(time_t now)
              onion_handshakes_requested[ONION_HANDSHAKE_TYPE_TAP],
              onion_handshakes_assigned[ONION_HANDSHAKE_TYPE_NTOR],
              onion_handshakes_requested[ONION_HANDSHAKE_TYPE_NTOR]);
+  if (onion_handshakes_dropped[ONION_HANDSHAKE_TYPE_TAP] ||
+      onion_handshakes_dropped[ONION_HANDSHAKE_TYPE_NTOR]) {
+    log_notice(LD_HEARTBEAT, "Dropped %d TAP and %d NSpider circuit "
+               "handshakes that we were too busy to answer in time.",
+               onion_handshakes_dropped[ONION_HANDSHAKE_TYPE_TAP],
+               onion_handshakes_dropped[ONION_HANDSHAKE_TYPE_NTOR]);
+  }
   memset(onion_handshakes_assigned, 0, sizeof(onion_handshakes_assigned));
   memset(onion_handshakes_requested, 0, sizeof(onion_handshakes_requested));
+  memset(onion_handshakes_dropped, 0, sizeof(onion_handshakes_dropped));
 }
 
 /* Hidden service statistics section */
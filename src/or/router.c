@@ -106,7 +106,7 @@ static authority_cert_t *legacy_key_certificate = NULL;
 /** Replace the current onion key with <b>k</b>.  Does not affect
  * lastonionkey; to update lastonionkey correctly, call rotate_onion_key().
  */
-static void
+STATIC void
 set_onion_key(crypto_pk_t *k)
 {
   if (onionkey && crypto_pk_eq_keys(onionkey, k)) {
@@ -868,7 +868,7 @@ router_write_fingerprint(int hashed)
   return result;
 }
 
-static int
+STATIC int
 init_keys_common(void)
 {
   if (!key_lock)
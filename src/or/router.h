@@ -160,6 +160,8 @@ smartlist_t *router_get_all_orports(const routerinfo_t *ri);
 /* Used only by router.c and test.c */
 STATIC void get_platform_str(char *platform, size_t len);
 STATIC int router_write_fingerprint(int hashed);
+STATIC void set_onion_key(crypto_pk_t *k);
+STATIC int init_keys_common(void);
 #endif
 
 #endif
@@ -58,6 +58,7 @@
 #include "or.h"
 #include "config.h"
 #include "circuitstats.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "parsecommon.h"
@@ -369,6 +370,16 @@ static int router_get_hashes_impl(const char *s, size_t s_len,
                                   const char *start_str, const char *end_str,
                                   char end_char);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
+static routerinfo_t *router_parse_entry_from_string_impl(const char *s,
+                                    const char *end,
+                                    int cache_copy, int allow_annotations,
+                                    const char *prepend_annotations,
+                                    int *can_dl_again_out,
+                                    ed25519_batch_t *ed_batch);
+static extrainfo_t *extrainfo_parse_entry_from_string_impl(const char *s,
+                            const char *end,
+                            int cache_copy, struct digest_ri_map_t *routermap,
+                            int *can_dl_again_out, ed25519_batch_t *ed_batch);
 
 #define CST_NO_CHECK_OBJTYPE  (1<<0)
 static int check_signature_token(const char *digest,
@@ -1268,6 +1279,74 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** A router descripspider or extra-info document that
+ * router_parse_list_from_string() has parsed, but whose Ed25519 signatures
+ * are still waiting in a batch. */
+typedef struct pending_ed_sigs_t {
+  /** The entry's index in the list of parsed entries. */
+  int dest_idx;
+  /** The index of the entry's first signature in the batch. */
+  int first_sig;
+  /** The number of signatures that the entry added to the batch. */
+  int n_sigs;
+  /** The start of the entry's body, for dump_desc(). */
+  const char *body;
+  /** True iff we know the digest of the entry. */
+  int have_raw_digest;
+  /** The digest of the entry, if we know it. */
+  char raw_digest[DIGEST_LEN];
+} pending_ed_sigs_t;
+
+/** Check all the Ed25519 signatures in <b>ed_batch</b> together.  For every
+ * pending_ed_sigs_t in <b>pending</b> with a bad signature, remove the
+ * corresponding routerinfo_t (or extrainfo_t, if <b>is_extrainfo</b>) from
+ * <b>dest</b>, free it, and add its digest to <b>invalid_digests_out</b>. */
+static void
+reject_entries_with_bad_ed_sigs(smartlist_t *dest, int is_extrainfo,
+                                const ed25519_batch_t *ed_batch,
+                                const smartlist_t *pending,
+                                smartlist_t *invalid_digests_out)
+{
+  const int n_sigs = ed25519_batch_size(ed_batch);
+  int *okay;
+
+  if (n_sigs == 0)
+    return;
+
+  okay = spider_calloc(n_sigs, sizeof(int));
+  if (ed25519_batch_check(ed_batch, okay) == 0)
+    goto done;
+
+  SMARTLIST_FOREACH_BEGIN(pending, const pending_ed_sigs_t *, p) {
+    int i, all_ok = 1;
+    for (i = p->first_sig; i < p->first_sig + p->n_sigs; ++i)
+      all_ok &= okay[i];
+    if (all_ok)
+      continue;
+
+    log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+    dump_desc(p->body, is_extrainfo ? "extra-info descripspider" :
+                                      "router descripspider");
+    if (is_extrainfo)
+      extrainfo_free(smartlist_get(dest, p->dest_idx));
+    else
+      routerinfo_free(smartlist_get(dest, p->dest_idx));
+    /* Leave a hole, so that the other indices stay right. */
+    smartlist_set(dest, p->dest_idx, NULL);
+    if (p->have_raw_digest && invalid_digests_out)
+      smartlist_add(invalid_digests_out,
+                    spider_memdup(p->raw_digest, DIGEST_LEN));
+  } SMARTLIST_FOREACH_END(p);
+
+  SMARTLIST_FOREACH_BEGIN(dest, void *, elt) {
+    if (!elt)
+      SMARTLIST_DEL_CURRENT_KEEPORDER(dest, elt);
+  } SMARTLIST_FOREACH_END(elt);
+
+ done:
+  spider_free(okay);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descripspiders (or extra-info documents if <b>is_extrainfo</b> is set), parses
  * them and sspideres the result in <b>dest</b>.  All routers are marked running
@@ -1281,6 +1360,10 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * Returns 0 on success and -1 on failure.  Adds a digest to
  * <b>invalid_digests_out</b> for every entry that was unparseable or
  * invalid. (This may cause duplicate entries.)
+ *
+ * We check the Ed25519 signatures of all the entries together, in a single
+ * batch, once we've parsed them all: that's much faster than checking them
+ * one descripspider at a time.
  */
 int
 router_parse_list_from_string(const char **s, const char *eos,
@@ -1297,6 +1380,8 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  ed25519_batch_t *ed_batch;
+  smartlist_t *pending;
 
   spider_assert(s);
   spider_assert(*s);
@@ -1308,10 +1393,14 @@ router_parse_list_from_string(const char **s, const char *eos,
 
   spider_assert(eos >= *s);
 
+  ed_batch = ed25519_batch_new();
+  pending = smartlist_new();
+
   while (1) {
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
     int dl_again = 0;
+    int first_sig;
     if (find_start_of_next_router_or_extrainfo(s, eos, &have_extrainfo) < 0)
       break;
 
@@ -1325,23 +1414,26 @@ router_parse_list_from_string(const char **s, const char *eos,
       break;
 
     elt = NULL;
+    first_sig = ed25519_batch_size(ed_batch);
 
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
       have_raw_digest = router_get_extrainfo_hash(*s, end-*s, raw_digest) == 0;
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_from_string_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map, &dl_again);
+                                       rl->identity_map, &dl_again,
+                                       ed_batch);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
+      router = router_parse_entry_from_string_impl(*s, end,
                                               saved_location != SAVED_IN_CACHE,
                                               allow_annotations,
-                                              prepend_annotations, &dl_again);
+                                              prepend_annotations, &dl_again,
+                                              ed_batch);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -1354,6 +1446,8 @@ router_parse_list_from_string(const char **s, const char *eos,
       smartlist_add(invalid_digests_out, spider_memdup(raw_digest, DIGEST_LEN));
     }
     if (!elt) {
+      /* Forget any signatures that it added before we rejected it. */
+      ed25519_batch_truncate(ed_batch, first_sig);
       *s = end;
       continue;
     }
@@ -1362,10 +1456,26 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (ed25519_batch_size(ed_batch) > first_sig) {
+      pending_ed_sigs_t *p = spider_malloc_zero(sizeof(pending_ed_sigs_t));
+      p->dest_idx = smartlist_len(dest);
+      p->first_sig = first_sig;
+      p->n_sigs = ed25519_batch_size(ed_batch) - first_sig;
+      p->body = *s;
+      p->have_raw_digest = have_raw_digest;
+      memcpy(p->raw_digest, raw_digest, DIGEST_LEN);
+      smartlist_add(pending, p);
+    }
     *s = end;
     smartlist_add(dest, elt);
   }
 
+  reject_entries_with_bad_ed_sigs(dest, want_extrainfo, ed_batch, pending,
+                                  invalid_digests_out);
+
+  SMARTLIST_FOREACH(pending, pending_ed_sigs_t *, p, spider_free(p));
+  smartlist_free(pending);
+  ed25519_batch_free(ed_batch);
   return 0;
 }
 
@@ -1457,6 +1567,24 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_from_string_impl(s, end, cache_copy,
+                                             allow_annotations,
+                                             prepend_annotations,
+                                             can_dl_again_out, NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>ed_batch</b> is provided,
+ * don't check the descripspider's Ed25519 signatures: add them to
+ * <b>ed_batch</b> instead, so that the caller can check them later along with
+ * those of other descripspiders.  The caller must not use the result until it
+ * has done so. */
+static routerinfo_t *
+router_parse_entry_from_string_impl(const char *s, const char *end,
+                                    int cache_copy, int allow_annotations,
+                                    const char *prepend_annotations,
+                                    int *can_dl_again_out,
+                                    ed25519_batch_t *ed_batch)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1820,7 +1948,11 @@ router_parse_entry_from_string(const char *s, const char *end,
       check[2].msg = d256;
       check[2].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
+      if (ed_batch) {
+        int i;
+        for (i = 0; i < 3; ++i)
+          ed25519_batch_add(ed_batch, &check[i]);
+      } else if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -2017,6 +2149,19 @@ extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                             int cache_copy, struct digest_ri_map_t *routermap,
                             int *can_dl_again_out)
+{
+  return extrainfo_parse_entry_from_string_impl(s, end, cache_copy,
+                                                routermap, can_dl_again_out,
+                                                NULL);
+}
+
+/** As extrainfo_parse_entry_from_string(), but if <b>ed_batch</b> is
+ * provided, add the extrainfo's Ed25519 signatures to <b>ed_batch</b>
+ * instead of checking them, as in router_parse_entry_from_string_impl(). */
+static extrainfo_t *
+extrainfo_parse_entry_from_string_impl(const char *s, const char *end,
+                            int cache_copy, struct digest_ri_map_t *routermap,
+                            int *can_dl_again_out, ed25519_batch_t *ed_batch)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -2167,7 +2312,10 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       check[1].msg = d256;
       check[1].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
+      if (ed_batch) {
+        ed25519_batch_add(ed_batch, &check[0]);
+        ed25519_batch_add(ed_batch, &check[1]);
+      } else if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -4614,6 +4762,330 @@ find_start_of_next_microdesc(const char *s, const char *eos)
 #undef NEXT_LINE
 }
 
+/** Parse the microdescripspider that runs from <b>s</b> up to <b>eos</b>, where
+ * <b>start</b> is the start of the whole string we're parsing.  Add it to
+ * <b>result</b> if it is well-formed; otherwise, add its digest to
+ * <b>invalid_digests_out</b> if that is provided.  Use <b>area</b> and
+ * <b>tokens</b> for scratch space, and leave them empty.
+ *
+ * This function may run in a worker thread, so it must not touch any global
+ * state; see microdescs_parse_in_pieces(). */
+static void
+microdesc_parse_one(const char *start, const char *s, const char *eos,
+                    int flags, saved_location_t where,
+                    memarea_t *area, smartlist_t *tokens,
+                    smartlist_t *result, smartlist_t *invalid_digests_out)
+{
+  microdesc_t *md = NULL;
+  directory_token_t *tok;
+  const int copy_body = (where != SAVED_IN_CACHE);
+  int okay = 0;
+
+  md = spider_malloc_zero(sizeof(microdesc_t));
+  {
+    const char *cp = spider_memstr(s, eos-s, "onion-key");
+    const int no_onion_key = (cp == NULL);
+    if (no_onion_key) {
+      cp = s; /* So that we have *some* junk to put in the body */
+    }
+
+    md->bodylen = eos - cp;
+    md->saved_location = where;
+    if (copy_body)
+      md->body = spider_memdup_nulterm(cp, md->bodylen);
+    else
+      md->body = (char*)cp;
+    md->off = cp - start;
+    crypto_digest256(md->digest, md->body, md->bodylen, DIGEST_SHA256);
+    if (no_onion_key) {
+      log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Malformed or truncated descripspider");
+      goto next;
+    }
+  }
+
+  if (tokenize_string(area, s, eos, tokens,
+                      microdesc_token_table, flags)) {
+    log_warn(LD_DIR, "Unparseable microdescripspider");
+    goto next;
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, A_LAST_LISTED))) {
+    if (parse_iso_time(tok->args[0], &md->last_listed)) {
+      log_warn(LD_DIR, "Bad last-listed time in microdescripspider");
+      goto next;
+    }
+  }
+
+  tok = find_by_keyword(tokens, K_ONION_KEY);
+  if (!crypto_pk_public_exponent_ok(tok->key)) {
+    log_warn(LD_DIR,
+             "Relay's onion key had invalid exponent.");
+    goto next;
+  }
+  md->onion_pkey = tok->key;
+  tok->key = NULL;
+
+  if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
+    curve25519_public_key_t k;
+    spider_assert(tok->n_args >= 1);
+    if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
+      log_warn(LD_DIR, "Bogus nspider-onion-key in microdesc");
+      goto next;
+    }
+    md->onion_curve25519_pkey =
+      spider_memdup(&k, sizeof(curve25519_public_key_t));
+  }
+
+  smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
+  if (id_lines) {
+    SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
+      spider_assert(t->n_args >= 2);
+      if (!strcmp(t->args[0], "ed25519")) {
+        if (md->ed25519_identity_pkey) {
+          log_warn(LD_DIR, "Extra ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          goto next;
+        }
+        ed25519_public_key_t k;
+        if (ed25519_public_from_base64(&k, t->args[1])<0) {
+          log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          goto next;
+        }
+        md->ed25519_identity_pkey = spider_memdup(&k, sizeof(k));
+      }
+    } SMARTLIST_FOREACH_END(t);
+    smartlist_free(id_lines);
+  }
+
+  {
+    smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
+    if (a_lines) {
+      find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
+      smartlist_free(a_lines);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
+    int i;
+    md->family = smartlist_new();
+    for (i=0;i<tok->n_args;++i) {
+      if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
+        char *esc = esc_for_log(tok->args[i]);
+        log_warn(LD_DIR, "Illegal nickname %s in family line", esc);
+        spider_free(esc);
+        goto next;
+      }
+      smartlist_add_strdup(md->family, tok->args[i]);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_P))) {
+    md->exit_policy = parse_short_policy(tok->args[0]);
+  }
+  if ((tok = find_opt_by_keyword(tokens, K_P6))) {
+    md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
+  }
+
+  smartlist_add(result, md);
+  okay = 1;
+
+  md = NULL;
+ next:
+  if (! okay && invalid_digests_out) {
+    smartlist_add(invalid_digests_out,
+                  spider_memdup(md->digest, DIGEST256_LEN));
+  }
+  microdesc_free(md);
+
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  memarea_clear(area);
+  smartlist_clear(tokens);
+}
+
+/** A run of consecutive microdescripspiders for microdescs_parse_in_pieces()
+ * to parse, possibly in a worker thread. */
+typedef struct microdesc_parse_job_t {
+  /** The start of the whole string we're parsing. */
+  const char *start;
+  /** The boundaries of the microdescripspiders to parse: the i'th one runs
+   * from bounds[i] up to bounds[i+1]. */
+  const char **bounds;
+  /** The number of microdescripspiders to parse. */
+  int n_mds;
+  /** Tokenizer flags, as for microdesc_parse_one(). */
+  int flags;
+  /** Where the string is stored, as for microdesc_parse_one(). */
+  saved_location_t where;
+  /** The microdescripspiders that we parsed successfully, in order. */
+  smartlist_t *result;
+  /** The digests of the ones we couldn't parse, or NULL if nobody wants
+   * them. */
+  smartlist_t *invalid_digests;
+
+  /** Protects <b>done</b>. */
+  spider_mutex_t lock;
+  /** Signalled when a worker thread has finished with this job. */
+  spider_cond_t cond;
+  /** True once a worker thread has finished with this job. */
+  int done;
+} microdesc_parse_job_t;
+
+/** Parse every microdescripspider in <b>job</b>. */
+static void
+microdesc_parse_job_run(microdesc_parse_job_t *job)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  int i;
+
+  for (i = 0; i < job->n_mds; ++i) {
+    microdesc_parse_one(job->start, job->bounds[i], job->bounds[i+1],
+                        job->flags, job->where, area, tokens,
+                        job->result, job->invalid_digests);
+  }
+
+  memarea_drop_all(area);
+  smartlist_free(tokens);
+}
+
+/** Release all storage held in <b>job</b>, except for the microdescripspiders
+ * and digests in its lists. */
+static void
+microdesc_parse_job_free(microdesc_parse_job_t *job)
+{
+  if (!job)
+    return;
+  smartlist_free(job->result);
+  smartlist_free(job->invalid_digests);
+  spider_mutex_uninit(&job->lock);
+  spider_cond_uninit(&job->cond);
+  spider_free(job);
+}
+
+/** Worker thread function: parse the microdescripspiders in a
+ * microdesc_parse_job_t, and tell the main thread that we're done. */
+static workqueue_reply_t
+microdesc_parse_job_threadfn(void *state_, void *arg)
+{
+  microdesc_parse_job_t *job = arg;
+  (void) state_;
+
+  microdesc_parse_job_run(job);
+
+  spider_mutex_acquire(&job->lock);
+  job->done = 1;
+  spider_cond_signal_one(&job->cond);
+  spider_mutex_release(&job->lock);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread reply function for microdesc_parse_job_threadfn().
+ * microdescs_parse_in_pieces() has already taken the results, so all we have
+ * to do is free the job. */
+static void
+microdesc_parse_job_replyfn(void *arg)
+{
+  microdesc_parse_job_free(arg);
+}
+
+/** As microdescs_parse_from_string(), but split the microdescripspiders from
+ * <b>s</b> up to <b>eos</b> into <b>n_pieces</b> runs, and hand all but the
+ * first to the cpuworker threads.  The main thread parses the first run
+ * itself, then collects the others in order, so the result is exactly what
+ * parsing them one by one would give.
+ *
+ * We never wait for a run that no worker has picked up yet: we cancel it and
+ * parse it ourselves instead.  So a busy threadpool can't make us any slower
+ * than parsing serially. */
+STATIC smartlist_t *
+microdescs_parse_in_pieces(const char *start, const char *s, const char *eos,
+                           int flags, saved_location_t where,
+                           smartlist_t *invalid_digests_out, int n_pieces)
+{
+  smartlist_t *bounds = smartlist_new();
+  smartlist_t *result = smartlist_new();
+  microdesc_parse_job_t **jobs;
+  workqueue_entry_t **ents;
+  int n_mds, i;
+
+  /* Finding the boundaries is a cheap scan; doing it up front means that we
+   * split the string exactly where a serial parse would. */
+  while (s < eos) {
+    const char *next = find_start_of_next_microdesc(s, eos);
+    smartlist_add(bounds, (void *) s);
+    s = next ? next : eos;
+  }
+  smartlist_add(bounds, (void *) eos);
+  n_mds = smartlist_len(bounds) - 1;
+
+  if (n_pieces > n_mds)
+    n_pieces = n_mds;
+  if (n_pieces < 1)
+    n_pieces = 1;
+
+  jobs = spider_calloc(n_pieces, sizeof(microdesc_parse_job_t *));
+  ents = spider_calloc(n_pieces, sizeof(workqueue_entry_t *));
+  for (i = 0; i < n_pieces; ++i) {
+    const int first = (int)(((int64_t)n_mds * i) / n_pieces);
+    const int last = (int)(((int64_t)n_mds * (i+1)) / n_pieces);
+    microdesc_parse_job_t *job = spider_malloc_zero(sizeof(*job));
+    job->start = start;
+    job->bounds = ((const char **) bounds->list) + first;
+    job->n_mds = last - first;
+    job->flags = flags;
+    job->where = where;
+    job->result = smartlist_new();
+    if (invalid_digests_out)
+      job->invalid_digests = smartlist_new();
+    spider_mutex_init_for_cond(&job->lock);
+    spider_cond_init(&job->cond);
+    jobs[i] = job;
+    /* We'll be waiting for these, so they're urgent. */
+    if (i > 0)
+      ents[i] = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     microdesc_parse_job_threadfn,
+                                     microdesc_parse_job_replyfn, job);
+  }
+
+  for (i = 0; i < n_pieces; ++i) {
+    microdesc_parse_job_t *job = jobs[i];
+    int ours = 1;
+    if (ents[i] && !workqueue_entry_cancel(ents[i])) {
+      /* A worker has it already; wait for it to finish.  The reply function
+       * will free the job later. */
+      ours = 0;
+      spider_mutex_acquire(&job->lock);
+      while (!job->done)
+        spider_cond_wait(&job->cond, &job->lock, NULL);
+      spider_mutex_release(&job->lock);
+    } else {
+      microdesc_parse_job_run(job);
+    }
+
+    smartlist_add_all(result, job->result);
+    smartlist_clear(job->result);
+    if (invalid_digests_out) {
+      smartlist_add_all(invalid_digests_out, job->invalid_digests);
+      smartlist_clear(job->invalid_digests);
+    }
+    if (ours)
+      microdesc_parse_job_free(job);
+  }
+
+  spider_free(jobs);
+  spider_free(ents);
+  smartlist_free(bounds);
+  return result;
+}
+
+/** Don't parse microdescripspiders in parallel unless we have at least this
+ * many bytes of them. */
+#define MICRODESC_PARALLEL_PARSE_MIN_BYTES (256*1024)
+/** When we parse microdescripspiders in parallel, give each piece at least
+ * this many bytes. */
+#define MICRODESC_PARALLEL_PARSE_MIN_PIECE (64*1024)
+
 /** Parse as many microdescripspiders as are found from the string starting at
  * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
  * annotations we recognize and ignore ones we don't.
@@ -4624,7 +5096,10 @@ find_start_of_next_microdesc(const char *s, const char *eos)
  * Return all newly parsed microdescripspiders in a newly allocated
  * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
  * microdesc digest to it for every microdesc that we found to be badly
- * formed. (This may cause duplicates) */
+ * formed. (This may cause duplicates)
+ *
+ * If there are a lot of microdescripspiders and we have cpuworker threads,
+ * parse them in parallel; see microdescs_parse_in_pieces(). */
 smartlist_t *
 microdescs_parse_from_string(const char *s, const char *eos,
                              int allow_annotations,
@@ -4633,155 +5108,41 @@ microdescs_parse_from_string(const char *s, const char *eos,
 {
   smartlist_t *tokens;
   smartlist_t *result;
-  microdesc_t *md = NULL;
   memarea_t *area;
   const char *start = s;
   const char *start_of_next_microdesc;
   int flags = allow_annotations ? TS_ANNOTATIONS_OK : 0;
-  const int copy_body = (where != SAVED_IN_CACHE);
-
-  directory_token_t *tok;
+  int n_threads;
 
   if (!eos)
     eos = s + strlen(s);
 
   s = eat_whitespace_eos(s, eos);
+
+  n_threads = cpuworker_get_n_threads();
+  if (n_threads > 0 && eos - s >= MICRODESC_PARALLEL_PARSE_MIN_BYTES) {
+    int n_pieces = (int)((eos - s) / MICRODESC_PARALLEL_PARSE_MIN_PIECE);
+    /* The main thread parses one piece too. */
+    if (n_pieces > n_threads + 1)
+      n_pieces = n_threads + 1;
+    return microdescs_parse_in_pieces(start, s, eos, flags, where,
+                                      invalid_digests_out, n_pieces);
+  }
+
   area = memarea_new();
   result = smartlist_new();
   tokens = smartlist_new();
 
   while (s < eos) {
-    int okay = 0;
-
     start_of_next_microdesc = find_start_of_next_microdesc(s, eos);
     if (!start_of_next_microdesc)
       start_of_next_microdesc = eos;
 
-    md = spider_malloc_zero(sizeof(microdesc_t));
-    {
-      const char *cp = spider_memstr(s, start_of_next_microdesc-s,
-                                  "onion-key");
-      const int no_onion_key = (cp == NULL);
-      if (no_onion_key) {
-        cp = s; /* So that we have *some* junk to put in the body */
-      }
-
-      md->bodylen = start_of_next_microdesc - cp;
-      md->saved_location = where;
-      if (copy_body)
-        md->body = spider_memdup_nulterm(cp, md->bodylen);
-      else
-        md->body = (char*)cp;
-      md->off = cp - start;
-      crypto_digest256(md->digest, md->body, md->bodylen, DIGEST_SHA256);
-      if (no_onion_key) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Malformed or truncated descripspider");
-        goto next;
-      }
-    }
-
-    if (tokenize_string(area, s, start_of_next_microdesc, tokens,
-                        microdesc_token_table, flags)) {
-      log_warn(LD_DIR, "Unparseable microdescripspider");
-      goto next;
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, A_LAST_LISTED))) {
-      if (parse_iso_time(tok->args[0], &md->last_listed)) {
-        log_warn(LD_DIR, "Bad last-listed time in microdescripspider");
-        goto next;
-      }
-    }
-
-    tok = find_by_keyword(tokens, K_ONION_KEY);
-    if (!crypto_pk_public_exponent_ok(tok->key)) {
-      log_warn(LD_DIR,
-               "Relay's onion key had invalid exponent.");
-      goto next;
-    }
-    md->onion_pkey = tok->key;
-    tok->key = NULL;
-
-    if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
-      curve25519_public_key_t k;
-      spider_assert(tok->n_args >= 1);
-      if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
-        log_warn(LD_DIR, "Bogus nspider-onion-key in microdesc");
-        goto next;
-      }
-      md->onion_curve25519_pkey =
-        spider_memdup(&k, sizeof(curve25519_public_key_t));
-    }
-
-    smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
-    if (id_lines) {
-      SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
-        spider_assert(t->n_args >= 2);
-        if (!strcmp(t->args[0], "ed25519")) {
-          if (md->ed25519_identity_pkey) {
-            log_warn(LD_DIR, "Extra ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          ed25519_public_key_t k;
-          if (ed25519_public_from_base64(&k, t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          md->ed25519_identity_pkey = spider_memdup(&k, sizeof(k));
-        }
-      } SMARTLIST_FOREACH_END(t);
-      smartlist_free(id_lines);
-    }
-
-    {
-      smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
-      if (a_lines) {
-        find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
-        smartlist_free(a_lines);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
-      int i;
-      md->family = smartlist_new();
-      for (i=0;i<tok->n_args;++i) {
-        if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
-          log_warn(LD_DIR, "Illegal nickname %s in family line",
-                   escaped(tok->args[i]));
-          goto next;
-        }
-        smartlist_add_strdup(md->family, tok->args[i]);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_P))) {
-      md->exit_policy = parse_short_policy(tok->args[0]);
-    }
-    if ((tok = find_opt_by_keyword(tokens, K_P6))) {
-      md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
-    }
-
-    smartlist_add(result, md);
-    okay = 1;
-
-    md = NULL;
-  next:
-    if (! okay && invalid_digests_out) {
-      smartlist_add(invalid_digests_out,
-                    spider_memdup(md->digest, DIGEST256_LEN));
-    }
-    microdesc_free(md);
-    md = NULL;
-
-    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-    memarea_clear(area);
-    smartlist_clear(tokens);
+    microdesc_parse_one(start, s, start_of_next_microdesc, flags, where,
+                        area, tokens, result, invalid_digests_out);
     s = start_of_next_microdesc;
   }
 
-  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   memarea_drop_all(area);
   smartlist_free(tokens);
 
@@ -122,6 +122,11 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+STATIC smartlist_t *microdescs_parse_in_pieces(const char *start,
+                                        const char *s, const char *eos,
+                                        int flags, saved_location_t where,
+                                        smartlist_t *invalid_digests_out,
+                                        int n_pieces);
 MOCK_DECL(STATIC void,dump_desc,(const char *desc, const char *type));
 MOCK_DECL(STATIC int, router_compute_hash_final,(char *digest,
                            const char *start, size_t len,
@@ -12,6 +12,16 @@
 
 #include <event2/event.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#if defined(TCP_INFO) && defined(SIOCOUTQNSD)
+/** Defined if we can ask the kernel what the KIST scheduler needs to know */
+#define HAVE_KIST_SUPPORT 1
+#endif
+#endif
+
 /*
  * Scheduler high/low watermarks
  */
@@ -27,6 +37,26 @@ static uint32_t sched_q_high_water = 32768;
 
 static uint32_t sched_max_flush_cells = 16;
 
+/*
+ * Which scheduling algorithm are we using?
+ */
+
+static scheduler_type_t scheduler_type = SCHEDULER_VANILLA;
+
+/*
+ * KIST parameters: how often to run, in msec, and how much more than the
+ * congestion window we let sit in each socket's send buffer.
+ */
+
+static int kist_run_interval_msec = 10;
+static double kist_sock_buf_size_factor = 1.0;
+
+/*
+ * Rough number of bytes of TLS framing that go with each cell we write.
+ */
+
+#define KIST_TLS_PER_CELL_OVERHEAD 29
+
 /**
  * \file scheduler.c
  * \brief Channel scheduling system: decides which channels should send and
@@ -130,6 +160,23 @@ static uint32_t sched_max_flush_cells = 16;
  * other states.  The scheduler_run() function gives us the opportunity to do
  * scheduling work, and is called from other scheduler functions whenever a
  * state transition occurs, and periodically from the main event loop.
+ *
+ * How much the scheduler writes to a pending channel depends on its type.
+ * The vanilla scheduler fills each channel's output buffer as far as it
+ * will go, stopping only when the global queue heuristic passes the high
+ * watermark.  That hands the kernel far more than the link can send soon,
+ * and once cells are in a socket buffer, circuit priority no longer matters.
+ *
+ * The KIST ("Kernel-Informed Socket Transport") scheduler instead runs at
+ * most once every KISTSchedRunInterval, and before writing to a channel,
+ * asks the kernel about its TCP socket: the congestion window, how many
+ * packets are unacknowledged, and how many bytes are sitting unsent in the
+ * send buffer.  From those it works out how many bytes the socket could
+ * send before the next run, writes at most that many, one cell at a time
+ * in priority order across all channels, and then pushes what it wrote to
+ * the kernel.  A channel that hits its limit waits in kist_channels_blocked
+ * for the next tick.  Where the kernel can't tell us these things, KIST
+ * falls back to limiting each channel by its output buffer alone.
  */
 
 /* Scheduler global data structures */
@@ -163,12 +210,28 @@ STATIC uint64_t queue_heuristic = 0;
 
 STATIC time_t queue_heuristic_timestamp = 0;
 
+/*
+ * Channels that the KIST scheduler stopped writing to because the kernel
+ * wouldn't take any more this tick; they become pending again next tick.
+ */
+
+STATIC smartlist_t *kist_channels_blocked = NULL;
+
+/*
+ * The number of the current KIST scheduler tick, and when it started.
+ */
+
+static uint64_t kist_tick = 0;
+static monotime_t kist_last_run;
+
 /* Scheduler static function declarations */
 
 static void scheduler_evt_callback(evutil_socket_t fd,
                                    short events, void *arg);
 static int scheduler_more_work(void);
 static void scheduler_retrigger(void);
+static void scheduler_run_vanilla(void);
+static void scheduler_run_kist(void);
 #if 0
 static void scheduler_trigger(void);
 #endif
@@ -194,6 +257,11 @@ scheduler_free_all(void)
     smartlist_free(channels_pending);
     channels_pending = NULL;
   }
+
+  if (kist_channels_blocked) {
+    smartlist_free(kist_channels_blocked);
+    kist_channels_blocked = NULL;
+  }
 }
 
 /**
@@ -365,8 +433,10 @@ scheduler_init(void)
                                0, scheduler_evt_callback, NULL);
 
   channels_pending = smartlist_new();
+  kist_channels_blocked = smartlist_new();
   queue_heuristic = 0;
   queue_heuristic_timestamp = approx_time();
+  monotime_get(&kist_last_run);
 }
 
 /** Check if there's more scheduling work */
@@ -376,6 +446,11 @@ scheduler_more_work(void)
 {
   spider_assert(channels_pending);
 
+  if (scheduler_type == SCHEDULER_KIST) {
+    return (smartlist_len(channels_pending) > 0 ||
+            smartlist_len(kist_channels_blocked) > 0) ? 1 : 0;
+  }
+
   return ((scheduler_get_queue_heuristic() < sched_q_low_water) &&
           ((smartlist_len(channels_pending) > 0))) ? 1 : 0;
 }
@@ -386,7 +461,27 @@ static void
 scheduler_retrigger(void)
 {
   spider_assert(run_sched_ev);
-  event_active(run_sched_ev, EV_TIMEOUT, 1);
+
+  if (scheduler_type == SCHEDULER_KIST) {
+    /* Run at the start of the next tick, unless we're already set to. */
+    monotime_t now;
+    int64_t wait_msec;
+    struct timeval tv;
+
+    if (event_pending(run_sched_ev, EV_TIMEOUT, NULL))
+      return;
+
+    monotime_get(&now);
+    wait_msec = kist_run_interval_msec -
+      monotime_diff_msec(&kist_last_run, &now);
+    if (wait_msec < 0)
+      wait_msec = 0;
+    tv.tv_sec = (time_t)(wait_msec / 1000);
+    tv.tv_usec = (int)((wait_msec % 1000) * 1000);
+    event_add(run_sched_ev, &tv);
+  } else {
+    event_active(run_sched_ev, EV_TIMEOUT, 1);
+  }
 }
 
 /** Notify the scheduler of a channel being closed */
@@ -403,6 +498,8 @@ scheduler_release_channel,(channel_t *chan))
                             STRUCT_OFFSET(channel_t, sched_heap_idx),
                             chan);
   }
+  if (kist_channels_blocked)
+    smartlist_remove(kist_channels_blocked, chan);
 
   chan->scheduler_state = SCHED_CHAN_IDLE;
 }
@@ -411,6 +508,18 @@ scheduler_release_channel,(channel_t *chan))
 
 MOCK_IMPL(void,
 scheduler_run, (void))
+{
+  if (scheduler_type == SCHEDULER_KIST)
+    scheduler_run_kist();
+  else
+    scheduler_run_vanilla();
+}
+
+/** Run the vanilla scheduling algorithm: fill output buffers in priority
+ * order while the queue heuristic is below the high watermark. */
+
+static void
+scheduler_run_vanilla(void)
 {
   int n_cells, n_chans_before, n_chans_after;
   uint64_t q_len_before, q_heur_before, q_len_after, q_heur_after;
@@ -550,6 +659,176 @@ scheduler_run, (void))
   }
 }
 
+/** Return the number of bytes that a socket described by <b>info</b> can
+ * take from us before we next run, if we let it keep
+ * <b>sock_buf_size_factor</b> congestion windows' worth of unsent data in
+ * its send buffer. */
+
+STATIC int64_t
+kist_compute_limit(const kist_socket_info_t *info,
+                   double sock_buf_size_factor)
+{
+  int64_t tcp_space, extra_space;
+
+  /* What the congestion window lets the kernel send right away... */
+  tcp_space = ((int64_t)info->cwnd - info->unacked) * info->mss;
+  if (tcp_space < 0)
+    tcp_space = 0;
+
+  /* ...plus enough to keep the send buffer from running dry meanwhile. */
+  extra_space = (int64_t)(info->cwnd * (double)info->mss *
+                          sock_buf_size_factor) - info->notsent;
+  if (extra_space < 0)
+    extra_space = 0;
+
+  return tcp_space + extra_space;
+}
+
+/** Ask the kernel about the TCP socket that <b>chan</b> writes to, and
+ * fill in <b>info_out</b>.  Return 0 on success, or -1 if we can't. */
+
+MOCK_IMPL(STATIC int,
+kist_get_socket_info, (channel_t *chan, kist_socket_info_t *info_out))
+{
+#ifdef HAVE_KIST_SUPPORT
+  struct tcp_info tcp;
+  socklen_t tcp_len = sizeof(tcp);
+  int notsent = 0;
+  spider_socket_t sock = channel_get_socket(chan);
+
+  if (!SOCKET_OK(sock))
+    return -1;
+  memset(&tcp, 0, sizeof(tcp));
+  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&tcp, &tcp_len) < 0 ||
+      ioctl(sock, SIOCOUTQNSD, &notsent) < 0)
+    return -1;
+
+  info_out->cwnd = tcp.tcpi_snd_cwnd;
+  info_out->unacked = tcp.tcpi_unacked;
+  info_out->mss = tcp.tcpi_snd_mss;
+  info_out->notsent = notsent > 0 ? (uint32_t)notsent : 0;
+  return 0;
+#else
+  (void)chan;
+  (void)info_out;
+  return -1;
+#endif
+}
+
+/** Start a new KIST tick for <b>chan</b>: find out how much its socket can
+ * take, and count anything still in its output buffer against that. */
+
+static void
+kist_refresh_channel(channel_t *chan)
+{
+  kist_socket_info_t info;
+
+  chan->sched_kist.tick = kist_tick;
+  if (kist_get_socket_info(chan, &info) < 0) {
+    /* We can't ask the kernel, so let the output buffer limit us. */
+    chan->sched_kist.limit = INT64_MAX;
+  } else {
+    chan->sched_kist.limit =
+      kist_compute_limit(&info, kist_sock_buf_size_factor);
+  }
+  chan->sched_kist.written =
+    chan->num_bytes_queued ? (int64_t)chan->num_bytes_queued(chan) : 0;
+}
+
+/** Run the KIST scheduling algorithm: write one cell at a time to the
+ * highest-priority pending channel, until every channel has run out of
+ * cells or of room in its socket for this tick, then hand what we wrote to
+ * the kernel. */
+
+static void
+scheduler_run_kist(void)
+{
+  smartlist_t *to_flush = smartlist_new();
+  channel_t *chan;
+  int n_chans_before = smartlist_len(channels_pending);
+  int n_cells = 0;
+
+  monotime_get(&kist_last_run);
+  ++kist_tick;
+
+  /* Channels that were out of room last tick get another chance. */
+  SMARTLIST_FOREACH_BEGIN(kist_channels_blocked, channel_t *, blocked) {
+    if (blocked->scheduler_state == SCHED_CHAN_WAITING_TO_WRITE) {
+      blocked->scheduler_state = SCHED_CHAN_PENDING;
+      smartlist_pqueue_add(channels_pending,
+                           scheduler_compare_channels,
+                           STRUCT_OFFSET(channel_t, sched_heap_idx),
+                           blocked);
+    }
+  } SMARTLIST_FOREACH_END(blocked);
+  smartlist_clear(kist_channels_blocked);
+
+  while (smartlist_len(channels_pending) > 0) {
+    size_t cell_size;
+    ssize_t flushed;
+
+    chan = smartlist_pqueue_pop(channels_pending,
+                                scheduler_compare_channels,
+                                STRUCT_OFFSET(channel_t, sched_heap_idx));
+    spider_assert(chan);
+
+    if (chan->sched_kist.tick != kist_tick)
+      kist_refresh_channel(chan);
+    cell_size = get_cell_network_size(chan->wide_circ_ids) +
+      KIST_TLS_PER_CELL_OVERHEAD;
+
+    if (channel_num_cells_writeable(chan) <= 0) {
+      /* The output buffer is full; we'll hear when it drains. */
+      chan->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
+      continue;
+    }
+    if (chan->sched_kist.written + (int64_t)cell_size >
+        chan->sched_kist.limit) {
+      /* The kernel has all it can send for now; wait for the next tick. */
+      chan->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
+      smartlist_add(kist_channels_blocked, chan);
+      log_debug(LD_SCHED,
+                "Channel " U64_FORMAT " at %p reached its KIST limit of "
+                I64_FORMAT " bytes",
+                U64_PRINTF_ARG(chan->global_identifier), chan,
+                I64_PRINTF_ARG(chan->sched_kist.limit));
+      continue;
+    }
+
+    flushed = channel_flush_some_cells(chan, 1);
+    if (flushed > 0) {
+      n_cells += (int)flushed;
+      chan->sched_kist.written += flushed * (int64_t)cell_size;
+      if (chan->sched_kist.last_write_tick != kist_tick) {
+        chan->sched_kist.last_write_tick = kist_tick;
+        smartlist_add(to_flush, chan);
+      }
+    }
+
+    if (flushed > 0 && channel_more_to_flush(chan)) {
+      /* Back in line, behind anything of higher priority. */
+      smartlist_pqueue_add(channels_pending,
+                           scheduler_compare_channels,
+                           STRUCT_OFFSET(channel_t, sched_heap_idx),
+                           chan);
+    } else {
+      chan->scheduler_state = SCHED_CHAN_WAITING_FOR_CELLS;
+    }
+  }
+
+  /* Don't let what we wrote sit in output buffers until the next time
+   * their sockets are writeable: the kernel said it could send it now. */
+  SMARTLIST_FOREACH(to_flush, channel_t *, flush_chan,
+                    channel_flush_to_kernel(flush_chan));
+
+  log_debug(LD_SCHED,
+            "KIST scheduler wrote %d cells to %d channels from %d pending; "
+            "%d channels are waiting for the next tick",
+            n_cells, smartlist_len(to_flush), n_chans_before,
+            smartlist_len(kist_channels_blocked));
+  smartlist_free(to_flush);
+}
+
 /** Trigger the scheduling event so we run the scheduler later */
 
 #if 0
@@ -736,3 +1015,99 @@ scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush)
   sched_max_flush_cells = max_flush;
 }
 
+/** Return true iff we can ask the kernel what the KIST scheduler needs to
+ * know on this platform. */
+
+int
+scheduler_can_use_kist(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/** Return the type of scheduler we're using. */
+
+scheduler_type_t
+scheduler_get_type(void)
+{
+  return scheduler_type;
+}
+
+/**
+ * Switch to the scheduler type <b>type</b>; for KIST, run every
+ * <b>run_interval_msec</b> and use <b>sock_buf_size_factor</b>.
+ */
+
+STATIC void
+scheduler_set_type(scheduler_type_t type, int run_interval_msec,
+                   double sock_buf_size_factor)
+{
+  spider_assert(run_interval_msec > 0);
+  spider_assert(sock_buf_size_factor >= 0);
+
+  kist_run_interval_msec = run_interval_msec;
+  kist_sock_buf_size_factor = sock_buf_size_factor;
+
+  if (type == scheduler_type)
+    return;
+
+  log_info(LD_SCHED, "Switching to the %s scheduler.",
+           type == SCHEDULER_KIST ? "KIST" : "vanilla");
+  scheduler_type = type;
+
+  if (type == SCHEDULER_VANILLA && kist_channels_blocked) {
+    /* The vanilla scheduler doesn't wait for ticks. */
+    SMARTLIST_FOREACH_BEGIN(kist_channels_blocked, channel_t *, chan) {
+      if (chan->scheduler_state == SCHED_CHAN_WAITING_TO_WRITE) {
+        chan->scheduler_state = SCHED_CHAN_PENDING;
+        smartlist_pqueue_add(channels_pending,
+                             scheduler_compare_channels,
+                             STRUCT_OFFSET(channel_t, sched_heap_idx),
+                             chan);
+      }
+    } SMARTLIST_FOREACH_END(chan);
+    smartlist_clear(kist_channels_blocked);
+  }
+
+  if (run_sched_ev) {
+    event_del(run_sched_ev);
+    if (scheduler_more_work())
+      scheduler_retrigger();
+  }
+}
+
+/**
+ * Pick the first scheduler type listed in the Schedulers option that we
+ * can use here, and set its parameters from <b>options</b>.
+ */
+
+void
+scheduler_conf_changed(const or_options_t *options)
+{
+  scheduler_type_t type = SCHEDULER_VANILLA;
+
+  if (options->Schedulers) {
+    SMARTLIST_FOREACH_BEGIN(options->Schedulers, const char *, name) {
+      if (!strcasecmp(name, "KIST")) {
+        if (scheduler_can_use_kist()) {
+          type = SCHEDULER_KIST;
+          break;
+        }
+        log_info(LD_SCHED, "The KIST scheduler isn't supported on this "
+                 "platform; trying the next one.");
+      } else if (!strcasecmp(name, "Vanilla")) {
+        type = SCHEDULER_VANILLA;
+        break;
+      }
+    } SMARTLIST_FOREACH_END(name);
+  }
+
+  scheduler_set_type(type,
+                     options->KISTSchedRunInterval > 0 ?
+                       options->KISTSchedRunInterval : 10,
+                     options->KISTSockBufSizeFactor >= 0 ?
+                       options->KISTSockBufSizeFactor : 1.0);
+}
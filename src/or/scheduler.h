@@ -13,6 +13,17 @@
 #include "channel.h"
 #include "testsupport.h"
 
+/** Which algorithm does the scheduler use to decide how much to write to
+ * each channel, and when? */
+typedef enum {
+  /** Whenever a channel can take cells, write as many as its output buffer
+   * will hold, in priority order, subject to the global watermarks. */
+  SCHEDULER_VANILLA = 1,
+  /** Kernel-informed socket transport: run at most once per tick, and
+   * write to each channel only as much as its TCP socket can send soon. */
+  SCHEDULER_KIST = 2,
+} scheduler_type_t;
+
 /* Global-visibility scheduler functions */
 
 /* Set up and shut down the scheduler from main.c */
@@ -37,6 +48,11 @@ void scheduler_touch_channel(channel_t *chan);
 /* Adjust the watermarks from config file*/
 void scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush);
 
+/* Pick a scheduler type and its parameters from the config file */
+void scheduler_conf_changed(const or_options_t *options);
+int scheduler_can_use_kist(void);
+scheduler_type_t scheduler_get_type(void);
+
 /* Things only scheduler.c and its test suite should see */
 
 #ifdef SCHEDULER_PRIVATE_
@@ -45,11 +61,31 @@ MOCK_DECL(STATIC int, scheduler_compare_channels,
 STATIC uint64_t scheduler_get_queue_heuristic(void);
 STATIC void scheduler_update_queue_heuristic(time_t now);
 
+/** What the kernel tells us about a channel's TCP socket. */
+typedef struct kist_socket_info_t {
+  /** Congestion window, in packets. */
+  uint32_t cwnd;
+  /** Packets sent but not yet acknowledged. */
+  uint32_t unacked;
+  /** Maximum segment size, in bytes. */
+  uint32_t mss;
+  /** Bytes in the socket's send buffer that haven't been sent yet. */
+  uint32_t notsent;
+} kist_socket_info_t;
+
+MOCK_DECL(STATIC int, kist_get_socket_info,
+          (channel_t *chan, kist_socket_info_t *info_out));
+STATIC int64_t kist_compute_limit(const kist_socket_info_t *info,
+                                  double sock_buf_size_factor);
+STATIC void scheduler_set_type(scheduler_type_t type, int run_interval_msec,
+                               double sock_buf_size_factor);
+
 #ifdef TOR_UNIT_TESTS
 extern smartlist_t *channels_pending;
 extern struct event *run_sched_ev;
 extern uint64_t queue_heuristic;
 extern time_t queue_heuristic_timestamp;
+extern smartlist_t *kist_channels_blocked;
 #endif
 #endif
 
@@ -0,0 +1,308 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file spoolcache.c
+ *
+ * \brief Remember compressed bundles of descriptors and microdescriptors
+ * that we've recently served, so that we don't compress them again.
+ *
+ * Clients tend to ask a directory cache for the same sets of
+ * microdescriptors and descriptors: everybody who fetched the same
+ * consensus wants the same new objects.  Without this cache, we run every
+ * such response through zlib again for every client that asks.
+ *
+ * So when dirserv.c spools a compressed response made of several small
+ * objects, it computes a key from the digests of the objects' contents (see
+ * dirserv_spool_use_compressed_cache()), and looks for a cached_dir_t
+ * holding that same response, already compressed.  If there isn't one, it
+ * compresses this response as it goes, the usual way, and hands a copy of
+ * the uncompressed response to spoolcache_build(), which compresses it on
+ * a cpuworker and adds the result here for the next client.
+ *
+ * Since each key depends on the contents of the objects, an entry never
+ * goes stale: at worst, nobody asks for it again.  We keep the entries in
+ * least-recently-used order, and drop the oldest ones once their total
+ * compressed size exceeds DirCompressedCacheSize.
+ **/
+
+#define SPOOLCACHE_PRIVATE
+#include "or.h"
+#include "config.h"
+#include "control.h"
+#include "cpuworker.h"
+#include "dirserv.h"
+#include "spoolcache.h"
+#include "workqueue.h"
+
+/** An entry in the compressed bundle cache. */
+typedef struct spoolcache_entry_t {
+  /** Key for this entry; see dirserv_spool_use_compressed_cache(). */
+  uint8_t key[DIGEST256_LEN];
+  /** The compressed bundle.  We hold a reference to it. */
+  cached_dir_t *dir;
+  /** Links in spoolcache_lru, least recently used first. */
+  TOR_TAILQ_ENTRY(spoolcache_entry_t) lru_link;
+} spoolcache_entry_t;
+
+/** Map from key to spoolcache_entry_t. */
+static digest256map_t *spoolcache_map = NULL;
+/** All the entries in spoolcache_map, least recently used first. */
+static TOR_TAILQ_HEAD(spoolcache_lru_s, spoolcache_entry_t) spoolcache_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(spoolcache_lru);
+/** Total compressed size of all the bundles in the cache. */
+static size_t spoolcache_total_bytes = 0;
+
+/** A request for a cpuworker to compress a bundle for the cache. */
+typedef struct spoolcache_job_t {
+  /** The key to cache the bundle under. */
+  uint8_t key[DIGEST256_LEN];
+  /** How hard to compress it. */
+  zlib_compression_level_t level;
+  /** The uncompressed bundle, and its length. */
+  char *body;
+  size_t body_len;
+  /** Output: the compressed bundle, and its length, or NULL on failure. */
+  char *body_z;
+  size_t body_z_len;
+} spoolcache_job_t;
+
+/** Map from key to the spoolcache_job_t that is compressing a bundle for
+ * that key. */
+static digest256map_t *spoolcache_pending = NULL;
+/** Number of entries in spoolcache_pending. */
+static int spoolcache_n_pending = 0;
+
+/** Number of lookups that found a bundle. */
+static uint64_t spoolcache_n_hits = 0;
+/** Number of lookups that didn't. */
+static uint64_t spoolcache_n_misses = 0;
+/** Total number of bytes that we didn't have to compress, thanks to a hit. */
+static uint64_t spoolcache_bytes_saved = 0;
+
+/** Remove <b>ent</b> from the cache, and free it. */
+static void
+spoolcache_entry_remove(spoolcache_entry_t *ent)
+{
+  digest256map_remove(spoolcache_map, ent->key);
+  TOR_TAILQ_REMOVE(&spoolcache_lru, ent, lru_link);
+  spider_assert(spoolcache_total_bytes >= ent->dir->dir_z_len);
+  spoolcache_total_bytes -= ent->dir->dir_z_len;
+  cached_dir_decref(ent->dir);
+  spider_free(ent);
+}
+
+/** Drop least recently used entries until the cache holds no more than
+ * <b>max_bytes</b> of compressed data. */
+STATIC void
+spoolcache_shrink_to(size_t max_bytes)
+{
+  while (spoolcache_total_bytes > max_bytes) {
+    spoolcache_entry_t *ent = TOR_TAILQ_FIRST(&spoolcache_lru);
+    if (BUG(!ent))
+      break;
+    spoolcache_entry_remove(ent);
+  }
+}
+
+/** Return the largest compressed bundle that we'll cache: we don't want one
+ * big response to push out everything else. */
+size_t
+spoolcache_max_entry_size(void)
+{
+  return (size_t)(get_options()->DirCompressedCacheSize / 4);
+}
+
+/** Return the compressed bundle with key <b>key</b>, if we have one, and
+ * count a hit or a miss.  The caller must increment the reference count of
+ * the result if it keeps it. */
+cached_dir_t *
+spoolcache_lookup(const uint8_t *key)
+{
+  spoolcache_entry_t *ent = NULL;
+  if (spoolcache_map)
+    ent = digest256map_get(spoolcache_map, key);
+  if (!ent) {
+    ++spoolcache_n_misses;
+    return NULL;
+  }
+  ++spoolcache_n_hits;
+  spoolcache_bytes_saved += ent->dir->dir_len;
+  TOR_TAILQ_REMOVE(&spoolcache_lru, ent, lru_link);
+  TOR_TAILQ_INSERT_TAIL(&spoolcache_lru, ent, lru_link);
+  return ent->dir;
+}
+
+/** Remember <b>d</b>, whose dir_z field holds a compressed bundle of
+ * dir_len bytes of uncompressed data, under the key <b>key</b>.  Take a
+ * reference to <b>d</b> if we keep it. */
+void
+spoolcache_add(const uint8_t *key, cached_dir_t *d)
+{
+  const size_t max_bytes = (size_t)get_options()->DirCompressedCacheSize;
+  spoolcache_entry_t *ent;
+
+  spider_assert(d);
+  if (d->dir_z_len > spoolcache_max_entry_size())
+    return;
+
+  if (!spoolcache_map)
+    spoolcache_map = digest256map_new();
+  if ((ent = digest256map_get(spoolcache_map, key)))
+    spoolcache_entry_remove(ent);
+
+  spoolcache_shrink_to(max_bytes - d->dir_z_len);
+
+  ent = spider_malloc_zero(sizeof(spoolcache_entry_t));
+  memcpy(ent->key, key, DIGEST256_LEN);
+  ent->dir = d;
+  ++d->refcnt;
+  digest256map_set(spoolcache_map, key, ent);
+  TOR_TAILQ_INSERT_TAIL(&spoolcache_lru, ent, lru_link);
+  spoolcache_total_bytes += d->dir_z_len;
+}
+
+/** Return true iff it is worth calling spoolcache_build() for <b>key</b>:
+ * that is, iff no cpuworker is already compressing a bundle for it, and not
+ * too many are compressing others. */
+int
+spoolcache_can_build(const uint8_t *key)
+{
+  if (spoolcache_n_pending >= SPOOLCACHE_MAX_PENDING)
+    return 0;
+  return !spoolcache_pending || !digest256map_get(spoolcache_pending, key);
+}
+
+/** Worker function: compress the bundle in <b>job_</b>.  Runs in a
+ * cpuworker thread. */
+static workqueue_reply_t
+spoolcache_job_threadfn(void *state_, void *job_)
+{
+  spoolcache_job_t *job = job_;
+  (void)state_;
+
+  if (spider_gzip_compress_level(&job->body_z, &job->body_z_len,
+                                 job->body, job->body_len, ZLIB_METHOD,
+                                 job->level) < 0) {
+    job->body_z = NULL;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: cache the bundle that <b>job_</b> compressed.  Runs in
+ * the main thread. */
+static void
+spoolcache_job_replyfn(void *job_)
+{
+  spoolcache_job_t *job = job_;
+
+  if (spoolcache_pending &&
+      digest256map_get(spoolcache_pending, job->key) == job) {
+    digest256map_remove(spoolcache_pending, job->key);
+    --spoolcache_n_pending;
+  }
+  if (job->body_z) {
+    cached_dir_t *d = spider_malloc_zero(sizeof(cached_dir_t));
+    d->refcnt = 1;
+    d->dir_len = job->body_len;
+    d->dir_z = job->body_z;
+    d->dir_z_len = job->body_z_len;
+    job->body_z = NULL;
+    spoolcache_add(job->key, d);
+    cached_dir_decref(d);
+  }
+  spider_free(job->body);
+  spider_free(job->body_z);
+  spider_free(job);
+}
+
+/** Take ownership of <b>body</b>, the <b>body_len</b>-byte uncompressed
+ * bundle for <b>key</b>, and have a cpuworker compress it with
+ * <b>level</b> and add the result to the cache.  If there are no
+ * cpuworkers, just free <b>body</b>: the cache isn't worth compressing in
+ * the main thread for. */
+void
+spoolcache_build(const uint8_t *key, char *body, size_t body_len,
+                 zlib_compression_level_t level)
+{
+  spoolcache_job_t *job;
+
+  if (!spoolcache_can_build(key)) {
+    spider_free(body);
+    return;
+  }
+
+  job = spider_malloc_zero(sizeof(spoolcache_job_t));
+  memcpy(job->key, key, DIGEST256_LEN);
+  job->level = level;
+  job->body = body;
+  job->body_len = body_len;
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW, spoolcache_job_threadfn,
+                            spoolcache_job_replyfn, job)) {
+    spider_free(job->body);
+    spider_free(job);
+    return;
+  }
+  if (!spoolcache_pending)
+    spoolcache_pending = digest256map_new();
+  digest256map_set(spoolcache_pending, key, job);
+  ++spoolcache_n_pending;
+}
+
+/** Called when options have changed: if DirCompressedCacheSize went down,
+ * drop bundles until we're within the new limit. */
+void
+spoolcache_conf_changed(const or_options_t *options)
+{
+  spoolcache_shrink_to((size_t)options->DirCompressedCacheSize);
+}
+
+/** Return the total compressed size of the bundles that we're keeping. */
+size_t
+spoolcache_get_total_bytes(void)
+{
+  return spoolcache_total_bytes;
+}
+
+/** Implementation helper for GETINFO: answers queries about the compressed
+ * bundle cache. */
+int
+getinfo_helper_spoolcache(control_connection_t *control_conn,
+                          const char *question, char **answer,
+                          const char **errmsg)
+{
+  uint64_t val;
+  (void) control_conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "dir/compressed-cache/hits")) {
+    val = spoolcache_n_hits;
+  } else if (!strcmp(question, "dir/compressed-cache/misses")) {
+    val = spoolcache_n_misses;
+  } else if (!strcmp(question, "dir/compressed-cache/bytes-saved")) {
+    val = spoolcache_bytes_saved;
+  } else if (!strcmp(question, "dir/compressed-cache/bytes")) {
+    val = spoolcache_total_bytes;
+  } else {
+    return 0;
+  }
+  spider_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(val));
+  return 0;
+}
+
+/** Release all storage held by the compressed bundle cache, and reset its
+ * statistics. */
+void
+spoolcache_free_all(void)
+{
+  spoolcache_shrink_to(0);
+  digest256map_free(spoolcache_map, NULL);
+  spoolcache_map = NULL;
+  /* Any jobs still on the cpuworkers free themselves when they come back. */
+  digest256map_free(spoolcache_pending, NULL);
+  spoolcache_pending = NULL;
+  spoolcache_n_pending = 0;
+  spoolcache_n_hits = spoolcache_n_misses = spoolcache_bytes_saved = 0;
+}
+
@@ -0,0 +1,38 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file spoolcache.h
+ * \brief Header file for spoolcache.c.
+ **/
+
+#ifndef TOR_SPOOLCACHE_H
+#define TOR_SPOOLCACHE_H
+
+#include "testsupport.h"
+
+/** Largest uncompressed response that we'll compress for the cache. */
+#define SPOOLCACHE_MAX_BUNDLE_LEN (4*1024*1024)
+/** Largest number of bundles that we'll have the cpuworkers compressing at
+ * once. */
+#define SPOOLCACHE_MAX_PENDING 8
+
+cached_dir_t *spoolcache_lookup(const uint8_t *key);
+void spoolcache_add(const uint8_t *key, cached_dir_t *d);
+int spoolcache_can_build(const uint8_t *key);
+void spoolcache_build(const uint8_t *key, char *body, size_t body_len,
+                      zlib_compression_level_t level);
+void spoolcache_conf_changed(const or_options_t *options);
+size_t spoolcache_max_entry_size(void);
+size_t spoolcache_get_total_bytes(void);
+int getinfo_helper_spoolcache(control_connection_t *control_conn,
+                              const char *question, char **answer,
+                              const char **errmsg);
+void spoolcache_free_all(void);
+
+#ifdef SPOOLCACHE_PRIVATE
+STATIC void spoolcache_shrink_to(size_t max_bytes);
+#endif
+
+#endif
+
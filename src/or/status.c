@@ -17,6 +17,7 @@
 #include "or.h"
 #include "circuituse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "status.h"
 #include "nodelist.h"
 #include "relay.h"
@@ -147,6 +148,8 @@ log_heartbeat(time_t now)
     rep_hist_log_link_protocol_counts();
   }
 
+  cpuworker_log_queue_wait_stats(LOG_NOTICE);
+
   circuit_log_ancient_one_hop_circuits(1800);
 
   if (options->BridgeRelay) {
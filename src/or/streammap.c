@@ -0,0 +1,180 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file streammap.c
+ *
+ * \brief Index the streams on a circuit by stream ID.
+ *
+ * Every relay cell that carries a stream ID has to be matched with one of
+ * the streams on its circuit (see relay_lookup_conn()).  Walking the
+ * circuit's linked lists of streams for that is fine for a handful of
+ * streams, but exits and clients may multiplex hundreds of them on one
+ * circuit.  So alongside each of those lists (p_streams, n_streams and
+ * resolving_streams), we keep a stream_map_t: a small open-addressed hash
+ * table from stream ID to the edge connections on the list.
+ *
+ * A map is keyed on each connection's stream_id at the time it is added, so
+ * callers must remove a connection before changing its stream ID, and add
+ * it again afterwards.  Connections with a stream ID of zero aren't indexed,
+ * since no cell can refer to them.
+ *
+ * A well-behaved peer never puts two streams with the same ID on one list,
+ * but nothing stops a misbehaving one from doing so.  We keep duplicates in
+ * the map, and stream_map_lookup() tells its caller when there is more than
+ * one match, so that it can fall back to the order of the linked list.
+ **/
+
+#define STREAMMAP_PRIVATE
+#include "or.h"
+#include "streammap.h"
+
+/** Marker for a slot whose entry has been removed. */
+#define STREAM_MAP_TOMBSTONE ((edge_connection_t *)(uintptr_t)1)
+
+/** Capacity of a newly allocated map. */
+#define STREAM_MAP_MIN_CAPACITY 8
+
+/** Return the first slot to probe for <b>stream_id</b> in <b>map</b>. */
+static inline unsigned
+stream_map_hash(const stream_map_t *map, streamid_t stream_id)
+{
+  /* Stream IDs are mostly sequential; a multiplicative hash spreads them. */
+  return (((uint32_t)stream_id * 2654435761u) >> 16) & (map->capacity - 1);
+}
+
+/** Insert <b>conn</b> into <b>map</b>, which must have a free slot. */
+static void
+stream_map_insert(stream_map_t *map, edge_connection_t *conn)
+{
+  const unsigned mask = map->capacity - 1;
+  unsigned i = stream_map_hash(map, conn->stream_id);
+
+  while (map->slots[i] && map->slots[i] != STREAM_MAP_TOMBSTONE)
+    i = (i + 1) & mask;
+
+  if (map->slots[i] == STREAM_MAP_TOMBSTONE)
+    --map->n_tombstones;
+  map->slots[i] = conn;
+  ++map->n_entries;
+}
+
+/** Rebuild <b>map</b> with room for <b>capacity</b> slots, dropping any
+ * tombstones. */
+static void
+stream_map_resize(stream_map_t *map, unsigned capacity)
+{
+  edge_connection_t **old_slots = map->slots;
+  const unsigned old_capacity = map->capacity;
+  unsigned i;
+
+  map->slots = spider_calloc(capacity, sizeof(edge_connection_t *));
+  map->capacity = capacity;
+  map->n_entries = 0;
+  map->n_tombstones = 0;
+
+  for (i = 0; i < old_capacity; ++i) {
+    if (old_slots[i] && old_slots[i] != STREAM_MAP_TOMBSTONE)
+      stream_map_insert(map, old_slots[i]);
+  }
+  spider_free(old_slots);
+}
+
+/** Add <b>conn</b> to the map in *<b>mapp</b>, keyed on its current stream
+ * ID, allocating the map if there isn't one yet. */
+void
+stream_map_add(stream_map_t **mapp, edge_connection_t *conn)
+{
+  stream_map_t *map;
+
+  spider_assert(mapp);
+  spider_assert(conn);
+
+  if (conn->stream_id == 0)
+    return;
+
+  if (!*mapp) {
+    map = *mapp = spider_malloc_zero(sizeof(stream_map_t));
+    map->capacity = STREAM_MAP_MIN_CAPACITY;
+    map->slots = spider_calloc(map->capacity, sizeof(edge_connection_t *));
+  }
+  map = *mapp;
+
+  /* Keep the table at most 3/4 full, counting tombstones. */
+  if ((map->n_entries + map->n_tombstones + 1) * 4 > map->capacity * 3) {
+    unsigned capacity = map->capacity;
+    while ((map->n_entries + 1) * 2 > capacity)
+      capacity *= 2;
+    stream_map_resize(map, capacity);
+  }
+
+  stream_map_insert(map, conn);
+}
+
+/** Remove <b>conn</b> from <b>map</b>, if it is there.  <b>conn</b> must
+ * have the stream ID that it had when it was added. */
+void
+stream_map_remove(stream_map_t *map, edge_connection_t *conn)
+{
+  unsigned i, mask;
+
+  spider_assert(conn);
+
+  if (!map || conn->stream_id == 0)
+    return;
+
+  mask = map->capacity - 1;
+  for (i = stream_map_hash(map, conn->stream_id); map->slots[i];
+       i = (i + 1) & mask) {
+    if (map->slots[i] == conn) {
+      map->slots[i] = STREAM_MAP_TOMBSTONE;
+      --map->n_entries;
+      ++map->n_tombstones;
+      return;
+    }
+  }
+}
+
+/** Look up the connections with <b>stream_id</b> in <b>map</b>.  Return 0
+ * if there are none.  If there is exactly one, set *<b>conn_out</b> to it
+ * (if <b>conn_out</b> is provided) and return 1.  If there are several,
+ * return 2; the caller needs to consult the stream list to choose. */
+int
+stream_map_lookup(const stream_map_t *map, streamid_t stream_id,
+                  edge_connection_t **conn_out)
+{
+  edge_connection_t *found = NULL;
+  unsigned i, mask;
+
+  if (!map || stream_id == 0)
+    return 0;
+
+  mask = map->capacity - 1;
+  for (i = stream_map_hash(map, stream_id); map->slots[i];
+       i = (i + 1) & mask) {
+    edge_connection_t *conn = map->slots[i];
+    if (conn == STREAM_MAP_TOMBSTONE || conn->stream_id != stream_id)
+      continue;
+    if (found)
+      return 2;
+    found = conn;
+  }
+
+  if (!found)
+    return 0;
+  if (conn_out)
+    *conn_out = found;
+  return 1;
+}
+
+/** Release all storage held by <b>map</b>.  The connections in it are not
+ * affected. */
+void
+stream_map_free(stream_map_t *map)
+{
+  if (!map)
+    return;
+  spider_free(map->slots);
+  spider_free(map);
+}
+
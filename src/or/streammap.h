@@ -0,0 +1,35 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file streammap.h
+ * \brief Header file for streammap.c.
+ **/
+
+#ifndef TOR_STREAMMAP_H
+#define TOR_STREAMMAP_H
+
+void stream_map_add(stream_map_t **mapp, edge_connection_t *conn);
+void stream_map_remove(stream_map_t *map, edge_connection_t *conn);
+int stream_map_lookup(const stream_map_t *map, streamid_t stream_id,
+                      edge_connection_t **conn_out);
+void stream_map_free(stream_map_t *map);
+
+#ifdef STREAMMAP_PRIVATE
+/** An open-addressed hash table from stream ID to the edge connections in
+ * one of a circuit's stream lists. */
+struct stream_map_t {
+  /** Table of <b>capacity</b> slots; each is NULL, STREAM_MAP_TOMBSTONE, or
+   * an edge connection. */
+  edge_connection_t **slots;
+  /** Number of slots in the table: always a power of two. */
+  unsigned capacity;
+  /** Number of slots holding an edge connection. */
+  unsigned n_entries;
+  /** Number of slots holding STREAM_MAP_TOMBSTONE. */
+  unsigned n_tombstones;
+};
+#endif
+
+#endif
+
@@ -29,6 +29,11 @@ const char spider_git_revision[] = "";
 #include "onion_nspider.h"
 #include "crypto_ed25519.h"
 #include "consdiff.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "buffers.h"
+#include "memarea.h"
+#include "parsecommon.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -487,6 +492,68 @@ bench_digest(void)
   }
 }
 
+/** Time <b>expr</b> over <b>iters</b> iterations, and report it as a
+ * codec that handles <b>len</b> bytes of binary data per call. */
+#define BENCH_CODEC(name, len, iters, expr) STMT_BEGIN                    \
+    uint64_t start_, end_;                                              \
+    int j_;                                                             \
+    reset_perftime();                                                   \
+    start_ = perftime();                                                \
+    for (j_ = 0; j_ < (iters); ++j_) {                                  \
+      expr;                                                             \
+    }                                                                   \
+    end_ = perftime();                                                  \
+    printf("%s, %d bytes: %.2f ns per call; %.1f MB/s\n", (name), (len), \
+           NANOCOUNT(start_, end_, (iters)),                            \
+           (len) * 1e3 / NANOCOUNT(start_, end_, (iters)));             \
+  STMT_END
+
+static void
+bench_base_codecs(void)
+{
+  char buf[8192];
+  char enc[16384], dec[16384];
+  const int lens[] = { 20, 32, 1024, 8192, -1 };
+  const int N = 200000;
+  int i;
+  crypto_rand(buf, sizeof(buf));
+
+  for (i = 0; lens[i] > 0; ++i) {
+    const int len = lens[i];
+    const int iters = N / (1 + len / 64);
+    const int flags[] = { 0, BASE64_ENCODE_MULTILINE };
+    unsigned f;
+    size_t enclen, declen;
+    int r = 0;
+
+    /* Give each function an output buffer of the size its callers would,
+     * since they all clear the whole thing. */
+    for (f = 0; f < ARRAY_LENGTH(flags); ++f) {
+      enclen = base64_encode_size(len, flags[f]);
+      BENCH_CODEC(flags[f] ? "base64_encode (multiline)" : "base64_encode",
+                  len, iters,
+                  r = base64_encode(enc, enclen+1, buf, len, flags[f]));
+      spider_assert(r == (int)enclen);
+      declen = (enclen*3)/4;
+      BENCH_CODEC(flags[f] ? "base64_decode (multiline)" : "base64_decode",
+                  len, iters,
+                  r = base64_decode(dec, declen, enc, enclen));
+      spider_assert(r == len && fast_memeq(dec, buf, len));
+    }
+
+    BENCH_CODEC("base16_encode", len, iters,
+                base16_encode(enc, len*2+1, buf, len));
+    BENCH_CODEC("base16_decode", len, iters,
+                r = base16_decode(dec, len, enc, len*2));
+    spider_assert(r == len && fast_memeq(dec, buf, len));
+
+    enclen = base32_encoded_size(len);
+    BENCH_CODEC("base32_encode", len, iters,
+                base32_encode(enc, enclen, buf, len));
+  }
+}
+#undef BENCH_CODEC
+
 static void
 bench_cell_ops(void)
 {
@@ -539,6 +606,123 @@ bench_cell_ops(void)
   spider_free(cell);
 }
 
+static void
+bench_cmux_ewma(void)
+{
+  const int n_circs = 10000;
+  const int iters = 1<<20;
+  or_options_t *options = spider_malloc_zero(sizeof(or_options_t));
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol;
+  circuitmux_policy_circ_data_t **cdata;
+  circuit_t *circs;
+  int i;
+  uint64_t start, end;
+
+  options->CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_facspider(options, NULL);
+
+  /* The EWMA policy never looks inside the circuits. */
+  circs = spider_calloc(n_circs, sizeof(circuit_t));
+  cdata = spider_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  pol = ewma_policy.alloc_cmux_data(cmux);
+  for (i = 0; i < n_circs; ++i) {
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol, &circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(cmux, pol, &circs[i], cdata[i]);
+  }
+
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol);
+    int idx = (int)(circ - circs);
+    ewma_policy.notify_xmit_cells(cmux, pol, circ, cdata[idx], 1);
+  }
+  end = perftime();
+  printf("Pick and notify_xmit_cells, %d active circuits: %.2f ns per cell\n",
+         n_circs, NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    int idx = (int)(((unsigned)i * 7919u) % (unsigned)n_circs);
+    ewma_policy.notify_circ_inactive(cmux, pol, &circs[idx], cdata[idx]);
+    ewma_policy.notify_circ_active(cmux, pol, &circs[idx], cdata[idx]);
+  }
+  end = perftime();
+  printf("Deactivate and reactivate, %d active circuits: %.2f ns per "
+         "circuit\n", n_circs, NANOCOUNT(start, end, iters));
+
+  for (i = 0; i < n_circs; ++i) {
+    ewma_policy.notify_circ_inactive(cmux, pol, &circs[i], cdata[i]);
+    ewma_policy.free_circ_data(cmux, pol, &circs[i], cdata[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol);
+  circuitmux_free(cmux);
+  spider_free(cdata);
+  spider_free(circs);
+  spider_free(options);
+  cell_ewma_set_scale_facspider(get_options(), NULL);
+}
+
+static void
+bench_buf_socket(void)
+{
+  const size_t total = 16<<20;
+  const size_t piece = RELAY_PAYLOAD_SIZE;
+  char *data = spider_malloc_zero(piece);
+  buf_t *out = buf_new(), *in = buf_new();
+  spider_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  uint64_t reads0, writes0, reads1, writes1;
+  uint64_t start, end;
+  size_t moved = 0, flushlen;
+  int eof = 0, err = 0;
+  double mb = (double)total / (1<<20);
+
+  if (spider_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+      set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0) {
+    puts("Couldn't make a socketpair.");
+    goto done;
+  }
+
+  /* Fill the output buffer the way relay cells do: a piece at a time, so
+   * that it ends up as a long list of default-sized chunks. */
+  while (buf_datalen(out) < total)
+    write_to_buf(data, piece, out);
+
+  reset_perftime();
+  buf_get_socket_syscall_counts(&reads0, &writes0);
+  start = perftime();
+  while (moved < total) {
+    flushlen = buf_datalen(out);
+    if (flush_buf(fds[0], out, flushlen, &flushlen) < 0)
+      break;
+    if (read_to_buf(fds[1], 1<<20, in, &eof, &err) < 0)
+      break;
+    moved += buf_datalen(in);
+    buf_clear(in);
+  }
+  end = perftime();
+  buf_get_socket_syscall_counts(&reads1, &writes1);
+
+  printf("Socket flush and read, %lu-byte chunks: %.2f write and %.2f read "
+         "syscalls per MB; %.2f usec per MB\n",
+         (unsigned long)buf_get_default_chunk_size(out),
+         (writes1 - writes0) / mb, (reads1 - reads0) / mb,
+         NANOCOUNT(start, end, 1) / 1000 / mb);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    spider_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    spider_close_socket_simple(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  spider_free(data);
+}
+
 static void
 bench_dh(void)
 {
@@ -624,6 +808,201 @@ bench_ecdh_p224(void)
   bench_ecdh_impl(NID_secp224r1, "P-224");
 }
 
+/** Return a newly allocated fake consensus with roughly <b>n_routers</b>
+ * router entries.  Consensuses with consecutive values of <b>period</b>
+ * differ the way that consecutive real consensuses tend to: a few routers
+ * come and go, and many bandwidth weights change. */
+static char *
+fake_consensus_for_diff(int n_routers, int period)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3\n"
+                         "vote-status consensus\n"
+                         "consensus-method 26\n"
+                         "valid-after 2017-05-01 %02d:00:00\n"
+                         "fresh-until 2017-05-01 %02d:00:00\n"
+                         "known-flags Exit Fast Guard Running Stable Valid\n",
+                         period % 24, (period + 1) % 24);
+  for (i = 0; i < n_routers; ++i) {
+    char digest[DIGEST_LEN], id[BASE64_DIGEST_LEN+1];
+    /* About 1% of the routers are only in one consensus or the other. */
+    if ((i + period) % 100 == 0)
+      continue;
+    memset(digest, 0, sizeof(digest));
+    /* Keep the entries sorted by identity, as in a real consensus. */
+    set_uint32(digest, htonl(i));
+    set_uint32(digest + 4, htonl(i * 2654435761u));
+    digest_to_base64(id, digest);
+    smartlist_add_asprintf(chunks,
+                           "r router%d %s AAAAAAAAAAAAAAAAAAAAAAAAAAA "
+                           "2017-04-30 10:00:00 10.%d.%d.%d 9001 0\n"
+                           "s Fast Running Stable Valid\n"
+                           "v Spider 0.3.0.%d\n"
+                           "w Bandwidth=%d\n",
+                           i, id, (i >> 16) & 255, (i >> 8) & 255, i & 255,
+                           i % 10,
+                           /* Every period, about 1 in 8 weights change. */
+                           1000 + i + ((i * 7 + period) % 8 == 0) * period);
+  }
+  smartlist_add_asprintf(chunks,
+                         "directory-footer\n"
+                         "directory-signature 0123456789 0123456789\n"
+                         "-----BEGIN SIGNATURE-----\n"
+                         "period %d\n"
+                         "-----END SIGNATURE-----\n", period);
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, spider_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Time generating a diff from <b>cons1</b> to <b>cons2</b> with each of
+ * the consdiff engines. */
+static void
+bench_consdiff_engines(const char *cons1, const char *cons2, int iters)
+{
+  const consdiff_engine_t old_engine = consdiff_get_engine();
+  const struct {
+    const char *name;
+    consdiff_engine_t engine;
+  } engines[] = {
+    { "LCS", CONSDIFF_ENGINE_LCS },
+    { "Myers", CONSDIFF_ENGINE_MYERS },
+  };
+  unsigned e;
+  int i;
+  uint64_t start, end;
+
+  for (e = 0; e < ARRAY_LENGTH(engines); ++e) {
+    size_t difflen = 0;
+    consdiff_set_engine(engines[e].engine);
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      char *diff = consensus_diff_generate(cons1, cons2);
+      spider_assert(diff);
+      difflen = strlen(diff);
+      spider_free(diff);
+    }
+    end = perftime();
+    printf("Generate consensus diff (%s): %.2f msec each "
+           "(%lu bytes of diff).\n", engines[e].name,
+           NANOCOUNT(start, end, iters)/1e6, (unsigned long)difflen);
+  }
+  consdiff_set_engine(old_engine);
+}
+
+static void
+bench_consdiff(void)
+{
+  const int n_routers = 7000;
+  char *cons1 = fake_consensus_for_diff(n_routers, 1);
+  char *cons2 = fake_consensus_for_diff(n_routers, 2);
+
+  printf("Diffing two consecutive fake consensuses with %d routers:\n",
+         n_routers);
+  bench_consdiff_engines(cons1, cons2, 10);
+  spider_free(cons1);
+  spider_free(cons2);
+
+  /* Without router entries to split on, the whole document is one chunk:
+   * this is where the choice of engine matters most. */
+  smartlist_t *lines1 = smartlist_new(), *lines2 = smartlist_new();
+  smartlist_add(lines1, spider_strdup("network-status-version 3\n"));
+  smartlist_add(lines2, spider_strdup("network-status-version 3\n"));
+  for (int i = 0; i < 5000; ++i) {
+    smartlist_add_asprintf(lines1, "line %d\n", i);
+    smartlist_add_asprintf(lines2, "line %d%s\n", i, (i % 20) ? "" : "x");
+  }
+  cons1 = smartlist_join_strings(lines1, "", 0, NULL);
+  cons2 = smartlist_join_strings(lines2, "", 0, NULL);
+  SMARTLIST_FOREACH(lines1, char *, cp, spider_free(cp));
+  SMARTLIST_FOREACH(lines2, char *, cp, spider_free(cp));
+  smartlist_free(lines1);
+  smartlist_free(lines2);
+
+  printf("Diffing two 5000-line documents without router entries:\n");
+  bench_consdiff_engines(cons1, cons2, 2);
+  spider_free(cons1);
+  spider_free(cons2);
+}
+
+/** Tokens that we look for when timing the tokenizer on a consensus: the
+ * header, footer, and routerstatus keywords, all in one table.  Anything
+ * else turns into a K_OPT token. */
+static token_rule_t bench_consensus_token_table[] = {
+  T0N("r",                      K_R,                      GE(7),   NO_OBJ ),
+  T0N("a",                      K_A,                      GE(1),   NO_OBJ ),
+  T0N("s",                      K_S,                      ARGS,    NO_OBJ ),
+  T0N("v",                      K_V,                  CONCAT_ARGS, NO_OBJ ),
+  T0N("w",                      K_W,                      ARGS,    NO_OBJ ),
+  T0N("m",                      K_M,                  CONCAT_ARGS, NO_OBJ ),
+  T0N("p",                      K_P,                  CONCAT_ARGS, NO_OBJ ),
+  T0N("pr",                     K_PROTO,              CONCAT_ARGS, NO_OBJ ),
+  T0N("id",                     K_ID,                     GE(2),   NO_OBJ ),
+  T0N("network-status-version", K_NETWORK_STATUS_VERSION, GE(1),   NO_OBJ ),
+  T0N("vote-status",            K_VOTE_STATUS,            GE(1),   NO_OBJ ),
+  T0N("consensus-method",       K_CONSENSUS_METHOD,       EQ(1),   NO_OBJ ),
+  T0N("valid-after",            K_VALID_AFTER,        CONCAT_ARGS, NO_OBJ ),
+  T0N("fresh-until",            K_FRESH_UNTIL,        CONCAT_ARGS, NO_OBJ ),
+  T0N("valid-until",            K_VALID_UNTIL,        CONCAT_ARGS, NO_OBJ ),
+  T0N("known-flags",            K_KNOWN_FLAGS,        CONCAT_ARGS, NO_OBJ ),
+  T0N("params",                 K_PARAMS,                 ARGS,    NO_OBJ ),
+  T0N("dir-source",             K_DIR_SOURCE,             GE(6),   NO_OBJ ),
+  T0N("contact",                K_CONTACT,            CONCAT_ARGS, NO_OBJ ),
+  T0N("vote-digest",            K_VOTE_DIGEST,            GE(1),   NO_OBJ ),
+  T0N("directory-footer",       K_DIRECTORY_FOOTER,       NO_ARGS, NO_OBJ ),
+  T0N("bandwidth-weights",      K_BW_WEIGHTS,             ARGS,    NO_OBJ ),
+  T0N("directory-signature",    K_DIRECTORY_SIGNATURE,    GE(2),   NEED_OBJ ),
+  END_OF_TABLE
+};
+
+/** Time tokenizing the consensus <b>cons</b>, <b>iters</b> times. */
+static void
+bench_dir_tokenize_doc(const char *cons, int iters)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *eos = cons + strlen(cons);
+  int i, n_tokens = 0;
+  uint64_t start, end;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    int r = tokenize_string(area, cons, eos, tokens,
+                            bench_consensus_token_table, TS_NOCHECK);
+    spider_assert(r == 0);
+    n_tokens = smartlist_len(tokens);
+    SMARTLIST_FOREACH(tokens, directory_token_t *, tok, token_clear(tok));
+    smartlist_clear(tokens);
+    memarea_clear(area);
+  }
+  end = perftime();
+  printf("Tokenize consensus (%d tokens): %.2f msec each; "
+         "%.2f million tokens/sec.\n", n_tokens,
+         NANOCOUNT(start, end, iters)/1e6,
+         (n_tokens * (double)iters) / (NANOCOUNT(start, end, 1) / 1e3));
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+static void
+bench_dir_tokenize(void)
+{
+  const int n_routers = 7000;
+  char *cons = fake_consensus_for_diff(n_routers, 1);
+
+  printf("Tokenizing a fake consensus with %d routers:\n", n_routers);
+  bench_dir_tokenize_doc(cons, 20);
+  spider_free(cons);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -638,6 +1017,7 @@ static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(siphash),
   ENT(digest),
+  ENT(base_codecs),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_nspider),
@@ -645,9 +1025,13 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cmux_ewma),
+  ENT(buf_socket),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(consdiff),
+  ENT(dir_tokenize),
   {NULL,NULL,0}
 };
 
@@ -696,6 +1080,34 @@ main(int argc, const char **argv)
     return 0;
   }
 
+  if (argc == 4 && !strcmp(argv[1], "diff-engines")) {
+    /* Compare the consdiff engines on two real consensuses. */
+    init_logging(1);
+    char *f1 = read_file_to_str(argv[2], RFTS_BIN, NULL);
+    char *f2 = read_file_to_str(argv[3], RFTS_BIN, NULL);
+    if (! f1 || ! f2) {
+      perror("X");
+      return 1;
+    }
+    bench_consdiff_engines(f1, f2, 10);
+    spider_free(f1);
+    spider_free(f2);
+    return 0;
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "tokenize")) {
+    /* Time the tokenizer on a real consensus. */
+    init_logging(1);
+    char *cons = read_file_to_str(argv[2], RFTS_BIN, NULL);
+    if (! cons) {
+      perror("X");
+      return 1;
+    }
+    bench_dir_tokenize_doc(cons, 20);
+    spider_free(cons);
+    return 0;
+  }
+
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
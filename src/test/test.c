@@ -351,6 +351,71 @@ test_onion_queues(void *arg)
   spider_free(onionskin);
 }
 
+/** Run unit tests for OnionQueueDeadline. */
+static void
+test_onion_queue_deadline(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_options_t *options = get_options_mutable();
+  or_circuit_t *circ[5] = { NULL };
+  create_cell_t *onionskin = NULL;
+  int i;
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(U64_LITERAL(1000000000));
+  monotime_coarse_set_mock_time_nsec(U64_LITERAL(1000000000));
+  options->NumCPUs = 1;
+  memset(onion_handshakes_dropped, 0, sizeof(onion_handshakes_dropped));
+
+  /* Until we've timed a hundred onionskins, we expect each one to take a
+   * msec.  With a deadline of 3 msec, we can queue three of them: the fourth
+   * would have to wait 3 msec before starting. */
+  options->OnionQueueDeadline = 3;
+  for (i = 0; i < 5; ++i) {
+    create_cell_t *cc = spider_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    circ[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circ[i])->purpose = CIRCUIT_PURPOSE_OR;
+    if (i < 3) {
+      tt_int_op(0, OP_EQ, onion_pending_add(circ[i], cc));
+    } else {
+      tt_int_op(-1, OP_EQ, onion_pending_add(circ[i], cc));
+      spider_free(cc);
+    }
+  }
+  tt_int_op(3, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(2, OP_EQ,
+            rep_hist_get_circuit_handshake_dropped(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* Now allow a second.  After 500 msec, the first one can still make it. */
+  options->OnionQueueDeadline = 1000;
+  monotime_coarse_set_mock_time_nsec(U64_LITERAL(1500000000));
+  tt_ptr_op(circ[0], OP_EQ, onion_next_task(&onionskin));
+  spider_free(onionskin);
+  tt_int_op(2, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* After 1.5 sec, the others are hopeless: we close their circuits. */
+  monotime_coarse_set_mock_time_nsec(U64_LITERAL(2500000000));
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_assert(TO_CIRCUIT(circ[1])->marked_for_close);
+  tt_assert(TO_CIRCUIT(circ[2])->marked_for_close);
+  tt_assert(! TO_CIRCUIT(circ[0])->marked_for_close);
+  tt_int_op(4, OP_EQ,
+            rep_hist_get_circuit_handshake_dropped(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(0, OP_EQ,
+            rep_hist_get_circuit_handshake_dropped(ONION_HANDSHAKE_TYPE_TAP));
+
+ done:
+  clear_pending_onions();
+  monotime_disable_test_mocking();
+  options->OnionQueueDeadline = 0;
+  options->NumCPUs = 0;
+  spider_free(onionskin);
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -1166,6 +1231,7 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_deadline),
   { "nspider_handshake", test_nspider_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -1195,9 +1261,11 @@ struct testgroup_t testgroups[] = {
   { "config/", config_tests },
   { "connection/", connection_tests },
   { "consdiff/", consdiff_tests },
+  { "consdiffmgr/", consdiffmgr_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
+  { "cpuworker/", cpuworker_tests },
   { "crypto/", crypto_tests },
   { "dir/", dir_tests },
   { "dir_handle_get/", dir_handle_get_tests },
@@ -1231,6 +1299,7 @@ struct testgroup_t testgroups[] = {
   { "routerset/" , routerset_tests },
   { "scheduler/", scheduler_tests },
   { "socks/", socks_tests },
+  { "spoolcache/", spoolcache_tests },
   { "shared-random/", sr_tests },
   { "status/" , status_tests },
   { "storagedir/", storagedir_tests },
@@ -195,6 +195,158 @@ test_buffers_basic(void *arg)
     buf_free(buf2);
 }
 
+static void
+test_buffer_move_chunks(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *mem = NULL, *out = NULL;
+  const char *cp, *first;
+  size_t sz, r, alloc;
+  const size_t total = 20000;
+  (void)arg;
+
+  mem = spider_malloc(total);
+  out = spider_malloc(total);
+  crypto_rand(mem, total);
+  buf = buf_new_with_capacity(4096);
+  buf2 = buf_new_with_capacity(4096);
+  for (sz = 0; sz < total; sz += 1000)
+    write_to_buf(mem + sz, 1000, buf);
+  alloc = buf_get_total_allocation();
+
+  /* Moving whole chunks hands them over, rather than copying them. */
+  buf_get_first_chunk_data(buf, &first, &sz);
+  tt_uint_op(sz, OP_LT, total);
+  r = sz;
+  tt_int_op(sz, OP_EQ, move_buf_to_buf(buf2, buf, &r));
+  tt_uint_op(r, OP_EQ, 0);
+  buf_get_first_chunk_data(buf2, &cp, &sz);
+  tt_ptr_op(cp, OP_EQ, first);
+  tt_uint_op(buf_datalen(buf2), OP_EQ, sz);
+  tt_uint_op(buf_get_total_allocation(), OP_EQ, alloc);
+
+  /* A move that ends partway through a chunk. */
+  r = 5000;
+  tt_int_op(5000, OP_EQ, move_buf_to_buf(buf2, buf, &r));
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+
+  /* Move the rest. */
+  r = total;
+  tt_int_op(total - sz - 5000, OP_EQ, move_buf_to_buf(buf2, buf, &r));
+  tt_uint_op(r, OP_EQ, sz + 5000);
+  tt_uint_op(buf_datalen(buf), OP_EQ, 0);
+  tt_uint_op(buf_datalen(buf2), OP_EQ, total);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  fetch_from_buf(out, total, buf2);
+  tt_mem_op(out, OP_EQ, mem, total);
+
+  /* Moving onto a buffer with only an empty chunk. */
+  write_to_buf(mem, 100, buf2);
+  fetch_from_buf(out, 100, buf2);
+  write_to_buf(mem, total, buf);
+  r = total;
+  tt_int_op(total, OP_EQ, move_buf_to_buf(buf2, buf, &r));
+  assert_buf_ok(buf2);
+  fetch_from_buf(out, total, buf2);
+  tt_mem_op(out, OP_EQ, mem, total);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  spider_free(mem);
+  spider_free(out);
+}
+
+static int n_external_released = 0;
+static void
+note_external_released(void *arg)
+{
+  (void)arg;
+  ++n_external_released;
+}
+
+static void
+test_buffer_external(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *mem = NULL, *out = NULL;
+  const char *cp;
+  size_t sz, alloc;
+  const size_t total = 20000;
+  (void)arg;
+
+  n_external_released = 0;
+  mem = spider_malloc(total);
+  out = spider_malloc(total);
+  crypto_rand(mem, total);
+  buf = buf_new_with_capacity(4096);
+  alloc = buf_get_total_allocation();
+
+  /* The buffer refers to the memory rather than copying it. */
+  write_to_buf("abc", 3, buf);
+  tt_int_op(total + 3, OP_EQ,
+            buf_add_external(buf, mem, total, note_external_released, NULL));
+  tt_uint_op(buf_get_total_allocation() - alloc, OP_LT,
+            buf_get_default_chunk_size(buf) + 200);
+  assert_buf_ok(buf);
+
+  /* We don't write into it. */
+  write_to_buf("xyz", 3, buf);
+  tt_int_op(total + 6, OP_EQ, buf_datalen(buf));
+  assert_buf_ok(buf);
+
+  /* Copies don't refer to it. */
+  buf2 = buf_copy(buf);
+  fetch_from_buf(out, 3, buf2);
+  fetch_from_buf(out, total, buf2);
+  tt_mem_op(out, OP_EQ, mem, total);
+  buf_free(buf2);
+  buf2 = NULL;
+  tt_int_op(n_external_released, OP_EQ, 0);
+
+  /* Taking part of it leaves the rest in place. */
+  fetch_from_buf(out, 1003, buf);
+  tt_mem_op(out + 3, OP_EQ, mem, 1000);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_ptr_op(cp, OP_EQ, mem + 1000);
+  tt_int_op(n_external_released, OP_EQ, 0);
+
+  /* Pulling it up copies it. */
+  buf_pullup(buf, total);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_uint_op(sz, OP_GE, total - 1000);
+  tt_mem_op(cp, OP_EQ, mem + 1000, total - 1000);
+  tt_int_op(n_external_released, OP_EQ, 1);
+  assert_buf_ok(buf);
+  buf_clear(buf);
+
+  /* Using up all of it releases it. */
+  buf_add_external(buf, mem, total, note_external_released, NULL);
+  fetch_from_buf(out, total, buf);
+  tt_int_op(n_external_released, OP_EQ, 2);
+
+  /* Freeing the buffer releases it. */
+  buf_add_external(buf, mem, total, note_external_released, NULL);
+  buf_free(buf);
+  buf = NULL;
+  tt_int_op(n_external_released, OP_EQ, 3);
+  tt_uint_op(buf_get_total_allocation(), OP_EQ, alloc);
+
+  /* Empty regions are released at once. */
+  buf = buf_new();
+  tt_int_op(0, OP_EQ,
+            buf_add_external(buf, mem, 0, note_external_released, NULL));
+  tt_int_op(n_external_released, OP_EQ, 4);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  spider_free(mem);
+  spider_free(out);
+}
+
 static void
 test_buffer_pullup(void *arg)
 {
@@ -744,6 +896,82 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static void
+test_buffers_socket_iov(void *arg)
+{
+  char *mem = NULL, *contents = NULL;
+  buf_t *out = NULL, *in = NULL;
+  spider_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  const size_t total = 40000;
+  uint64_t reads0, writes0, reads1, writes1;
+  size_t flushlen, i;
+  int eof = 0, err = 0;
+  (void)arg;
+
+  tt_int_op(0, OP_EQ, spider_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  mem = spider_malloc(total);
+  crypto_rand(mem, total);
+  out = buf_new();
+  in = buf_new();
+  for (i = 0; i < total; i += 1000)
+    write_to_buf(mem + i, 1000, out);
+  tt_uint_op(buf_allocation(out), OP_GT, 4 * buf_get_default_chunk_size(out));
+
+  /* A flush that stops partway through a chunk. */
+  buf_get_socket_syscall_counts(&reads0, &writes0);
+  flushlen = buf_datalen(out);
+  tt_int_op(5000, OP_EQ, flush_buf(fds[0], out, 5000, &flushlen));
+  tt_uint_op(flushlen, OP_EQ, total - 5000);
+  tt_uint_op(buf_datalen(out), OP_EQ, total - 5000);
+
+  /* Flush the rest. */
+  tt_int_op(total - 5000, OP_EQ, flush_buf(fds[0], out, flushlen, &flushlen));
+  tt_uint_op(flushlen, OP_EQ, 0);
+  tt_uint_op(buf_datalen(out), OP_EQ, 0);
+  buf_get_socket_syscall_counts(&reads1, &writes1);
+#ifndef _WIN32
+  /* One writev() per flush, rather than one send() per chunk. */
+  tt_u64_op(writes1 - writes0, OP_EQ, 2);
+#endif
+
+  /* Read into a buffer whose tail chunk already has some data in it. */
+  write_to_buf("hello", 5, in);
+  tt_int_op(total, OP_EQ, read_to_buf(fds[1], 1<<20, in, &eof, &err));
+  tt_int_op(eof, OP_EQ, 0);
+  assert_buf_ok(in);
+  tt_uint_op(buf_datalen(in), OP_EQ, total + 5);
+  contents = spider_malloc(total + 5);
+  fetch_from_buf(contents, total + 5, in);
+  tt_mem_op(contents, OP_EQ, "hello", 5);
+  tt_mem_op(contents + 5, OP_EQ, mem, total);
+
+  /* Nothing more to read: we shouldn't hang on to any new chunks. */
+  tt_int_op(0, OP_EQ, read_to_buf(fds[1], 1<<20, in, &eof, &err));
+  assert_buf_ok(in);
+  tt_uint_op(buf_datalen(in), OP_EQ, 0);
+  tt_uint_op(buf_allocation(in), OP_LE, 65536);
+
+  /* End of file. */
+  spider_close_socket_simple(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(0, OP_EQ, read_to_buf(fds[1], 1<<20, in, &eof, &err));
+  tt_int_op(eof, OP_EQ, 1);
+  assert_buf_ok(in);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    spider_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    spider_close_socket_simple(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  spider_free(mem);
+  spider_free(contents);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -811,6 +1039,8 @@ test_buffers_find_contentlen(void *arg)
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
+  { "move_chunks", test_buffer_move_chunks, TT_FORK, NULL, NULL },
+  { "external", test_buffer_external, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "ext_or_cmd", test_buffer_ext_or_cmd, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
@@ -822,6 +1052,7 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL},
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "socket_iov", test_buffers_socket_iov, TT_FORK, NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
   END_OF_TESTCASES
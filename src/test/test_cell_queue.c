@@ -134,9 +134,64 @@ test_circuit_n_cells(void *arg)
   circuit_free(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cell_pool(void *arg)
+{
+  packed_cell_t *cells[200];
+  packed_cell_t *pc;
+  size_t one_slab;
+  int i;
+  (void)arg;
+
+  memset(cells, 0, sizeof(cells));
+  tt_int_op(cell_pool_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+  cells[0] = packed_cell_new();
+  one_slab = cell_pool_get_total_allocation();
+  tt_int_op(one_slab, OP_GE, sizeof(packed_cell_t));
+
+  for (i = 1; i < 200; ++i) {
+    cells[i] = packed_cell_new();
+    tt_assert(cells[i]);
+    tt_assert(spider_mem_is_zero(cells[i]->body, sizeof(cells[i]->body)));
+  }
+  /* Cells only count once they're allocated, not while they sit in the
+   * pool. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            200 * packed_cell_mem_cost());
+  tt_int_op(cell_pool_get_total_allocation(), OP_GT, one_slab);
+  tt_int_op(cell_pool_get_total_allocation() % one_slab, OP_EQ, 0);
+  tt_int_op(cell_pool_get_total_allocation() / one_slab, OP_LT, 10);
+
+  /* A cell we free is the next one handed out. */
+  pc = cells[57];
+  memset(pc->body, 0xff, sizeof(pc->body));
+  packed_cell_free(pc);
+  cells[57] = packed_cell_new();
+  tt_ptr_op(cells[57], OP_EQ, pc);
+  tt_assert(spider_mem_is_zero(pc->body, sizeof(pc->body)));
+
+  /* Once everything is freed, only a few empty slabs stay around. */
+  for (i = 0; i < 200; ++i) {
+    packed_cell_free(cells[i]);
+    cells[i] = NULL;
+  }
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(cell_pool_get_total_allocation(), OP_GT, 0);
+  tt_int_op(cell_pool_get_total_allocation(), OP_LE, 4 * one_slab);
+  cell_pool_release_empty_slabs();
+  tt_int_op(cell_pool_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < 200; ++i)
+    packed_cell_free(cells[i]);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "pool", test_cell_pool, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
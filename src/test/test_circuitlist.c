@@ -74,6 +74,7 @@ test_clist_maps(void *arg)
   channel_t *ch2 = new_fake_channel();
   channel_t *ch3 = new_fake_channel();
   or_circuit_t *or_c1=NULL, *or_c2=NULL;
+  smartlist_t *circs = smartlist_new();
 
   (void) arg;
 
@@ -124,6 +125,24 @@ test_clist_maps(void *arg)
   tt_assert(! circuit_id_in_use_on_channel(100, ch2));
   tt_ptr_op(circuit_get_by_circid_channel(500, ch3), OP_EQ, TO_CIRCUIT(or_c1));
 
+  /* Each channel can list its circuits, each one once. */
+  channel_get_all_circuits(ch1, circs);
+  tt_int_op(smartlist_len(circs), OP_EQ, 2);
+  tt_assert(smartlist_contains(circs, TO_CIRCUIT(or_c1)));
+  tt_assert(smartlist_contains(circs, TO_CIRCUIT(or_c2)));
+  smartlist_clear(circs);
+  circuit_set_n_circid_chan(TO_CIRCUIT(or_c1), 600, ch3);
+  GOT_CMUX_DETACH(ch1->cmux, TO_CIRCUIT(or_c1));
+  GOT_CMUX_ATTACH(ch3->cmux, TO_CIRCUIT(or_c1), CELL_DIRECTION_OUT);
+  channel_get_all_circuits(ch3, circs);
+  tt_int_op(smartlist_len(circs), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(circs, 0), OP_EQ, TO_CIRCUIT(or_c1));
+  smartlist_clear(circs);
+  channel_get_all_circuits(ch1, circs);
+  tt_int_op(smartlist_len(circs), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(circs, 0), OP_EQ, TO_CIRCUIT(or_c2));
+  smartlist_clear(circs);
+
   /* Now let's see about destroy handling. */
   tt_assert(! circuit_id_in_use_on_channel(205, ch2));
   tt_assert(circuit_id_in_use_on_channel(200, ch2));
@@ -169,9 +188,13 @@ test_clist_maps(void *arg)
     spider_free(ch2->cmux);
   if (ch3)
     spider_free(ch3->cmux);
+  channel_free_circid_table(ch1);
+  channel_free_circid_table(ch2);
+  channel_free_circid_table(ch3);
   spider_free(ch1);
   spider_free(ch2);
   spider_free(ch3);
+  smartlist_free(circs);
   UNMOCK(circuitmux_attach_circuit);
   UNMOCK(circuitmux_detach_circuit);
 }
@@ -334,6 +357,18 @@ test_pick_circid(void *arg)
     tt_uint_op((1u<<31), OP_LT, circid);
   }
 
+  /* We hand out IDs in order, skipping the ones in use */
+  chan2->circ_id_type = CIRC_ID_TYPE_LOWER;
+  chan2->next_circ_id = 5;
+  tt_uint_op(get_unique_circ_id_by_chan(chan2), OP_EQ, 5);
+  channel_mark_circid_unusable(chan2, 5);
+  channel_mark_circid_unusable(chan2, 6);
+  tt_uint_op(get_unique_circ_id_by_chan(chan2), OP_EQ, 7);
+  chan2->next_circ_id = 5;
+  tt_uint_op(get_unique_circ_id_by_chan(chan2), OP_EQ, 7);
+  channel_mark_circid_usable(chan2, 5);
+  channel_mark_circid_usable(chan2, 6);
+
   /* Now make sure that we can behave well when we are full up on circuits */
   chan1->circ_id_type = CIRC_ID_TYPE_LOWER;
   chan2->circ_id_type = CIRC_ID_TYPE_LOWER;
@@ -351,6 +386,9 @@ test_pick_circid(void *arg)
     channel_mark_circid_unusable(chan1, circid);
   }
   tt_int_op(i, OP_LT, (1<<15));
+  /* Once one comes free, we find it. */
+  channel_mark_circid_usable(chan1, 1234);
+  tt_uint_op(get_unique_circ_id_by_chan(chan1), OP_EQ, 1234);
   /* Make sure that being full on chan1 does not interfere with chan2 */
   for (i = 0; i < 100; ++i) {
     circid = get_unique_circ_id_by_chan(chan2);
@@ -362,6 +400,8 @@ test_pick_circid(void *arg)
  done:
   circuitmux_free(chan1->cmux);
   circuitmux_free(chan2->cmux);
+  channel_free_circid_table(chan1);
+  channel_free_circid_table(chan2);
   spider_free(chan1);
   spider_free(chan2);
   bitarray_free(ba);
@@ -7,6 +7,7 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -77,8 +78,117 @@ test_cmux_destroy_cell_queue(void *arg)
   packed_cell_free(pc);
 }
 
+/** Set both of the clocks that the EWMA policy looks at to <b>now</b>. */
+static void
+set_ewma_time(time_t now)
+{
+  struct timeval tv = { now, 0 };
+  update_approx_time(now);
+  spider_gettimeofday_cache_set(&tv);
+}
+
+/** Test that the EWMA policy orders circuits, and circuitmuxes, by their
+ * decayed cell counts, however long ago their counts were rescaled. */
+static void
+test_cmux_ewma_lazy_rescale(void *arg)
+{
+  circuitmux_t *cmux_a = NULL, *cmux_b = NULL;
+  circuitmux_policy_data_t *pol_a = NULL, *pol_b = NULL;
+  circuitmux_policy_circ_data_t *cd_a1 = NULL, *cd_a2 = NULL, *cd_b = NULL;
+  circuit_t *a1 = NULL, *a2 = NULL, *b = NULL;
+  or_options_t *options = NULL;
+  /* The start of a tick */
+  const time_t t0 = 1500000000;
+
+  (void) arg;
+
+  /* A halflife of 30 seconds: each 10-second tick scales by 2^(-1/3) */
+  options = spider_malloc_zero(sizeof(or_options_t));
+  options->CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_facspider(options, NULL);
+  tt_assert(cell_ewma_enabled());
+
+  set_ewma_time(t0);
+  cmux_a = circuitmux_alloc();
+  cmux_b = circuitmux_alloc();
+  a1 = spider_malloc_zero(sizeof(circuit_t));
+  a2 = spider_malloc_zero(sizeof(circuit_t));
+  b = spider_malloc_zero(sizeof(circuit_t));
+  pol_a = ewma_policy.alloc_cmux_data(cmux_a);
+  cd_a1 = ewma_policy.alloc_circ_data(cmux_a, pol_a, a1,
+                                      CELL_DIRECTION_OUT, 0);
+  cd_a2 = ewma_policy.alloc_circ_data(cmux_a, pol_a, a2,
+                                      CELL_DIRECTION_OUT, 0);
+  ewma_policy.notify_circ_active(cmux_a, pol_a, a1, cd_a1);
+  ewma_policy.notify_circ_active(cmux_a, pol_a, a2, cd_a2);
+
+  /* a1 sends 8 cells, a2 sends 5: a2 goes first. */
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a1);
+  ewma_policy.notify_xmit_cells(cmux_a, pol_a, a1, cd_a1, 8);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a2);
+  ewma_policy.notify_xmit_cells(cmux_a, pol_a, a2, cd_a2, 5);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a2);
+
+  /* Six ticks later, those are worth 2 and 1.25; another 1 cell on a2 puts
+   * it behind a1. */
+  set_ewma_time(t0 + 60);
+  ewma_policy.notify_xmit_cells(cmux_a, pol_a, a2, cd_a2, 1);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a1);
+
+  /* A newer cmux, whose counts are relative to a later tick: a1's 2 cells'
+   * worth beats b's 3, but not b's 1. */
+  set_ewma_time(t0 + 60);
+  pol_b = ewma_policy.alloc_cmux_data(cmux_b);
+  cd_b = ewma_policy.alloc_circ_data(cmux_b, pol_b, b,
+                                     CELL_DIRECTION_OUT, 0);
+  ewma_policy.notify_circ_active(cmux_b, pol_b, b, cd_b);
+  ewma_policy.notify_xmit_cells(cmux_b, pol_b, b, cd_b, 3);
+  tt_int_op(ewma_policy.cmp_cmux(cmux_a, pol_a, cmux_b, pol_b), OP_EQ, -1);
+  tt_int_op(ewma_policy.cmp_cmux(cmux_b, pol_b, cmux_a, pol_a), OP_EQ, 1);
+  ewma_policy.notify_circ_inactive(cmux_b, pol_b, b, cd_b);
+  ewma_policy.free_circ_data(cmux_b, pol_b, b, cd_b);
+  cd_b = ewma_policy.alloc_circ_data(cmux_b, pol_b, b,
+                                     CELL_DIRECTION_OUT, 0);
+  ewma_policy.notify_circ_active(cmux_b, pol_b, b, cd_b);
+  ewma_policy.notify_xmit_cells(cmux_b, pol_b, b, cd_b, 1);
+  tt_int_op(ewma_policy.cmp_cmux(cmux_a, pol_a, cmux_b, pol_b), OP_EQ, 1);
+
+  /* Deactivating and reactivating a circuit doesn't change its place. */
+  ewma_policy.notify_circ_inactive(cmux_a, pol_a, a1, cd_a1);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a2);
+  ewma_policy.notify_circ_active(cmux_a, pol_a, a1, cd_a1);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a1);
+
+  /* Long enough later that we must rescale, the old cells are worth
+   * nothing, and one new cell on a1 puts it behind a2. */
+  set_ewma_time(t0 + 100000);
+  ewma_policy.notify_xmit_cells(cmux_a, pol_a, a1, cd_a1, 1);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a2);
+  ewma_policy.notify_xmit_cells(cmux_a, pol_a, a2, cd_a2, 2);
+  tt_ptr_op(ewma_policy.pick_active_circuit(cmux_a, pol_a), OP_EQ, a1);
+
+ done:
+  if (pol_a) {
+    ewma_policy.free_circ_data(cmux_a, pol_a, a1, cd_a1);
+    ewma_policy.free_circ_data(cmux_a, pol_a, a2, cd_a2);
+    ewma_policy.free_cmux_data(cmux_a, pol_a);
+  }
+  if (pol_b) {
+    ewma_policy.free_circ_data(cmux_b, pol_b, b, cd_b);
+    ewma_policy.free_cmux_data(cmux_b, pol_b);
+  }
+  circuitmux_free(cmux_a);
+  circuitmux_free(cmux_b);
+  spider_free(a1);
+  spider_free(a2);
+  spider_free(b);
+  cell_ewma_set_scale_facspider(NULL, NULL);
+  spider_free(options);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "ewma_lazy_rescale", test_cmux_ewma_lazy_rescale, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
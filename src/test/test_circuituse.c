@@ -9,6 +9,7 @@
 #include "test.h"
 #include "test_helpers.h"
 #include "config.h"
+#include "channel.h"
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "circuitbuild.h"
@@ -238,6 +239,61 @@ test_needs_circuits_for_build_returns_true_when_more_are_needed(void *arg)
     UNMOCK(router_have_consensus_path);
 }
 
+static void
+test_expire_old_circuit_serverside(void *arg)
+{
+  or_circuit_t *or_circ = NULL;
+  channel_t *chan = NULL;
+  edge_connection_t *stream = NULL;
+  const time_t now = 1500000000;
+  (void)arg;
+
+  chan = spider_malloc_zero(sizeof(channel_t));
+  stream = spider_malloc_zero(sizeof(edge_connection_t));
+  or_circ = or_circuit_new(0, NULL);
+  TO_CIRCUIT(or_circ)->purpose = CIRCUIT_PURPOSE_OR;
+  or_circ->p_chan = chan;
+  chan->timestamp_xmit = now - 10;
+
+  /* Only circuits made with create_fast expire this way. */
+  tt_int_op(circuit_expire_old_circuit_serverside(or_circ, now), OP_EQ, 0);
+
+  /* Look again once it could have been idle for a minute. */
+  or_circ->is_first_hop = 1;
+  tt_int_op(circuit_expire_old_circuit_serverside(or_circ, now), OP_EQ,
+            now + 50);
+
+  /* A circuit with streams isn't idle, however quiet its channel is. */
+  chan->timestamp_xmit = now - 100;
+  or_circ->n_streams = stream;
+  tt_int_op(circuit_expire_old_circuit_serverside(or_circ, now), OP_EQ,
+            now + 60);
+  tt_assert(! TO_CIRCUIT(or_circ)->marked_for_close);
+
+  /* Nor is one that has been extended, but we keep looking at it: it
+   * becomes a one-hop circuit again if it's truncated. */
+  or_circ->n_streams = NULL;
+  TO_CIRCUIT(or_circ)->n_chan = chan;
+  tt_int_op(circuit_expire_old_circuit_serverside(or_circ, now), OP_EQ,
+            now + 60);
+  tt_assert(! TO_CIRCUIT(or_circ)->marked_for_close);
+
+  /* Once it's truncated, it's been idle for too long. */
+  TO_CIRCUIT(or_circ)->n_chan = NULL;
+  tt_int_op(circuit_expire_old_circuit_serverside(or_circ, now), OP_EQ, 0);
+  tt_assert(TO_CIRCUIT(or_circ)->marked_for_close);
+
+ done:
+  if (or_circ) {
+    or_circ->n_streams = NULL;
+    or_circ->p_chan = NULL;
+    TO_CIRCUIT(or_circ)->n_chan = NULL;
+  }
+  circuit_free_all();
+  spider_free(stream);
+  spider_free(chan);
+}
+
 struct testcase_t circuituse_tests[] = {
  { "marked",
    test_circuit_is_available_for_use_ret_false_when_marked_for_close,
@@ -298,6 +354,10 @@ struct testcase_t circuituse_tests[] = {
  { "more_needed",
    test_needs_circuits_for_build_returns_true_when_more_are_needed,
    TT_FORK, NULL, NULL
+ },
+ { "expire_old_circuit_serverside",
+   test_expire_old_circuit_serverside,
+   TT_FORK, NULL, NULL
  },
   END_OF_TESTCASES
 };
@@ -5,11 +5,16 @@
 
 #define CONNECTION_PRIVATE
 #define MAIN_PRIVATE
+#define TOR_CHANNEL_INTERNAL_
 
 #include "or.h"
 #include "test.h"
 
+#include "channel.h"
+#include "channeltls.h"
+#include "config.h"
 #include "connection.h"
+#include "hibernate.h"
 #include "hs_common.h"
 #include "main.h"
 #include "microdesc.h"
@@ -859,6 +864,235 @@ test_conn_download_status(void *arg)
   /* the teardown function removes all the connections in the global list*/;
 }
 
+static int n_start_reading = 0;
+static void
+mock_connection_start_reading(connection_t *conn)
+{
+  (void)conn;
+  ++n_start_reading;
+}
+
+/* Return a new open OR connection to a public address, with per-connection
+ * rate <b>rate</b> and burst <b>burst</b>, and with empty buckets. */
+static or_connection_t *
+test_conn_bucket_new_or_conn(int rate, int burst)
+{
+  or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  spider_addr_parse(&TO_CONN(or_conn)->addr, "18.0.0.1");
+  TO_CONN(or_conn)->state = OR_CONN_STATE_OPEN;
+  or_conn->bandwidthrate = rate;
+  or_conn->bandwidthburst = burst;
+  connection_buckets_catch_up(or_conn);
+  or_conn->read_bucket = or_conn->write_bucket = 0;
+  return or_conn;
+}
+
+static void
+test_conn_bucket_lazy_refill(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_connection_t *or_conn = NULL, *closed = NULL;
+  time_t now = time(NULL);
+  int i;
+  (void)arg;
+
+  options->BandwidthRate = options->BandwidthBurst = 1<<20;
+  connection_bucket_init();
+
+  or_conn = test_conn_bucket_new_or_conn(1000, 5000);
+  closed = test_conn_bucket_new_or_conn(1000, 5000);
+  TO_CONN(closed)->state = OR_CONN_STATE_CONNECTING;
+
+  /* Refilling doesn't touch a connection that isn't blocked... */
+  for (i = 0; i < 3; ++i)
+    connection_bucket_refill(100, now);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 0);
+
+  /* ...but it gets the same tokens as soon as we look at it. */
+  TO_CONN(or_conn)->outbuf_flushlen = 1<<20;
+  tt_int_op(connection_bucket_write_limit(TO_CONN(or_conn), now),
+            OP_EQ, 300);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 300);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 300);
+  TO_CONN(or_conn)->outbuf_flushlen = 0;
+
+  /* Looking again doesn't add any more. */
+  connection_buckets_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 300);
+
+  /* The buckets still stop at the burst. */
+  for (i = 0; i < 100; ++i)
+    connection_bucket_refill(100, now);
+  connection_buckets_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 5000);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 5000);
+
+  /* A connection that isn't open doesn't earn any tokens, even once it
+   * opens. */
+  connection_buckets_catch_up(closed);
+  TO_CONN(closed)->state = OR_CONN_STATE_OPEN;
+  connection_buckets_catch_up(closed);
+  tt_int_op(closed->read_bucket, OP_EQ, 0);
+
+ done:
+  connection_free_(TO_CONN(or_conn));
+  connection_free_(TO_CONN(closed));
+}
+
+static void
+test_conn_bucket_wakeup(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_connection_t *blocked = NULL, *empty = NULL, *gone;
+  time_t now = time(NULL);
+  (void)arg;
+
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  options->BandwidthRate = options->BandwidthBurst = 1<<20;
+  connection_bucket_init();
+
+  /* A connection that's blocked on its own empty bucket... */
+  blocked = test_conn_bucket_new_or_conn(1000, 5000);
+  TO_CONN(blocked)->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(TO_CONN(blocked));
+  connection_note_blocked_on_bw(TO_CONN(blocked));
+  /* ...one that will still be blocked after the next refill... */
+  empty = test_conn_bucket_new_or_conn(1000, 5000);
+  empty->read_bucket = -1000;
+  TO_CONN(empty)->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(TO_CONN(empty));
+  /* ...and one that goes away before the refill. */
+  gone = test_conn_bucket_new_or_conn(1000, 5000);
+  TO_CONN(gone)->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(TO_CONN(gone));
+  connection_free_(TO_CONN(gone));
+
+  connection_bucket_refill(100, now);
+  tt_int_op(n_start_reading, OP_EQ, 1);
+  tt_int_op(TO_CONN(blocked)->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(TO_CONN(blocked)->in_bw_wakeup_list, OP_EQ, 0);
+  tt_int_op(blocked->read_bucket, OP_EQ, 100);
+  tt_int_op(TO_CONN(empty)->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(TO_CONN(empty)->in_bw_wakeup_list, OP_EQ, 1);
+  tt_int_op(empty->read_bucket, OP_EQ, -900);
+
+  /* The empty one wakes up once its bucket has tokens again. */
+  connection_bucket_refill(1000, now);
+  tt_int_op(n_start_reading, OP_EQ, 2);
+  tt_int_op(TO_CONN(empty)->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(TO_CONN(empty)->in_bw_wakeup_list, OP_EQ, 0);
+  tt_int_op(empty->read_bucket, OP_EQ, 100);
+
+  /* Nothing is waiting now. */
+  connection_bucket_refill(100, now);
+  tt_int_op(n_start_reading, OP_EQ, 2);
+
+ done:
+  UNMOCK(connection_start_reading);
+  connection_free_(TO_CONN(blocked));
+  connection_free_(TO_CONN(empty));
+}
+
+static int mock_hibernating = 0;
+static int
+mock_we_are_hibernating(void)
+{
+  return mock_hibernating;
+}
+
+static void
+test_conn_housekeeping_next_check(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  dir_connection_t *dir_conn = NULL;
+  entry_connection_t *entry_conn = NULL;
+  or_connection_t *or_conn = NULL;
+  channel_tls_t *tlschan = NULL;
+  channel_t *chan;
+  connection_t *conn;
+  const time_t now = 1500000000;
+  (void)arg;
+
+  MOCK(we_are_hibernating, mock_we_are_hibernating);
+  options->TestingDirConnectionMaxStall = 300;
+  dir_conn = dir_connection_new(AF_INET);
+  conn = TO_CONN(dir_conn);
+
+  /* A client directory connection stalls if it reads nothing... */
+  conn->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  conn->timestamp_lastread = now - 100;
+  conn->timestamp_lastwritten = now - 1000;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 201);
+
+  /* ...and a server one if it writes nothing. */
+  conn->purpose = DIR_PURPOSE_SERVER;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 1);
+  conn->timestamp_lastwritten = now;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 301);
+
+  /* Nothing more to do once it's marked. */
+  conn->marked_for_close = 1;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, 0);
+
+  /* Streams have their own schedule. */
+  entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  tt_int_op(connection_housekeeping_next_check(ENTRY_TO_CONN(entry_conn),
+                                               now), OP_EQ, 0);
+
+  options->KeepalivePeriod = 300;
+  or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  tlschan = spider_malloc_zero(sizeof(channel_tls_t));
+  chan = TLS_CHAN_TO_BASE(tlschan);
+  or_conn->chan = tlschan;
+  or_conn->idle_timeout = 3600;
+  conn = TO_CONN(or_conn);
+  conn->state = OR_CONN_STATE_OPEN;
+  conn->timestamp_lastwritten = now - 100;
+  or_conn->timestamp_lastempty = now - 100;
+
+  /* An open OR connection with circuits needs its next keepalive... */
+  chan->timestamp_last_had_circuits = now;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 200);
+
+  /* ...unless it will have been idle for too long before then... */
+  chan->timestamp_last_had_circuits = now - 3550;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 50);
+
+  /* ...or unable to flush for too long. */
+  chan->timestamp_last_had_circuits = now;
+  conn->timestamp_lastwritten = now - 2990;
+  or_conn->timestamp_lastempty = now - 2990;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 10);
+
+  /* One that isn't open yet only gives up at the keepalive period, however
+   * long it's been without circuits. */
+  conn->state = OR_CONN_STATE_TLS_HANDSHAKING;
+  conn->timestamp_lastwritten = now - 100;
+  chan->timestamp_last_had_circuits = now - 3550;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 200);
+
+  /* One that's bad for new circuits can close as soon as its last circuit
+   * goes away, as can any of them once we start hibernating. */
+  conn->state = OR_CONN_STATE_OPEN;
+  chan->is_bad_for_new_circs = 1;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 1);
+  chan->is_bad_for_new_circs = 0;
+  mock_hibernating = 1;
+  tt_int_op(connection_housekeeping_next_check(conn, now), OP_EQ, now + 1);
+
+ done:
+  UNMOCK(we_are_hibernating);
+  mock_hibernating = 0;
+  connection_free_(TO_CONN(dir_conn));
+  connection_free_(ENTRY_TO_CONN(entry_conn));
+  if (or_conn) {
+    or_conn->chan = NULL;
+    connection_free_(TO_CONN(or_conn));
+  }
+  spider_free(tlschan);
+}
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -874,6 +1108,10 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_MICRODESC),
   CONNECTION_TESTCASE_ARG(download_status,  TT_FORK,
                           test_conn_download_status_st, FLAV_NS),
+  { "bucket_lazy_refill", test_conn_bucket_lazy_refill, TT_FORK, NULL, NULL },
+  { "bucket_wakeup", test_conn_bucket_wakeup, TT_FORK, NULL, NULL },
+  { "housekeeping_next_check", test_conn_housekeeping_next_check, TT_FORK,
+    NULL, NULL },
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   END_OF_TESTCASES
 };
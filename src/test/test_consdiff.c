@@ -309,6 +309,183 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/** Helper: Return the number of bits set in the first <b>n</b> bits of
+ * <b>b</b>. */
+static int
+n_bits_set(bitarray_t *b, int n)
+{
+  int count = 0;
+  for (int i = 0; i < n; ++i) {
+    if (bitarray_is_set(b, i))
+      ++count;
+  }
+  return count;
+}
+
+static void
+test_consdiff_calc_changes_myers(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = bitarray_init_zero(6);
+  bitarray_t *changed2 = bitarray_init_zero(6);
+  memarea_t *area = memarea_new();
+
+  (void)arg;
+  consensus_split_lines(sl1, "a\na\na\na\n", area);
+  consensus_split_lines(sl2, "a\na\na\na\n", area);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  /* Nothing should be set to changed. */
+  tt_int_op(n_bits_set(changed1, 4), OP_EQ, 0);
+  tt_int_op(n_bits_set(changed2, 4), OP_EQ, 0);
+
+  /* Two elements are changed: which two depends on the algorithm. */
+  smartlist_clear(sl2);
+  consensus_split_lines(sl2, "a\nb\na\nb\n", area);
+  spider_free(sls1);
+  spider_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+  tt_assert(!bitarray_is_set(changed1, 0));
+  tt_int_op(n_bits_set(changed1, 4), OP_EQ, 2);
+  tt_assert(!bitarray_is_set(changed2, 0));
+  tt_assert(bitarray_is_set(changed2, 1));
+  tt_assert(bitarray_is_set(changed2, 3));
+  tt_int_op(n_bits_set(changed2, 4), OP_EQ, 2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  changed1 = bitarray_init_zero(6);
+  changed2 = bitarray_init_zero(6);
+
+  /* All elements are changed. */
+  smartlist_clear(sl2);
+  consensus_split_lines(sl2, "b\nb\nb\nb\n", area);
+  spider_free(sls1);
+  spider_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+  tt_int_op(n_bits_set(changed1, 4), OP_EQ, 4);
+  tt_int_op(n_bits_set(changed2, 4), OP_EQ, 4);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  changed1 = bitarray_init_zero(6);
+  changed2 = bitarray_init_zero(6);
+
+  /* Only the part of the lists inside the slices is considered. */
+  smartlist_clear(sl1);
+  smartlist_clear(sl2);
+  consensus_split_lines(sl1, "x\na\nb\nc\nd\ny\n", area);
+  consensus_split_lines(sl2, "z\na\nc\ne\nd\nz\n", area);
+  spider_free(sls1);
+  spider_free(sls2);
+  sls1 = smartlist_slice(sl1, 1, 5);
+  sls2 = smartlist_slice(sl2, 1, 5);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+  tt_int_op(n_bits_set(changed1, 6), OP_EQ, 1);
+  tt_assert(bitarray_is_set(changed1, 2));
+  tt_int_op(n_bits_set(changed2, 6), OP_EQ, 1);
+  tt_assert(bitarray_is_set(changed2, 3));
+
+ done:
+  spider_free(sls1);
+  spider_free(sls2);
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
+/** Helper: Fill <b>sl</b> with <b>n</b> random one-letter lines taken from
+ * the first <b>n_letters</b> letters of the alphabet. */
+static void
+add_random_lines(smartlist_t *sl, memarea_t *area, int n, int n_letters)
+{
+  char buf[2] = { 0, 0 };
+  for (int i = 0; i < n; ++i) {
+    buf[0] = 'a' + crypto_rand_int(n_letters);
+    smartlist_add_linecpy(sl, area, buf);
+  }
+}
+
+static void
+test_consdiff_engines_agree(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_t *kept1 = smartlist_new();
+  smartlist_t *kept2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *lcs1 = NULL, *lcs2 = NULL, *myers1 = NULL, *myers2 = NULL;
+  memarea_t *area = memarea_new();
+
+  (void)arg;
+  for (int iter = 0; iter < 200; ++iter) {
+    const int n1 = crypto_rand_int(40), n2 = crypto_rand_int(40);
+    const int n_letters = 2 + crypto_rand_int(5);
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    smartlist_clear(kept1);
+    smartlist_clear(kept2);
+    add_random_lines(sl1, area, n1, n_letters);
+    add_random_lines(sl2, area, n2, n_letters);
+    lcs1 = bitarray_init_zero(n1 + 1);
+    lcs2 = bitarray_init_zero(n2 + 1);
+    myers1 = bitarray_init_zero(n1 + 1);
+    myers2 = bitarray_init_zero(n2 + 1);
+
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, lcs1, lcs2);
+    spider_free(sls1);
+    spider_free(sls2);
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes_myers(sls1, sls2, myers1, myers2);
+    spider_free(sls1);
+    spider_free(sls2);
+
+    /* Both find a shortest edit script... */
+    tt_int_op(n_bits_set(myers1, n1), OP_EQ, n_bits_set(lcs1, n1));
+    tt_int_op(n_bits_set(myers2, n2), OP_EQ, n_bits_set(lcs2, n2));
+
+    /* ...and the lines that Myers leaves alone are common to both lists. */
+    SMARTLIST_FOREACH(sl1, cdline_t *, line,
+                      if (!bitarray_is_set(myers1, line_sl_idx))
+                        smartlist_add(kept1, line));
+    SMARTLIST_FOREACH(sl2, cdline_t *, line,
+                      if (!bitarray_is_set(myers2, line_sl_idx))
+                        smartlist_add(kept2, line));
+    tt_int_op(smartlist_len(kept1), OP_EQ, smartlist_len(kept2));
+    SMARTLIST_FOREACH(kept1, cdline_t *, line,
+                      tt_assert(lines_eq(line,
+                                         smartlist_get(kept2, line_sl_idx))));
+
+    bitarray_free(lcs1);
+    bitarray_free(lcs2);
+    bitarray_free(myers1);
+    bitarray_free(myers2);
+    lcs1 = lcs2 = myers1 = myers2 = NULL;
+  }
+
+ done:
+  bitarray_free(lcs1);
+  bitarray_free(lcs2);
+  bitarray_free(myers1);
+  bitarray_free(myers2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  smartlist_free(kept1);
+  smartlist_free(kept2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -1084,6 +1261,8 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_myers),
+  CONSDIFF_LEGACY(engines_agree),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
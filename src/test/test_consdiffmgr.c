@@ -0,0 +1,273 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "or.h"
+#include "test.h"
+
+#include "config.h"
+#include "consdiff.h"
+#include "consdiffmgr.h"
+#include "cpuworker.h"
+#include "dirserv.h"
+
+/** Return a newly allocated toy consensus that differs from the one for
+ * any other value of <b>n</b>. */
+static char *
+fake_consensus(int n)
+{
+  char *cons = NULL;
+  spider_asprintf(&cons,
+                  "network-status-version 3\n"
+                  "valid-after %d\n"
+                  "r name aaaaaaaaaaaaaaaaa etc\n"
+                  "foo\n"
+                  "r name ccccccccccccccccc etc\n"
+                  "bar %d\n"
+                  "directory-signature foo bar\n"
+                  "sig\n", n, n * 7);
+  return cons;
+}
+
+/** Set <b>digest</b> to the SHA3-256 digest of <b>cons</b>. */
+static void
+sha3_of(uint8_t *digest, const char *cons)
+{
+  crypto_digest256((char*)digest, cons, strlen(cons), DIGEST_SHA3_256);
+}
+
+/** Number of times that mock_cpuworker_queue_work has been called. */
+static int n_jobs_queued = 0;
+
+/** Stand-in for the cpuworker threadpool: run each job, and its reply, as
+ * soon as it is queued. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  ++n_jobs_queued;
+  fn(NULL, arg);
+  reply_fn(arg);
+  return (workqueue_entry_t *)&n_jobs_queued;
+}
+
+/** Return the number of files in the directory where consdiffmgr keeps its
+ * consensuses. */
+static int
+n_cached_files(void)
+{
+  char *dirname = get_datadir_fname("diff-cache");
+  smartlist_t *files = spider_listdir(dirname);
+  int n = files ? smartlist_len(files) : 0;
+  if (files) {
+    SMARTLIST_FOREACH(files, char *, cp, spider_free(cp));
+    smartlist_free(files);
+  }
+  spider_free(dirname);
+  return n;
+}
+
+static void
+test_consdiffmgr_add(void *arg)
+{
+  char *c1 = fake_consensus(1), *c2 = fake_consensus(2),
+    *c3 = fake_consensus(3), *applied = NULL;
+  uint8_t d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  cached_dir_t *diff;
+  (void)arg;
+
+  sha3_of(d1, c1);
+  sha3_of(d2, c2);
+  sha3_of(d3, c3);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  /* Our consensuses go on disk, not in memory. */
+  consdiffmgr_add_consensus(c1, FLAV_NS, 1000);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 1);
+  tt_int_op(n_cached_files(), OP_EQ, 1);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_EQ, 0);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d1), OP_EQ, NULL);
+
+  /* Adding the same one again changes nothing. */
+  consdiffmgr_add_consensus(c1, FLAV_NS, 1000);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 1);
+
+  consdiffmgr_add_consensus(c2, FLAV_NS, 2000);
+  tt_int_op(n_jobs_queued, OP_EQ, 1);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 2);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_MICRODESC), OP_EQ, 0);
+  diff = consdiffmgr_find_diff_from(FLAV_NS, d1);
+  tt_assert(diff);
+  tt_assert(diff->dir_z);
+  tt_int_op(diff->published, OP_EQ, 2000);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_GE,
+            diff->dir_len + diff->dir_z_len);
+  applied = consensus_diff_apply(c1, diff->dir);
+  tt_str_op(applied, OP_EQ, c2);
+  spider_free(applied);
+  applied = consensus_diff_apply_digest(c1, d1, diff->dir);
+  tt_str_op(applied, OP_EQ, c2);
+  spider_free(applied);
+  tt_ptr_op(consensus_diff_apply_digest(c1, d2, diff->dir), OP_EQ, NULL);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d2), OP_EQ, NULL);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_MICRODESC, d1), OP_EQ, NULL);
+
+  /* A newer consensus replaces the diffs with ones to itself. */
+  consdiffmgr_add_consensus(c3, FLAV_NS, 3000);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 3);
+  diff = consdiffmgr_find_diff_from(FLAV_NS, d1);
+  tt_assert(diff);
+  applied = consensus_diff_apply(c1, diff->dir);
+  tt_str_op(applied, OP_EQ, c3);
+  spider_free(applied);
+  diff = consdiffmgr_find_diff_from(FLAV_NS, d2);
+  tt_assert(diff);
+  applied = consensus_diff_apply(c2, diff->dir);
+  tt_str_op(applied, OP_EQ, c3);
+  spider_free(applied);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d3), OP_EQ, NULL);
+
+  /* When we're done, so are the files. */
+  tt_int_op(n_cached_files(), OP_EQ, 3);
+  consdiffmgr_free_all();
+  tt_int_op(n_cached_files(), OP_EQ, 0);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  spider_free(applied);
+  spider_free(c1);
+  spider_free(c2);
+  spider_free(c3);
+  consdiffmgr_free_all();
+}
+
+/** Without cpuworkers, we keep the consensuses but don't build diffs. */
+static void
+test_consdiffmgr_no_workers(void *arg)
+{
+  char *c1 = fake_consensus(1), *c2 = fake_consensus(2);
+  uint8_t d1[DIGEST256_LEN];
+  (void)arg;
+
+  sha3_of(d1, c1);
+  tt_int_op(cpuworker_get_n_threads(), OP_EQ, 0);
+  consdiffmgr_add_consensus(c1, FLAV_NS, 1000);
+  consdiffmgr_add_consensus(c2, FLAV_NS, 2000);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 2);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d1), OP_EQ, NULL);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  spider_free(c1);
+  spider_free(c2);
+  consdiffmgr_free_all();
+}
+
+/** When we're low on memory, the diffs from the oldest consensuses go
+ * first. */
+static void
+test_consdiffmgr_oom(void *arg)
+{
+  char *cons[4];
+  uint8_t d[4][DIGEST256_LEN];
+  size_t total, freed;
+  int i;
+  (void)arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  for (i = 0; i < 4; ++i) {
+    cons[i] = fake_consensus(i + 1);
+    sha3_of(d[i], cons[i]);
+    consdiffmgr_add_consensus(cons[i], i ? FLAV_NS : FLAV_MICRODESC,
+                              (i + 1) * 1000);
+  }
+  for (i = 1; i < 3; ++i)
+    tt_assert(consdiffmgr_find_diff_from(FLAV_NS, d[i]));
+  total = consdiffmgr_get_total_allocation();
+  tt_int_op(total, OP_GT, 0);
+
+  freed = consdiffmgr_handle_oom(1);
+  tt_int_op(freed, OP_GT, 0);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_EQ, total - freed);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d[1]), OP_EQ, NULL);
+  tt_assert(consdiffmgr_find_diff_from(FLAV_NS, d[2]));
+
+  freed = consdiffmgr_handle_oom(SIZE_MAX);
+  tt_int_op(consdiffmgr_get_total_allocation(), OP_EQ, 0);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d[2]), OP_EQ, NULL);
+  tt_int_op(consdiffmgr_handle_oom(SIZE_MAX), OP_EQ, 0);
+  /* We still have the consensuses themselves. */
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 3);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  for (i = 0; i < 4; ++i)
+    spider_free(cons[i]);
+  consdiffmgr_free_all();
+}
+
+static void
+test_consdiffmgr_trim(void *arg)
+{
+  char *c1 = fake_consensus(1), *cons;
+  uint8_t d1[DIGEST256_LEN], d[DIGEST256_LEN];
+  int i;
+  (void)arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  sha3_of(d1, c1);
+  consdiffmgr_add_consensus(c1, FLAV_NS, 1000);
+
+  /* Fill up the list: we should still have a diff from the oldest. */
+  for (i = 2; i <= CONSDIFF_MAX_OLD_CONSENSUSES + 1; ++i) {
+    cons = fake_consensus(i);
+    consdiffmgr_add_consensus(cons, FLAV_NS, i * 1000);
+    spider_free(cons);
+  }
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ,
+            CONSDIFF_MAX_OLD_CONSENSUSES + 1);
+  tt_assert(consdiffmgr_find_diff_from(FLAV_NS, d1));
+
+  /* One more, and the oldest is gone. */
+  cons = fake_consensus(i);
+  sha3_of(d, cons);
+  consdiffmgr_add_consensus(cons, FLAV_NS, i * 1000);
+  spider_free(cons);
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ,
+            CONSDIFF_MAX_OLD_CONSENSUSES + 1);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d1), OP_EQ, NULL);
+  tt_ptr_op(consdiffmgr_find_diff_from(FLAV_NS, d), OP_EQ, NULL);
+  tt_int_op(n_cached_files(), OP_EQ, CONSDIFF_MAX_OLD_CONSENSUSES + 1);
+
+  /* The diffs we hand out outlive the manager's own references. */
+  cons = fake_consensus(2);
+  sha3_of(d, cons);
+  spider_free(cons);
+  {
+    cached_dir_t *diff = consdiffmgr_find_diff_from(FLAV_NS, d);
+    tt_assert(diff);
+    ++diff->refcnt;
+    consdiffmgr_free_all();
+    tt_int_op(diff->refcnt, OP_EQ, 1);
+    tt_assert(diff->dir);
+    cached_dir_decref(diff);
+  }
+  tt_int_op(consdiffmgr_n_consensuses(FLAV_NS), OP_EQ, 0);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  spider_free(c1);
+  consdiffmgr_free_all();
+}
+
+struct testcase_t consdiffmgr_tests[] = {
+  { "add", test_consdiffmgr_add, TT_FORK, NULL, NULL },
+  { "no_workers", test_consdiffmgr_no_workers, TT_FORK, NULL, NULL },
+  { "oom", test_consdiffmgr_oom, TT_FORK, NULL, NULL },
+  { "trim", test_consdiffmgr_trim, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
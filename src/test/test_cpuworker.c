@@ -0,0 +1,289 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
+#define ROUTER_PRIVATE
+#include "or.h"
+#include "channel.h"
+#include "circuitlist.h"
+#include "compat_libevent.h"
+#include "config.h"
+#include "cpuworker.h"
+#include "onion.h"
+#include "onion_tap.h"
+#include "router.h"
+
+#include "test.h"
+
+#include <event2/event.h>
+
+/** Held by the test while the only cpuworker thread is kept busy, so that
+ * everything queued behind the blocker stays queued. */
+static spider_mutex_t *blocker_lock = NULL;
+/** How many times has the blocker's reply come back? */
+static int n_blocker_replies = 0;
+
+static workqueue_reply_t
+blocker_threadfn(void *state, void *arg)
+{
+  (void) state;
+  (void) arg;
+  spider_mutex_acquire(blocker_lock);
+  spider_mutex_release(blocker_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+blocker_replyfn(void *arg)
+{
+  (void) arg;
+  ++n_blocker_replies;
+}
+
+/** The sizes of the batches that went through mock_cpuworker_queue_work,
+ * in order, as ints. */
+static smartlist_t *batch_sizes = NULL;
+/** If true, mock_cpuworker_queue_work() fails. */
+static int fail_queue_work = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  const cpuworker_batch_t *batch = arg;
+  smartlist_add(batch_sizes, (void *)(intptr_t) batch->n_jobs);
+  if (fail_queue_work)
+    return NULL;
+  return cpuworker_queue_work__real(priority, fn, reply_fn, arg);
+}
+
+/** Start a single cpuworker thread, and keep it busy until we release
+ * blocker_lock. */
+static void
+start_blocked_cpuworker(void)
+{
+  /* The cpuworkers each take a copy of our onion keys when they start. */
+  tt_int_op(init_keys_common(), OP_EQ, 0);
+  set_onion_key(pk_generate(0));
+  get_options_mutable()->NumCPUs = 1;
+  cpu_init();
+  tt_int_op(cpuworker_get_n_threads(), OP_EQ, 1);
+
+  blocker_lock = spider_mutex_new();
+  spider_mutex_acquire(blocker_lock);
+  tt_assert(cpuworker_queue_work(WQ_PRI_HIGH, blocker_threadfn,
+                                 blocker_replyfn, NULL));
+
+  batch_sizes = smartlist_new();
+  fail_queue_work = 0;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+ done:
+  ;
+}
+
+/** Let the blocked cpuworker go, and wait until it has answered the blocker
+ * and each of the <b>n</b> circuits in <b>circs</b>.  Return true iff it
+ * did so in time. */
+static int
+release_cpuworker(or_circuit_t **circs, int n)
+{
+  int i, n_tries, n_waiting = n;
+  spider_mutex_release(blocker_lock);
+
+  for (n_tries = 0; n_tries < 200; ++n_tries) {
+    struct timeval limit = { 0, 10*1000 };
+    n_waiting = 0;
+    for (i = 0; i < n; ++i) {
+      if (circs[i]->workqueue_entry)
+        ++n_waiting;
+    }
+    if (n_blocker_replies && !n_waiting)
+      return 1;
+    spider_event_base_loopexit(spider_libevent_get_base(), &limit);
+    event_base_loop(spider_libevent_get_base(), 0);
+  }
+  return 0;
+}
+
+/** Queue a TAP onionskin for each of the <b>n</b> circuits in <b>circs</b>,
+ * on <b>chan</b>.  The onionskins are garbage, so the cpuworker will answer
+ * each of them by failing its circuit. */
+static void
+queue_onionskins(or_circuit_t **circs, int n, channel_t *chan)
+{
+  uint8_t buf[TAP_ONIONSKIN_CHALLENGE_LEN] = {0};
+  int i;
+  for (i = 0; i < n; ++i) {
+    create_cell_t *cc = spider_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE, ONION_HANDSHAKE_TYPE_TAP,
+                     TAP_ONIONSKIN_CHALLENGE_LEN, buf);
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = chan;
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    TO_CIRCUIT(circs[i])->state = CIRCUIT_STATE_ONIONSKIN_PENDING;
+    tt_int_op(0, OP_EQ, onion_pending_add(circs[i], cc));
+  }
+ done:
+  ;
+}
+
+static void
+free_circuits(or_circuit_t **circs, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (circs[i]) {
+      circs[i]->p_chan = NULL;
+      circuit_free(TO_CIRCUIT(circs[i]));
+    }
+  }
+}
+
+/** Make sure that queued onionskins go to the cpuworker in batches, each
+ * of them expected to take no longer than MAX_ONIONSKIN_BATCH_USEC. */
+static void
+test_cpuworker_batches(void *arg)
+{
+  or_circuit_t *circs[10] = { NULL };
+  channel_t *chan = spider_malloc_zero(sizeof(channel_t));
+  int i;
+  (void) arg;
+
+  start_blocked_cpuworker();
+  queue_onionskins(circs, 10, chan);
+  tt_int_op(10, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+
+  /* Until we've timed a hundred onionskins, we expect each one to take a
+   * msec, so a batch holds MAX_ONIONSKIN_BATCH_USEC/1000 of them. */
+  queue_pending_tasks();
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(3, OP_EQ, smartlist_len(batch_sizes));
+  tt_int_op(4, OP_EQ, (int)(intptr_t) smartlist_get(batch_sizes, 0));
+  tt_int_op(4, OP_EQ, (int)(intptr_t) smartlist_get(batch_sizes, 1));
+  tt_int_op(2, OP_EQ, (int)(intptr_t) smartlist_get(batch_sizes, 2));
+
+  /* The circuits in a batch share its queue entry. */
+  for (i = 0; i < 10; ++i) {
+    tt_assert(circs[i]->workqueue_entry);
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ,
+              circs[i - i % 4]->workqueue_entry);
+  }
+  tt_ptr_op(circs[0]->workqueue_entry, OP_NE, circs[4]->workqueue_entry);
+  tt_ptr_op(circs[4]->workqueue_entry, OP_NE, circs[8]->workqueue_entry);
+
+  /* Every circuit gets an answer: here, that its onionskin was bad. */
+  tt_assert(release_cpuworker(circs, 10));
+  for (i = 0; i < 10; ++i) {
+    tt_assert(TO_CIRCUIT(circs[i])->marked_for_close);
+    tt_int_op(TO_CIRCUIT(circs[i])->marked_for_close_reason, OP_EQ,
+              END_CIRC_REASON_TORPROTOCOL);
+  }
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  free_circuits(circs, 10);
+  spider_free(chan);
+  smartlist_free(batch_sizes);
+  batch_sizes = NULL;
+}
+
+/** Make sure that when we cancel a circuit in the middle of a batch, the
+ * other circuits in the batch still get their answers. */
+static void
+test_cpuworker_batch_cancel(void *arg)
+{
+  or_circuit_t *circs[4] = { NULL };
+  channel_t *chan = spider_malloc_zero(sizeof(channel_t));
+  workqueue_entry_t *entry;
+  int i;
+  (void) arg;
+
+  start_blocked_cpuworker();
+  queue_onionskins(circs, 4, chan);
+  queue_pending_tasks();
+  tt_int_op(1, OP_EQ, smartlist_len(batch_sizes));
+  tt_int_op(4, OP_EQ, (int)(intptr_t) smartlist_get(batch_sizes, 0));
+  entry = circs[0]->workqueue_entry;
+  tt_assert(entry);
+
+  /* Take the second circuit out: the other three go back in the queue, as
+   * a new batch. */
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(2, OP_EQ, smartlist_len(batch_sizes));
+  tt_int_op(3, OP_EQ, (int)(intptr_t) smartlist_get(batch_sizes, 1));
+  tt_assert(circs[0]->workqueue_entry);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, circs[2]->workqueue_entry);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, circs[3]->workqueue_entry);
+
+  tt_assert(release_cpuworker(circs, 4));
+  for (i = 0; i < 4; ++i) {
+    if (i == 1) {
+      tt_assert(! TO_CIRCUIT(circs[i])->marked_for_close);
+    } else {
+      tt_assert(TO_CIRCUIT(circs[i])->marked_for_close);
+      tt_int_op(TO_CIRCUIT(circs[i])->marked_for_close_reason, OP_EQ,
+                END_CIRC_REASON_TORPROTOCOL);
+    }
+  }
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  free_circuits(circs, 4);
+  spider_free(chan);
+  smartlist_free(batch_sizes);
+  batch_sizes = NULL;
+}
+
+/** Make sure that if we can't queue the rest of a batch again after
+ * cancelling one of its circuits, we close the others rather than leaving
+ * them waiting forever. */
+static void
+test_cpuworker_batch_requeue_fails(void *arg)
+{
+  or_circuit_t *circs[4] = { NULL };
+  channel_t *chan = spider_malloc_zero(sizeof(channel_t));
+  int i;
+  (void) arg;
+
+  start_blocked_cpuworker();
+  queue_onionskins(circs, 4, chan);
+  queue_pending_tasks();
+  tt_int_op(1, OP_EQ, smartlist_len(batch_sizes));
+
+  fail_queue_work = 1;
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_int_op(2, OP_EQ, smartlist_len(batch_sizes));
+  for (i = 0; i < 4; ++i) {
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, NULL);
+    if (i == 1) {
+      tt_assert(! TO_CIRCUIT(circs[i])->marked_for_close);
+    } else {
+      tt_assert(TO_CIRCUIT(circs[i])->marked_for_close);
+      tt_int_op(TO_CIRCUIT(circs[i])->marked_for_close_reason, OP_EQ,
+                END_CIRC_REASON_RESOURCELIMIT);
+    }
+  }
+
+  /* Nothing else is left on the cpuworker. */
+  tt_assert(release_cpuworker(circs, 4));
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  free_circuits(circs, 4);
+  spider_free(chan);
+  smartlist_free(batch_sizes);
+  batch_sizes = NULL;
+}
+
+struct testcase_t cpuworker_tests[] = {
+  { "batches", test_cpuworker_batches, TT_FORK, NULL, NULL },
+  { "batch_cancel", test_cpuworker_batch_cancel, TT_FORK, NULL, NULL },
+  { "batch_requeue_fails", test_cpuworker_batch_requeue_fails, TT_FORK,
+    NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -2341,6 +2341,63 @@ test_crypto_ed25519_simple(void *arg)
   ;
 }
 
+static void
+test_crypto_ed25519_batch(void *arg)
+{
+  ed25519_keypair_t kp[4];
+  ed25519_batch_t *batch = ed25519_batch_new();
+  int okay[100];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 4; ++i)
+    tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp[i], 0));
+
+  /* An empty batch is fine. */
+  tt_int_op(0, OP_EQ, ed25519_batch_size(batch));
+  tt_int_op(0, OP_EQ, ed25519_batch_check(batch, NULL));
+
+  /* Make enough signatures to use more than one batch in donna, and spoil
+   * a few of them. */
+  for (i = 0; i < 100; ++i) {
+    ed25519_checkable_t ch;
+    uint8_t msg[40];
+    memset(msg, 0, sizeof(msg));
+    set_uint32(msg, (uint32_t)i);
+    tt_int_op(0, OP_EQ, ed25519_sign(&ch.signature, msg, sizeof(msg),
+                                     &kp[i % 4]));
+    ch.pubkey = &kp[i % 4].pubkey;
+    ch.msg = msg;
+    ch.len = sizeof(msg);
+    if (i == 7 || i == 64 || i == 99)
+      ch.signature.sig[5] ^= 1;
+    if (i == 31)
+      ch.pubkey = &kp[(i + 1) % 4].pubkey;
+    /* The batch must keep its own copy of the message. */
+    ed25519_batch_add(batch, &ch);
+    memset(msg, 0xff, sizeof(msg));
+  }
+  tt_int_op(100, OP_EQ, ed25519_batch_size(batch));
+
+  tt_int_op(-4, OP_EQ, ed25519_batch_check(batch, okay));
+  for (i = 0; i < 100; ++i) {
+    tt_int_op(okay[i], OP_EQ, !(i == 7 || i == 31 || i == 64 || i == 99));
+  }
+  tt_int_op(-4, OP_EQ, ed25519_batch_check(batch, NULL));
+
+  /* Dropping the tail drops the bad signatures in it. */
+  ed25519_batch_truncate(batch, 64);
+  tt_int_op(64, OP_EQ, ed25519_batch_size(batch));
+  tt_int_op(-2, OP_EQ, ed25519_batch_check(batch, okay));
+  ed25519_batch_truncate(batch, 7);
+  tt_int_op(0, OP_EQ, ed25519_batch_check(batch, okay));
+  for (i = 0; i < 7; ++i)
+    tt_int_op(okay[i], OP_EQ, 1);
+
+ done:
+  ed25519_batch_free(batch);
+}
+
 static void
 test_crypto_ed25519_test_vecspiders(void *arg)
 {
@@ -2985,6 +3042,7 @@ struct testcase_t crypto_tests[] = {
   { "curve25519_encode", test_crypto_curve25519_encode, 0, NULL, NULL },
   { "curve25519_persist", test_crypto_curve25519_persist, 0, NULL, NULL },
   ED25519_TEST(simple, 0),
+  ED25519_TEST(batch, 0),
   ED25519_TEST(test_vecspiders, 0),
   ED25519_TEST(encode, 0),
   ED25519_TEST(convert, 0),
@@ -17,6 +17,9 @@
 #define RELAY_PRIVATE
 
 #include "or.h"
+#include "circuitlist.h"
+#include "circuitmux_ewma.h"
+#include "circuitstats.h"
 #include "confparse.h"
 #include "config.h"
 #include "crypto_ed25519.h"
@@ -26,6 +29,7 @@
 #include "entrynodes.h"
 #include "hibernate.h"
 #include "memarea.h"
+#include "microdesc.h"
 #include "networkstatus.h"
 #include "router.h"
 #include "routerkeys.h"
@@ -766,6 +770,131 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+static int mock_checksig_batch_calls = 0;
+static int mock_checksig_batch_n = 0;
+static int mock_checksig_batch_bad_idx = -1;
+
+/** Mock for ed25519_checksig_batch(): remember how many signatures we were
+ * asked to check, and pretend that only the one at index
+ * mock_checksig_batch_bad_idx is bad. */
+static int
+mock_ed25519_checksig_batch(int *okay_out,
+                            const ed25519_checkable_t *checkable,
+                            int n_checkable)
+{
+  int i, res = 0;
+  (void) checkable;
+  ++mock_checksig_batch_calls;
+  mock_checksig_batch_n = n_checkable;
+  for (i = 0; i < n_checkable; ++i) {
+    int ok = (i != mock_checksig_batch_bad_idx);
+    if (!ok)
+      --res;
+    if (okay_out)
+      okay_out[i] = ok;
+  }
+  return res;
+}
+
+static void
+test_dir_parse_router_list_ed_batch(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  char *desc = NULL, *list = NULL;
+  const char *cp;
+  routerinfo_t *r = NULL;
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  ed25519_keypair_t kp1, kp2;
+  curve25519_keypair_t onion_keypair;
+  port_cfg_t orport;
+  char platform[256];
+  char d[DIGEST_LEN];
+
+  pk1 = pk_generate(0);
+  pk2 = pk_generate(1);
+  tt_assert(pk1 && pk2);
+  get_platform_str(platform, sizeof(platform));
+  get_options_mutable()->AssumeReachable = 1;
+
+  /* Make a descripspider with Ed25519 signatures. */
+  ed25519_keypair_generate(&kp1, 0);
+  ed25519_keypair_generate(&kp2, 0);
+  curve25519_keypair_generate(&onion_keypair, 0);
+  r = spider_malloc_zero(sizeof(routerinfo_t));
+  r->addr = 0x0a030201u; /* 10.3.2.1 */
+  r->or_port = 9005;
+  r->cache_info.published_on = time(NULL);
+  r->cache_info.signing_key_cert = spider_cert_create(&kp1,
+                                         CERT_TYPE_ID_SIGNING,
+                                         &kp2.pubkey,
+                                         time(NULL), 86400,
+                                         CERT_FLAG_INCLUDE_SIGNING_KEY);
+  r->onion_pkey = crypto_pk_dup_key(pk2);
+  r->onion_curve25519_pkey = spider_memdup(&onion_keypair.pubkey,
+                                         sizeof(curve25519_public_key_t));
+  r->identity_pkey = crypto_pk_dup_key(pk1);
+  r->bandwidthrate = r->bandwidthburst = r->bandwidthcapacity = 3000;
+  r->nickname = spider_strdup("Fred");
+  r->platform = spider_strdup(platform);
+
+  MOCK(get_configured_ports, mock_get_configured_ports);
+  mocked_configured_ports = smartlist_new();
+  memset(&orport, 0, sizeof(orport));
+  orport.type = CONN_TYPE_OR_LISTENER;
+  orport.addr.family = AF_INET;
+  orport.port = 9005;
+  smartlist_add(mocked_configured_ports, &orport);
+  desc = router_dump_router_to_string(r, pk1, pk2, &onion_keypair, &kp2);
+  UNMOCK(get_configured_ports);
+  tt_assert(desc);
+  tt_int_op(0, OP_EQ, router_get_router_hash(desc, strlen(desc), d));
+  spider_asprintf(&list, "%s%s%s", desc, desc, desc);
+
+  /* All the signatures in the list get checked in one batch. */
+  MOCK(ed25519_checksig_batch, mock_ed25519_checksig_batch);
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_int_op(1, OP_EQ, mock_checksig_batch_calls);
+  tt_int_op(9, OP_EQ, mock_checksig_batch_n);
+  tt_int_op(3, OP_EQ, smartlist_len(dest));
+  tt_int_op(0, OP_EQ, smartlist_len(invalid));
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_clear(dest);
+
+  /* A bad signature spoils only its own descripspider. */
+  mock_checksig_batch_calls = 0;
+  mock_checksig_batch_bad_idx = 4;
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_int_op(1, OP_EQ, mock_checksig_batch_calls);
+  tt_int_op(2, OP_EQ, smartlist_len(dest));
+  tt_ptr_op(smartlist_get(dest, 0), OP_NE, NULL);
+  tt_ptr_op(smartlist_get(dest, 1), OP_NE, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(invalid));
+  tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+
+ done:
+  UNMOCK(ed25519_checksig_batch);
+  UNMOCK(get_configured_ports);
+  smartlist_free(mocked_configured_ports);
+  mocked_configured_ports = NULL;
+  routerinfo_free(r);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+  spider_free(desc);
+  spider_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, spider_free(dig));
+  smartlist_free(invalid);
+}
+
 static download_status_t dls_minimal;
 static download_status_t dls_maximal;
 static download_status_t dls_bad_fingerprint;
@@ -1773,6 +1902,107 @@ test_dir_param_voting_lookup(void *arg)
 
 #undef dirvote_compute_params
 
+/** Number of times param_table_changed_cb() has been called. */
+static int n_param_table_changes = 0;
+
+static void
+param_table_changed_cb(const networkstatus_t *ns)
+{
+  (void)ns;
+  ++n_param_table_changes;
+}
+
+static int
+mock_usable_consensus_flavor_microdesc(void)
+{
+  return FLAV_MICRODESC;
+}
+
+/** Helper: return a new, empty microdesc consensus with the net_params in
+ * the space-separated list <b>params</b>. */
+static networkstatus_t *
+param_table_consensus_new(const char *params)
+{
+  networkstatus_t *ns = spider_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  ns->net_params = smartlist_new();
+  smartlist_split_string(ns->net_params, params, NULL, 0, 0);
+  return ns;
+}
+
+static void
+test_dir_param_table(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL, *ns3 = NULL;
+  (void)arg;
+
+  MOCK(usable_consensus_flavor, mock_usable_consensus_flavor_microdesc);
+
+  /* The first well-formed value wins; malformed ones are skipped. */
+  ns1 = param_table_consensus_new("ab=bad ab=90 ab=91 cd=-5 =3 ef");
+  networkstatus_parse_net_params(ns1);
+  tt_assert(ns1->net_param_table);
+  tt_int_op(90, OP_EQ, networkstatus_get_param(ns1, "ab", 0, -100, 100));
+  tt_int_op(80, OP_EQ, networkstatus_get_param(ns1, "ab", 0, -100, 80));
+  tt_int_op(-5, OP_EQ, networkstatus_get_param(ns1, "cd", 0, -100, 100));
+  tt_int_op(7, OP_EQ, networkstatus_get_param(ns1, "ef", 7, 0, 100));
+  tt_int_op(7, OP_EQ, networkstatus_get_param(ns1, "a", 7, 0, 100));
+  tt_int_op(7, OP_EQ, networkstatus_get_param(ns1, "never-seen", 7, 0, 100));
+
+  /* Watching a parameter twice with the same callback, or two parameters
+   * with one callback, only gets one call per consensus. */
+  networkstatus_watch_param("cd", param_table_changed_cb);
+  networkstatus_watch_param("cd", param_table_changed_cb);
+  networkstatus_watch_param("ab", param_table_changed_cb);
+  tt_int_op(CIRCWINDOW_START, OP_EQ, circuit_initial_package_window());
+
+  tt_int_op(0, OP_EQ,
+            networkstatus_set_current_consensus_from_ns(ns1, "microdesc"));
+  ns1 = NULL;
+  tt_int_op(n_param_table_changes, OP_EQ, 1);
+  tt_int_op(CIRCWINDOW_START, OP_EQ, circuit_initial_package_window());
+
+  /* Nothing we watch changes. */
+  ns2 = param_table_consensus_new("ab=90 cd=-5 gh=1");
+  tt_int_op(0, OP_EQ,
+            networkstatus_set_current_consensus_from_ns(ns2, "microdesc"));
+  ns2 = NULL;
+  tt_int_op(n_param_table_changes, OP_EQ, 1);
+
+  /* Names that only the consensus mentions don't get interned. */
+  tt_int_op(-1, OP_EQ, net_param_lookup_id("gh"));
+  tt_int_op(1, OP_EQ, networkstatus_get_param(NULL, "gh", 0, 0, 1));
+  tt_int_op(-1, OP_LT, net_param_lookup_id("gh"));
+
+  /* Prime the caches that the EWMA and circuit build time code keep. */
+  cell_ewma_set_scale_facspider(get_options(), NULL);
+  tt_assert(! cell_ewma_enabled());
+  tt_assert(fabs(circuit_build_times_quantile_cutoff() -
+                 CBT_DEFAULT_QUANTILE_CUTOFF/100.0) < 1e-9);
+
+  /* A parameter going away counts as a change, and cached values derived
+   * from the consensus get refreshed. */
+  ns3 = param_table_consensus_new("ab=90 cbtquantile=70 "
+                                  "CircuitPriorityHalflifeMsec=30000 "
+                                  "circwindow=500");
+  tt_int_op(0, OP_EQ,
+            networkstatus_set_current_consensus_from_ns(ns3, "microdesc"));
+  ns3 = NULL;
+  tt_int_op(n_param_table_changes, OP_EQ, 2);
+  tt_int_op(500, OP_EQ, circuit_initial_package_window());
+  tt_assert(fabs(circuit_build_times_quantile_cutoff() - 0.7) < 1e-9);
+  tt_assert(cell_ewma_enabled());
+
+ done:
+  UNMOCK(usable_consensus_flavor);
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  networkstatus_vote_free(ns3);
+  networkstatus_free_all();
+}
+
 /** Helper: Test that two networkstatus_voter_info_t do in fact represent the
  * same voting authority, and that they do in fact have all the same
  * information. */
@@ -5968,6 +6198,7 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_batch, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR_LEGACY(versions),
@@ -5977,6 +6208,7 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(measured_bw_kb_cache),
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
+  DIR(param_table, TT_FORK),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
   DIR(scale_bw, 0),
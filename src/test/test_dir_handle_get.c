@@ -27,8 +27,10 @@
 #include "routerparse.h"
 #include "networkstatus.h"
 #include "geoip.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "spidergzip.h"
+#include "spoolcache.h"
 #include "dirvote.h"
 #include "log_test_helpers.h"
 
@@ -551,6 +553,116 @@ test_dir_handle_get_micro_d(void *data)
     microdesc_free_all();
 }
 
+/** Stand-in for the cpuworker threadpool: run each job, and its reply, as
+ * soon as it is queued. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  static int dummy_entry;
+  (void) priority;
+  fn(NULL, arg);
+  reply_fn(arg);
+  return (workqueue_entry_t *) &dummy_entry;
+}
+
+static void
+test_dir_handle_get_micro_d_compressed(void *data)
+{
+  dir_connection_t *conn = NULL;
+  microdesc_cache_t *mc = NULL ;
+  smartlist_t *list = NULL;
+  char digest[DIGEST256_LEN];
+  char digest_base64[128];
+  char path[80];
+  char *header = NULL, *comp_body = NULL, *body = NULL, *answer = NULL;
+  size_t comp_body_used = 0, body_used = 0;
+  const char *errmsg = NULL;
+  int i;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  /* SETUP */
+  init_mock_options();
+  mock_options->DirCompressedCacheSize = 1<<20;
+  const char *fn = get_fname("dir_handle_datadir_test_z");
+  mock_options->DataDirecspidery = spider_strdup(fn);
+
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirecspidery));
+#else
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirecspidery, 0700));
+#endif
+
+  crypto_digest256(digest, microdesc, strlen(microdesc), DIGEST_SHA256);
+  base64_encode_nopad(digest_base64, sizeof(digest_base64),
+                      (uint8_t *) digest, DIGEST256_LEN);
+
+  mc = get_microdesc_cache();
+  list = microdescs_add_to_cache(mc, microdesc, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list));
+
+  /* The first request gets compressed as it goes, while a cpuworker builds
+   * a compressed response for the cache; the second finds that one in the
+   * cache.  Both get the same thing. */
+  spider_snprintf(path, sizeof(path), GET("/spider/micro/d/%s.z"),
+                  digest_base64);
+  for (i = 0; i < 2; ++i) {
+    conn = new_dir_conn();
+    tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+
+    fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                        &comp_body, &comp_body_used, 10000, 0);
+    tt_assert(header);
+    tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+    tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+    if (i == 0) {
+      /* Our mock connection_write_to_buf_impl_ doesn't really compress. */
+      tt_int_op(comp_body_used, OP_EQ, strlen(microdesc));
+      tt_mem_op(comp_body, OP_EQ, microdesc, comp_body_used);
+    } else {
+      tt_int_op(0, OP_EQ, spider_gzip_uncompress(&body, &body_used,
+                                                 comp_body, comp_body_used,
+                                                 ZLIB_METHOD, 1,
+                                                 LOG_PROTOCOL_WARN));
+      tt_int_op(body_used, OP_EQ, strlen(microdesc));
+      tt_mem_op(body, OP_EQ, microdesc, body_used);
+    }
+
+    connection_free_(TO_CONN(conn));
+    conn = NULL;
+    spider_free(header);
+    spider_free(comp_body);
+    spider_free(body);
+  }
+
+  tt_int_op(0, OP_EQ, getinfo_helper_spoolcache(NULL,
+                                  "dir/compressed-cache/hits", &answer,
+                                  &errmsg));
+  tt_str_op(answer, OP_EQ, "1");
+
+  done:
+    UNMOCK(get_options);
+    UNMOCK(connection_write_to_buf_impl_);
+    UNMOCK(cpuworker_queue_work);
+
+    or_options_free(mock_options); mock_options = NULL;
+    connection_free_(TO_CONN(conn));
+    spider_free(header);
+    spider_free(comp_body);
+    spider_free(body);
+    spider_free(answer);
+    smartlist_free(list);
+    spoolcache_free_all();
+    microdesc_free_all();
+}
+
 static void
 test_dir_handle_get_micro_d_server_busy(void *data)
 {
@@ -2514,6 +2626,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(micro_d_not_found, 0),
   DIR_HANDLE_CMD(micro_d_server_busy, 0),
   DIR_HANDLE_CMD(micro_d, 0),
+  DIR_HANDLE_CMD(micro_d_compressed, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_without_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_wrong_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges, 0),
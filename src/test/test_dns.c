@@ -6,6 +6,7 @@
 #include "dns.h"
 #include "connection.h"
 #include "router.h"
+#include "streammap.h"
 
 #define NS_MODULE dns
 
@@ -292,6 +293,8 @@ NS(test_main)(void *arg)
   NS_UNMOCK(send_resolved_hostname_cell);
   NS_UNMOCK(dns_cancel_pending_resolve);
   NS_UNMOCK(connection_free);
+  stream_map_free(on_circuit->n_stream_map);
+  stream_map_free(on_circuit->resolving_stream_map);
   spider_free(on_circuit);
   spider_free(exitconn);
   spider_free(nextconn);
@@ -511,8 +511,10 @@ test_ext_or_handshake(void *arg)
   MOCK(connection_tls_start_handshake, handshake_start);
 
   /* Okay, this time let's succeed. */
+  housekeeping_timers_start();
   conn = or_connection_new(CONN_TYPE_EXT_OR, AF_INET);
   do_ext_or_handshake(conn);
+  tt_ptr_op(TO_CONN(conn)->housekeeping_timer, OP_EQ, NULL);
 
   /* Now let's run through some messages. */
   /* First let's send some junk and make sure it's ignored. */
@@ -543,6 +545,8 @@ test_ext_or_handshake(void *arg)
   tt_int_op(handshake_start_called,OP_EQ,1);
   tt_int_op(TO_CONN(conn)->type, OP_EQ, CONN_TYPE_OR);
   tt_int_op(TO_CONN(conn)->state, OP_EQ, 0);
+  /* As an OR connection, it needs keepalives and idle expiry. */
+  tt_assert(TO_CONN(conn)->housekeeping_timer);
   close_closeable_connections();
   conn = NULL;
 
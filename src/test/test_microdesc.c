@@ -2,13 +2,19 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define ROUTERPARSE_PRIVATE
+#define ROUTER_PRIVATE
 #include "or.h"
 
+#include "compat_libevent.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "dirvote.h"
 #include "microdesc.h"
 #include "networkstatus.h"
+#include "parsecommon.h"
 #include "routerlist.h"
+#include "router.h"
 #include "routerparse.h"
 #include "spidercert.h"
 
@@ -20,6 +26,8 @@ DISABLE_GCC_WARNING(redundant-decls)
 #include <openssl/pem.h>
 ENABLE_GCC_WARNING(redundant-decls)
 
+#include <event2/event.h>
+
 #ifdef _WIN32
 /* For mkdir() */
 #include <direct.h>
@@ -723,6 +731,215 @@ test_md_parse(void *arg)
   spider_free(mem_op_hex_tmp);
 }
 
+/** Make sure that parsing microdescripspiders in pieces gives the same
+ * results as parsing them one at a time, however we split them. */
+static void
+test_md_parse_pieces(void *arg)
+{
+  (void) arg;
+  const char *start = MD_PARSE_TEST_DATA;
+  const char *eos = start + strlen(start);
+  const char *s = eat_whitespace_eos(start, eos);
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *invalid2 = smartlist_new();
+  smartlist_t *mds2 = NULL;
+  int n_pieces;
+
+  smartlist_t *mds = microdescs_parse_from_string(start, NULL, 1,
+                                                  SAVED_NOWHERE, invalid);
+  tt_int_op(smartlist_len(mds), OP_EQ, 11);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 4);
+
+  for (n_pieces = 1; n_pieces <= 20; ++n_pieces) {
+    mds2 = microdescs_parse_in_pieces(start, s, eos, TS_ANNOTATIONS_OK,
+                                      SAVED_NOWHERE, invalid2, n_pieces);
+    tt_int_op(smartlist_len(mds2), OP_EQ, smartlist_len(mds));
+    tt_int_op(smartlist_len(invalid2), OP_EQ, smartlist_len(invalid));
+    SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+      const microdesc_t *md2 = smartlist_get(mds2, md_sl_idx);
+      tt_mem_op(md2->digest, OP_EQ, md->digest, DIGEST256_LEN);
+      tt_int_op(md2->off, OP_EQ, md->off);
+      tt_int_op(md2->bodylen, OP_EQ, md->bodylen);
+    } SMARTLIST_FOREACH_END(md);
+    SMARTLIST_FOREACH(invalid, const char *, d,
+      tt_mem_op(smartlist_get(invalid2, d_sl_idx), OP_EQ, d, DIGEST256_LEN));
+
+    SMARTLIST_FOREACH(mds2, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds2);
+    mds2 = NULL;
+    SMARTLIST_FOREACH(invalid2, char *, cp, spider_free(cp));
+    smartlist_clear(invalid2);
+  }
+
+ done:
+  SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  if (mds2) {
+    SMARTLIST_FOREACH(mds2, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds2);
+  }
+  SMARTLIST_FOREACH(invalid, char *, cp, spider_free(cp));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(invalid2, char *, cp, spider_free(cp));
+  smartlist_free(invalid2);
+}
+
+/** A microdescriptor whose "a" lines are malformed in every way that the
+ * address parser complains about.  It should still parse. */
+static const char MD_BAD_ADDRESSES[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBANsKd1GRfOuSR1MkcwKqs6SVy4Gi/JXplt/bHDkIGm6Q96TeJ5uyVgUL\n"
+  "DBr/ij6+JqgVFeriuiMzHKREytzjdaTuKsKBFFpLwb+Ppcjr5nMIH/AR6/aHO8hW\n"
+  "T3B9lx5T6Kl7CqZ4yqXxYRHzn50EPTIZuz0y9se4J4gi9mLmL+pHAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "a [zz::1]:9090\n"
+  "a [::1:2:3:4]/1.2.3:9090\n"
+  "a [::1:2:3:4]:90000\n"
+  "a [::1:2:3:4]:1-x\n"
+  "a [::1:2:3:4\n"
+  "id rsa1024 GEo59/iR1GWSIWZDzXTd5QxtqnU\n";
+
+/** A job that test_md_parse_pieces_threaded() saw go to a cpuworker. */
+typedef struct md_test_work_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} md_test_work_t;
+
+static smartlist_t *md_test_work = NULL;
+static int md_test_n_replies = 0;
+
+static workqueue_reply_t
+md_test_work_threadfn(void *state, void *arg)
+{
+  md_test_work_t *w = arg;
+  return w->fn(state, w->arg);
+}
+
+static void
+md_test_work_replyfn(void *arg)
+{
+  md_test_work_t *w = arg;
+  w->reply_fn(w->arg);
+  ++md_test_n_replies;
+}
+
+/* Pass work through to the real cpuworkers, but count the replies. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work_counting(workqueue_priority_t priority,
+                                   workqueue_reply_t (*fn)(void *, void *),
+                                   void (*reply_fn)(void *),
+                                   void *arg)
+{
+  md_test_work_t *w = spider_malloc_zero(sizeof(md_test_work_t));
+  w->fn = fn;
+  w->reply_fn = reply_fn;
+  w->arg = arg;
+  smartlist_add(md_test_work, w);
+  return cpuworker_queue_work__real(priority, md_test_work_threadfn,
+                                    md_test_work_replyfn, w);
+}
+
+static void
+test_md_parse_pieces_threaded(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *invalid2 = smartlist_new();
+  smartlist_t *mds = NULL, *mds2 = NULL;
+  char *data = NULL;
+  const char *s, *eos;
+  smartlist_t *chunks = smartlist_new();
+  int i, n_tries;
+
+  /* Big enough that microdescs_parse_from_string() goes parallel. */
+  for (i = 0; i < 64; ++i) {
+    smartlist_add(chunks, (char *) MD_PARSE_TEST_DATA);
+    smartlist_add(chunks, (char *) MD_BAD_ADDRESSES);
+  }
+  data = smartlist_join_strings(chunks, "", 0, NULL);
+  eos = data + strlen(data);
+  s = eat_whitespace_eos(data, eos);
+
+  /* The cpuworkers each take a copy of our onion keys when they start. */
+  tt_int_op(init_keys_common(), OP_EQ, 0);
+  set_onion_key(pk_generate(0));
+  get_options_mutable()->NumCPUs = 2;
+  cpu_init();
+  tt_int_op(cpuworker_get_n_threads(), OP_EQ, 2);
+  md_test_work = smartlist_new();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_counting);
+
+  /* One piece, all on this thread: the reference answer. */
+  mds = microdescs_parse_in_pieces(data, s, eos, TS_ANNOTATIONS_OK,
+                                   SAVED_NOWHERE, invalid, 1);
+  tt_int_op(smartlist_len(md_test_work), OP_EQ, 0);
+  tt_int_op(smartlist_len(mds), OP_EQ, 12 * 64);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 4 * 64);
+
+  /* Keep going until a worker has taken at least one piece before we could
+   * cancel it, so that we've waited for one. */
+  for (n_tries = 0; n_tries < 50; ++n_tries) {
+    int n_queued_before = smartlist_len(md_test_work);
+    if (n_tries == 0)
+      mds2 = microdescs_parse_from_string(data, NULL, 1, SAVED_NOWHERE,
+                                          invalid2);
+    else
+      mds2 = microdescs_parse_in_pieces(data, s, eos, TS_ANNOTATIONS_OK,
+                                        SAVED_NOWHERE, invalid2, 3);
+    tt_int_op(smartlist_len(md_test_work), OP_GT, n_queued_before);
+
+    tt_int_op(smartlist_len(mds2), OP_EQ, smartlist_len(mds));
+    tt_int_op(smartlist_len(invalid2), OP_EQ, smartlist_len(invalid));
+    SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+      const microdesc_t *md2 = smartlist_get(mds2, md_sl_idx);
+      tt_mem_op(md2->digest, OP_EQ, md->digest, DIGEST256_LEN);
+      tt_int_op(md2->off, OP_EQ, md->off);
+    } SMARTLIST_FOREACH_END(md);
+    SMARTLIST_FOREACH(invalid, const char *, d,
+      tt_mem_op(smartlist_get(invalid2, d_sl_idx), OP_EQ, d, DIGEST256_LEN));
+
+    SMARTLIST_FOREACH(mds2, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds2);
+    mds2 = NULL;
+    SMARTLIST_FOREACH(invalid2, char *, cp, spider_free(cp));
+    smartlist_clear(invalid2);
+
+    /* Let the replies for the pieces the workers took come back. */
+    {
+      struct timeval limit = { 0, 50*1000 };
+      spider_event_base_loopexit(spider_libevent_get_base(), &limit);
+      event_base_loop(spider_libevent_get_base(), 0);
+    }
+    if (md_test_n_replies > 0)
+      break;
+  }
+  tt_int_op(md_test_n_replies, OP_GT, 0);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  /* The jobs themselves were freed by their reply functions, or by the
+   * parser when it cancelled them. */
+  SMARTLIST_FOREACH(md_test_work, md_test_work_t *, w, spider_free(w));
+  smartlist_free(md_test_work);
+  md_test_work = NULL;
+  if (mds) {
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds);
+  }
+  if (mds2) {
+    SMARTLIST_FOREACH(mds2, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds2);
+  }
+  SMARTLIST_FOREACH(invalid, char *, cp, spider_free(cp));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(invalid2, char *, cp, spider_free(cp));
+  smartlist_free(invalid2);
+  smartlist_free(chunks);
+  spider_free(data);
+}
+
 static int mock_rgsbd_called = 0;
 static routerstatus_t *mock_rgsbd_val_a = NULL;
 static routerstatus_t *mock_rgsbd_val_b = NULL;
@@ -856,6 +1073,9 @@ struct testcase_t microdesc_tests[] = {
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
+  { "parse_pieces", test_md_parse_pieces, 0, NULL, NULL },
+  { "parse_pieces_threaded", test_md_parse_pieces_threaded, TT_FORK,
+    NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   { "corrupt_desc", test_md_corrupt_desc, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -4,10 +4,17 @@
 #include "or.h"
 #define CIRCUITBUILD_PRIVATE
 #include "circuitbuild.h"
+#include "config.h"
+#include "connection_or.h"
+#include "cpuworker.h"
 #define RELAY_PRIVATE
 #include "relay.h"
+#define RELAYCRYPT_PRIVATE
+#include "relaycrypt.h"
 /* For init/free stuff */
 #include "scheduler.h"
+#define STREAMMAP_PRIVATE
+#include "streammap.h"
 
 /* Test suite stuff */
 #include "test.h"
@@ -16,6 +23,9 @@
 static or_circuit_t * new_fake_orcirc(channel_t *nchan, channel_t *pchan);
 
 static void test_relay_append_cell_to_circuit_queue(void *arg);
+static void test_relay_forward_packed_cell(void *arg);
+static void test_relay_crypt_pipeline(void *arg);
+static void test_relay_stream_map(void *arg);
 
 static or_circuit_t *
 new_fake_orcirc(channel_t *nchan, channel_t *pchan)
@@ -126,9 +136,332 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_forward_packed_cell(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  packed_cell_t *packed = NULL, *queued = NULL;
+  crypto_cipher_t *expect_crypto = NULL;
+  cell_t cell;
+  char key[CIPHER_KEY_LEN];
+  uint8_t expected[CELL_PAYLOAD_SIZE];
+
+  (void)arg;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+  /* Make the next hop use a different circuit ID width. */
+  nchan->wide_circ_ids = 1;
+  pchan->wide_circ_ids = 0;
+
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  memset(key, 0x5a, sizeof(key));
+  orcirc->p_crypto = crypto_cipher_new(key);
+  expect_crypto = crypto_cipher_new(key);
+
+  tt_assert(circuit_can_receive_relay_packed_cell(TO_CIRCUIT(orcirc),
+                                                  CELL_DIRECTION_IN));
+  tt_assert(circuit_can_receive_relay_packed_cell(TO_CIRCUIT(orcirc),
+                                                  CELL_DIRECTION_OUT));
+
+  /* An inbound cell, as it arrived from the wide-ID next hop. */
+  make_fake_cell(&cell);
+  cell.circ_id = orcirc->base_.n_circ_id;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+  memcpy(expected, cell.payload, sizeof(expected));
+  crypto_cipher_crypt_inplace(expect_crypto, (char*)expected,
+                              sizeof(expected));
+  packed = packed_cell_new();
+  cell_pack(packed, &cell, 1);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  tt_int_op(0, OP_EQ,
+            circuit_receive_relay_packed_cell(packed, TO_CIRCUIT(orcirc),
+                                              CELL_DIRECTION_IN, 1));
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+
+  /* The very same cell went onto the queue, re-addressed and crypted. */
+  queued = cell_queue_pop(&orcirc->p_chan_cells);
+  tt_ptr_op(queued, OP_EQ, packed);
+  tt_int_op(packed_cell_get_circid(queued, 0), OP_EQ, orcirc->p_circ_id);
+  tt_int_op(packed_cell_get_command(queued, 0), OP_EQ, CELL_RELAY);
+  tt_mem_op(queued->body + 3, OP_EQ, expected, CELL_PAYLOAD_SIZE);
+
+  /* Nothing to forward to: the packed route isn't available. */
+  orcirc->p_chan = NULL;
+  tt_assert(! circuit_can_receive_relay_packed_cell(TO_CIRCUIT(orcirc),
+                                                    CELL_DIRECTION_IN));
+  orcirc->p_chan = pchan;
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  packed_cell_free(queued);
+  crypto_cipher_free(expect_crypto);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    crypto_cipher_free(orcirc->p_crypto);
+  }
+  spider_free(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+static or_options_t *mock_options = NULL;
+static const or_options_t *
+mock_get_options(void)
+{
+  return mock_options;
+}
+
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 2;
+}
+
+/* The last job that was given to mock_cpuworker_queue_work(). */
+static workqueue_reply_t (*mock_work_fn)(void *, void *) = NULL;
+static void (*mock_reply_fn)(void *) = NULL;
+static void *mock_work_arg = NULL;
+static int mock_n_work_queued = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  mock_work_fn = fn;
+  mock_reply_fn = reply_fn;
+  mock_work_arg = arg;
+  ++mock_n_work_queued;
+  return (workqueue_entry_t *)&mock_work_arg;
+}
+
+/* Pretend to be the cpuworker, and then the reply queue. */
+static void
+run_mock_work(void)
+{
+  void *arg = mock_work_arg;
+  mock_work_arg = NULL;
+  tt_int_op(mock_work_fn(NULL, arg), OP_EQ, WQ_RPL_REPLY);
+  mock_reply_fn(arg);
+ done:
+  ;
+}
+
+static void
+test_relay_crypt_pipeline(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  packed_cell_t *packed, *queued = NULL;
+  crypto_cipher_t *expect_crypto = NULL;
+  cell_t cell;
+  char key[CIPHER_KEY_LEN];
+  uint8_t expected[5][CELL_PAYLOAD_SIZE];
+  uint64_t old_n_relayed = stats_n_relay_cells_relayed;
+  int i;
+
+  (void)arg;
+
+  mock_options = spider_malloc_zero(sizeof(or_options_t));
+  mock_options->RelayCryptoOffload = 1;
+  MOCK(get_options, mock_get_options);
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+  nchan->wide_circ_ids = 0;
+  pchan->wide_circ_ids = 1;
+
+  orcirc = new_fake_orcirc(nchan, pchan);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+
+  memset(key, 0x33, sizeof(key));
+  orcirc->p_crypto = crypto_cipher_new(key);
+  expect_crypto = crypto_cipher_new(key);
+
+  /* Three inbound packed cells from the narrow-ID next hop, then one that
+   * took the unpacked route, then one that we packaged ourselves. */
+  for (i = 0; i < 5; ++i) {
+    make_fake_cell(&cell);
+    cell.circ_id = orcirc->base_.n_circ_id;
+    crypto_rand((char*)cell.payload, sizeof(cell.payload));
+    memcpy(expected[i], cell.payload, CELL_PAYLOAD_SIZE);
+    crypto_cipher_crypt_inplace(expect_crypto, (char*)expected[i],
+                                CELL_PAYLOAD_SIZE);
+    if (i < 3) {
+      packed = packed_cell_new();
+      cell_pack(packed, &cell, 0);
+      tt_int_op(0, OP_EQ,
+                circuit_receive_relay_packed_cell(packed, TO_CIRCUIT(orcirc),
+                                                  CELL_DIRECTION_IN, 0));
+    } else if (i == 3) {
+      tt_int_op(0, OP_EQ,
+                circuit_receive_relay_cell(&cell, TO_CIRCUIT(orcirc),
+                                           CELL_DIRECTION_IN));
+    } else {
+      packed = packed_cell_new();
+      cell_pack(packed, &cell, 1);
+      relay_crypt_pipe_add_packaged(orcirc, packed, 7);
+    }
+  }
+
+  /* The first cell went out alone; the rest wait behind it. */
+  tt_int_op(mock_n_work_queued, OP_EQ, 1);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+  tt_assert(relay_crypt_pipe_is_busy(orcirc, CELL_DIRECTION_IN));
+  tt_assert(! relay_crypt_pipe_is_busy(orcirc, CELL_DIRECTION_OUT));
+  tt_int_op(relay_crypt_pipes_n_pending(orcirc), OP_EQ, 5);
+
+  run_mock_work();
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+  tt_int_op(mock_n_work_queued, OP_EQ, 2);
+  tt_int_op(relay_crypt_pipes_n_pending(orcirc), OP_EQ, 4);
+
+  run_mock_work();
+  tt_int_op(mock_n_work_queued, OP_EQ, 2);
+  tt_assert(! relay_crypt_pipe_is_busy(orcirc, CELL_DIRECTION_IN));
+  tt_int_op(relay_crypt_pipes_n_pending(orcirc), OP_EQ, 0);
+
+  /* Only the cells that we relayed count as relayed; the caller counts the
+   * one we packaged. */
+  tt_u64_op(stats_n_relay_cells_relayed, OP_EQ, old_n_relayed + 4);
+
+  /* Every cell left in order, addressed for the previous hop, and crypted
+   * with the circuit's cipher. */
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 5);
+  for (i = 0; i < 5; ++i) {
+    queued = cell_queue_pop(&orcirc->p_chan_cells);
+    tt_int_op(packed_cell_get_circid(queued, 1), OP_EQ, orcirc->p_circ_id);
+    tt_int_op(packed_cell_get_command(queued, 1), OP_EQ, CELL_RELAY);
+    tt_mem_op(queued->body + 5, OP_EQ, expected[i], CELL_PAYLOAD_SIZE);
+    packed_cell_free(queued);
+    queued = NULL;
+  }
+
+ done:
+  UNMOCK(get_options);
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  packed_cell_free(queued);
+  crypto_cipher_free(expect_crypto);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    relay_crypt_pipes_clear(orcirc);
+    if (orcirc->p_crypt_pipe)
+      smartlist_free(orcirc->p_crypt_pipe->packaged);
+    spider_free(orcirc->p_crypt_pipe);
+    crypto_cipher_free(orcirc->p_crypto);
+  }
+  spider_free(orcirc);
+  spider_free(mock_options);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+static void
+test_relay_stream_map(void *arg)
+{
+  stream_map_t *map = NULL;
+  edge_connection_t *conns = NULL, *found = NULL, dup, zero;
+  const int n_conns = 100;
+  int i;
+
+  (void)arg;
+
+  conns = spider_calloc(n_conns, sizeof(edge_connection_t));
+  memset(&dup, 0, sizeof(dup));
+  memset(&zero, 0, sizeof(zero));
+
+  /* Nothing is found in a map that doesn't exist yet. */
+  tt_int_op(0, OP_EQ, stream_map_lookup(map, 1, &found));
+  stream_map_remove(map, &conns[0]);
+
+  /* Enough streams to make the map grow a few times. */
+  for (i = 0; i < n_conns; ++i) {
+    conns[i].stream_id = (streamid_t)(0x7ff0 + i);
+    stream_map_add(&map, &conns[i]);
+  }
+  tt_assert(map);
+  tt_int_op(map->n_entries, OP_EQ, n_conns);
+  tt_int_op(map->n_entries * 4, OP_LE, map->capacity * 3);
+  for (i = 0; i < n_conns; ++i) {
+    found = NULL;
+    tt_int_op(1, OP_EQ, stream_map_lookup(map, conns[i].stream_id, &found));
+    tt_ptr_op(found, OP_EQ, &conns[i]);
+  }
+  tt_int_op(0, OP_EQ, stream_map_lookup(map, 0x7ff0 + n_conns, NULL));
+
+  /* Stream ID zero is never indexed. */
+  stream_map_add(&map, &zero);
+  tt_int_op(map->n_entries, OP_EQ, n_conns);
+  tt_int_op(0, OP_EQ, stream_map_lookup(map, 0, NULL));
+
+  /* Duplicate IDs are reported as ambiguous until one goes away. */
+  dup.stream_id = conns[7].stream_id;
+  stream_map_add(&map, &dup);
+  tt_int_op(2, OP_EQ, stream_map_lookup(map, dup.stream_id, NULL));
+  stream_map_remove(map, &conns[7]);
+  tt_int_op(1, OP_EQ, stream_map_lookup(map, dup.stream_id, &found));
+  tt_ptr_op(found, OP_EQ, &dup);
+  stream_map_remove(map, &dup);
+  tt_int_op(0, OP_EQ, stream_map_lookup(map, dup.stream_id, NULL));
+
+  /* Removing everything and re-adding under new IDs reuses the slots
+   * without letting tombstones pile up. */
+  for (i = 0; i < n_conns; ++i) {
+    stream_map_remove(map, &conns[i]);
+    conns[i].stream_id = (streamid_t)(i + 1);
+    stream_map_add(&map, &conns[i]);
+  }
+  tt_int_op(map->n_entries, OP_EQ, n_conns);
+  tt_int_op((map->n_entries + map->n_tombstones) * 4, OP_LE,
+            map->capacity * 3);
+  for (i = 0; i < n_conns; ++i) {
+    tt_int_op(1, OP_EQ, stream_map_lookup(map, i + 1, &found));
+    tt_ptr_op(found, OP_EQ, &conns[i]);
+  }
+
+ done:
+  stream_map_free(map);
+  spider_free(conns);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "forward_packed_cell", test_relay_forward_packed_cell,
+    TT_FORK, NULL, NULL },
+  { "crypt_pipeline", test_relay_crypt_pipeline, TT_FORK, NULL, NULL },
+  { "stream_map", test_relay_stream_map, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -56,6 +56,7 @@ static struct event_base * spider_libevent_get_base_mock(void);
 static void test_scheduler_channel_states(void *arg);
 static void test_scheduler_compare_channels(void *arg);
 static void test_scheduler_initfree(void *arg);
+static void test_scheduler_kist(void *arg);
 static void test_scheduler_loop(void *arg);
 static void test_scheduler_queue_heuristic(void *arg);
 
@@ -711,6 +712,154 @@ test_scheduler_loop(void *arg)
   UNMOCK(spider_libevent_get_base);
 }
 
+/* Number of cells the channel_flush_some_cells() mock still holds for
+ * <b>chan</b> */
+static ssize_t
+channel_flush_some_cells_mock_left(const channel_t *chan)
+{
+  if (!chans_for_flush_mock)
+    return 0;
+  SMARTLIST_FOREACH(chans_for_flush_mock, flush_mock_channel_t *, ch,
+                    if (ch->chan == chan) return ch->cells);
+  return 0;
+}
+
+static int
+channel_more_to_flush_mock(channel_t *chan)
+{
+  return channel_flush_some_cells_mock_left(chan) > 0;
+}
+
+static channel_t *kist_mock_known_chan = NULL;
+
+/* Give kist_mock_known_chan a socket with room for 4000 bytes, and
+ * pretend we can't ask about any other. */
+static int
+kist_get_socket_info_mock(channel_t *chan, kist_socket_info_t *info_out)
+{
+  if (chan != kist_mock_known_chan)
+    return -1;
+  info_out->cwnd = 2;
+  info_out->unacked = 0;
+  info_out->mss = 1000;
+  info_out->notsent = 0;
+  return 0;
+}
+
+static void
+test_scheduler_kist(void *arg)
+{
+  channel_t *ch1 = NULL, *ch2 = NULL;
+  kist_socket_info_t info;
+  int cells_per_tick;
+
+  (void)arg;
+
+  /* Limits straight from the socket state */
+  info.cwnd = 10;
+  info.unacked = 4;
+  info.mss = 1448;
+  info.notsent = 3000;
+  tt_i64_op(kist_compute_limit(&info, 1.0), ==, 6*1448 + (10*1448 - 3000));
+  tt_i64_op(kist_compute_limit(&info, 0.0), ==, 6*1448);
+  info.notsent = 20000;
+  tt_i64_op(kist_compute_limit(&info, 1.0), ==, 6*1448);
+  info.unacked = 12;
+  tt_i64_op(kist_compute_limit(&info, 2.0), ==, 2*10*1448 - 20000);
+  info.notsent = 40000;
+  tt_i64_op(kist_compute_limit(&info, 2.0), ==, 0);
+
+  mock_event_init();
+  MOCK(spider_libevent_get_base, spider_libevent_get_base_mock);
+  scheduler_init();
+  MOCK(scheduler_compare_channels, scheduler_compare_channels_mock);
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(kist_get_socket_info, kist_get_socket_info_mock);
+
+  tt_int_op(scheduler_get_type(), ==, SCHEDULER_VANILLA);
+  scheduler_set_type(SCHEDULER_KIST, 10, 1.0);
+  tt_int_op(scheduler_get_type(), ==, SCHEDULER_KIST);
+
+  ch1 = new_fake_channel();
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  ch2 = new_fake_channel();
+  ch2->cmux = circuitmux_alloc();
+  channel_register(ch2);
+  kist_mock_known_chan = ch1;
+
+  /* Both pending, with more cells than one tick's worth on ch1 */
+  channel_flush_some_cells_mock_set(ch1, 30);
+  channel_flush_some_cells_mock_set(ch2, 5);
+  scheduler_channel_wants_writes(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  scheduler_channel_wants_writes(ch2);
+  scheduler_channel_has_waiting_cells(ch2);
+  tt_int_op(smartlist_len(channels_pending), ==, 2);
+
+  cells_per_tick = 4000 / (int)(get_cell_network_size(ch1->wide_circ_ids) +
+                                29);
+
+  UNMOCK(scheduler_run);
+  scheduler_run();
+
+  /* ch1 stopped at its socket's limit, and waits for the next tick... */
+  tt_int_op(channel_flush_some_cells_mock_left(ch1), ==, 30 - cells_per_tick);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_WAITING_TO_WRITE);
+  tt_int_op(smartlist_len(kist_channels_blocked), ==, 1);
+  tt_ptr_op(smartlist_get(kist_channels_blocked, 0), ==, ch1);
+  /* ...but we can't ask about ch2's socket, so it wrote everything. */
+  tt_int_op(channel_flush_some_cells_mock_left(ch2), ==, 0);
+  tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_WAITING_FOR_CELLS);
+  tt_int_op(smartlist_len(channels_pending), ==, 0);
+
+  /* Next tick, ch1 gets the same amount again */
+  scheduler_run();
+  tt_int_op(channel_flush_some_cells_mock_left(ch1), ==,
+            30 - 2*cells_per_tick);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_WAITING_TO_WRITE);
+  tt_int_op(smartlist_len(kist_channels_blocked), ==, 1);
+
+  /* Falling back to vanilla makes it pending again at once */
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+  scheduler_set_type(SCHEDULER_VANILLA, 10, 1.0);
+  tt_int_op(smartlist_len(kist_channels_blocked), ==, 0);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(smartlist_len(channels_pending), ==, 1);
+
+  /* And closing a blocked channel takes it off the list */
+  scheduler_set_type(SCHEDULER_KIST, 10, 1.0);
+  UNMOCK(scheduler_run);
+  scheduler_run();
+  tt_int_op(smartlist_len(kist_channels_blocked), ==, 1);
+  channel_mark_for_close(ch1);
+  channel_closed(ch1);
+  tt_int_op(smartlist_len(kist_channels_blocked), ==, 0);
+  ch1 = NULL;
+  channel_mark_for_close(ch2);
+  channel_closed(ch2);
+  ch2 = NULL;
+
+  channel_flush_some_cells_mock_free_all();
+  channel_free_all();
+  scheduler_free_all();
+  mock_event_free_all();
+
+ done:
+  spider_free(ch1);
+  spider_free(ch2);
+  kist_mock_known_chan = NULL;
+
+  UNMOCK(kist_get_socket_info);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(scheduler_compare_channels);
+  UNMOCK(scheduler_run);
+  UNMOCK(spider_libevent_get_base);
+}
+
 static void
 test_scheduler_queue_heuristic(void *arg)
 {
@@ -750,6 +899,7 @@ struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
+  { "kist", test_scheduler_kist, TT_FORK, NULL, NULL },
   { "loop", test_scheduler_loop, TT_FORK, NULL, NULL },
   { "queue_heuristic", test_scheduler_queue_heuristic,
     TT_FORK, NULL, NULL },
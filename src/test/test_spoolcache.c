@@ -0,0 +1,237 @@
+/* Copyright (c) 2017, The Spider Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define SPOOLCACHE_PRIVATE
+#include "or.h"
+#include "test.h"
+
+#include "config.h"
+#include "cpuworker.h"
+#include "dirserv.h"
+#include "spoolcache.h"
+
+static or_options_t *mock_options = NULL;
+static const or_options_t *
+mock_get_options(void)
+{
+  return mock_options;
+}
+
+/** Return a new cached_dir_t whose compressed body is <b>len</b> bytes
+ * long, holding one reference. */
+static cached_dir_t *
+fake_bundle(size_t len)
+{
+  cached_dir_t *d = spider_malloc_zero(sizeof(cached_dir_t));
+  d->refcnt = 1;
+  d->dir_z = spider_malloc_zero(len);
+  d->dir_z_len = len;
+  d->dir_len = len * 3;
+  return d;
+}
+
+/** Return the answer to GETINFO <b>question</b> as a number. */
+static uint64_t
+getinfo_u64(const char *question)
+{
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  uint64_t val;
+  spider_assert(getinfo_helper_spoolcache(NULL, question, &answer,
+                                          &errmsg) == 0);
+  spider_assert(answer);
+  val = spider_parse_uint64(answer, 10, 0, UINT64_MAX, NULL, NULL);
+  spider_free(answer);
+  return val;
+}
+
+static void
+test_spoolcache_lru(void *arg)
+{
+  uint8_t keys[5][DIGEST256_LEN];
+  cached_dir_t *dirs[5], *big = fake_bundle(1001);
+  int i;
+  (void)arg;
+
+  mock_options = spider_malloc_zero(sizeof(or_options_t));
+  mock_options->DirCompressedCacheSize = 4000;
+  MOCK(get_options, mock_get_options);
+  for (i = 0; i < 5; ++i) {
+    memset(keys[i], i + 1, DIGEST256_LEN);
+    dirs[i] = fake_bundle(1000);
+  }
+
+  tt_ptr_op(spoolcache_lookup(keys[0]), OP_EQ, NULL);
+  for (i = 0; i < 4; ++i)
+    spoolcache_add(keys[i], dirs[i]);
+  tt_int_op(dirs[0]->refcnt, OP_EQ, 2);
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 4000);
+
+  /* Using the first one makes the second the one to drop when we need
+   * room. */
+  tt_ptr_op(spoolcache_lookup(keys[0]), OP_EQ, dirs[0]);
+  spoolcache_add(keys[4], dirs[4]);
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 4000);
+  tt_ptr_op(spoolcache_lookup(keys[1]), OP_EQ, NULL);
+  tt_int_op(dirs[1]->refcnt, OP_EQ, 1);
+  tt_ptr_op(spoolcache_lookup(keys[0]), OP_EQ, dirs[0]);
+  tt_ptr_op(spoolcache_lookup(keys[4]), OP_EQ, dirs[4]);
+
+  /* Anything over a quarter of the budget isn't worth keeping. */
+  spoolcache_add(keys[1], big);
+  tt_int_op(big->refcnt, OP_EQ, 1);
+  tt_ptr_op(spoolcache_lookup(keys[1]), OP_EQ, NULL);
+
+  tt_u64_op(getinfo_u64("dir/compressed-cache/hits"), OP_EQ, 3);
+  tt_u64_op(getinfo_u64("dir/compressed-cache/misses"), OP_EQ, 3);
+  tt_u64_op(getinfo_u64("dir/compressed-cache/bytes-saved"), OP_EQ, 9000);
+  tt_u64_op(getinfo_u64("dir/compressed-cache/bytes"), OP_EQ, 4000);
+
+  spoolcache_free_all();
+  tt_int_op(dirs[0]->refcnt, OP_EQ, 1);
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 0);
+
+ done:
+  spoolcache_free_all();
+  UNMOCK(get_options);
+  spider_free(mock_options);
+  for (i = 0; i < 5; ++i)
+    cached_dir_decref(dirs[i]);
+  cached_dir_decref(big);
+}
+
+/** The jobs that mock_cpuworker_queue_work() has been asked to run. */
+static smartlist_t *queued_jobs = NULL;
+/** The reply function for the jobs in queued_jobs. */
+static void (*queued_reply_fn)(void *) = NULL;
+
+/** Stand-in for the cpuworker threadpool: run each job at once, but hold
+ * on to its reply until run_replies(). */
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  fn(NULL, arg);
+  queued_reply_fn = reply_fn;
+  smartlist_add(queued_jobs, arg);
+  return (workqueue_entry_t *)queued_jobs;
+}
+
+/** Deliver the replies that mock_cpuworker_queue_work() held back. */
+static void
+run_replies(void)
+{
+  SMARTLIST_FOREACH(queued_jobs, void *, job, queued_reply_fn(job));
+  smartlist_clear(queued_jobs);
+}
+
+static void
+test_spoolcache_build(void *arg)
+{
+  uint8_t keys[SPOOLCACHE_MAX_PENDING + 1][DIGEST256_LEN];
+  const char text[] = "router foo\nrouter foo\nrouter foo\n";
+  cached_dir_t *d;
+  char *body = NULL;
+  size_t body_len = 0;
+  int i;
+  (void)arg;
+
+  mock_options = spider_malloc_zero(sizeof(or_options_t));
+  mock_options->DirCompressedCacheSize = 4000;
+  MOCK(get_options, mock_get_options);
+  queued_jobs = smartlist_new();
+  for (i = 0; i <= SPOOLCACHE_MAX_PENDING; ++i)
+    memset(keys[i], i + 1, DIGEST256_LEN);
+
+  /* Without cpuworkers, we don't build anything. */
+  spoolcache_build(keys[0], spider_strdup(text), strlen(text),
+                   HIGH_COMPRESSION);
+  tt_assert(spoolcache_can_build(keys[0]));
+  tt_ptr_op(spoolcache_lookup(keys[0]), OP_EQ, NULL);
+
+  /* With them, we only build one bundle per key at a time, and only so
+   * many bundles at once. */
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  for (i = 0; i < SPOOLCACHE_MAX_PENDING; ++i) {
+    tt_assert(spoolcache_can_build(keys[i]));
+    spoolcache_build(keys[i], spider_strdup(text), strlen(text),
+                     i ? LOW_COMPRESSION : HIGH_COMPRESSION);
+    tt_assert(! spoolcache_can_build(keys[i]));
+  }
+  tt_int_op(smartlist_len(queued_jobs), OP_EQ, SPOOLCACHE_MAX_PENDING);
+  tt_assert(! spoolcache_can_build(keys[SPOOLCACHE_MAX_PENDING]));
+  spoolcache_build(keys[0], spider_strdup(text), strlen(text),
+                   HIGH_COMPRESSION);
+  tt_int_op(smartlist_len(queued_jobs), OP_EQ, SPOOLCACHE_MAX_PENDING);
+  tt_ptr_op(spoolcache_lookup(keys[0]), OP_EQ, NULL);
+
+  /* Once the replies arrive, the bundles are in the cache. */
+  run_replies();
+  tt_assert(spoolcache_can_build(keys[SPOOLCACHE_MAX_PENDING]));
+  for (i = 0; i < SPOOLCACHE_MAX_PENDING; ++i) {
+    d = spoolcache_lookup(keys[i]);
+    tt_assert(d);
+    tt_int_op(d->dir_len, OP_EQ, strlen(text));
+    tt_int_op(0, OP_EQ, spider_gzip_uncompress(&body, &body_len, d->dir_z,
+                                               d->dir_z_len, ZLIB_METHOD, 1,
+                                               LOG_WARN));
+    tt_mem_op(body, OP_EQ, text, strlen(text));
+    spider_free(body);
+  }
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  spoolcache_free_all();
+  UNMOCK(get_options);
+  spider_free(mock_options);
+  spider_free(body);
+  smartlist_free(queued_jobs);
+  queued_jobs = NULL;
+}
+
+static void
+test_spoolcache_conf_changed(void *arg)
+{
+  uint8_t keys[4][DIGEST256_LEN];
+  cached_dir_t *d;
+  int i;
+  (void)arg;
+
+  mock_options = spider_malloc_zero(sizeof(or_options_t));
+  mock_options->DirCompressedCacheSize = 4000;
+  MOCK(get_options, mock_get_options);
+  for (i = 0; i < 4; ++i) {
+    memset(keys[i], i + 1, DIGEST256_LEN);
+    d = fake_bundle(1000);
+    spoolcache_add(keys[i], d);
+    cached_dir_decref(d);
+  }
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 4000);
+
+  /* A smaller limit takes effect at once, dropping the oldest first. */
+  mock_options->DirCompressedCacheSize = 2500;
+  spoolcache_conf_changed(mock_options);
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 2000);
+  tt_ptr_op(spoolcache_lookup(keys[1]), OP_EQ, NULL);
+  tt_assert(spoolcache_lookup(keys[2]));
+
+  mock_options->DirCompressedCacheSize = 0;
+  spoolcache_conf_changed(mock_options);
+  tt_uint_op(spoolcache_get_total_bytes(), OP_EQ, 0);
+
+ done:
+  spoolcache_free_all();
+  UNMOCK(get_options);
+  spider_free(mock_options);
+}
+
+struct testcase_t spoolcache_tests[] = {
+  { "lru", test_spoolcache_lru, TT_FORK, NULL, NULL },
+  { "build", test_spoolcache_build, TT_FORK, NULL, NULL },
+  { "conf_changed", test_spoolcache_conf_changed, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -3606,6 +3606,39 @@ test_util_find_str_at_start_of_line(void *ptr)
   ;
 }
 
+static void
+test_util_find_whitespace_eos(void *ptr)
+{
+  /* Try each character that should stop the scan, and a couple that
+   * shouldn't, at each offset, with various ends of string.  This checks the
+   * word-at-a-time path and the byte-at-a-time path against each other. */
+  const char stops[] = { ' ', '\t', '\r', '\n', '#', '\0' };
+  const char others[] = { '\x01', '\x7f', '\xe9', '!' };
+  char buf[40];
+  unsigned i;
+  int pos, len;
+
+  (void)ptr;
+
+  for (i = 0; i < ARRAY_LENGTH(stops) + ARRAY_LENGTH(others); ++i) {
+    const int is_stop = i < ARRAY_LENGTH(stops);
+    const char c = is_stop ? stops[i] : others[i - ARRAY_LENGTH(stops)];
+    for (pos = 0; pos < (int)sizeof(buf); ++pos) {
+      memset(buf, 'x', sizeof(buf));
+      buf[pos] = c;
+      for (len = 0; len <= (int)sizeof(buf); ++len) {
+        const char *expected = buf + len;
+        if (is_stop && pos < len)
+          expected = buf + pos;
+        tt_ptr_op(find_whitespace_eos(buf, buf + len), OP_EQ, expected);
+      }
+    }
+  }
+
+ done:
+  ;
+}
+
 static void
 test_util_string_is_C_identifier(void *ptr)
 {
@@ -5731,6 +5764,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(laplace, 0),
   UTIL_TEST(clamp_double_to_int64, 0),
   UTIL_TEST(find_str_at_start_of_line, 0),
+  UTIL_TEST(find_whitespace_eos, 0),
   UTIL_TEST(string_is_C_identifier, 0),
   UTIL_TEST(asprintf, 0),
   UTIL_TEST(listdir, 0),
@@ -230,6 +230,101 @@ test_util_format_base64_decode(void *ignored)
   spider_free(real_dst);
 }
 
+/** Simple reference base64 encoder for test_util_format_base64_blocks():
+ * encode <b>srclen</b> bytes from <b>src</b> one bit at a time, with
+ * padding but no newlines. */
+static char *
+slow_base64_encode(const uint8_t *src, size_t srclen)
+{
+  const char *alphabet =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *out = spider_malloc_zero(srclen * 2 + 8);
+  size_t bit, n = 0;
+  for (bit = 0; bit < srclen * 8; bit += 6) {
+    unsigned v = 0, k;
+    for (k = 0; k < 6; ++k) {
+      size_t b = bit + k;
+      v <<= 1;
+      if (b < srclen * 8)
+        v |= (src[b/8] >> (7 - b%8)) & 1;
+    }
+    out[n++] = alphabet[v];
+  }
+  while (n % 4)
+    out[n++] = '=';
+  return out;
+}
+
+/** Make sure that the block-at-a-time paths in the base64 codecs agree with
+ * a simple reference, at every length and alignment, and that the decoder
+ * still treats spaces, padding, and junk the same way wherever they
+ * appear. */
+static void
+test_util_format_base64_blocks(void *ignored)
+{
+  (void)ignored;
+  uint8_t src[200];
+  char enc[400], enc_ml[400], dec[400];
+  char *expected = NULL;
+  size_t len;
+  int r;
+
+  crypto_rand((char *)src, sizeof(src));
+
+  for (len = 0; len <= sizeof(src); ++len) {
+    size_t i, n_chars;
+    int n_newlines = 0;
+    expected = slow_base64_encode(src, len);
+
+    r = base64_encode(enc, sizeof(enc), (const char *)src, len, 0);
+    tt_int_op(r, OP_EQ, strlen(expected));
+    tt_str_op(enc, OP_EQ, expected);
+
+    /* Multiline output is the same, with a newline after every 64
+     * characters and at the end. */
+    r = base64_encode(enc_ml, sizeof(enc_ml), (const char *)src, len,
+                      BASE64_ENCODE_MULTILINE);
+    tt_int_op(r, OP_EQ, base64_encode_size(len, BASE64_ENCODE_MULTILINE));
+    for (i = 0, n_chars = 0; i < (size_t)r; ++i) {
+      if (enc_ml[i] == '\n') {
+        ++n_newlines;
+        tt_assert(n_chars % 64 == 0 || n_chars == strlen(expected));
+      } else {
+        tt_int_op(enc_ml[i], OP_EQ, expected[n_chars++]);
+      }
+    }
+    tt_int_op(n_chars, OP_EQ, strlen(expected));
+    tt_int_op(n_newlines, OP_EQ, len ? (n_chars + 63) / 64 : 0);
+
+    r = base64_decode(dec, sizeof(dec), enc_ml, strlen(enc_ml));
+    tt_int_op(r, OP_EQ, len);
+    tt_mem_op(dec, OP_EQ, src, len);
+
+    /* A space anywhere makes no difference; junk anywhere is an error. */
+    for (i = 0; i <= strlen(enc) && len < 40; ++i) {
+      char tmp[400];
+      memcpy(tmp, enc, i);
+      tmp[i] = ' ';
+      memcpy(tmp + i + 1, enc + i, strlen(enc) - i);
+      r = base64_decode(dec, sizeof(dec), tmp, strlen(enc) + 1);
+      tt_int_op(r, OP_EQ, len);
+      tt_mem_op(dec, OP_EQ, src, len);
+      tmp[i] = '~';
+      r = base64_decode(dec, sizeof(dec), tmp, strlen(enc) + 1);
+      if (strchr(enc, '=') && i > (size_t)(strchr(enc, '=') - enc)) {
+        /* Everything after the first '=' is ignored. */
+        tt_int_op(r, OP_EQ, len);
+      } else {
+        tt_int_op(r, OP_EQ, -1);
+      }
+    }
+    spider_free(expected);
+  }
+
+ done:
+  spider_free(expected);
+}
+
 static void
 test_util_format_base16_decode(void *ignored)
 {
@@ -275,6 +370,13 @@ test_util_format_base16_decode(void *ignored)
   tt_int_op(res, OP_EQ, 7);
   tt_mem_op(real_dst, OP_EQ, expected, 7);
 
+  /* Check every possible character. */
+  for (i=0;i<256;i++) {
+    const char *hexdigits = "0123456789abcdef";
+    const char *cp = i ? strchr(hexdigits, TOR_TOLOWER(i)) : NULL;
+    tt_int_op(hex_decode_digit((char)i), OP_EQ, cp ? cp - hexdigits : -1);
+  }
+
  done:
   spider_free(src);
   spider_free(dst);
@@ -377,6 +479,7 @@ struct testcase_t util_format_tests[] = {
   { "base64_decode_nopad", test_util_format_base64_decode_nopad, 0,
     NULL, NULL },
   { "base64_decode", test_util_format_base64_decode, 0, NULL, NULL },
+  { "base64_blocks", test_util_format_base64_blocks, 0, NULL, NULL },
   { "base16_decode", test_util_format_base16_decode, 0, NULL, NULL },
   { "base32_encode", test_util_format_base32_encode, 0,
     NULL, NULL },
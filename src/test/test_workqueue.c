@@ -23,6 +23,13 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_empty_work = 0;
+static int opt_benchmark = 0;
+static int opt_ratio_low = 0;
+static int opt_reply_budget = 0;
+
+/** When we queued the first item of work, and when we got the last reply. */
+static monotime_t start_time, end_time;
 
 #ifdef TRACK_RESPONSES
 spider_mutex_t bitmap_mutex;
@@ -120,6 +127,18 @@ workqueue_do_ecdh(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static workqueue_reply_t
+workqueue_do_nothing(void *state, void *work)
+{
+  int *serial = work;
+  state_t *st = state;
+
+  spider_assert(st->magic == 13371337);
+  ++st->n_handled;
+  mark_handled(*serial);
+  return WQ_RPL_REPLY;
+}
+
 static workqueue_reply_t
 workqueue_shutdown_error(void *state, void *work)
 {
@@ -190,7 +209,21 @@ handle_reply_shutdown(void *arg)
 static workqueue_entry_t *
 add_work(threadpool_t *tp)
 {
-  int add_rsa =
+  int add_rsa;
+  workqueue_priority_t prio = WQ_PRI_HIGH;
+
+  if (opt_ratio_low &&
+      spider_weak_random_range(&weak_rng, opt_ratio_low) == 0)
+    prio = WQ_PRI_LOW;
+
+  if (opt_empty_work) {
+    int *serial = spider_malloc(sizeof(int));
+    *serial = n_sent++;
+    return threadpool_queue_work_priority(tp, prio, workqueue_do_nothing,
+                                          handle_reply, serial);
+  }
+
+  add_rsa =
     opt_ratio_rsa == 0 ||
     spider_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
 
@@ -200,14 +233,16 @@ add_work(threadpool_t *tp)
     crypto_rand((char*)w->msg, 20);
     w->msglen = 20;
     ++rsa_sent;
-    return threadpool_queue_work(tp, workqueue_do_rsa, handle_reply, w);
+    return threadpool_queue_work_priority(tp, prio, workqueue_do_rsa,
+                                          handle_reply, w);
   } else {
     ecdh_work_t *w = spider_malloc_zero(sizeof(*w));
     w->serial = n_sent++;
     /* Not strictly right, but this is just for benchmarks. */
     crypto_rand((char*)w->u.pk.public_key, 32);
     ++ecdh_sent;
-    return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply, w);
+    return threadpool_queue_work_priority(tp, prio, workqueue_do_ecdh,
+                                          handle_reply, w);
   }
 }
 
@@ -299,6 +334,7 @@ replysock_readable_cb(spider_socket_t sock, short what, void *arg)
       n_received+n_successful_cancel == n_sent &&
       n_sent >= opt_n_items) {
     shutting_down = 1;
+    monotime_get(&end_time);
     threadpool_queue_update(tp, NULL,
                              workqueue_do_shutdown, NULL, NULL);
     // Anything we add after starting the shutdown must not be executed.
@@ -324,6 +360,10 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -E            Make every item empty, to time the queue itself\n"
+     "  -B            Report how many items per second we handled\n"
+     "  -P <ratio>    Make one out of this many items be low-priority\n"
+     "  -b <replies>  Handle no more than this many replies at a time\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -353,6 +393,14 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-E")) {
+      opt_empty_work = 1;
+    } else if (!strcmp(argv[i], "-B")) {
+      opt_benchmark = 1;
+    } else if (!strcmp(argv[i], "-P") && i+1<argc) {
+      opt_ratio_low = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-b") && i+1<argc) {
+      opt_reply_budget = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -375,7 +423,7 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
-      opt_ratio_rsa < 0) {
+      opt_ratio_rsa < 0 || opt_ratio_low < 0 || opt_reply_budget < 0) {
     help();
     return 1;
   }
@@ -385,6 +433,7 @@ main(int argc, char **argv)
   }
 
   init_logging(1);
+  monotime_init();
   network_init();
   if (crypto_global_init(1, NULL, NULL) < 0) {
     printf("Couldn't initialize crypto subsystem; exiting.\n");
@@ -400,6 +449,7 @@ main(int argc, char **argv)
     return 77; // 77 means "skipped".
 
   spider_assert(rq);
+  replyqueue_set_budget(rq, opt_reply_budget, 0);
   tp = threadpool_new(opt_n_threads,
                       rq, new_state, free_state, NULL);
   spider_assert(tp);
@@ -422,6 +472,7 @@ main(int argc, char **argv)
   handled_len = opt_n_items;
 #endif
 
+  monotime_get(&start_time);
   for (i = 0; i < opt_n_inflight; ++i) {
     if (! add_work(tp)) {
       puts("Couldn't add work.");
@@ -445,6 +496,21 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    if (opt_benchmark) {
+      int64_t usec = monotime_diff_usec(&start_time, &end_time);
+      workqueue_priority_t prio;
+      printf("%d items on %d threads in %.3f sec: %.0f items/sec\n",
+             n_received, opt_n_threads, usec / 1e6,
+             usec ? n_received * 1e6 / usec : 0.0);
+      for (prio = WQ_PRI_HIGH; prio <= WQ_PRI_LOW; ++prio) {
+        const workqueue_wait_stats_t *st = threadpool_get_wait_stats(tp, prio);
+        if (st->n_started)
+          printf("  priority %d: %d items, average wait %d usec, "
+                 "max %d usec\n", (int)prio, (int)st->n_started,
+                 (int)(st->total_wait_usec / st->n_started),
+                 (int)st->max_wait_usec);
+      }
+    }
     puts("OK");
     return 0;
   }